@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# Renderer corpus: renders every <name>.md here with "mdtp-bridge render"
+# and compares the result with <name>.html, then times the whole corpus
+# and a batch of seeded random inputs, checking that every tag the
+# renderer opened was closed.
+#
+#   bridge/corpus/run.sh [path/to/mdtp-bridge] [seed]
+#
+# After an intended change to the renderer, regenerate an expectation with
+#   mdtp-bridge render name.md > name.html
+# and review the diff before committing it.
+
+BRIDGE=${1:-./mdtp-bridge}
+SEED=${2:-42}
+DIR=$(dirname "$0")
+TMP=${TMPDIR:-/tmp}/mdtp-corpus.$$
+failed=0
+
+trap 'rm -rf "$TMP"' EXIT
+mkdir -p "$TMP" || exit 1
+
+if [ ! -x "$BRIDGE" ]; then
+    echo "usage: $0 [path/to/mdtp-bridge] [seed]" >&2
+    exit 1
+fi
+
+# Every opening tag must have its closing tag, and in the right numbers.
+balanced() {
+    for tag in p em strong code a ul ol li blockquote pre; do
+        open=$(grep -o "<$tag[ >]" "$1" | wc -l)
+        close=$(grep -o "</$tag>" "$1" | wc -l)
+        if [ "$open" -ne "$close" ]; then
+            echo "  <$tag> opened $open times, closed $close"
+            return 1
+        fi
+    done
+    return 0
+}
+
+echo "Correctness"
+for md in "$DIR"/*.md; do
+    name=$(basename "$md" .md)
+    "$BRIDGE" render "$md" > "$TMP/$name.html"
+    if cmp -s "$TMP/$name.html" "$DIR/$name.html" && balanced "$TMP/$name.html"; then
+        echo "  ok    $name"
+    else
+        echo "  FAIL  $name"
+        diff -u "$DIR/$name.html" "$TMP/$name.html" | head -20
+        failed=1
+    fi
+done
+
+# Random documents built from the bytes the renderer treats specially.
+echo "Random inputs (seed $SEED)"
+awk -v seed="$SEED" 'BEGIN {
+    srand(seed);
+    n = split("* ** *** _ __ ` `` [ ] ( ) \\ < > & \" # - 1. > ``` text word \n \n\n   ", tok, " ");
+    tok[n + 1] = " "; n++;
+    for (doc = 0; doc < 200; doc++) {
+        file = sprintf("'"$TMP"'/random%03d.md", doc);
+        for (i = 0; i < 400; i++) printf "%s", tok[int(rand() * n) + 1] > file;
+        close(file);
+    }
+}'
+random_failed=0
+for md in "$TMP"/random*.md; do
+    if ! "$BRIDGE" render "$md" > "$md.html" || ! balanced "$md.html"; then
+        echo "  FAIL  $(basename "$md") kept in $DIR/failed-$(basename "$md")"
+        cp "$md" "$DIR/failed-$(basename "$md")"
+        random_failed=1
+    fi
+done
+[ $random_failed -eq 0 ] && echo "  ok    200 documents"
+[ $random_failed -ne 0 ] && failed=1
+
+# Throughput over the corpus repeated to about 4 MB, sequential and chunked.
+echo "Throughput"
+size=0
+: > "$TMP/all.md"
+while [ "$size" -lt 4000000 ]; do
+    cat "$DIR"/*.md >> "$TMP/all.md"
+    printf '\n' >> "$TMP/all.md"
+    size=$(wc -c < "$TMP/all.md")
+done
+printf '  '; "$BRIDGE" render "$TMP/all.md" -n 20
+"$BRIDGE" render "$TMP/all.md" -n 20 -j 4 | sed 's/^/  /'
+
+[ $failed -eq 0 ] && echo "All passed" || echo "Failures above"
+exit $failed
@@ -1,28 +1,85 @@
-#include <stdio.h> 
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <time.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../helpers/trace.h"
+#include "../helpers/timer.h"
 
 #define BRIDGE_PORT 9999
-#define BUFFER_SIZE 8192
+#define BUFFER_SIZE 8192                /* largest request a browser may send */
+#define REQUEST_BUFFER_MIN 1024
 #define MDTP_VERSION "MDTP/1.0"
+#define MAX_PATH 1024
+#define MAX_EVENTS 64
+#define MAX_RESPONSE (16 * 1024 * 1024)
+#define BRIDGE_TIMEOUT 30
+#define BRIDGE_BACKLOG 511
+#define BRIDGE_DEFER_ACCEPT 5
+#define BRIDGE_FASTOPEN 256
+#define MAX_SEND_BUFFER (4 * 1024 * 1024)
 
 
+typedef struct fetch fetch_t;
 
-const char* HTML_TEMPLATE_HEADER = 
-"HTTP/1.1 200 OK\r\n"
-"Content-Type: text/html\r\n"
-"Connection: close\r\n\r\n"
-"<!DOCTYPE html>\n"
-"<html>\n"
-"<head>\n"
-"  <meta charset=\"UTF-8\">\n"
-"  <meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
-"  <title>MDTP Browser</title>\n"
-"  <style>\n"
+/* Per-connection state for the bridge's keep-alive event loop. */
+typedef struct {
+    int fd;
+    timer_entry_t timer;        /* read or write deadline; see conn_touch() */
+    int closing;                /* close once the pending output is written */
+    int shut;                   /* the browser closed its side while a page was being fetched */
+    char *out;                  /* output the socket has not taken yet */
+    size_t out_offset;
+    size_t out_length;
+    size_t out_capacity;
+    int file_fd;                /* pre-rendered page to send after out, or -1 */
+    off_t file_offset;
+    size_t file_remaining;
+    int send_buffer;            /* SO_SNDBUF we set, 0 while the kernel sizes it */
+    size_t length;
+    size_t capacity;            /* of buffer; see conn_reserve() */
+    char *buffer;
+    fetch_t *fetch;             /* backend fetch this connection waits on, or NULL */
+} bridge_conn_t;
+
+/* Seconds a browser connection may sit idle or stall a write, and a backend a fetch; 0 = never. */
+static int g_timeout = BRIDGE_TIMEOUT;
+static int g_epoll_fd = -1;
+
+
+
+/*
+ * The stylesheet is served separately from /style.css so browsers cache it
+ * once instead of receiving it inline with every page. Bump STYLE_VERSION
+ * whenever HTML_STYLESHEET changes so cached copies are replaced.
+ */
+#define STYLE_VERSION "1"
+#define STYLE_MAX_AGE 31536000
+
+const char* HTML_STYLESHEET = 
 "    body {\n"
 "      font-family: -apple-system, BlinkMacSystemFont, 'Segoe UI', Roboto, sans-serif;\n"
 "      max-width: 850px;\n"
@@ -131,8 +188,16 @@ const char* HTML_TEMPLATE_HEADER =
 "      margin: 2.5rem 0;\n"
 "    }\n"
 "    strong { color: #1a202c; font-weight: 600; }\n"
-"    em { color: #4a5568; }\n"
-"  </style>\n"
+"    em { color: #4a5568; }\n";
+
+const char* HTML_TEMPLATE_HEADER = 
+"<!DOCTYPE html>\n"
+"<html>\n"
+"<head>\n"
+"  <meta charset=\"UTF-8\">\n"
+"  <meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
+"  <title>MDTP Browser</title>\n"
+"  <link rel=\"stylesheet\" href=\"/style.css?v=" STYLE_VERSION "\">\n"
 "</head>\n"
 "<body>\n"
 "  <div class=\"mdtp-indicator\">MDTP/1.0</div>\n"
@@ -144,375 +209,2430 @@ const char* HTML_TEMPLATE_FOOTER =
 "</html>\n";
 
 
-void markdown_to_html(const char *markdown, char *html, size_t html_size) {
-    const char *src = markdown;
-    char *dst = html;
-    size_t remaining = html_size - 1;
-    int in_code_block = 0;
-    int in_list = 0;
-    
-    while (*src && remaining > 100) {
-        if (strncmp(src, "```", 3) == 0) {
-            in_code_block = !in_code_block;
-            if (in_code_block) {
-                int written = snprintf(dst, remaining, "<pre><code>");
-                dst += written;
-                remaining -= written;
-                src += 3;
-                while (*src && *src != '\n') src++; 
-                if (*src) src++;
-            } else {
-                int written = snprintf(dst, remaining, "</code></pre>\n");
-                dst += written;
-                remaining -= written;
-                src += 3;
-            }
-            continue;
-        }
-        
-        if (in_code_block) {
-            *dst++ = *src++;
-            remaining--;
-            continue;
+/* ------------------------------------------------------------------------
+ * Markdown rendering
+ *
+ * Blocks are recognised a line at a time: fenced code, ATX headings,
+ * thematic breaks, bullet and ordered lists (nested by indentation), block
+ * quotes and paragraphs, whose lines are joined with <br>. The first
+ * significant byte of a line is classified through MD_BLOCK_CLASS; within
+ * a line, MD_INLINE_CLASS marks the few bytes that can start inline markup
+ * and everything between them is copied as one run.
+ *
+ * Emphasis keeps a small delimiter stack per line, so nested runs such as
+ * "**bold *and* bold**" close in the right order; openers still unclosed
+ * at the end of the line are turned back into the literal characters.
+ *
+ * Every byte of the document reaches the output through either the inline
+ * loop or md_put_escaped(), so < > & and " are always written as entities,
+ * in text, code and link URLs alike. Both find the next byte needing work
+ * 16 at a time with SSE2 where available; runs with nothing in them are
+ * copied in one piece.
+ * ------------------------------------------------------------------------ */
+
+#define MD_MAX_EMPHASIS 16
+#define MD_MAX_LINK_DEPTH 4
+#define MD_MAX_LINK_TEXT 1024      /* bounds the search for "]" and ")" */
+#define MD_MAX_LINK_URL 2048
+#define MD_MAX_LIST_DEPTH 8
+
+enum {
+    MD_TEXT = 0,
+    MD_EMPHASIS,        /* * _ */
+    MD_CODE,            /* ` */
+    MD_LINK,            /* [ */
+    MD_ESCAPE,          /* \ */
+    MD_HTML             /* < > & " */
+};
+
+static const unsigned char MD_INLINE_CLASS[256] = {
+    ['*'] = MD_EMPHASIS, ['_'] = MD_EMPHASIS,
+    ['`'] = MD_CODE,
+    ['['] = MD_LINK,
+    ['\\'] = MD_ESCAPE,
+    ['<'] = MD_HTML, ['>'] = MD_HTML, ['&'] = MD_HTML, ['"'] = MD_HTML
+};
+
+static const unsigned char MD_HTML_CLASS[256] = {
+    ['<'] = 1, ['>'] = 1, ['&'] = 1, ['"'] = 1
+};
+
+enum {
+    MD_LINE_TEXT = 0,
+    MD_LINE_HEADING,    /* # */
+    MD_LINE_FENCE,      /* ` */
+    MD_LINE_BULLET,     /* - * + (or a rule) */
+    MD_LINE_RULE,       /* _ */
+    MD_LINE_DIGIT,      /* ordered list item */
+    MD_LINE_QUOTE       /* > */
+};
+
+static const unsigned char MD_BLOCK_CLASS[256] = {
+    ['#'] = MD_LINE_HEADING,
+    ['`'] = MD_LINE_FENCE,
+    ['-'] = MD_LINE_BULLET, ['*'] = MD_LINE_BULLET, ['+'] = MD_LINE_BULLET,
+    ['_'] = MD_LINE_RULE,
+    ['0'] = MD_LINE_DIGIT, ['1'] = MD_LINE_DIGIT, ['2'] = MD_LINE_DIGIT, ['3'] = MD_LINE_DIGIT,
+    ['4'] = MD_LINE_DIGIT, ['5'] = MD_LINE_DIGIT, ['6'] = MD_LINE_DIGIT, ['7'] = MD_LINE_DIGIT,
+    ['8'] = MD_LINE_DIGIT, ['9'] = MD_LINE_DIGIT,
+    ['>'] = MD_LINE_QUOTE
+};
+
+/* Output cursor; writes past `end` are dropped, so output is truncated, never overrun. */
+typedef struct {
+    char *start;
+    char *dst;
+    char *end;
+} md_out_t;
+
+typedef struct {
+    char marker;        /* '*' or '_' */
+    int strong;
+    size_t at;          /* offset of the opening tag in the output */
+} md_delim_t;
+
+typedef struct {
+    int indent;
+    int ordered;
+} md_list_t;
+
+typedef enum { MD_NONE, MD_PARAGRAPH, MD_LIST, MD_QUOTE, MD_FENCE } md_block_t;
+
+typedef struct {
+    md_out_t *out;
+    md_block_t block;
+    size_t fence_len;
+    md_list_t lists[MD_MAX_LIST_DEPTH];
+    int list_depth;
+} md_render_t;
+
+
+static void md_put(md_out_t *o, const char *s, size_t n) {
+    size_t room = o->end - o->dst;
+    if (n > room) n = room;
+    memcpy(o->dst, s, n);
+    o->dst += n;
+}
+
+#define MD_PUTS(o, literal) md_put((o), (literal), sizeof(literal) - 1)
+
+
+#ifdef __SSE2__
+#define MD_EQ(v, c) _mm_cmpeq_epi8((v), _mm_set1_epi8(c))
+
+/* Bits set for the bytes of v in MD_HTML_CLASS, or in MD_INLINE_CLASS too if inline_set. */
+static inline int md_special_mask(__m128i v, int inline_set) {
+    __m128i hit = _mm_or_si128(_mm_or_si128(MD_EQ(v, '<'), MD_EQ(v, '>')),
+                               _mm_or_si128(MD_EQ(v, '&'), MD_EQ(v, '"')));
+    if (inline_set) {
+        hit = _mm_or_si128(hit, _mm_or_si128(_mm_or_si128(MD_EQ(v, '*'), MD_EQ(v, '_')),
+                                             _mm_or_si128(MD_EQ(v, '`'), MD_EQ(v, '['))));
+        hit = _mm_or_si128(hit, MD_EQ(v, '\\'));
+    }
+    return _mm_movemask_epi8(hit);
+}
+#endif
+
+/*
+ * First byte in p..e that is special in MD_INLINE_CLASS (inline_set) or
+ * MD_HTML_CLASS. Most runs in markup-heavy text are short, so the first
+ * 16 bytes are looked up one at a time before switching to blocks.
+ */
+static inline const char* md_scan(const char *p, const char *e, int inline_set) {
+    const unsigned char *table = inline_set ? MD_INLINE_CLASS : MD_HTML_CLASS;
+#ifdef __SSE2__
+    const char *first = e - p > 16 ? p + 16 : e;
+    while (p < first && !table[(unsigned char)*p]) p++;
+    if (p < first || p == e) return p;
+
+    while (e - p >= 16) {
+        int mask = md_special_mask(_mm_loadu_si128((const __m128i *)p), inline_set);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < e && !table[(unsigned char)*p]) p++;
+    return p;
+}
+
+static void md_put_entity(md_out_t *o, char c) {
+    switch (c) {
+        case '<': MD_PUTS(o, "&lt;"); break;
+        case '>': MD_PUTS(o, "&gt;"); break;
+        case '&': MD_PUTS(o, "&amp;"); break;
+        case '"': MD_PUTS(o, "&quot;"); break;
+        default: md_put(o, &c, 1); break;
+    }
+}
+
+/* Copy s[0..n) with HTML special characters replaced by entities. */
+static void md_put_escaped(md_out_t *o, const char *s, size_t n) {
+    const char *e = s + n;
+    while (s < e) {
+        const char *run = s;
+        s = md_scan(s, e, 0);
+        md_put(o, run, s - run);
+        if (s < e) md_put_entity(o, *s++);
+    }
+}
+
+
+static int md_is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static int md_is_alnum(char c) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+
+static void md_inline(md_out_t *o, const char *s, const char *e, int depth);
+
+/* A run of * or _ at p: close open emphasis, open new, or stay literal. */
+static const char* md_emphasis(md_out_t *o, const char *s, const char *e, const char *p,
+                               md_delim_t *stack, int *top) {
+    char c = *p;
+    const char *run = p;
+    while (p < e && *p == c) p++;
+    int left = p - run;
+
+    int can_open = p < e && !md_is_space(*p) && (c == '*' || run == s || !md_is_alnum(run[-1]));
+    int can_close = run > s && !md_is_space(run[-1]) && (c == '*' || p == e || !md_is_alnum(*p));
+    int closed = 0;
+
+    while (left > 0 && can_close && *top > 0 && stack[*top - 1].marker == c) {
+        md_delim_t *d = &stack[*top - 1];
+        if (d->strong && left >= 2) {
+            MD_PUTS(o, "</strong>");
+            left -= 2;
+        } else if (!d->strong) {
+            MD_PUTS(o, "</em>");
+            left -= 1;
+        } else {
+            break;
         }
-        
-        if (*src == '#' && (src == markdown || *(src-1) == '\n')) {
-            int level = 0;
-            while (*src == '#' && level < 6) {
-                level++;
-                src++;
-            }
-            while (*src == ' ') src++;
-            
-            int written = snprintf(dst, remaining, "<h%d>", level);
-            dst += written;
-            remaining -= written;
-            
-            while (*src && *src != '\n') {
-                *dst++ = *src++;
-                remaining--;
-            }
-            
-            written = snprintf(dst, remaining, "</h%d>\n", level);
-            dst += written;
-            remaining -= written;
-            continue;
+        (*top)--;
+        closed = 1;
+    }
+
+    if (!closed && can_open && left <= 3 && *top + 2 <= MD_MAX_EMPHASIS) {
+        if (left >= 2) {
+            stack[(*top)++] = (md_delim_t){ c, 1, o->dst - o->start };
+            MD_PUTS(o, "<strong>");
+            left -= 2;
         }
-        
-        if (strncmp(src, "**", 2) == 0) {
-            src += 2;
-            int written = snprintf(dst, remaining, "<strong>");
-            dst += written;
-            remaining -= written;
-            
-            while (*src && strncmp(src, "**", 2) != 0) {
-                *dst++ = *src++;
-                remaining--;
-            }
-            if (*src) src += 2;
-            
-            written = snprintf(dst, remaining, "</strong>");
-            dst += written;
-            remaining -= written;
-            continue;
+        if (left == 1) {
+            stack[(*top)++] = (md_delim_t){ c, 0, o->dst - o->start };
+            MD_PUTS(o, "<em>");
+            left = 0;
         }
+    }
+
+    while (left-- > 0) md_put(o, &c, 1);
+    return p;
+}
+
+/* Turn opening tags that were never closed back into their markers. */
+static void md_unwind_emphasis(md_out_t *o, md_delim_t *stack, int top) {
+    while (top-- > 0) {
+        md_delim_t *d = &stack[top];
+        size_t tag_len = d->strong ? 8 : 4;
+        size_t marker_len = d->strong ? 2 : 1;
+        char *tag = o->start + d->at;
+
+        if (tag + tag_len > o->dst) continue;   /* output was truncated */
+        memmove(tag + marker_len, tag + tag_len, o->dst - (tag + tag_len));
+        memset(tag, d->marker, marker_len);
+        o->dst -= tag_len - marker_len;
+    }
+}
+
+/* `code` with a closing run of exactly as many backticks; *missing caches failed lengths. */
+static const char* md_code_span(md_out_t *o, const char *e, const char *p, uint32_t *missing) {
+    const char *run = p;
+    while (p < e && *p == '`') p++;
+    size_t k = p - run;
 
-        if (*src == '*' && *(src+1) != '*') {
-            src++;
-            int written = snprintf(dst, remaining, "<em>");
-            dst += written;
-            remaining -= written;
-            
-            while (*src && *src != '*') {
-                *dst++ = *src++;
-                remaining--;
+    if (k >= 32 || !(*missing & (1u << k))) {
+        for (const char *q = p; q < e; ) {
+            if (*q != '`') {
+                q++;
+                continue;
             }
-            if (*src) src++;
-            
-            written = snprintf(dst, remaining, "</em>");
-            dst += written;
-            remaining -= written;
-            continue;
-        }
-        
-        if (*src == '`') {
-            src++;
-            int written = snprintf(dst, remaining, "<code>");
-            dst += written;
-            remaining -= written;
-            
-            while (*src && *src != '`') {
-                *dst++ = *src++;
-                remaining--;
+            const char *close = q;
+            while (q < e && *q == '`') q++;
+            if ((size_t)(q - close) == k) {
+                MD_PUTS(o, "<code>");
+                md_put_escaped(o, p, close - p);
+                MD_PUTS(o, "</code>");
+                return q;
             }
-            if (*src) src++;
-            
-            written = snprintf(dst, remaining, "</code>");
-            dst += written;
-            remaining -= written;
-            continue;
         }
-    
-        if (*src == '[') {
-            src++;
-            char link_text[256] = {0};
-            char link_url[512] = {0};
-            int i = 0;
-            
-            while (*src && *src != ']' && i < 255) {
-                link_text[i++] = *src++;
-            }
-            if (*src == ']') src++;
-            if (*src == '(') {
-                src++;
-                i = 0;
-                while (*src && *src != ')' && i < 511) {
-                    link_url[i++] = *src++;
+        if (k < 32) *missing |= 1u << k;
+    }
+
+    md_put(o, run, k);
+    return p;
+}
+
+/* [text](url) at p, or NULL if p does not start a complete link. */
+static const char* md_link(md_out_t *o, const char *e, const char *p, int depth, int *no_close) {
+    int nest = 0;
+    const char *close = NULL;
+    const char *limit = e - p > MD_MAX_LINK_TEXT ? p + MD_MAX_LINK_TEXT : e;
+
+    for (const char *q = p + 1; q < limit && !close; q++) {
+        if (*q == '\\' && q + 1 < limit) q++;
+        else if (*q == '[') nest++;
+        else if (*q == ']' && nest-- == 0) close = q;
+    }
+    if (!close) {
+        if (limit == e) *no_close = 1;
+        return NULL;
+    }
+    if (close + 1 >= e || close[1] != '(') return NULL;
+
+    const char *url = close + 2;
+    const char *url_end = NULL;
+    nest = 0;
+    limit = e - url > MD_MAX_LINK_URL ? url + MD_MAX_LINK_URL : e;
+    for (const char *q = url; q < limit && !url_end; q++) {
+        if (*q == '(') nest++;
+        else if (*q == ')' && nest-- == 0) url_end = q;
+    }
+    if (!url_end) return NULL;
+
+    const char *u = url, *u_end = url_end;
+    while (u < u_end && md_is_space(*u)) u++;
+    while (u_end > u && md_is_space(u_end[-1])) u_end--;
+
+    MD_PUTS(o, "<a href=\"");
+    if (u_end - u >= 7 && strncmp(u, "mdtp://", 7) == 0) {
+        MD_PUTS(o, "http://127.0.0.1:9999/");
+        u += 7;
+    }
+    md_put_escaped(o, u, u_end - u);
+    MD_PUTS(o, "\">");
+    md_inline(o, p + 1, close, depth + 1);
+    MD_PUTS(o, "</a>");
+    return url_end + 1;
+}
+
+/* Render the inline content of s..e. */
+static void md_inline(md_out_t *o, const char *s, const char *e, int depth) {
+    md_delim_t stack[MD_MAX_EMPHASIS];
+    int top = 0;
+    uint32_t missing_code = 0;
+    int no_link_close = 0;
+    const char *p = s;
+
+    while (p < e) {
+        const char *run = p;
+        p = md_scan(p, e, 1);
+        md_put(o, run, p - run);
+        if (p >= e) break;
+
+        switch (MD_INLINE_CLASS[(unsigned char)*p]) {
+            case MD_EMPHASIS:
+                p = md_emphasis(o, s, e, p, stack, &top);
+                break;
+            case MD_CODE:
+                p = md_code_span(o, e, p, &missing_code);
+                break;
+            case MD_LINK: {
+                const char *next = NULL;
+                if (depth < MD_MAX_LINK_DEPTH && !no_link_close) {
+                    next = md_link(o, e, p, depth, &no_link_close);
                 }
-                if (*src == ')') src++;
-                
-                if (strncmp(link_url, "mdtp://", 7) == 0) {
-                    int written = snprintf(dst, remaining, 
-                        "<a href=\"http://127.0.0.1:9999/%s\">%s</a>",
-                        link_url + 7, link_text);
-                    dst += written;
-                    remaining -= written;
+                if (next) {
+                    p = next;
                 } else {
-                    int written = snprintf(dst, remaining, 
-                        "<a href=\"%s\">%s</a>", link_url, link_text);
-                    dst += written;
-                    remaining -= written;
+                    md_put(o, p, 1);
+                    p++;
                 }
+                break;
             }
-            continue;
-        }
-        
-        if ((*src == '-' || *src == '*') && (src == markdown || *(src-1) == '\n')) {
-            if (!in_list) {
-                int written = snprintf(dst, remaining, "<ul>\n");
-                dst += written;
-                remaining -= written;
-                in_list = 1;
-            }
-            src++;
-            while (*src == ' ') src++;
-            
-            int written = snprintf(dst, remaining, "<li>");
-            dst += written;
-            remaining -= written;
-            
-            while (*src && *src != '\n') {
-                *dst++ = *src++;
-                remaining--;
-            }
-            
-            written = snprintf(dst, remaining, "</li>\n");
-            dst += written;
-            remaining -= written;
-            continue;
+            case MD_ESCAPE:
+                if (p + 1 < e && ispunct((unsigned char)p[1])) p++;
+                md_put_entity(o, *p++);
+                break;
+            case MD_HTML:
+                md_put_entity(o, *p++);
+                break;
         }
-        
-        if (in_list && *src == '\n' && *(src+1) != '-' && *(src+1) != '*') {
-            int written = snprintf(dst, remaining, "</ul>\n");
-            dst += written;
-            remaining -= written;
-            in_list = 0;
-        }
-        
-        if (strncmp(src, "---", 3) == 0) {
-            int written = snprintf(dst, remaining, "<hr>\n");
-            dst += written;
-            remaining -= written;
-            src += 3;
-            while (*src == '-') src++;
-            continue;
+    }
+
+    md_unwind_emphasis(o, stack, top);
+}
+
+
+static void md_close_lists(md_render_t *r, int depth) {
+    while (r->list_depth > depth) {
+        r->list_depth--;
+        if (r->lists[r->list_depth].ordered) MD_PUTS(r->out, "</li>\n</ol>\n");
+        else MD_PUTS(r->out, "</li>\n</ul>\n");
+    }
+}
+
+static void md_close_block(md_render_t *r) {
+    switch (r->block) {
+        case MD_PARAGRAPH: MD_PUTS(r->out, "</p>\n"); break;
+        case MD_QUOTE: MD_PUTS(r->out, "</blockquote>\n"); break;
+        case MD_FENCE: MD_PUTS(r->out, "</code></pre>\n"); break;
+        case MD_LIST: md_close_lists(r, 0); break;
+        case MD_NONE: break;
+    }
+    r->block = MD_NONE;
+}
+
+static void md_open_list(md_render_t *r, int indent, int ordered) {
+    r->lists[r->list_depth++] = (md_list_t){ indent, ordered };
+    if (ordered) MD_PUTS(r->out, "<ol>\n");
+    else MD_PUTS(r->out, "<ul>\n");
+}
+
+/* A list item whose marker is at column indent. */
+static void md_list_item(md_render_t *r, int indent, int ordered, const char *text, const char *end) {
+    if (r->block != MD_LIST) {
+        md_close_block(r);
+        r->block = MD_LIST;
+        md_open_list(r, indent, ordered);
+    } else if (indent > r->lists[r->list_depth - 1].indent && r->list_depth < MD_MAX_LIST_DEPTH) {
+        MD_PUTS(r->out, "\n");
+        md_open_list(r, indent, ordered);
+    } else {
+        while (r->list_depth > 1 && indent < r->lists[r->list_depth - 1].indent) {
+            md_close_lists(r, r->list_depth - 1);
         }
-        
-        if (*src == '\n') {
-            if (*(src+1) == '\n') {
-                int written = snprintf(dst, remaining, "</p>\n<p>");
-                dst += written;
-                remaining -= written;
-                src += 2;
-                continue;
-            } else {
-                int written = snprintf(dst, remaining, "<br>\n");
-                dst += written;
-                remaining -= written;
-                src++;
-                continue;
-            }
+        if (r->lists[r->list_depth - 1].ordered != ordered) {
+            md_close_lists(r, r->list_depth - 1);
+            if (r->list_depth > 0) MD_PUTS(r->out, "\n");
+            md_open_list(r, indent, ordered);
+        } else {
+            MD_PUTS(r->out, "</li>\n");
         }
-        
-        *dst++ = *src++;
-        remaining--;
     }
-    
-    if (in_list) {
-        snprintf(dst, remaining, "</ul>\n");
-    }
-    
-    *dst = '\0';
+
+    MD_PUTS(r->out, "<li>");
+    md_inline(r->out, text, end, 0);
 }
 
-char* fetch_mdtp(const char *host, int port, const char *path) {
-    int sock;
-    struct sockaddr_in server_addr;
-    char request[1024];
-    char response[BUFFER_SIZE * 2];
-    
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return NULL;
-    
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, host, &server_addr.sin_addr);
-    
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(sock);
-        return NULL;
+/* "---", "* * *", "___": three or more of one character and nothing else. */
+static int md_is_rule(const char *p, const char *end) {
+    char c = *p;
+    int count = 0;
+    for (; p < end; p++) {
+        if (*p == c) count++;
+        else if (!md_is_space(*p)) return 0;
     }
-    
-    snprintf(request, sizeof(request),
-        "GET %s %s\r\n"
-        "Host: %s\r\n"
-        "User-Agent: MDTP-Bridge/1.0\r\n"
-        "\r\n",
-        path, MDTP_VERSION, host
-    );
-    
-    send(sock, request, strlen(request), 0);
-    ssize_t bytes = recv(sock, response, sizeof(response) - 1, 0);
-    close(sock);
-    if (bytes <= 0) return NULL;
-    response[bytes] = '\0';
-    char *body = strstr(response, "\r\n\r\n");
-    if (body) {
-        body += 4;
-        return strdup(body);
+    return count >= 3;
+}
+
+/* Skip leading blanks, returning the first other byte and its column. */
+static const char* md_skip_indent(const char *p, const char *end, int *indent) {
+    *indent = 0;
+    while (p < end && md_is_space(*p)) {
+        *indent += *p == '\t' ? 4 - *indent % 4 : 1;
+        p++;
     }
-    
-    return NULL;
+    return p;
 }
 
-void handle_http_request(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-    
-    if (bytes <= 0) {
-        close(client_sock);
+/* Length of the backtick run opening a fence at p, or 0 if the line does not open one. */
+static size_t md_fence_open(const char *p, const char *end) {
+    const char *q = p;
+    while (q < end && *q == '`') q++;
+    if (q - p < 3 || memchr(q, '`', end - q)) return 0;
+    return q - p;
+}
+
+/* Whether a line whose text starts at p (column indent) closes a fence of fence_len. */
+static int md_fence_close(const char *p, const char *end, int indent, size_t fence_len) {
+    const char *q = p;
+    while (q < end && *q == '`') q++;
+    if (indent >= 4 || (size_t)(q - p) < fence_len || q - p < 3) return 0;
+    while (q < end && md_is_space(*q)) q++;
+    return q == end;
+}
+
+/* Handle one line (without its newline). */
+static void md_line(md_render_t *r, const char *line, const char *end) {
+    md_out_t *o = r->out;
+    int indent;
+    const char *p = md_skip_indent(line, end, &indent);
+
+    if (r->block == MD_FENCE) {
+        if (md_fence_close(p, end, indent, r->fence_len)) {
+            md_close_block(r);
+            return;
+        }
+        md_put_escaped(o, line, end - line);
+        MD_PUTS(o, "\n");
         return;
     }
-    
-    buffer[bytes] = '\0';
-    char method[16], path[512];
-    sscanf(buffer, "%s %s", method, path);
-    printf("[HTTP Bridge] %s %s\n", method, path);
 
-    if (strcmp(path, "/") == 0) {
-        const char *home = 
-            "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n"
-            "<html><head><title>MDTP Bridge</title></head>"
-            "<body style='font-family:sans-serif;max-width:600px;margin:50px auto'>"
-            "<h1>🌐 MDTP HTTP Bridge</h1>"
-            "<p>Access MDTP sites through your browser!</p>"
-            "<h2>Try these:</h2><ul>"
-            "<li><a href='/127.0.0.1:8585/index.md'>index.md</a></li>"
-            "<li><a href='/127.0.0.1:8585/about.md'>about.md</a></li>"
-            "</ul></body></html>";
-        send(client_sock, home, strlen(home), 0);
-        close(client_sock);
+    if (p == end) {
+        md_close_block(r);
         return;
     }
 
-    char host[256] = "127.0.0.1";
-    int port = 8585;
-    char mdtp_path[512] = "/index.md";
-    
-    if (path[0] == '/') {
-        char *p = path + 1;
-        char *colon = strchr(p, ':');
-        char *slash = strchr(p, '/');
-        
-        if (colon && slash) {
-            int host_len = colon - p;
-            strncpy(host, p, host_len);
-            host[host_len] = '\0';
-            port = atoi(colon + 1);
-            strcpy(mdtp_path, slash);
-        } else if (slash) {
-            strcpy(mdtp_path, slash);
+    const char *q = p;
+    switch (MD_BLOCK_CLASS[(unsigned char)*p]) {
+        case MD_LINE_HEADING: {
+            while (q < end && *q == '#' && q - p < 7) q++;
+            int level = q - p;
+            if (level > 6 || (q < end && !md_is_space(*q))) break;
+            while (q < end && md_is_space(*q)) q++;
+            while (end > q && md_is_space(end[-1])) end--;
+
+            char open_tag[] = "<h0>", close_tag[] = "</h0>\n";
+            open_tag[2] = close_tag[3] = '0' + level;
+            md_close_block(r);
+            MD_PUTS(o, open_tag);
+            md_inline(o, q, end, 0);
+            MD_PUTS(o, close_tag);
+            return;
+        }
+
+        case MD_LINE_FENCE: {
+            size_t fence_len = md_fence_open(p, end);
+            if (!fence_len) break;
+            md_close_block(r);
+            MD_PUTS(o, "<pre><code>");
+            r->block = MD_FENCE;
+            r->fence_len = fence_len;
+            return;
         }
+
+        case MD_LINE_BULLET:
+            if (md_is_rule(p, end)) {
+                md_close_block(r);
+                MD_PUTS(o, "<hr>\n");
+                return;
+            }
+            if (p + 1 < end && !md_is_space(p[1])) break;
+            q = p + 1;
+            while (q < end && md_is_space(*q)) q++;
+            md_list_item(r, indent, 0, q, end);
+            return;
+
+        case MD_LINE_RULE:
+            if (!md_is_rule(p, end)) break;
+            md_close_block(r);
+            MD_PUTS(o, "<hr>\n");
+            return;
+
+        case MD_LINE_DIGIT:
+            while (q < end && *q >= '0' && *q <= '9' && q - p < 9) q++;
+            if (q >= end || (*q != '.' && *q != ')') || (q + 1 < end && !md_is_space(q[1]))) break;
+            q++;
+            while (q < end && md_is_space(*q)) q++;
+            md_list_item(r, indent, 1, q, end);
+            return;
+
+        case MD_LINE_QUOTE:
+            q = p + 1;
+            if (q < end && *q == ' ') q++;
+            if (r->block == MD_QUOTE) {
+                MD_PUTS(o, "<br>\n");
+            } else {
+                md_close_block(r);
+                MD_PUTS(o, "<blockquote>");
+                r->block = MD_QUOTE;
+            }
+            md_inline(o, q, end, 0);
+            return;
     }
-    
-    char *markdown = fetch_mdtp(host, port, mdtp_path);
-    
-    if (markdown) {
-        char html_content[BUFFER_SIZE * 2];
-        markdown_to_html(markdown, html_content, sizeof(html_content));
-        
-        send(client_sock, HTML_TEMPLATE_HEADER, strlen(HTML_TEMPLATE_HEADER), 0);
-        send(client_sock, html_content, strlen(html_content), 0);
-        send(client_sock, HTML_TEMPLATE_FOOTER, strlen(HTML_TEMPLATE_FOOTER), 0);
-        
-        free(markdown);
+
+    /* Plain text: continues the open paragraph, list item or quote. */
+    if (r->block == MD_NONE) {
+        MD_PUTS(o, "<p>");
+        r->block = MD_PARAGRAPH;
     } else {
-        const char *error = 
-            "HTTP/1.1 500 Error\r\nContent-Type: text/html\r\n\r\n"
-            "<html><body><h1>MDTP Error</h1>"
-            "<p>Failed to fetch from MDTP server</p></body></html>";
-        send(client_sock, error, strlen(error), 0);
+        MD_PUTS(o, "<br>\n");
     }
-    
-    close(client_sock);
+    md_inline(o, p, end, 0);
 }
 
+/* Render md[0..len) into o. */
+static void md_render(md_out_t *o, const char *md, size_t len) {
+    md_render_t r = { .out = o, .block = MD_NONE };
+    const char *p = md;
+    const char *end = md + len;
 
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket failed");
-        return 1;
+    while (p < end && o->dst < o->end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl ? nl : end;
+        md_line(&r, p, line_end > p && line_end[-1] == '\r' ? line_end - 1 : line_end);
+        p = nl ? nl + 1 : end;
     }
-    
-    int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(BRIDGE_PORT);
-    
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        return 1;
+    md_close_block(&r);
+}
+
+
+/*
+ * Output size that markdown_to_html() never exceeds for an input of md_len
+ * bytes. The largest expansions (an empty "- " item, a "#" heading, a
+ * lone "`" pair) stay well under 16 bytes per input byte.
+ */
+size_t markdown_html_capacity(size_t md_len) {
+    return md_len * 16 + 4096;
+}
+
+void markdown_to_html(const char *markdown, char *html, size_t html_size) {
+    md_out_t out = { html, html, html + html_size - 1 };
+
+    TRACE_BEGIN(t_render);
+    md_render(&out, markdown, strlen(markdown));
+    *out.dst = '\0';
+    TRACE_END(t_render, "render");
+}
+
+
+/* ------------------------------------------------------------------------
+ * Parallel rendering
+ *
+ * After a blank line outside fenced code the renderer has closed every
+ * block and list, so the text that follows renders the same on its own.
+ * Large documents are cut at such lines into chunks of about
+ * MD_CHUNK_SIZE, the chunks are rendered on a pool of worker threads and
+ * their outputs are concatenated in order, which gives exactly the bytes
+ * of a sequential render. The caller renders chunk 0 itself so it can
+ * send it while the workers are still busy with the rest.
+ * ------------------------------------------------------------------------ */
+
+#define MD_CHUNK_SIZE (256 * 1024)
+#define MD_PARALLEL_MIN (1024 * 1024)      /* smaller documents render sequentially */
+
+typedef struct md_chunk {
+    const char *markdown;
+    size_t length;
+    char *html;                 /* NULL if the output buffer could not be allocated */
+    size_t html_length;
+    int done;
+    struct md_chunk *next;
+} md_chunk_t;
+
+static int g_render_threads = 0;            /* 0: no pool, always sequential */
+static md_chunk_t *g_render_queue = NULL;
+static md_chunk_t **g_render_tail = &g_render_queue;
+static pthread_mutex_t g_render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_render_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_render_done = PTHREAD_COND_INITIALIZER;
+
+static void render_chunk(md_chunk_t *chunk) {
+    size_t size = markdown_html_capacity(chunk->length);
+
+    TRACE_BEGIN(t_render);
+    chunk->html = malloc(size);
+    if (chunk->html) {
+        md_out_t out = { chunk->html, chunk->html, chunk->html + size };
+        md_render(&out, chunk->markdown, chunk->length);
+        chunk->html_length = out.dst - out.start;
     }
-    
-    listen(server_sock, 10);
-    
-    printf("╔═══════════════════════════════════════════════════════╗\n");
-    printf("║       MDTP HTTP Bridge Server - Running!            ║\n");
-    printf("╠═══════════════════════════════════════════════════════╣\n");
-    printf("║  Browse MDTP sites in your regular web browser!      ║\n");
+    TRACE_END(t_render, "render chunk");
+}
+
+static void* render_worker(void *arg) {
+    (void)arg;
+    TRACE_THREAD("render");
+    pthread_mutex_lock(&g_render_lock);
+    for (;;) {
+        while (!g_render_queue) pthread_cond_wait(&g_render_queued, &g_render_lock);
+        md_chunk_t *chunk = g_render_queue;
+        g_render_queue = chunk->next;
+        if (!g_render_queue) g_render_tail = &g_render_queue;
+        pthread_mutex_unlock(&g_render_lock);
+
+        render_chunk(chunk);
+
+        pthread_mutex_lock(&g_render_lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&g_render_done);
+    }
+    return NULL;
+}
+
+/* Start `threads` render workers. Returns the number actually started. */
+int start_render_pool(int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, render_worker, NULL) != 0) break;
+        pthread_detach(thread);
+        g_render_threads++;
+    }
+    return g_render_threads;
+}
+
+/*
+ * Cut md[0..len) into chunks at blank lines outside fences. Returns a
+ * malloc'd array of *count chunks (at least one), or NULL on failure.
+ */
+md_chunk_t* markdown_split(const char *md, size_t len, int *count) {
+    int capacity = len / MD_CHUNK_SIZE + 2;
+    md_chunk_t *chunks = calloc(capacity, sizeof(md_chunk_t));
+    if (!chunks) return NULL;
+
+    const char *p = md, *end = md + len, *start = md;
+    size_t fence_len = 0;
+    int n = 0;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl ? nl : end;
+        const char *next = nl ? nl + 1 : end;
+        if (line_end > p && line_end[-1] == '\r') line_end--;
+
+        int indent;
+        const char *q = md_skip_indent(p, line_end, &indent);
+        if (fence_len) {
+            if (md_fence_close(q, line_end, indent, fence_len)) fence_len = 0;
+        } else if (q < line_end && *q == '`') {
+            fence_len = md_fence_open(q, line_end);
+        } else if (q == line_end && next - start >= MD_CHUNK_SIZE && n < capacity - 1) {
+            chunks[n++] = (md_chunk_t){ .markdown = start, .length = next - start };
+            start = next;
+        }
+        p = next;
+    }
+    if (start < end || n == 0) {
+        chunks[n++] = (md_chunk_t){ .markdown = start, .length = end - start };
+    }
+
+    *count = n;
+    return chunks;
+}
+
+/*
+ * Queue chunks 1..count-1 on the pool and render chunk 0 on the calling
+ * thread, returning once it is done. Wait for the others with
+ * markdown_wait_chunk() before using or freeing them.
+ */
+void markdown_render_chunks(md_chunk_t *chunks, int count) {
+    pthread_mutex_lock(&g_render_lock);
+    for (int i = 1; i < count; i++) {
+        chunks[i].next = NULL;
+        *g_render_tail = &chunks[i];
+        g_render_tail = &chunks[i].next;
+    }
+    pthread_cond_broadcast(&g_render_queued);
+    pthread_mutex_unlock(&g_render_lock);
+
+    render_chunk(&chunks[0]);
+    chunks[0].done = 1;
+}
+
+void markdown_wait_chunk(md_chunk_t *chunk) {
+    pthread_mutex_lock(&g_render_lock);
+    while (!chunk->done) pthread_cond_wait(&g_render_done, &g_render_lock);
+    pthread_mutex_unlock(&g_render_lock);
+}
+
+/* Wait for every chunk, then release their outputs and the array. */
+void markdown_free_chunks(md_chunk_t *chunks, int count) {
+    for (int i = 0; i < count; i++) {
+        markdown_wait_chunk(&chunks[i]);
+        free(chunks[i].html);
+    }
+    free(chunks);
+}
+
+/*
+ * markdown_to_html() on the render pool: the chunk outputs are copied
+ * into html in order. Renders sequentially if the pool is not running.
+ */
+void markdown_to_html_parallel(const char *markdown, char *html, size_t html_size) {
+    size_t len = strlen(markdown);
+    int count;
+    md_chunk_t *chunks = g_render_threads > 0 ? markdown_split(markdown, len, &count) : NULL;
+    if (!chunks) {
+        markdown_to_html(markdown, html, html_size);
+        return;
+    }
+
+    md_out_t out = { html, html, html + html_size - 1 };
+    markdown_render_chunks(chunks, count);
+    for (int i = 0; i < count; i++) {
+        markdown_wait_chunk(&chunks[i]);
+        if (chunks[i].html) md_put(&out, chunks[i].html, chunks[i].html_length);
+    }
+    *out.dst = '\0';
+    markdown_free_chunks(chunks, count);
+}
+
+/* ------------------------------------------------------------------------
+ * Backend connections
+ *
+ * Each backend is reached over one persistent MDTP/2 connection (framing
+ * as described in mdtp.c), so fetching a page costs a frame round trip
+ * instead of a new TCP connection, and the pages of many browsers can be
+ * in flight on it at once. A backend that answers the upgrade with
+ * anything but 101 is remembered and fetched over MDTP/1.0 from then on,
+ * one connection per document, in turn.
+ *
+ * Backend sockets are non-blocking and share the epoll set with the
+ * browsers. A browser whose page is being fetched reads no further
+ * requests until its fetch finishes; the page is then rendered and sent
+ * from the backend's event. A backend with fetches outstanding has one
+ * deadline g_timeout seconds ahead, renewed whenever data arrives; when it
+ * passes, every fetch on it fails. Only a refused upgrade switches a
+ * backend to MDTP/1.0: a timeout or a failed connect is not a refusal. A
+ * framed connection that drops is reopened once for the fetches it had
+ * not begun to answer, since the server may have closed it while idle.
+ * ------------------------------------------------------------------------ */
+
+#define MDTP2_VERSION "MDTP/2.0"
+#define MDTP2_FRAME_HEADER 9
+#define MDTP2_MAX_FRAME 16384
+#define MDTP2_DATA 0x0
+#define MDTP2_HEADERS 0x1
+#define MDTP2_GOAWAY 0x7
+#define MDTP2_END_STREAM 0x1
+#define MAX_BACKENDS 16
+
+static const char MDTP2_SWITCHING[] = MDTP2_VERSION " 101 Switching Protocols\r\n\r\n";
+
+typedef enum {
+    BACKEND_IDLE,               /* no connection */
+    BACKEND_CONNECTING,
+    BACKEND_UPGRADING,          /* OPTIONS sent, waiting for the 101 */
+    BACKEND_FRAMED,             /* MDTP/2 streams */
+    BACKEND_MDTP1               /* MDTP/1.0 request for the first fetch in the queue */
+} backend_state_t;
+
+struct fetch {
+    struct fetch *next;         /* in the backend's queue, oldest first */
+    bridge_conn_t *conn;        /* browser waiting for the page, NULL once it has gone */
+    int keep_alive;
+    int streamable;             /* HTTP/1.1, so a large page may be streamed */
+    char path[512];
+    uint32_t stream_id;         /* 0 until sent on a framed connection */
+    int answered;               /* the response headers have arrived */
+    int retried;                /* already resent after a dropped connection */
+    char *doc;
+    size_t have;
+    size_t cap;
+    size_t want;                /* Content-Length, or SIZE_MAX until the response ends */
+#ifdef MDTP_TRACE
+    uint64_t started;
+#endif
+};
+
+typedef struct {
+    char host[256];
+    int port;
+    int sock;
+    backend_state_t state;
+    int mdtp1_only;
+    int writing;                /* registered for EPOLLOUT */
+    uint32_t next_stream_id;
+    fetch_t *fetches;
+    timer_entry_t timer;        /* armed while fetches are outstanding */
+    char *out;                  /* requests the socket has not taken yet */
+    size_t out_offset;
+    size_t out_length;
+    size_t out_capacity;
+    size_t in_length;
+    unsigned char in[MDTP2_FRAME_HEADER + MDTP2_MAX_FRAME + 1];
+} backend_t;
+
+static backend_t g_backends[MAX_BACKENDS];
+static int g_backend_count = 0;
+static timer_wheel_t g_backend_timers;
+
+static void answer_fetched_page(bridge_conn_t *conn, const char *markdown, int keep_alive, int streamable);
+
+
+static int is_backend(const void *ptr) {
+    return ptr >= (const void *)g_backends && ptr < (const void *)(g_backends + MAX_BACKENDS);
+}
+
+
+static backend_t* get_backend(const char *host, int port) {
+    for (int i = 0; i < g_backend_count; i++) {
+        if (g_backends[i].port == port && strcmp(g_backends[i].host, host) == 0) {
+            return &g_backends[i];
+        }
+    }
+    if (g_backend_count == MAX_BACKENDS) return NULL;
+
+    backend_t *b = &g_backends[g_backend_count++];
+    snprintf(b->host, sizeof(b->host), "%s", host);
+    b->port = port;
+    b->sock = -1;
+    b->state = BACKEND_IDLE;
+    return b;
+}
+
+
+static void backend_touch(backend_t *b) {
+    if (!b->fetches || g_timeout <= 0) timer_cancel(&g_backend_timers, &b->timer);
+    else timer_arm(&g_backend_timers, &b->timer, time(NULL) + g_timeout);
+}
+
+
+static void backend_watch(backend_t *b) {
+    int writing = b->state == BACKEND_CONNECTING || b->out_offset < b->out_length;
+    if (writing == b->writing) return;
+
+    struct epoll_event ev = { .events = EPOLLIN | (writing ? EPOLLOUT : 0), .data.ptr = b };
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, b->sock, &ev);
+    b->writing = writing;
+}
+
+
+/* Write queued requests. A broken connection is shut down, so its reader sees the end. */
+static void backend_flush(backend_t *b) {
+    while (b->out_offset < b->out_length) {
+        ssize_t n = send(b->sock, b->out + b->out_offset, b->out_length - b->out_offset, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                shutdown(b->sock, SHUT_RDWR);
+                b->out_offset = b->out_length;
+            }
+            break;
+        }
+        b->out_offset += n;
+    }
+    if (b->out_offset == b->out_length) b->out_offset = b->out_length = 0;
+    backend_watch(b);
+}
+
+
+static void backend_send(backend_t *b, const void *data, size_t length) {
+    if (b->out_length + length > b->out_capacity) {
+        size_t capacity = b->out_capacity ? b->out_capacity : 4096;
+        while (capacity < b->out_length + length) capacity *= 2;
+        char *out = realloc(b->out, capacity);
+        if (!out) {
+            shutdown(b->sock, SHUT_RDWR);
+            return;
+        }
+        b->out = out;
+        b->out_capacity = capacity;
+    }
+    memcpy(b->out + b->out_length, data, length);
+    b->out_length += length;
+    backend_flush(b);
+}
+
+
+/* Start a non-blocking connect; the backend's EPOLLOUT continues in backend_connected(). */
+static int backend_connect(backend_t *b) {
+    struct sockaddr_in addr;
+
+    b->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (b->sock < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(b->port);
+    inet_pton(AF_INET, b->host, &addr.sin_addr);
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = b };
+    if ((connect(b->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, b->sock, &ev) < 0) {
+        close(b->sock);
+        b->sock = -1;
+        return -1;
+    }
+    b->state = BACKEND_CONNECTING;
+    b->writing = 1;
+    backend_touch(b);
+    return 0;
+}
+
+
+static void backend_close(backend_t *b) {
+    if (b->sock >= 0) close(b->sock);
+    b->sock = -1;
+    b->state = BACKEND_IDLE;
+    b->out_offset = b->out_length = 0;
+    b->in_length = 0;
+}
+
+
+static void fetch_unlink(backend_t *b, fetch_t *f) {
+    fetch_t **p = &b->fetches;
+    while (*p != f) p = &(*p)->next;
+    *p = f->next;
+    if (!b->fetches) backend_touch(b);
+}
+
+
+/* Hand a finished fetch (already unlinked) to its browser, or the error page if !ok. */
+static void fetch_finish(fetch_t *f, int ok) {
+#ifdef MDTP_TRACE
+    trace_span("fetch", f->started, trace_now());
+#endif
+    char *doc = ok ? (f->doc ? f->doc : malloc(1)) : NULL;
+    if (doc) doc[f->have] = '\0';
+    else free(f->doc);
+
+    bridge_conn_t *conn = f->conn;
+    if (conn) {
+        conn->fetch = NULL;
+        answer_fetched_page(conn, doc, f->keep_alive, f->streamable);
+    }
+    free(doc);
+    free(f);
+}
+
+
+/* Fail every fetch on b and close its connection. */
+static void backend_fail(backend_t *b) {
+    fetch_t *f = b->fetches;
+
+    backend_close(b);
+    b->fetches = NULL;
+    backend_touch(b);
+    while (f) {
+        fetch_t *next = f->next;
+        fetch_finish(f, 0);
+        f = next;
+    }
+}
+
+
+/* Timeout callback for g_backend_timers. */
+static void backend_expired(timer_entry_t *entry, void *arg) {
+    (void)arg;
+    backend_t *b = (backend_t *)((char *)entry - offsetof(backend_t, timer));
+    printf("[Bridge] %s:%d did not answer within %d s\n", b->host, b->port, g_timeout);
+    backend_fail(b);
+}
+
+
+/* Length of the response body, once the headers say; -1 if it is too large to take. */
+static int fetch_expect(fetch_t *f, const char *headers) {
+    const char *cl = strcasestr(headers, "\r\nContent-Length:");
+    f->answered = 1;
+    if (!cl) return 0;
+
+    size_t want = strtoull(cl + 17, NULL, 10);
+    if (want > MAX_RESPONSE) return -1;
+    f->doc = malloc(want + 1);
+    if (!f->doc) return -1;
+    f->cap = f->want = want;
+    return 0;
+}
+
+
+/* Append body bytes; -1 if they would pass Content-Length or MAX_RESPONSE. */
+static int fetch_append(fetch_t *f, const void *data, size_t length) {
+    if (length > f->want - f->have || f->have + length > MAX_RESPONSE) return -1;
+    if (f->have + length > f->cap) {
+        size_t cap = f->cap ? f->cap : BUFFER_SIZE;
+        while (cap < f->have + length) cap *= 2;
+        if (cap > MAX_RESPONSE) cap = MAX_RESPONSE;
+        char *doc = realloc(f->doc, cap + 1);
+        if (!doc) return -1;
+        f->doc = doc;
+        f->cap = cap;
+    }
+    memcpy(f->doc + f->have, data, length);
+    f->have += length;
+    return 0;
+}
+
+
+/* Send the request for f: a HEADERS frame on a framed connection, else an MDTP/1.0 GET. */
+static void fetch_send(backend_t *b, fetch_t *f) {
+    unsigned char frame[MDTP2_FRAME_HEADER + 1024];
+    char *request = (char *)frame + MDTP2_FRAME_HEADER;
+    int framed = b->state == BACKEND_FRAMED;
+
+    int n = snprintf(request, sizeof(frame) - MDTP2_FRAME_HEADER,
+        "GET %s %s\r\n"
+        "Host: %s\r\n"
+        "User-Agent: MDTP-Bridge/1.0\r\n"
+        "%s",
+        f->path, framed ? MDTP2_VERSION : MDTP_VERSION, b->host, framed ? "" : "\r\n");
+    if (!framed) {
+        backend_send(b, request, n);
+        return;
+    }
+
+    f->stream_id = b->next_stream_id;
+    b->next_stream_id += 2;
+    frame[0] = n >> 16;
+    frame[1] = n >> 8;
+    frame[2] = n;
+    frame[3] = MDTP2_HEADERS;
+    frame[4] = MDTP2_END_STREAM;
+    frame[5] = f->stream_id >> 24;
+    frame[6] = f->stream_id >> 16;
+    frame[7] = f->stream_id >> 8;
+    frame[8] = f->stream_id;
+    backend_send(b, frame, MDTP2_FRAME_HEADER + n);
+}
+
+
+/* The framed connection broke: resend what it had not begun to answer, fail the rest. */
+static void backend_drop(backend_t *b) {
+    fetch_t *failed = NULL, **tail = &failed;
+
+    backend_close(b);
+    for (fetch_t **p = &b->fetches; *p; ) {
+        fetch_t *f = *p;
+        if (!f->answered && !f->retried) {
+            f->retried = 1;
+            f->stream_id = 0;
+            p = &f->next;
+            continue;
+        }
+        *p = f->next;
+        f->next = NULL;
+        *tail = f;
+        tail = &f->next;
+    }
+
+    if (b->fetches && backend_connect(b) < 0) backend_fail(b);
+    if (!b->fetches) backend_touch(b);
+    while (failed) {
+        fetch_t *next = failed->next;
+        fetch_finish(failed, 0);
+        failed = next;
+    }
+}
+
+
+static void backend_connected(backend_t *b) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(b->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        printf("[Bridge] cannot reach %s:%d: %s\n", b->host, b->port, strerror(err ? err : errno));
+        backend_fail(b);
+        return;
+    }
+    struct sockaddr_in peer;
+    len = sizeof(peer);
+    if (getpeername(b->sock, (struct sockaddr *)&peer, &len) < 0) return;     /* still connecting */
+
+    int nodelay = 1;
+    setsockopt(b->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (b->mdtp1_only) {
+        b->state = BACKEND_MDTP1;
+        fetch_send(b, b->fetches);
+        return;
+    }
+
+    char request[512];
+    int n = snprintf(request, sizeof(request),
+        "OPTIONS * %s\r\n"
+        "Host: %s\r\n"
+        "User-Agent: MDTP-Bridge/1.0\r\n"
+        "\r\n",
+        MDTP2_VERSION, b->host);
+    b->state = BACKEND_UPGRADING;
+    backend_send(b, request, n);
+}
+
+
+/* Read the reply to the upgrade. Returns 1 once the connection is framed. */
+static int backend_read_upgrade(backend_t *b) {
+    for (;;) {
+        ssize_t n = recv(b->sock, b->in + b->in_length, sizeof(b->in) - 1 - b->in_length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) {
+            backend_fail(b);
+            return 0;
+        }
+        b->in_length += n;
+        backend_touch(b);
+
+        unsigned char *end = memmem(b->in, b->in_length, "\r\n\r\n", 4);
+        if (!end && b->in_length < sizeof(b->in) - 1) continue;
+
+        size_t reply = end ? (size_t)(end + 4 - b->in) : b->in_length;
+        if (reply == sizeof(MDTP2_SWITCHING) - 1 && memcmp(b->in, MDTP2_SWITCHING, reply) == 0) {
+            b->in_length -= reply;
+            memmove(b->in, b->in + reply, b->in_length);
+            b->state = BACKEND_FRAMED;
+            b->next_stream_id = 1;
+            for (fetch_t *f = b->fetches; f; f = f->next) fetch_send(b, f);
+            return 1;
+        }
+
+        printf("[Bridge] %s:%d does not speak %s, using %s\n",
+               b->host, b->port, MDTP2_VERSION, MDTP_VERSION);
+        b->mdtp1_only = 1;
+        backend_close(b);
+        if (backend_connect(b) < 0) backend_fail(b);
+        return 0;
+    }
+}
+
+
+static void backend_frame(backend_t *b, const unsigned char *header, const unsigned char *payload, size_t length) {
+    int type = header[3];
+    int flags = header[4];
+    uint32_t id = ((uint32_t)header[5] << 24) | ((uint32_t)header[6] << 16) |
+                  ((uint32_t)header[7] << 8) | header[8];
+
+    fetch_t *f = b->fetches;
+    while (f && f->stream_id != id) f = f->next;
+    if (!f) return;
+
+    int ok = 1;
+    if (type == MDTP2_HEADERS) {
+        char headers[MDTP2_MAX_FRAME + 1];
+        memcpy(headers, payload, length);
+        headers[length] = '\0';
+        ok = fetch_expect(f, headers) == 0;
+    } else if (type == MDTP2_DATA) {
+        ok = f->answered && fetch_append(f, payload, length) == 0;
+    }
+
+    if (ok && !(flags & MDTP2_END_STREAM)) return;
+    fetch_unlink(b, f);
+    fetch_finish(f, ok);
+}
+
+
+static void backend_read_frames(backend_t *b) {
+    for (;;) {
+        ssize_t n = recv(b->sock, b->in + b->in_length, sizeof(b->in) - 1 - b->in_length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            backend_drop(b);
+            return;
+        }
+        b->in_length += n;
+        backend_touch(b);
+
+        size_t used = 0;
+        while (b->in_length - used >= MDTP2_FRAME_HEADER) {
+            const unsigned char *header = b->in + used;
+            size_t length = ((size_t)header[0] << 16) | ((size_t)header[1] << 8) | header[2];
+            if (length > MDTP2_MAX_FRAME || header[3] == MDTP2_GOAWAY) {
+                backend_drop(b);
+                return;
+            }
+            if (b->in_length - used < MDTP2_FRAME_HEADER + length) break;
+            backend_frame(b, header, header + MDTP2_FRAME_HEADER, length);
+            used += MDTP2_FRAME_HEADER + length;
+        }
+        b->in_length -= used;
+        memmove(b->in, b->in + used, b->in_length);
+    }
+}
+
+
+/* Read the MDTP/1.0 response for the first fetch; when it ends, start the next one. */
+static void backend_read_mdtp1(backend_t *b) {
+    fetch_t *f = b->fetches;
+    int ok = 0;
+
+    for (;;) {
+        ssize_t n = recv(b->sock, b->in + b->in_length, sizeof(b->in) - 1 - b->in_length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            ok = f->answered;       /* without a Content-Length the body ends here */
+            break;
+        }
+        backend_touch(b);
+
+        if (f->answered) {
+            size_t take = (size_t)n < f->want - f->have ? (size_t)n : f->want - f->have;
+            if (fetch_append(f, b->in, take) < 0) break;
+            if (f->have == f->want) {
+                ok = 1;
+                break;
+            }
+            continue;
+        }
+
+        b->in_length += n;
+        b->in[b->in_length] = '\0';
+        char *body = strstr((char *)b->in, "\r\n\r\n");
+        if (!body) {
+            if (b->in_length == sizeof(b->in) - 1) break;
+            continue;
+        }
+        body += 4;
+        body[-2] = '\0';
+        size_t have = b->in_length - (body - (char *)b->in);
+        b->in_length = 0;
+        if (fetch_expect(f, (char *)b->in) < 0) break;
+        if (have > f->want) have = f->want;
+        if (fetch_append(f, body, have) < 0) break;
+        if (f->have == f->want) {
+            ok = 1;
+            break;
+        }
+    }
+
+    fetch_unlink(b, f);
+    backend_close(b);
+    if (b->fetches && backend_connect(b) < 0) backend_fail(b);
+    fetch_finish(f, ok);
+}
+
+
+/* Event on a backend socket. What happened is taken from SO_ERROR and recv, not the event bits. */
+static void backend_event(backend_t *b) {
+    if (b->sock < 0) return;
+    if (b->state == BACKEND_CONNECTING) {
+        backend_connected(b);
+        return;
+    }
+
+    backend_flush(b);
+    if (b->state == BACKEND_UPGRADING && !backend_read_upgrade(b)) return;
+    if (b->state == BACKEND_FRAMED) backend_read_frames(b);
+    else if (b->state == BACKEND_MDTP1) backend_read_mdtp1(b);
+}
+
+
+/*
+ * Fetch path from host:port for conn. The page is answered from the
+ * backend's events, through answer_fetched_page(), once the document has
+ * arrived or the fetch has failed. Returns -1 if the fetch could not be
+ * started; the caller then answers at once.
+ */
+static int fetch_start(bridge_conn_t *conn, const char *host, int port, const char *path,
+                       int keep_alive, int streamable) {
+    backend_t *b = get_backend(host, port);
+    if (!b) return -1;
+
+    fetch_t *f = calloc(1, sizeof(fetch_t));
+    if (!f) return -1;
+    f->conn = conn;
+    f->keep_alive = keep_alive;
+    f->streamable = streamable;
+    f->want = SIZE_MAX;
+    snprintf(f->path, sizeof(f->path), "%s", path);
+#ifdef MDTP_TRACE
+    f->started = trace_now();
+#endif
+
+    fetch_t **tail = &b->fetches;
+    while (*tail) tail = &(*tail)->next;
+    *tail = f;
+
+    if (b->state == BACKEND_IDLE && backend_connect(b) < 0) {
+        b->fetches = NULL;
+        free(f);
+        return -1;
+    }
+    if (b->state == BACKEND_FRAMED) fetch_send(b, f);
+    if (!b->timer.next) backend_touch(b);
+    conn->fetch = f;
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Browser connection output
+ *
+ * Browser sockets are non-blocking, as in the server: what the socket does
+ * not take at once is queued on the connection (a pre-rendered page stays
+ * a file range) and written as it drains, with the connection waiting for
+ * EPOLLOUT and reading no further requests meanwhile. Each connection has
+ * one deadline g_timeout seconds ahead: the read deadline, renewed only
+ * when a whole request has been answered, or while output is pending the
+ * write deadline, renewed whenever a write makes progress.
+ * ------------------------------------------------------------------------ */
+
+#define CONN_OUT_KEEP 65536         /* larger queue buffers are freed once drained */
+
+static timer_wheel_t g_timers;
+
+
+static int conn_pending(const bridge_conn_t *conn) {
+    return conn->out_offset < conn->out_length || conn->file_fd >= 0;
+}
+
+
+/* Request buffers grow from REQUEST_BUFFER_MIN to BUFFER_SIZE as needed, as in the server. */
+static size_t conn_reserve(bridge_conn_t *conn) {
+    size_t want = conn->capacity;
+
+    if (conn->length + 1 >= want) want *= 2;
+    else if (conn->length == 0) want = REQUEST_BUFFER_MIN;
+    if (want > BUFFER_SIZE) want = BUFFER_SIZE;
+
+    if (want != conn->capacity) {
+        char *buffer = realloc(conn->buffer, want);
+        if (buffer) {
+            conn->buffer = buffer;
+            conn->capacity = want;
+        }
+    }
+    return conn->capacity > conn->length + 1 ? conn->capacity - 1 - conn->length : 0;
+}
+
+
+/* Raise SO_SNDBUF toward a large page's size; see conn_size_send_buffer() in mdtp.c. */
+#define SEND_BUFFER_MIN (256 * 1024)
+
+static void conn_size_send_buffer(bridge_conn_t *conn, size_t length) {
+    if (length <= SEND_BUFFER_MIN) return;
+    if (length > MAX_SEND_BUFFER) length = MAX_SEND_BUFFER;
+    if ((int)length <= conn->send_buffer) return;
+
+    int current;
+    socklen_t len = sizeof(current);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &current, &len) == 0 && current >= (int)length) return;
+
+    int size = length / 2 + 1;
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == 0) conn->send_buffer = length;
+}
+
+
+static void conn_touch(bridge_conn_t *conn) {
+    if (g_timeout <= 0) return;
+    timer_arm(&g_timers, &conn->timer, time(NULL) + g_timeout);
+}
+
+
+static void conn_want_write(bridge_conn_t *conn, int on) {
+    struct epoll_event ev = { .events = on ? EPOLLOUT : EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+
+static int conn_queue(bridge_conn_t *conn, const char *data, size_t length) {
+    if (conn->out_offset > 0 && conn->out_length + length > conn->out_capacity) {
+        memmove(conn->out, conn->out + conn->out_offset, conn->out_length - conn->out_offset);
+        conn->out_length -= conn->out_offset;
+        conn->out_offset = 0;
+    }
+    if (conn->out_length + length > conn->out_capacity) {
+        size_t capacity = conn->out_capacity ? conn->out_capacity : 4096;
+        while (capacity < conn->out_length + length) capacity *= 2;
+        char *out = realloc(conn->out, capacity);
+        if (!out) return -1;
+        conn->out = out;
+        conn->out_capacity = capacity;
+    }
+    memcpy(conn->out + conn->out_length, data, length);
+    conn->out_length += length;
+    return 0;
+}
+
+
+/* Write iov without blocking and queue whatever the socket does not take. Returns -1 if broken. */
+static int conn_writev(bridge_conn_t *conn, const struct iovec *iov, int count) {
+    int was_pending = conn_pending(conn);
+    size_t sent = 0;
+
+    if (conn->file_fd >= 0) return -1;
+
+    if (!was_pending) {
+        ssize_t n;
+        do {
+            n = writev(conn->fd, iov, count);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        if (n > 0) sent = n;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        if (conn_queue(conn, (char *)iov[i].iov_base + sent, iov[i].iov_len - sent) < 0) return -1;
+        sent = 0;
+    }
+
+    if (!was_pending && conn_pending(conn)) {
+        conn_want_write(conn, 1);
+        conn_touch(conn);
+    }
+    return 0;
+}
+
+
+/* Write pending output. Returns 0 once it is all out, 1 if some remains, -1 if broken. */
+static int conn_flush(bridge_conn_t *conn) {
+    while (conn->out_offset < conn->out_length) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_offset, conn->out_length - conn->out_offset,
+                         MSG_NOSIGNAL | (conn->file_fd >= 0 ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        conn->out_offset += n;
+    }
+    conn->out_offset = conn->out_length = 0;
+    if (conn->out_capacity > CONN_OUT_KEEP) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_capacity = 0;
+    }
+
+    while (conn->file_fd >= 0 && conn->file_remaining > 0) {
+        ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, conn->file_remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        if (n == 0) return -1;
+        conn->file_remaining -= n;
+    }
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    return 0;
+}
+
+
+/* Send length bytes of fd after any pending output. Takes ownership of fd. */
+static int conn_sendfile(bridge_conn_t *conn, int fd, size_t length) {
+    int was_pending = conn_pending(conn);
+
+    if (conn->file_fd >= 0) {
+        close(fd);
+        return -1;
+    }
+    conn->file_fd = fd;
+    conn->file_offset = 0;
+    conn->file_remaining = length;
+    if (was_pending) return 0;
+
+    int rc = conn_flush(conn);
+    if (rc == 1) {
+        conn_want_write(conn, 1);
+        conn_touch(conn);
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+
+static void close_http_conn(bridge_conn_t *conn) {
+    if (conn->fetch) conn->fetch->conn = NULL;     /* the page is fetched and dropped */
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->file_fd >= 0) close(conn->file_fd);
+    timer_cancel(&g_timers, &conn->timer);
+    free(conn->out);
+    free(conn->buffer);
+    free(conn);
+}
+
+
+/* Deadline expiry callback for g_timers. */
+static void conn_expired(timer_entry_t *entry, void *arg) {
+    (void)arg;
+    close_http_conn((bridge_conn_t *)((char *)entry - offsetof(bridge_conn_t, timer)));
+}
+
+
+static void set_cork(int sock, int on) {
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+
+/*
+ * Assemble and send a complete HTTP response: the header block (with a
+ * Content-Length computed from the body pieces) and every body piece go
+ * out in one writev() while the socket is corked, so the page leaves in
+ * full-sized segments instead of one small packet per piece.
+ */
+int send_http_response(bridge_conn_t *conn, const char *status, const char *content_type,
+                       const char *extra_headers, const struct iovec *body,
+                       int body_count, int keep_alive) {
+    struct iovec iov[8];
+    size_t content_length = 0;
+    char header[512];
+
+    if (body_count > 7) return -1;
+    for (int i = 0; i < body_count; i++) {
+        content_length += body[i].iov_len;
+        iov[i + 1] = body[i];
+    }
+
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "Connection: %s\r\n\r\n",
+        status, content_type, content_length,
+        extra_headers ? extra_headers : "",
+        keep_alive ? "keep-alive" : "close");
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+
+    TRACE_BEGIN(t_send);
+    conn_size_send_buffer(conn, header_len + content_length);
+    set_cork(conn->fd, 1);
+    int rc = conn_writev(conn, iov, body_count + 1);
+    set_cork(conn->fd, 0);
+    TRACE_END(t_send, "send");
+    return rc;
+}
+
+/*
+ * Streamed responses use chunked transfer encoding, since their length is
+ * not known when the first bytes go out. The header is left corked so it
+ * leaves in the same segment as the first chunk; a send_http_chunk() with
+ * no body ends the response.
+ */
+int send_http_stream_start(bridge_conn_t *conn, const char *status, const char *content_type, int keep_alive) {
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: %s\r\n\r\n",
+        status, content_type, keep_alive ? "keep-alive" : "close");
+    struct iovec iov = { header, header_len };
+
+    set_cork(conn->fd, 1);
+    return conn_writev(conn, &iov, 1);
+}
+
+int send_http_chunk(bridge_conn_t *conn, const struct iovec *body, int body_count) {
+    struct iovec iov[8];
+    size_t length = 0;
+    char size_line[32];
+
+    if (body_count > 6) return -1;
+    for (int i = 0; i < body_count; i++) {
+        length += body[i].iov_len;
+        iov[i + 1] = body[i];
+    }
+    if (length == 0 && body_count > 0) return 0;    /* a zero-size chunk would end the body */
+
+    iov[0].iov_base = size_line;
+    iov[0].iov_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+    iov[body_count + 1].iov_base = (void *)"\r\n";
+    iov[body_count + 1].iov_len = 2;
+
+    TRACE_BEGIN(t_send);
+    set_cork(conn->fd, 1);
+    int rc = conn_writev(conn, iov, body_count + 2);
+    set_cork(conn->fd, 0);
+    TRACE_END(t_send, "send");
+    return rc;
+}
+
+/*
+ * Render a large document on the pool and stream it: chunk 0 (with the
+ * page header) is sent as soon as it is rendered, the rest as each one
+ * finishes in order. Returns 1 once the page has been sent, 0 if nothing
+ * was sent and the caller should render it sequentially, -1 if the
+ * connection failed part way through.
+ */
+static int stream_rendered_page(bridge_conn_t *conn, const char *markdown, size_t length, int keep_alive) {
+    int count;
+    md_chunk_t *chunks = markdown_split(markdown, length, &count);
+    if (!chunks) return 0;
+
+    markdown_render_chunks(chunks, count);
+    if (!chunks[0].html) {
+        markdown_free_chunks(chunks, count);
+        return 0;
+    }
+
+    struct iovec first[2] = {
+        { (void *)HTML_TEMPLATE_HEADER, strlen(HTML_TEMPLATE_HEADER) },
+        { chunks[0].html, chunks[0].html_length }
+    };
+    conn_size_send_buffer(conn, length);     /* the page is at least as long as its source */
+    int rc = send_http_stream_start(conn, "200 OK", "text/html", keep_alive);
+    if (rc == 0) rc = send_http_chunk(conn, first, 2);
+
+    for (int i = 1; i < count && rc == 0; i++) {
+        markdown_wait_chunk(&chunks[i]);
+        struct iovec body = { chunks[i].html, chunks[i].html_length };
+        rc = chunks[i].html ? send_http_chunk(conn, &body, 1) : -1;
+    }
+    if (rc == 0) {
+        struct iovec footer = { (void *)HTML_TEMPLATE_FOOTER, strlen(HTML_TEMPLATE_FOOTER) };
+        rc = send_http_chunk(conn, &footer, 1);
+        if (rc == 0) rc = send_http_chunk(conn, NULL, 0);
+    }
+
+    markdown_free_chunks(chunks, count);
+    return rc == 0 ? 1 : -1;
+}
+
+/* ------------------------------------------------------------------------
+ * Pre-rendered pages
+ *
+ * "mdtp-bridge build <content> <out>" renders every .md file under the
+ * content tree to <out>/<name>.html (template applied) on all cores, and
+ * only re-renders files whose source is newer than the existing output.
+ * Started with -P <out>, the bridge serves those files with sendfile()
+ * for requests to the backend they were built from, instead of fetching
+ * and converting on every request.
+ * ------------------------------------------------------------------------ */
+
+static const char *g_prerender_dir = NULL;
+static char g_prerender_backend[300] = "127.0.0.1:8585";
+
+typedef struct {
+    const char *src_dir;
+    const char *out_dir;
+    char **files;
+    size_t count;
+    size_t cap;
+    int force;
+    atomic_size_t next;
+    atomic_long rendered;
+    atomic_long skipped;
+    atomic_long failed;
+} prerender_job_t;
+
+
+int mkdir_p(const char *dir) {
+    char tmp[MAX_PATH];
+    snprintf(tmp, sizeof(tmp), "%s", dir);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) < 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    if (mkdir(tmp, 0755) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+
+/* Map "dir/page.md" to "<root>/dir/page.html". Returns -1 for non-.md paths. */
+int prerendered_path(const char *root, const char *md_path, char *out, size_t out_size) {
+    size_t len = strlen(md_path);
+    if (len < 3 || strcmp(md_path + len - 3, ".md") != 0) return -1;
+    int n = snprintf(out, out_size, "%s/%.*s.html", root, (int)(len - 3), md_path);
+    return n > 0 && (size_t)n < out_size ? 0 : -1;
+}
+
+
+int collect_markdown(prerender_job_t *job, const char *rel) {
+    char dir_path[MAX_PATH];
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", job->src_dir, rel);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) return -1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        /* A path that does not fit is reported and left out, never cut short. */
+        char child[MAX_PATH];
+        char full[MAX_PATH];
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", entry->d_name) >= (int)sizeof(child) ||
+            snprintf(full, sizeof(full), "%s/%s", job->src_dir, child) >= (int)sizeof(full)) {
+            fprintf(stderr, "[BUILD] Path too long, skipped: %s/%s%s%s\n",
+                    job->src_dir, rel, *rel ? "/" : "", entry->d_name);
+            atomic_fetch_add(&job->failed, 1);
+            continue;
+        }
+
+        struct stat st;
+        if (stat(full, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            collect_markdown(job, child);
+            continue;
+        }
+
+        size_t len = strlen(child);
+        if (!S_ISREG(st.st_mode) || len < 3 || strcmp(child + len - 3, ".md") != 0) continue;
+
+        if (job->count == job->cap) {
+            size_t cap = job->cap ? job->cap * 2 : 64;
+            char **files = realloc(job->files, cap * sizeof(char *));
+            if (!files) break;
+            job->files = files;
+            job->cap = cap;
+        }
+        job->files[job->count] = strdup(child);
+        if (job->files[job->count]) job->count++;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/* Returns 1 if rendered, 0 if the output was already up to date, -1 on error. */
+int prerender_file(prerender_job_t *job, const char *rel) {
+    char src[MAX_PATH], out[MAX_PATH], tmp[MAX_PATH + 32];
+    struct stat src_st, out_st;
+
+    snprintf(src, sizeof(src), "%s/%s", job->src_dir, rel);
+    if (prerendered_path(job->out_dir, rel, out, sizeof(out)) < 0) return -1;
+    if (stat(src, &src_st) < 0) return -1;
+
+    if (!job->force && stat(out, &out_st) == 0 &&
+        (out_st.st_mtim.tv_sec > src_st.st_mtim.tv_sec ||
+         (out_st.st_mtim.tv_sec == src_st.st_mtim.tv_sec &&
+          out_st.st_mtim.tv_nsec >= src_st.st_mtim.tv_nsec))) {
+        return 0;
+    }
+
+    FILE *f = fopen(src, "r");
+    if (!f) return -1;
+    char *markdown = malloc(src_st.st_size + 1);
+    size_t md_len = markdown ? fread(markdown, 1, src_st.st_size, f) : 0;
+    fclose(f);
+    if (!markdown) return -1;
+    markdown[md_len] = '\0';
+
+    size_t html_size = markdown_html_capacity(md_len);
+    char *html = malloc(html_size);
+    if (!html) {
+        free(markdown);
+        return -1;
+    }
+    markdown_to_html(markdown, html, html_size);
+    free(markdown);
+
+    char *slash = strrchr(out, '/');
+    *slash = '\0';
+    int rc = mkdir_p(out);
+    *slash = '/';
+
+    /* Render to a temporary name so the bridge never serves a partial page. */
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%lu", out, (unsigned long)pthread_self());
+    int fd = rc < 0 ? -1 : open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(html);
+        return -1;
+    }
+
+    rc = write_all(fd, HTML_TEMPLATE_HEADER, strlen(HTML_TEMPLATE_HEADER));
+    if (rc == 0) rc = write_all(fd, html, strlen(html));
+    if (rc == 0) rc = write_all(fd, HTML_TEMPLATE_FOOTER, strlen(HTML_TEMPLATE_FOOTER));
+    if (close(fd) < 0) rc = -1;
+    free(html);
+
+    if (rc < 0 || rename(tmp, out) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 1;
+}
+
+
+static void* prerender_worker(void *arg) {
+    prerender_job_t *job = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+        int rc = prerender_file(job, job->files[i]);
+        if (rc > 0) atomic_fetch_add(&job->rendered, 1);
+        else if (rc == 0) atomic_fetch_add(&job->skipped, 1);
+        else {
+            fprintf(stderr, "[BUILD] Failed to render %s\n", job->files[i]);
+            atomic_fetch_add(&job->failed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+
+int run_build(const char *src_dir, const char *out_dir, int jobs, int force) {
+    prerender_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.src_dir = src_dir;
+    job.out_dir = out_dir;
+    job.force = force;
+
+    if (collect_markdown(&job, "") < 0) {
+        perror("Cannot read content directory");
+        return 1;
+    }
+    if (mkdir_p(out_dir) < 0) {
+        perror("Cannot create output directory");
+        return 1;
+    }
+
+    if (jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0) jobs = 1;
+    if ((size_t)jobs > job.count) jobs = job.count ? (int)job.count : 1;
+
+    printf("[BUILD] %zu documents in %s -> %s (%d threads)\n", job.count, src_dir, out_dir, jobs);
+
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    int running = 0;
+    for (int i = 0; threads && i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, prerender_worker, &job) != 0) break;
+        running++;
+    }
+    if (running == 0) prerender_worker(&job);
+    for (int i = 0; i < running; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    printf("[BUILD] %ld rendered, %ld up to date, %ld failed\n",
+           atomic_load(&job.rendered), atomic_load(&job.skipped), atomic_load(&job.failed));
+
+    for (size_t i = 0; i < job.count; i++) free(job.files[i]);
+    free(job.files);
+    return atomic_load(&job.failed) > 0;
+}
+
+
+/* Serve a pre-rendered page if one exists for this target. Returns 0 if sent. */
+int send_prerendered(bridge_conn_t *conn, const char *host, int port, const char *mdtp_path,
+                     int keep_alive) {
+    char backend[300], file[MAX_PATH];
+
+    snprintf(backend, sizeof(backend), "%s:%d", host, port);
+    if (strcmp(backend, g_prerender_backend) != 0) return -1;
+    if (strstr(mdtp_path, "..")) return -1;
+    if (prerendered_path(g_prerender_dir, mdtp_path, file, sizeof(file)) < 0) return -1;
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: %lld\r\n"
+        "Connection: %s\r\n\r\n",
+        (long long)st.st_size, keep_alive ? "keep-alive" : "close");
+
+    struct iovec iov = { header, header_len };
+
+    TRACE_BEGIN(t_send);
+    conn_size_send_buffer(conn, header_len + st.st_size);
+    set_cork(conn->fd, 1);
+    if (conn_writev(conn, &iov, 1) == 0) conn_sendfile(conn, fd, st.st_size);
+    else close(fd);
+    set_cork(conn->fd, 0);
+    TRACE_END(t_send, "send");
+    return 0;
+}
+
+
+/*
+ * Send the page for a fetched document, or an error page if markdown is
+ * NULL. Returns 1 if the connection should stay open for the next request.
+ */
+static int send_fetched_page(bridge_conn_t *conn, const char *markdown, int keep_alive, int streamable) {
+    if (markdown && streamable) {
+        size_t md_len = strlen(markdown);
+        int sent = md_len >= MD_PARALLEL_MIN ? stream_rendered_page(conn, markdown, md_len, keep_alive) : 0;
+        if (sent != 0) return sent > 0 ? keep_alive : 0;
+    }
+
+    if (markdown) {
+        size_t html_size = markdown_html_capacity(strlen(markdown));
+        char *html_content = malloc(html_size);
+        if (html_content) {
+            markdown_to_html(markdown, html_content, html_size);
+
+            struct iovec page[3] = {
+                { (void *)HTML_TEMPLATE_HEADER, strlen(HTML_TEMPLATE_HEADER) },
+                { html_content, strlen(html_content) },
+                { (void *)HTML_TEMPLATE_FOOTER, strlen(HTML_TEMPLATE_FOOTER) }
+            };
+            send_http_response(conn, "200 OK", "text/html", NULL, page, 3, keep_alive);
+            free(html_content);
+            return keep_alive;
+        }
+    }
+
+    static const char error[] = 
+        "<html><body><h1>MDTP Error</h1>"
+        "<p>Failed to fetch from MDTP server</p></body></html>";
+    struct iovec body = { (void *)error, sizeof(error) - 1 };
+    send_http_response(conn, "500 Error", "text/html", NULL, &body, 1, keep_alive);
+    return keep_alive;
+}
+
+
+/*
+ * Answer one HTTP request (headers up to the blank line). Returns 1 if the
+ * connection should stay open for the next request.
+ */
+int handle_http_request(bridge_conn_t *conn, const char *request) {
+    char method[16], path[512], version[16] = "HTTP/1.0";
+    if (sscanf(request, "%15s %511s %15s", method, path, version) < 2) {
+        return 0;
+    }
+    printf("[HTTP Bridge] %s %s\n", method, path);
+
+    /* HTTP/1.1 connections persist unless the client asks otherwise. */
+    int keep_alive = strcmp(version, "HTTP/1.1") == 0;
+    const char *conn_header = strcasestr(request, "\r\nConnection:");
+    if (conn_header) {
+        conn_header += 13;
+        while (*conn_header == ' ') conn_header++;
+        if (strncasecmp(conn_header, "close", 5) == 0) keep_alive = 0;
+        else if (strncasecmp(conn_header, "keep-alive", 10) == 0) keep_alive = 1;
+    }
+
+    if (strcmp(path, "/") == 0) {
+        static const char home[] = 
+            "<html><head><title>MDTP Bridge</title></head>"
+            "<body style='font-family:sans-serif;max-width:600px;margin:50px auto'>"
+            "<h1>🌐 MDTP HTTP Bridge</h1>"
+            "<p>Access MDTP sites through your browser!</p>"
+            "<h2>Try these:</h2><ul>"
+            "<li><a href='/127.0.0.1:8585/index.md'>index.md</a></li>"
+            "<li><a href='/127.0.0.1:8585/about.md'>about.md</a></li>"
+            "</ul></body></html>";
+        struct iovec body = { (void *)home, sizeof(home) - 1 };
+        send_http_response(conn, "200 OK", "text/html", NULL, &body, 1, keep_alive);
+        return keep_alive;
+    }
+
+    if (strncmp(path, "/style.css", 10) == 0 && (path[10] == '\0' || path[10] == '?')) {
+        char cache_headers[64];
+        snprintf(cache_headers, sizeof(cache_headers),
+                 "Cache-Control: public, max-age=%d, immutable\r\n", STYLE_MAX_AGE);
+        struct iovec body = { (void *)HTML_STYLESHEET, strlen(HTML_STYLESHEET) };
+        send_http_response(conn, "200 OK", "text/css", cache_headers, &body, 1, keep_alive);
+        return keep_alive;
+    }
+
+    char host[256] = "127.0.0.1";
+    int port = 8585;
+    char mdtp_path[512] = "/index.md";
+    
+    if (path[0] == '/') {
+        char *p = path + 1;
+        char *colon = strchr(p, ':');
+        char *slash = strchr(p, '/');
+        
+        if (colon && slash && colon < slash && colon - p < (int)sizeof(host)) {
+            int host_len = colon - p;
+            strncpy(host, p, host_len);
+            host[host_len] = '\0';
+            port = atoi(colon + 1);
+            strcpy(mdtp_path, slash);
+        } else if (slash) {
+            strcpy(mdtp_path, slash);
+        }
+    }
+    
+    if (g_prerender_dir && send_prerendered(conn, host, port, mdtp_path, keep_alive) == 0) {
+        return keep_alive;
+    }
+
+    int streamable = g_render_threads > 0 && strcmp(version, "HTTP/1.1") == 0;
+    if (fetch_start(conn, host, port, mdtp_path, keep_alive, streamable) == 0) {
+        timer_cancel(&g_timers, &conn->timer);     /* the backend's deadline covers the wait */
+        return keep_alive;
+    }
+    return send_fetched_page(conn, NULL, keep_alive, 0);
+}
+
+
+/*
+ * Answer each complete request buffered on a browser connection, stopping
+ * while a response is still being written or a page is being fetched.
+ * Returns -1 when the connection should be closed now.
+ */
+static int process_http_requests(bridge_conn_t *conn) {
+    int answered = 0;
+    int keep_alive = 1;
+    char *end;
+
+    while (!conn_pending(conn) && !conn->fetch && (end = strstr(conn->buffer, "\r\n\r\n")) != NULL) {
+        size_t request_len = end + 4 - conn->buffer;
+        char next = conn->buffer[request_len];
+
+        conn->buffer[request_len] = '\0';
+        TRACE_BEGIN(t_request);
+        keep_alive = handle_http_request(conn, conn->buffer);
+        TRACE_END(t_request, "request");
+        conn->buffer[request_len] = next;
+
+        memmove(conn->buffer, conn->buffer + request_len, conn->length - request_len + 1);
+        conn->length -= request_len;
+        answered = 1;
+
+        if (!keep_alive) break;
+    }
+
+    int busy = conn_pending(conn) || conn->fetch;
+    if (!busy && conn->length + 1 >= BUFFER_SIZE) keep_alive = 0;
+
+    if (!keep_alive) {
+        if (!busy) return -1;
+        conn->closing = 1;
+        return 0;
+    }
+
+    /* A new read deadline starts only once a whole request has been answered. */
+    if (answered && !busy) conn_touch(conn);
+    return 0;
+}
+
+
+/*
+ * Read from a browser connection and answer each complete request in it.
+ * Returns -1 when the connection should be closed.
+ */
+int handle_http_client(bridge_conn_t *conn) {
+    size_t room = conn_reserve(conn);
+    if (room == 0) return -1;
+
+    TRACE_BEGIN(t_recv);
+    ssize_t bytes = recv(conn->fd, conn->buffer + conn->length, room, 0);
+    TRACE_END(t_recv, "recv");
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (bytes == 0 && conn->fetch && !conn->shut) {
+        /* The browser has finished sending: stop reading, answer the page being fetched, then close. */
+        struct epoll_event ev = { .events = 0, .data.ptr = conn };
+        epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->shut = 1;
+        conn->closing = 1;
+        return 0;
+    }
+    if (bytes <= 0) {
+        return -1;
+    }
+
+    conn->length += bytes;
+    conn->buffer[conn->length] = '\0';
+    return process_http_requests(conn);
+}
+
+
+/* Continue pending output; once it has all gone out, go back to the buffered requests. */
+int resume_http_client(bridge_conn_t *conn) {
+    int rc = conn_flush(conn);
+    if (rc < 0) return -1;
+
+    conn_touch(conn);
+    if (rc > 0) return 0;
+    if (conn->closing) return -1;
+
+    conn_want_write(conn, 0);
+    return process_http_requests(conn);
+}
+
+
+/*
+ * A fetch started by handle_http_request() has finished: send the page,
+ * then go on to the requests buffered meanwhile. This runs from a backend
+ * event, so a connection that is done is not closed here but left to
+ * close from its own EPOLLOUT, through resume_http_client().
+ */
+static void answer_fetched_page(bridge_conn_t *conn, const char *markdown, int keep_alive, int streamable) {
+    if (send_fetched_page(conn, markdown, keep_alive, streamable) && !conn->closing) {
+        if (!conn_pending(conn)) conn_touch(conn);
+        if (process_http_requests(conn) == 0) return;
+    }
+    conn->closing = 1;
+    conn_want_write(conn, 1);
+}
+
+
+/*
+ * "render": convert one Markdown file and print the HTML, or with -n,
+ * render it that many times and report throughput instead. With -j the
+ * document is rendered in chunks on that many threads, and the timed run
+ * also checks the result against a sequential render.
+ */
+int run_render(const char *file, int iterations, int threads) {
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("render: cannot open input");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    size_t md_len = st.st_size;
+    char *markdown = malloc(md_len + 1);
+    size_t html_size = markdown_html_capacity(md_len);
+    char *html = malloc(html_size);
+    if (!markdown || !html || read(fd, markdown, md_len) != (ssize_t)md_len) {
+        perror("render: cannot read input");
+        close(fd);
+        free(markdown);
+        free(html);
+        return 1;
+    }
+    close(fd);
+    markdown[md_len] = '\0';
+
+    if (threads > 0) start_render_pool(threads);
+
+    if (iterations <= 0) {
+        markdown_to_html_parallel(markdown, html, html_size);
+        fputs(html, stdout);
+    } else {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; i++) markdown_to_html_parallel(markdown, html, html_size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%d renders of %zu bytes in %.3f s: %.1f MB/s, %zu bytes of HTML\n",
+               iterations, md_len, secs, md_len * (double)iterations / secs / 1e6, strlen(html));
+
+        if (g_render_threads > 0) {
+            char *expected = malloc(html_size);
+            if (expected) {
+                int chunks;
+                free(markdown_split(markdown, md_len, &chunks));
+                markdown_to_html(markdown, expected, html_size);
+                printf("%d chunks on %d threads, output %s sequential render\n", chunks, g_render_threads,
+                       strcmp(expected, html) == 0 ? "identical to" : "DIFFERS from");
+                free(expected);
+            }
+        }
+    }
+
+    free(markdown);
+    free(html);
+    return 0;
+}
+
+
+void print_usage(const char *prog) {
+    printf("Usage:\n");
+    printf("  %s [-P <dir>] [-b host:port] [-j n] [-t secs] [-q n]\n", prog);
+    printf("        Run the HTTP bridge on port %d\n", BRIDGE_PORT);
+    printf("        -P  serve pre-rendered pages from <dir> for backend -b\n");
+    printf("            (default backend: 127.0.0.1:8585)\n");
+    printf("        -j  render pages over 1 MB on n threads and stream them\n");
+    printf("        -t  close connections idle or stalled for secs (default %d, 0 = never)\n",
+           BRIDGE_TIMEOUT);
+    printf("        -q  listen queue length (default %d)\n", BRIDGE_BACKLOG);
+    printf("  %s build <content> <out> [-j n] [-f]\n", prog);
+    printf("        Render every .md under <content> to <out>; only changed\n");
+    printf("        files are rebuilt unless -f is given\n");
+    printf("  %s render <file.md> [-n iterations] [-j n]\n", prog);
+    printf("        Print the HTML for one file, or time -n renders of it;\n");
+    printf("        -j renders it in chunks on n threads\n");
+}
+
+#ifdef MDTP_TRACE
+static volatile sig_atomic_t g_trace_requested = 0;
+
+static void handle_sigusr1(int sig) {
+    (void)sig;
+    g_trace_requested = 1;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    int server_sock, client_sock;
+    struct sockaddr_in server_addr, client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    int render_threads = 0;
+    int backlog = BRIDGE_BACKLOG;
+
+    if (argc > 1 && strcmp(argv[1], "build") == 0) {
+        if (argc < 4) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        int jobs = 0, force = 0;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jobs = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-f") == 0) force = 1;
+            else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        return run_build(argv[2], argv[3], jobs, force);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "render") == 0) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        int iterations = 0, threads = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+            else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        return run_render(argv[2], iterations, threads);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            g_prerender_dir = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            snprintf(g_prerender_backend, sizeof(g_prerender_backend), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            render_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            g_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            backlog = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("Socket failed");
+        return 1;
+    }
+    
+    int opt = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(BRIDGE_PORT);
+    
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        return 1;
+    }
+    
+    /* As in the server's tune_listener(): hand over connections once a request is in, allow TFO. */
+    int defer = BRIDGE_DEFER_ACCEPT, fastopen = BRIDGE_FASTOPEN;
+    setsockopt(server_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+    setsockopt(server_sock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen));
+    if (listen(server_sock, backlog > 0 ? backlog : SOMAXCONN) < 0) {
+        perror("Listen failed");
+        return 1;
+    }
+    
+    printf("╔═══════════════════════════════════════════════════════╗\n");
+    printf("║       MDTP HTTP Bridge Server - Running!            ║\n");
+    printf("╠═══════════════════════════════════════════════════════╣\n");
+    printf("║  Browse MDTP sites in your regular web browser!      ║\n");
     printf("║                                                       ║\n");
     printf("║  Open: http://127.0.0.1:9999/                        ║\n");
     printf("║                                                       ║\n");
     printf("║  Direct access:                                       ║\n");
     printf("║  http://127.0.0.1:9999/127.0.0.1:8585/index.md       ║\n");
     printf("╚═══════════════════════════════════════════════════════╝\n\n");
+    if (g_prerender_dir) {
+        printf("[Bridge] Serving pre-rendered pages from %s for %s\n\n",
+               g_prerender_dir, g_prerender_backend);
+    }
+    if (render_threads > 0) {
+        printf("[Bridge] Rendering large pages on %d threads\n\n", start_render_pool(render_threads));
+    }
     
+    signal(SIGPIPE, SIG_IGN);
+#ifdef MDTP_TRACE
+    signal(SIGUSR1, handle_sigusr1);
+    TRACE_THREAD("bridge");
+    printf("[Bridge] Tracing enabled; SIGUSR1 writes the recorded spans\n\n");
+#endif
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev);
+    g_epoll_fd = epoll_fd;
+    timer_wheel_init(&g_timers, time(NULL));
+    timer_wheel_init(&g_backend_timers, time(NULL));
+
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock >= 0) {
-            handle_http_request(client_sock);
+#ifdef MDTP_TRACE
+        if (g_trace_requested) {
+            g_trace_requested = 0;
+            printf("[Bridge] Trace: wrote %d spans\n", trace_dump(NULL));
+        }
+#endif
+
+        timer_expire(&g_timers, time(NULL), conn_expired, NULL);
+        timer_expire(&g_backend_timers, time(NULL), backend_expired, NULL);
+
+        int armed = g_timers.armed > 0 || g_backend_timers.armed > 0;
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, armed ? 1000 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            bridge_conn_t *conn = events[i].data.ptr;
+
+            if (is_backend(events[i].data.ptr)) {
+                backend_event(events[i].data.ptr);
+                continue;
+            }
+
+            if (!conn) {
+                client_len = sizeof(client_addr);
+                client_sock = accept4(server_sock, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK);
+                if (client_sock < 0) continue;
+
+                conn = calloc(1, sizeof(bridge_conn_t));
+                if (!conn) {
+                    close(client_sock);
+                    continue;
+                }
+                conn->fd = client_sock;
+                conn->file_fd = -1;
+                conn->buffer = malloc(REQUEST_BUFFER_MIN);
+                conn->capacity = REQUEST_BUFFER_MIN;
+                if (!conn->buffer) {
+                    close(client_sock);
+                    free(conn);
+                    continue;
+                }
+                conn->buffer[0] = '\0';
+
+                int nodelay = 1;
+                setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+                struct epoll_event cev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &cev) < 0) {
+                    close(client_sock);
+                    free(conn->buffer);
+                    free(conn);
+                    continue;
+                }
+                conn_touch(conn);
+                continue;
+            }
+
+            int finishing = conn_pending(conn) || (conn->closing && !conn->fetch);
+            int rc = finishing ? resume_http_client(conn) : handle_http_client(conn);
+            if (rc < 0) close_http_conn(conn);
         }
     }
     
+    close(epoll_fd);
     close(server_sock);
     return 0;
 } 
@@ -0,0 +1,602 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "cache.h"
+#include "delta.h"
+
+/*
+ * Document cache with content-addressed storage.
+ *
+ * Path entries map a file (checked against dev/inode/size/mtime on every
+ * lookup) to a blob; blobs are keyed by the hash of their content, so every
+ * copy of an identical file shares one buffer and one deflated variant.
+ * The content hash is also the document's ETag. Blobs are freed with the
+ * last path entry pointing at them.
+ *
+ * Memory is split into two tiers. Hot blobs hold the raw content, ready to
+ * send, plus the deflated variant once a client has asked for it. Warm
+ * blobs hold only the deflated content and are inflated on a hit, which
+ * moves them back to the hot tier. Which blobs stay hot is decided by
+ * W-TinyLFU: new and promoted blobs enter a small LRU window; a blob
+ * leaving the window joins the main segmented LRU only if it has been
+ * used more often than the blob main would give up for it, and access
+ * counts come from a count-min sketch that is halved periodically so old
+ * popularity fades. Blobs leaving the hot tier are deflated into the warm
+ * tier, whose least recently used blobs are dropped when it is full.
+ * Content that does not deflate smaller is never kept warm.
+ *
+ * cache_read() hands out the blob's own buffers rather than copies, with a
+ * reference that the response gives back through cache_release() once it
+ * has been sent. A blob evicted or demoted meanwhile keeps the buffers
+ * the reader holds until then, outside the budgets.
+ */
+
+#define CACHE_PATH_BUCKETS 8192
+#define CACHE_BLOB_BUCKETS 8192
+#define CACHE_MAX_PATHS 65536
+
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_WIDTH 16384        /* counters per row, a power of two */
+#define CACHE_SKETCH_MAX 15
+#define CACHE_SKETCH_PERIOD (CACHE_SKETCH_WIDTH * 10)   /* additions between halvings */
+
+enum { TIER_NONE, TIER_WINDOW, TIER_PROBATION, TIER_PROTECTED, TIER_WARM, TIER_COUNT };
+
+typedef struct cache_blob {
+    uint64_t hash;
+    char *data;                 /* NULL while warm */
+    size_t length;
+    char *deflated;             /* computed on first request for it, or on demotion */
+    size_t deflated_length;
+    int deflate_state;          /* 0 not tried, 1 available, -1 would not shrink */
+    int tier;
+    long size;                  /* bytes charged to its tier */
+    int refs;                   /* readers still sending from it; see cache_release() */
+    int dead;                   /* out of the cache, freed by the last cache_release() */
+    struct cache_entry *entries;            /* paths with this content */
+    struct cache_blob *newer, *older;       /* position in its tier */
+    struct cache_blob *next;
+} cache_blob_t;
+
+typedef struct cache_entry {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    cache_blob_t *blob;
+    struct cache_entry *blob_next;
+    struct cache_entry *next;
+} cache_entry_t;
+
+typedef struct {
+    cache_blob_t *newest;
+    cache_blob_t *oldest;
+    long bytes;
+    long count;
+} cache_tier_t;
+
+static cache_entry_t *g_paths[CACHE_PATH_BUCKETS];
+static cache_blob_t *g_blobs[CACHE_BLOB_BUCKETS];
+static cache_tier_t g_tiers[TIER_COUNT];
+static uint8_t g_sketch[CACHE_SKETCH_ROWS][CACHE_SKETCH_WIDTH];
+static long g_sketch_additions = 0;
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long g_max_bytes = 0;
+static int g_hot_percent = 75;
+static long g_max_file_size = 0;
+static long g_path_count = 0;
+static long g_blob_count = 0;
+static long g_logical_bytes = 0;
+static long g_blob_bytes = 0;
+static long g_deflated_bytes = 0;
+static long g_hot_hits = 0;
+static long g_warm_hits = 0;
+static long g_misses = 0;
+static long g_promotions = 0;
+static long g_demotions = 0;
+static long g_evictions = 0;
+
+static void enforce_budgets(void);
+
+
+/*
+ * Cache up to max_bytes of content in files no larger than max_file_size,
+ * hot_percent of it uncompressed; 0 disables. Shrinking the budget evicts
+ * at once.
+ */
+void cache_configure(long max_bytes, int hot_percent, long max_file_size) {
+    pthread_mutex_lock(&g_cache_lock);
+    g_max_bytes = max_bytes > 0 ? max_bytes : 0;
+    g_hot_percent = hot_percent < 0 ? 0 : hot_percent > 100 ? 100 : hot_percent;
+    g_max_file_size = max_file_size;
+    enforce_budgets();
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+
+/* ------------------------------------------------------------------------
+ * Frequency sketch
+ * ------------------------------------------------------------------------ */
+
+static uint32_t sketch_slot(uint64_t hash, int row) {
+    uint64_t h = (hash + (uint64_t)(row + 1) * 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+    return (uint32_t)(h >> 40) & (CACHE_SKETCH_WIDTH - 1);
+}
+
+
+static void sketch_add(uint64_t hash) {
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t *c = &g_sketch[row][sketch_slot(hash, row)];
+        if (*c < CACHE_SKETCH_MAX) (*c)++;
+    }
+
+    if (++g_sketch_additions < CACHE_SKETCH_PERIOD) return;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        for (int i = 0; i < CACHE_SKETCH_WIDTH; i++) g_sketch[row][i] >>= 1;
+    }
+    g_sketch_additions /= 2;
+}
+
+
+static int sketch_estimate(uint64_t hash) {
+    int count = CACHE_SKETCH_MAX;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        int c = g_sketch[row][sketch_slot(hash, row)];
+        if (c < count) count = c;
+    }
+    return count;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Tiers
+ * ------------------------------------------------------------------------ */
+
+static void tier_push(int tier, cache_blob_t *blob) {
+    cache_tier_t *t = &g_tiers[tier];
+
+    blob->tier = tier;
+    blob->size = blob->deflated_length + (tier == TIER_WARM ? 0 : blob->length);
+    blob->older = t->newest;
+    blob->newer = NULL;
+    if (t->newest) t->newest->newer = blob;
+    else t->oldest = blob;
+    t->newest = blob;
+    t->bytes += blob->size;
+    t->count++;
+}
+
+
+static void tier_remove(cache_blob_t *blob) {
+    cache_tier_t *t = &g_tiers[blob->tier];
+
+    if (blob->tier == TIER_NONE) return;
+    if (blob->newer) blob->newer->older = blob->older;
+    else t->newest = blob->older;
+    if (blob->older) blob->older->newer = blob->newer;
+    else t->oldest = blob->newer;
+    t->bytes -= blob->size;
+    t->count--;
+    blob->tier = TIER_NONE;
+}
+
+
+static void tier_move(int tier, cache_blob_t *blob) {
+    tier_remove(blob);
+    tier_push(tier, blob);
+}
+
+
+static long hot_capacity(void) {
+    return g_max_bytes / 100 * g_hot_percent;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Blobs and path entries
+ * ------------------------------------------------------------------------ */
+
+static cache_entry_t** find_entry(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = path; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    cache_entry_t **ep = &g_paths[hash % CACHE_PATH_BUCKETS];
+    while (*ep && strcmp((*ep)->path, path) != 0) ep = &(*ep)->next;
+    return ep;
+}
+
+
+static int entry_matches(const cache_entry_t *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+static void destroy_blob(cache_blob_t *blob) {
+    free(blob->data);
+    free(blob->deflated);
+    free(blob);
+}
+
+
+static void free_blob(cache_blob_t *blob) {
+    cache_blob_t **bp = &g_blobs[blob->hash % CACHE_BLOB_BUCKETS];
+    while (*bp != blob) bp = &(*bp)->next;
+    *bp = blob->next;
+
+    tier_remove(blob);
+    g_blob_count--;
+    g_blob_bytes -= blob->length;
+    g_deflated_bytes -= blob->deflated_length;
+    if (blob->refs > 0) blob->dead = 1;
+    else destroy_blob(blob);
+}
+
+
+static void remove_entry(cache_entry_t **ep) {
+    cache_entry_t *e = *ep;
+    cache_blob_t *blob = e->blob;
+    *ep = e->next;
+
+    cache_entry_t **bp = &blob->entries;
+    while (*bp != e) bp = &(*bp)->blob_next;
+    *bp = e->blob_next;
+
+    g_path_count--;
+    g_logical_bytes -= blob->length;
+    free(e->path);
+    free(e);
+    if (!blob->entries) free_blob(blob);
+}
+
+
+/* Forget a blob and every path that leads to it. */
+static void drop_blob(cache_blob_t *blob) {
+    cache_entry_t *e = blob->entries;
+
+    g_evictions++;
+    while (e) {
+        cache_entry_t *next = e->blob_next;
+        remove_entry(find_entry(e->path));      /* the last one frees blob */
+        e = next;
+    }
+}
+
+
+/*
+ * Blob holding exactly these bytes, creating it from `data` (taking
+ * ownership) if none exists. A warm blob found this way takes `data` as
+ * its raw content, unless a reader still holds its old one. Returns NULL
+ * if out of memory; `data` is then still the caller's.
+ */
+static cache_blob_t* intern_blob(char *data, size_t length, uint64_t hash) {
+    cache_blob_t **bp = &g_blobs[hash % CACHE_BLOB_BUCKETS];
+    for (cache_blob_t *b = *bp; b; b = b->next) {
+        if (b->hash != hash || b->length != length) continue;
+        if (b->data) {
+            if (memcmp(b->data, data, length) != 0) continue;
+            free(data);
+        } else {
+            b->data = data;
+        }
+        if (b->tier == TIER_WARM) {
+            tier_move(TIER_WINDOW, b);
+            g_promotions++;
+        }
+        return b;
+    }
+
+    cache_blob_t *blob = calloc(1, sizeof(cache_blob_t));
+    if (!blob) return NULL;
+    blob->hash = hash;
+    blob->data = data;
+    blob->length = length;
+    blob->next = *bp;
+    *bp = blob;
+    tier_push(TIER_WINDOW, blob);
+
+    g_blob_count++;
+    g_blob_bytes += length;
+    return blob;
+}
+
+
+/* Build the deflated variant once; kept only if it is smaller. */
+static void deflate_blob(cache_blob_t *blob, int level) {
+    uLongf bound = compressBound(blob->length);
+    char *out = malloc(bound);
+
+    blob->deflate_state = -1;
+    if (!out) return;
+    if (compress2((Bytef *)out, &bound, (const Bytef *)blob->data, blob->length, level) != Z_OK ||
+        bound >= blob->length) {
+        free(out);
+        return;
+    }
+
+    char *shrunk = realloc(out, bound);
+    blob->deflated = shrunk ? shrunk : out;
+    blob->deflated_length = bound;
+    blob->deflate_state = 1;
+    g_deflated_bytes += bound;
+    if (blob->tier != TIER_NONE) {
+        blob->size += bound;
+        g_tiers[blob->tier].bytes += bound;
+    }
+}
+
+
+static char* inflate_blob(const cache_blob_t *blob) {
+    uLongf length = blob->length;
+    char *data = malloc(blob->length + 1);
+
+    if (!data) return NULL;
+    if (uncompress((Bytef *)data, &length, (const Bytef *)blob->deflated, blob->deflated_length) != Z_OK ||
+        length != blob->length) {
+        free(data);
+        return NULL;
+    }
+    data[length] = '\0';
+    return data;
+}
+
+
+/*
+ * Move a hot blob to the warm tier, deflating it first if no client has
+ * asked for that yet (at the fastest level: this runs on someone else's
+ * miss). A blob seen only once is not worth deflating and is dropped, as
+ * is content that will not shrink.
+ */
+static void demote(cache_blob_t *blob) {
+    tier_remove(blob);
+    if (g_max_bytes - hot_capacity() <= 0 ||
+        (blob->deflate_state == 0 && sketch_estimate(blob->hash) < 2)) {
+        drop_blob(blob);
+        return;
+    }
+    if (blob->deflate_state == 0) deflate_blob(blob, Z_BEST_SPEED);
+    if (blob->deflate_state != 1) {
+        drop_blob(blob);
+        return;
+    }
+
+    if (blob->refs == 0) {
+        free(blob->data);
+        blob->data = NULL;
+    }
+    tier_push(TIER_WARM, blob);
+    g_demotions++;
+}
+
+
+/*
+ * Bring the tiers back within budget. The hot budget is split into a
+ * window of 1% and a main area, 80% of which is the protected segment for
+ * blobs hit again since they were admitted; the rest is probation.
+ */
+static void enforce_budgets(void) {
+    long hot = hot_capacity();
+    long window = hot / 100;
+    long main_area = hot - window;
+    long protected = main_area / 5 * 4;
+    long warm = g_max_bytes - hot;
+
+    /* The window's oldest blob stays hot only if it is used more than what it would displace. */
+    while (g_tiers[TIER_WINDOW].bytes > window) {
+        cache_blob_t *candidate = g_tiers[TIER_WINDOW].oldest;
+        tier_remove(candidate);
+
+        int admit = candidate->size <= main_area;
+        while (admit && g_tiers[TIER_PROBATION].bytes + g_tiers[TIER_PROTECTED].bytes + candidate->size > main_area) {
+            cache_blob_t *victim = g_tiers[TIER_PROBATION].oldest ? g_tiers[TIER_PROBATION].oldest
+                                                                  : g_tiers[TIER_PROTECTED].oldest;
+            if (sketch_estimate(candidate->hash) <= sketch_estimate(victim->hash)) admit = 0;
+            else demote(victim);
+        }
+        if (admit) tier_push(TIER_PROBATION, candidate);
+        else demote(candidate);
+    }
+
+    while (g_tiers[TIER_PROTECTED].bytes > protected) {
+        tier_move(TIER_PROBATION, g_tiers[TIER_PROTECTED].oldest);
+    }
+    while (g_tiers[TIER_PROBATION].bytes + g_tiers[TIER_PROTECTED].bytes > main_area) {
+        demote(g_tiers[TIER_PROBATION].oldest ? g_tiers[TIER_PROBATION].oldest
+                                              : g_tiers[TIER_PROTECTED].oldest);
+    }
+    while (g_tiers[TIER_WARM].bytes > warm) drop_blob(g_tiers[TIER_WARM].oldest);
+}
+
+
+/* A hit on a hot blob: recency within its segment, or promotion out of probation. */
+static void touch(cache_blob_t *blob) {
+    tier_move(blob->tier == TIER_PROBATION ? TIER_PROTECTED : blob->tier, blob);
+}
+
+
+static char* read_whole(const char *filepath, struct stat *st, size_t *length) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    char *data = malloc(st->st_size + 1);
+    size_t have = 0;
+    while (data && have < (size_t)st->st_size) {
+        ssize_t n = read(fd, data + have, st->st_size - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += n;
+    }
+    close(fd);
+
+    if (data) {
+        data[have] = '\0';
+        *length = have;
+    }
+    return data;
+}
+
+
+/*
+ * Lend out a hot blob's content, and its deflated variant if asked for,
+ * building that on the first request once the content has been seen
+ * before; a one-off read is sent as it is rather than compressed for a
+ * cache it will soon leave.
+ */
+static const char* lend_blob(cache_blob_t *blob, size_t *length, uint64_t *etag,
+                             const char **deflated, size_t *deflated_length, void **ref) {
+    if (deflated && blob->deflate_state == 0 && sketch_estimate(blob->hash) >= 2) {
+        deflate_blob(blob, Z_DEFAULT_COMPRESSION);
+    }
+    if (deflated && blob->deflate_state == 1) {
+        *deflated = blob->deflated;
+        *deflated_length = blob->deflated_length;
+    }
+    *length = blob->length;
+    *etag = blob->hash;
+    *ref = blob;
+    blob->refs++;
+    return blob->data;
+}
+
+
+/*
+ * Read a file through the cache. Returns its NUL-terminated content and
+ * its ETag, or NULL if it cannot be read. If deflated is not NULL it
+ * receives the deflated variant, or NULL when deflating does not make the
+ * document smaller. Both stay valid until *ref is given to cache_release().
+ */
+const char* cache_read(const char *filepath, size_t *length, uint64_t *etag,
+                       const char **deflated, size_t *deflated_length, void **ref) {
+    struct stat st;
+    const char *body;
+
+    if (deflated) *deflated = NULL;
+
+    pthread_mutex_lock(&g_cache_lock);
+    cache_entry_t **ep = find_entry(filepath);
+    if (*ep && stat(filepath, &st) == 0 && entry_matches(*ep, &st)) {
+        cache_blob_t *blob = (*ep)->blob;
+
+        sketch_add(blob->hash);
+        if (blob->tier == TIER_WARM && (blob->data || (blob->data = inflate_blob(blob)))) {
+            tier_move(TIER_WINDOW, blob);
+            g_promotions++;
+            g_warm_hits++;
+        } else if (blob->tier != TIER_WARM) {
+            touch(blob);
+            g_hot_hits++;
+        }
+
+        if (blob->data) {
+            body = lend_blob(blob, length, etag, deflated, deflated_length, ref);
+            enforce_budgets();
+            pthread_mutex_unlock(&g_cache_lock);
+            return body;
+        }
+    }
+    if (*ep) remove_entry(ep);
+    g_misses++;
+    pthread_mutex_unlock(&g_cache_lock);
+
+    size_t len;
+    char *data = read_whole(filepath, &st, &len);
+    if (!data) return NULL;
+    uint64_t hash = delta_hash(data, len);
+
+    pthread_mutex_lock(&g_cache_lock);
+    sketch_add(hash);
+    cache_blob_t *blob = NULL;
+    ep = find_entry(filepath);
+    if (*ep) remove_entry(ep);
+    if (g_max_bytes > 0 && (long)len <= g_max_file_size && g_path_count < CACHE_MAX_PATHS) {
+        cache_entry_t *e = calloc(1, sizeof(cache_entry_t));
+        if (e && (e->path = strdup(filepath)) && (blob = intern_blob(data, len, hash))) {
+            data = NULL;
+            e->dev = st.st_dev;
+            e->ino = st.st_ino;
+            e->size = st.st_size;
+            e->mtime = st.st_mtim;
+            e->blob = blob;
+            e->blob_next = blob->entries;
+            blob->entries = e;
+            e->next = *ep;
+            *ep = e;
+            g_path_count++;
+            g_logical_bytes += len;
+        } else if (e) {
+            free(e->path);
+            free(e);
+        }
+    }
+    if (blob) {
+        body = lend_blob(blob, length, etag, deflated, deflated_length, ref);
+        enforce_budgets();
+        pthread_mutex_unlock(&g_cache_lock);
+        return body;
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+
+    /* Not cached: lend it through a blob of its own, freed on release. */
+    blob = calloc(1, sizeof(cache_blob_t));
+    if (!blob) {
+        free(data);
+        return NULL;
+    }
+    blob->data = data;
+    blob->length = len;
+    blob->hash = hash;
+    blob->dead = 1;
+    return lend_blob(blob, length, etag, NULL, NULL, ref);
+}
+
+
+/* Give back a reference from cache_read(). */
+void cache_release(void *ref) {
+    cache_blob_t *blob = ref;
+
+    pthread_mutex_lock(&g_cache_lock);
+    if (--blob->refs == 0) {
+        if (blob->dead) {
+            destroy_blob(blob);
+        } else if (blob->tier == TIER_WARM) {
+            free(blob->data);
+            blob->data = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+
+void cache_get_stats(cache_stats_t *stats) {
+    pthread_mutex_lock(&g_cache_lock);
+    stats->paths = g_path_count;
+    stats->blobs = g_blob_count;
+    stats->logical_bytes = g_logical_bytes;
+    stats->blob_bytes = g_blob_bytes;
+    stats->deflated_bytes = g_deflated_bytes;
+    stats->hot_blobs = g_tiers[TIER_WINDOW].count + g_tiers[TIER_PROBATION].count + g_tiers[TIER_PROTECTED].count;
+    stats->hot_bytes = g_tiers[TIER_WINDOW].bytes + g_tiers[TIER_PROBATION].bytes + g_tiers[TIER_PROTECTED].bytes;
+    stats->warm_blobs = g_tiers[TIER_WARM].count;
+    stats->warm_bytes = g_tiers[TIER_WARM].bytes;
+    stats->hot_hits = g_hot_hits;
+    stats->warm_hits = g_warm_hits;
+    stats->misses = g_misses;
+    stats->promotions = g_promotions;
+    stats->demotions = g_demotions;
+    stats->evictions = g_evictions;
+    pthread_mutex_unlock(&g_cache_lock);
+}
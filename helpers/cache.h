@@ -0,0 +1,31 @@
+#ifndef MDTP_CACHE_H
+#define MDTP_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    long paths;
+    long blobs;
+    long logical_bytes;     /* what a path-keyed cache would hold */
+    long blob_bytes;        /* the same, one copy per content, either tier */
+    long deflated_bytes;
+    long hot_blobs;
+    long hot_bytes;         /* raw content plus deflated variants */
+    long warm_blobs;
+    long warm_bytes;        /* deflated content only */
+    long hot_hits;
+    long warm_hits;
+    long misses;
+    long promotions;        /* warm to hot */
+    long demotions;         /* hot to warm */
+    long evictions;         /* dropped altogether */
+} cache_stats_t;
+
+void cache_configure(long max_bytes, int hot_percent, long max_file_size);
+const char* cache_read(const char *filepath, size_t *length, uint64_t *etag,
+                       const char **deflated, size_t *deflated_length, void **ref);
+void cache_release(void *ref);
+void cache_get_stats(cache_stats_t *stats);
+
+#endif
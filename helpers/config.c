@@ -1,43 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 
-#define CONFIG_FILE "./mdtp.conf"
+#include "config.h"
+#include "logging.h"
 
-typedef struct {
-    char root_dir[512];
-    int port;
-    int max_connections;
-    int timeout_seconds;
-    int enable_logging;
-    int log_level;
-    char index_file[256];
-    int enable_stats;
-    int stats_interval;
-    int enable_cache;
-    long max_file_size;
-} mdtp_config_t;
-
-static mdtp_config_t g_config = {
-    .root_dir = "./content",
+static mdtp_config_t g_default_config = {
+    .root_dir = ".",
     .port = 8585,
     .max_connections = 100,
+    .rate_limit = 0,
+    .rate_burst = 20,
     .timeout_seconds = 30,
+    .drain_timeout = 30,
     .enable_logging = 1,
     .log_level = LOG_INFO,
     .index_file = "index.md",
+    .pack_file = "",
     .enable_stats = 1,
     .stats_interval = 300,
     .enable_cache = 1,
-    .max_file_size = 10485760
+    .cache_size = 67108864,
+    .cache_hot_percent = 75,
+    .enable_search = 1,
+    .search_refresh = 10,
+    .max_file_size = 10485760,
+    .listen_backlog = 511,
+    .tcp_nodelay = 1,
+    .tcp_fastopen = 256,
+    .defer_accept = 5,
+    .max_send_buffer = 4194304,
+    .max_request_size = 8192,
+    .backends = "",
+    .health_interval = 5,
+    .proxy_cache_size = 0,
+    .proxy_cache_ttl = 10
 };
 
-int load_config(const char *config_file) {
+/*
+ * The active configuration is published through an atomic pointer so
+ * request handlers can read it without locking while SIGHUP installs a
+ * new one. Handlers never keep the pointer across requests, so a replaced
+ * configuration is only freed once the next one is published.
+ */
+static _Atomic(mdtp_config_t *) g_config = &g_default_config;
+static mdtp_config_t *g_retired_config = NULL;
+
+/*
+ * Parse a config file into a newly allocated configuration, starting from
+ * the built-in defaults. Returns NULL if the file cannot be opened.
+ */
+mdtp_config_t* parse_config_file(const char *config_file) {
     FILE *f = fopen(config_file ? config_file : CONFIG_FILE, "r");
-    if (!f) {
-        log_message(LOG_WARNING, "Config file not found, using defaults");
-        return 0;
+    if (!f) return NULL;
+
+    mdtp_config_t *config = malloc(sizeof(mdtp_config_t));
+    if (!config) {
+        fclose(f);
+        return NULL;
     }
+    *config = g_default_config;
     
     char line[512];
     while (fgets(line, sizeof(line), f)) {
@@ -53,31 +76,91 @@ int load_config(const char *config_file) {
             }
             
             if (strcmp(key, "root_dir") == 0) {
-                strncpy(g_config.root_dir, v, sizeof(g_config.root_dir) - 1);
+                strncpy(config->root_dir, v, sizeof(config->root_dir) - 1);
             } else if (strcmp(key, "port") == 0) {
-                g_config.port = atoi(v);
+                config->port = atoi(v);
             } else if (strcmp(key, "max_connections") == 0) {
-                g_config.max_connections = atoi(v);
+                config->max_connections = atoi(v);
+            } else if (strcmp(key, "rate_limit") == 0) {
+                config->rate_limit = atoi(v);
+            } else if (strcmp(key, "rate_burst") == 0) {
+                config->rate_burst = atoi(v);
             } else if (strcmp(key, "timeout") == 0) {
-                g_config.timeout_seconds = atoi(v);
+                config->timeout_seconds = atoi(v);
+            } else if (strcmp(key, "drain_timeout") == 0) {
+                config->drain_timeout = atoi(v);
             } else if (strcmp(key, "enable_logging") == 0) {
-                g_config.enable_logging = atoi(v);
+                config->enable_logging = atoi(v);
             } else if (strcmp(key, "log_level") == 0) {
-                if (strcmp(v, "DEBUG") == 0) g_config.log_level = LOG_DEBUG;
-                else if (strcmp(v, "INFO") == 0) g_config.log_level = LOG_INFO;
-                else if (strcmp(v, "WARNING") == 0) g_config.log_level = LOG_WARNING;
-                else if (strcmp(v, "ERROR") == 0) g_config.log_level = LOG_ERROR;
+                if (strcmp(v, "DEBUG") == 0) config->log_level = LOG_DEBUG;
+                else if (strcmp(v, "INFO") == 0) config->log_level = LOG_INFO;
+                else if (strcmp(v, "WARNING") == 0) config->log_level = LOG_WARNING;
+                else if (strcmp(v, "ERROR") == 0) config->log_level = LOG_ERROR;
             } else if (strcmp(key, "index_file") == 0) {
-                strncpy(g_config.index_file, v, sizeof(g_config.index_file) - 1);
+                strncpy(config->index_file, v, sizeof(config->index_file) - 1);
+            } else if (strcmp(key, "pack_file") == 0) {
+                strncpy(config->pack_file, v, sizeof(config->pack_file) - 1);
             } else if (strcmp(key, "enable_stats") == 0) {
-                g_config.enable_stats = atoi(v);
+                config->enable_stats = atoi(v);
+            } else if (strcmp(key, "stats_interval") == 0) {
+                config->stats_interval = atoi(v);
+            } else if (strcmp(key, "enable_cache") == 0) {
+                config->enable_cache = atoi(v);
+            } else if (strcmp(key, "cache_size") == 0) {
+                config->cache_size = atol(v);
+            } else if (strcmp(key, "cache_hot_percent") == 0) {
+                config->cache_hot_percent = atoi(v);
+            } else if (strcmp(key, "enable_search") == 0) {
+                config->enable_search = atoi(v);
+            } else if (strcmp(key, "search_refresh") == 0) {
+                config->search_refresh = atoi(v);
             } else if (strcmp(key, "max_file_size") == 0) {
-                g_config.max_file_size = atol(v);
+                config->max_file_size = atol(v);
+            } else if (strcmp(key, "backlog") == 0) {
+                config->listen_backlog = atoi(v);
+            } else if (strcmp(key, "tcp_nodelay") == 0) {
+                config->tcp_nodelay = atoi(v);
+            } else if (strcmp(key, "tcp_fastopen") == 0) {
+                config->tcp_fastopen = atoi(v);
+            } else if (strcmp(key, "defer_accept") == 0) {
+                config->defer_accept = atoi(v);
+            } else if (strcmp(key, "max_send_buffer") == 0) {
+                config->max_send_buffer = atol(v);
+            } else if (strcmp(key, "max_request_size") == 0) {
+                config->max_request_size = atoi(v);
+            } else if (strcmp(key, "backends") == 0) {
+                strncpy(config->backends, v, sizeof(config->backends) - 1);
+            } else if (strcmp(key, "health_interval") == 0) {
+                config->health_interval = atoi(v);
+            } else if (strcmp(key, "proxy_cache_size") == 0) {
+                config->proxy_cache_size = atol(v);
+            } else if (strcmp(key, "proxy_cache_ttl") == 0) {
+                config->proxy_cache_ttl = atoi(v);
             }
         }
     }
     
     fclose(f);
+    return config;
+}
+
+void publish_config(mdtp_config_t *config) {
+    mdtp_config_t *old = atomic_exchange_explicit(&g_config, config, memory_order_acq_rel);
+
+    if (g_retired_config && g_retired_config != &g_default_config) {
+        free(g_retired_config);
+    }
+    g_retired_config = old;
+}
+
+int load_config(const char *config_file) {
+    mdtp_config_t *config = parse_config_file(config_file);
+    if (!config) {
+        log_message(LOG_WARNING, "Config file not found, using defaults");
+        return 0;
+    }
+    
+    publish_config(config);
     log_message(LOG_INFO, "Configuration loaded from %s", config_file ? config_file : CONFIG_FILE);
     return 1;
 }
@@ -92,10 +175,14 @@ void save_default_config() {
     fprintf(f, "# MDTP Server Configuration\n\n");
     fprintf(f, "# Server settings\n");
     fprintf(f, "port = 8585\n");
-    fprintf(f, "root_dir = \"./content\"\n");
+    fprintf(f, "root_dir = \".\"\n");
     fprintf(f, "index_file = \"index.md\"\n");
+    fprintf(f, "pack_file = \"\"        # content pack from \"mdtp pack\"; empty = serve root_dir\n");
     fprintf(f, "max_connections = 100\n");
-    fprintf(f, "timeout = 30\n");
+    fprintf(f, "rate_limit = 0         # requests/s per client IP, 0 = off\n");
+    fprintf(f, "rate_burst = 20\n");
+    fprintf(f, "timeout = 30           # seconds a connection may idle or stall, 0 = never\n");
+    fprintf(f, "drain_timeout = 30\n");
     fprintf(f, "max_file_size = 10485760\n\n");
     fprintf(f, "# Logging\n");
     fprintf(f, "enable_logging = 1\n");
@@ -105,33 +192,61 @@ void save_default_config() {
     fprintf(f, "stats_interval = 300\n\n");
     fprintf(f, "# Performance\n");
     fprintf(f, "enable_cache = 1\n");
+    fprintf(f, "cache_size = 67108864  # bytes of document content kept in memory\n");
+    fprintf(f, "cache_hot_percent = 75 # kept ready to send; the rest holds deflated copies\n\n");
+    fprintf(f, "# TCP tuning\n");
+    fprintf(f, "backlog = 511\n");
+    fprintf(f, "tcp_nodelay = 1\n");
+    fprintf(f, "tcp_fastopen = 256     # TFO queue length, 0 = off\n");
+    fprintf(f, "defer_accept = 5       # seconds, 0 = accept before the request arrives\n");
+    fprintf(f, "max_send_buffer = 4194304\n");
+    fprintf(f, "max_request_size = 8192\n\n");
+    fprintf(f, "# Full-text search (/_search?q=)\n");
+    fprintf(f, "enable_search = 1\n");
+    fprintf(f, "search_refresh = 10    # seconds between index rescans, 0 = never\n\n");
+    fprintf(f, "# Proxy mode (mdtp proxy)\n");
+    fprintf(f, "backends = \"\"          # host:port,host:port,...\n");
+    fprintf(f, "health_interval = 5\n");
+    fprintf(f, "proxy_cache_size = 0   # bytes of responses kept at the proxy, 0 = off\n");
+    fprintf(f, "proxy_cache_ttl = 10   # seconds a cached response is served\n");
     
     fclose(f);
     log_message(LOG_INFO, "Default configuration created: %s", CONFIG_FILE);
 }
 
 void print_config() {
+    mdtp_config_t *config = get_config();
+
     printf("\n");
     printf("╔════════════════════════════════════════════════════════════╗\n");
     printf("║             MDTP SERVER CONFIGURATION                      ║\n");
     printf("╠════════════════════════════════════════════════════════════╣\n");
-    printf("║ Port:              %-10d                              ║\n", g_config.port);
-    printf("║ Root Directory:    %-40s ║\n", g_config.root_dir);
-    printf("║ Index File:        %-40s ║\n", g_config.index_file);
-    printf("║ Max Connections:   %-10d                              ║\n", g_config.max_connections);
-    printf("║ Timeout:           %-10d seconds                       ║\n", g_config.timeout_seconds);
+    printf("║ Port:              %-10d                              ║\n", config->port);
+    printf("║ Root Directory:    %-40s ║\n", config->root_dir);
+    printf("║ Index File:        %-40s ║\n", config->index_file);
+    if (config->pack_file[0]) {
+        printf("║ Content Pack:      %-40s ║\n", config->pack_file);
+    }
+    printf("║ Max Connections:   %-10d                              ║\n", config->max_connections);
+    printf("║ Rate Limit:        %-10d req/s per IP (burst %-6d)    ║\n",
+           config->rate_limit, config->rate_burst);
+    printf("║ Timeout:           %-10d seconds                       ║\n", config->timeout_seconds);
+    printf("║ Drain Timeout:     %-10d seconds                       ║\n", config->drain_timeout);
+    printf("║ Listen Backlog:    %-10d                              ║\n", config->listen_backlog);
     printf("║ Max File Size:     %.2f MB                               ║\n", 
-           (float)g_config.max_file_size / 1024 / 1024);
+           (float)config->max_file_size / 1024 / 1024);
     printf("║ Logging:           %s                                     ║\n", 
-           g_config.enable_logging ? "Enabled" : "Disabled");
+           config->enable_logging ? "Enabled" : "Disabled");
     printf("║ Statistics:        %s                                     ║\n",
-           g_config.enable_stats ? "Enabled" : "Disabled");
+           config->enable_stats ? "Enabled" : "Disabled");
     printf("║ Cache:             %s                                     ║\n",
-           g_config.enable_cache ? "Enabled" : "Disabled");
+           config->enable_cache ? "Enabled" : "Disabled");
+    printf("║ Search:            %s                                     ║\n",
+           config->enable_search ? "Enabled" : "Disabled");
     printf("╚════════════════════════════════════════════════════════════╝\n");
     printf("\n");
 }
 
 mdtp_config_t* get_config() {
-    return &g_config;
+    return atomic_load_explicit(&g_config, memory_order_acquire);
 }
@@ -0,0 +1,45 @@
+#ifndef MDTP_CONFIG_H
+#define MDTP_CONFIG_H
+
+#define CONFIG_FILE "./mdtp.conf"
+
+typedef struct {
+    char root_dir[512];
+    int port;
+    int max_connections;
+    int rate_limit;
+    int rate_burst;
+    int timeout_seconds;
+    int drain_timeout;
+    int enable_logging;
+    int log_level;
+    char index_file[256];
+    char pack_file[512];        /* serve from this content pack instead of root_dir */
+    int enable_stats;
+    int stats_interval;
+    int enable_cache;
+    long cache_size;            /* both tiers together */
+    int cache_hot_percent;      /* share of cache_size kept uncompressed */
+    int enable_search;
+    int search_refresh;
+    long max_file_size;
+    int listen_backlog;
+    int tcp_nodelay;
+    int tcp_fastopen;           /* TFO queue length on the listener, 0 = off */
+    int defer_accept;           /* seconds a connection may wait for its first request unaccepted */
+    long max_send_buffer;       /* SO_SNDBUF is raised toward a large response's size up to this */
+    int max_request_size;       /* request buffers start small and grow up to this */
+    char backends[512];         /* proxy mode: comma-separated host:port list */
+    int health_interval;        /* proxy mode: seconds between backend checks */
+    long proxy_cache_size;      /* proxy mode: bytes of responses kept, 0 = off */
+    int proxy_cache_ttl;        /* proxy mode: seconds a cached response is served */
+} mdtp_config_t;
+
+int load_config(const char *config_file);
+mdtp_config_t* parse_config_file(const char *config_file);
+void publish_config(mdtp_config_t *config);
+void save_default_config();
+void print_config();
+mdtp_config_t* get_config();
+
+#endif
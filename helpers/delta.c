@@ -0,0 +1,549 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "delta.h"
+
+/*
+ * Line-based delta encoding for documents that changed a little.
+ *
+ * A delta is a sequence of operations applied to the base version from
+ * its first line on:
+ *
+ *   c <n>\n            copy the next n lines of the base
+ *   d <n>\n            skip the next n lines of the base
+ *   a <bytes>\n<data>  insert <bytes> bytes of new text
+ *
+ * Lines keep their "\n", so copying reproduces the base byte for byte.
+ * The edit script comes from Myers' O(ND) diff over line hashes after the
+ * common prefix and suffix are trimmed; documents that differ in more
+ * than DELTA_MAX_EDITS lines, or whose delta would not be much smaller
+ * than the document, get no delta.
+ *
+ * The server keeps recent versions of each served document in a version
+ * store bounded by DELTA_STORE_BYTES and DELTA_VERSIONS_PER_DOC; the
+ * oldest versions are dropped first.
+ */
+
+#define DELTA_MAX_EDITS 1000
+#define DELTA_STORE_BUCKETS 4096
+
+typedef struct {
+    const char *data;
+    size_t length;
+    uint32_t hash;
+} delta_line_t;
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} delta_buf_t;
+
+
+/*
+ * XXH64 (seed 0) of a document. This is the ETag, and the document cache
+ * uses it as the content address, so it must stay stable across releases.
+ */
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3 1609587929392839161ULL
+#define XXH_PRIME4 9650029242287828579ULL
+#define XXH_PRIME5 2870177450012600261ULL
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t delta_hash(const char *data, size_t length) {
+    const char *p = data;
+    const char *end = data + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2, v3 = 0, v4 = -XXH_PRIME1;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += length;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (uint64_t)k * XXH_PRIME1;
+        h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (unsigned char)*p * XXH_PRIME5;
+        h = xxh_rotl(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+static size_t split_lines(const char *data, size_t length, delta_line_t **out) {
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == '\n') count++;
+    }
+    if (length > 0 && data[length - 1] != '\n') count++;
+
+    delta_line_t *lines = malloc((count ? count : 1) * sizeof(delta_line_t));
+    if (!lines) return (size_t)-1;
+
+    size_t n = 0;
+    for (size_t start = 0; start < length; n++) {
+        const char *nl = memchr(data + start, '\n', length - start);
+        size_t end = nl ? (size_t)(nl - data) + 1 : length;
+        uint32_t hash = 2166136261u;
+        for (size_t i = start; i < end; i++) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+
+        lines[n].data = data + start;
+        lines[n].length = end - start;
+        lines[n].hash = hash;
+        start = end;
+    }
+
+    *out = lines;
+    return count;
+}
+
+
+static int lines_equal(const delta_line_t *a, const delta_line_t *b) {
+    return a->hash == b->hash && a->length == b->length &&
+           memcmp(a->data, b->data, a->length) == 0;
+}
+
+
+static int buf_append(delta_buf_t *b, const char *data, size_t length) {
+    if (b->length + length > b->capacity) {
+        size_t cap = b->capacity ? b->capacity : 256;
+        while (cap < b->length + length) cap *= 2;
+        char *grown = realloc(b->data, cap + 1);
+        if (!grown) return -1;
+        b->data = grown;
+        b->capacity = cap;
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+    return 0;
+}
+
+
+/* Append an operation, merging it into the previous one of the same kind. */
+typedef struct {
+    char kind;          /* 'c', 'd' or 'a' */
+    size_t count;       /* lines */
+} delta_op_t;
+
+static int push_op(delta_op_t **ops, size_t *count, size_t *cap, char kind) {
+    if (*count > 0 && (*ops)[*count - 1].kind == kind) {
+        (*ops)[*count - 1].count++;
+        return 0;
+    }
+    if (*count == *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 64;
+        delta_op_t *grown = realloc(*ops, grown_cap * sizeof(delta_op_t));
+        if (!grown) return -1;
+        *ops = grown;
+        *cap = grown_cap;
+    }
+    (*ops)[(*count)++] = (delta_op_t){ kind, 1 };
+    return 0;
+}
+
+
+/*
+ * Myers diff of a[0..n) against b[0..m). Fills ops in reverse order.
+ * Returns -1 if more than DELTA_MAX_EDITS edits are needed.
+ */
+static int myers(const delta_line_t *a, int n, const delta_line_t *b, int m,
+                 delta_op_t **ops, size_t *op_count, size_t *op_cap) {
+    int max = n + m < DELTA_MAX_EDITS ? n + m : DELTA_MAX_EDITS;
+    int offset = max + 1;
+    int *v = calloc(2 * max + 3, sizeof(int));
+    int *trace = NULL;
+    size_t trace_cap = 0;
+    int found = -1;
+
+    if (!v) return -1;
+
+    for (int d = 0; d <= max && found < 0; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x;
+            if (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) x = v[offset + k + 1];
+            else x = v[offset + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && lines_equal(&a[x], &b[y])) {
+                x++;
+                y++;
+            }
+            v[offset + k] = x;
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+
+        /* Snapshot v[-d..d]; trace for d starts at d * d. */
+        size_t need = (size_t)(d + 1) * (d + 1);
+        if (need > trace_cap) {
+            size_t cap = trace_cap ? trace_cap * 2 : 1024;
+            while (cap < need) cap *= 2;
+            int *grown = realloc(trace, cap * sizeof(int));
+            if (!grown) {
+                found = -2;
+                break;
+            }
+            trace = grown;
+            trace_cap = cap;
+        }
+        memcpy(trace + (size_t)d * d, v + offset - d, (2 * d + 1) * sizeof(int));
+    }
+    free(v);
+
+    if (found < 0) {
+        free(trace);
+        return -1;
+    }
+
+    int x = n, y = m;
+    for (int d = found; d > 0; d--) {
+        const int *prev = trace + (size_t)(d - 1) * (d - 1) + (d - 1);   /* prev[k] for k in [-(d-1), d-1] */
+        int k = x - y;
+        int prev_k = (k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1;
+        int prev_x = prev[prev_k];
+        int prev_y = prev_x - prev_k;
+
+        while (x > prev_x && y > prev_y) {
+            if (push_op(ops, op_count, op_cap, 'c') < 0) goto fail;
+            x--;
+            y--;
+        }
+        if (push_op(ops, op_count, op_cap, prev_k == k + 1 ? 'a' : 'd') < 0) goto fail;
+        x = prev_x;
+        y = prev_y;
+    }
+    while (x > 0 && y > 0) {
+        if (push_op(ops, op_count, op_cap, 'c') < 0) goto fail;
+        x--;
+        y--;
+    }
+
+    free(trace);
+    return 0;
+
+fail:
+    free(trace);
+    return -1;
+}
+
+
+/*
+ * Encode data as a delta against base. Returns the delta (malloc'd), or
+ * NULL when no worthwhile delta exists.
+ */
+char* delta_make(const char *base, size_t base_len, const char *data, size_t length, size_t *delta_len) {
+    delta_line_t *a = NULL, *b = NULL;
+    delta_op_t *ops = NULL;
+    size_t op_count = 0, op_cap = 0;
+    delta_buf_t out = { 0 };
+
+    size_t n = split_lines(base, base_len, &a);
+    size_t m = split_lines(data, length, &b);
+    if (n == (size_t)-1 || m == (size_t)-1) goto fail;
+
+    size_t prefix = 0;
+    while (prefix < n && prefix < m && lines_equal(&a[prefix], &b[prefix])) prefix++;
+    size_t suffix = 0;
+    while (suffix < n - prefix && suffix < m - prefix &&
+           lines_equal(&a[n - 1 - suffix], &b[m - 1 - suffix])) {
+        suffix++;
+    }
+
+    /* Operations are collected back to front: suffix, middle, prefix. */
+    for (size_t i = 0; i < suffix; i++) {
+        if (push_op(&ops, &op_count, &op_cap, 'c') < 0) goto fail;
+    }
+    if (myers(a + prefix, n - prefix - suffix, b + prefix, m - prefix - suffix,
+              &ops, &op_count, &op_cap) < 0) {
+        goto fail;
+    }
+    for (size_t i = 0; i < prefix; i++) {
+        if (push_op(&ops, &op_count, &op_cap, 'c') < 0) goto fail;
+    }
+
+    size_t line = 0;
+    for (size_t i = op_count; i-- > 0; ) {
+        char head[48];
+        delta_op_t *op = &ops[i];
+
+        if (op->kind == 'a') {
+            size_t bytes = 0;
+            for (size_t j = 0; j < op->count; j++) bytes += b[line + j].length;
+            int len = snprintf(head, sizeof(head), "a %zu\n", bytes);
+            if (buf_append(&out, head, len) < 0) goto fail;
+            for (size_t j = 0; j < op->count; j++, line++) {
+                if (buf_append(&out, b[line].data, b[line].length) < 0) goto fail;
+            }
+        } else {
+            int len = snprintf(head, sizeof(head), "%c %zu\n", op->kind, op->count);
+            if (buf_append(&out, head, len) < 0) goto fail;
+            if (op->kind == 'c') line += op->count;
+        }
+
+        /* Not worth it once the delta reaches three quarters of the document. */
+        if (out.length >= length - length / 4) goto fail;
+    }
+
+    free(a);
+    free(b);
+    free(ops);
+    if (!out.data) out.data = malloc(1);
+    *delta_len = out.length;
+    return out.data;
+
+fail:
+    free(a);
+    free(b);
+    free(ops);
+    free(out.data);
+    return NULL;
+}
+
+
+/* Rebuild a document from its base and a delta. Returns NULL if the delta is malformed. */
+char* delta_apply(const char *base, size_t base_len, const char *delta, size_t delta_len, size_t *length) {
+    delta_buf_t out = { 0 };
+    size_t pos = 0, at = 0;
+
+    while (pos < delta_len) {
+        const char *nl = memchr(delta + pos, '\n', delta_len - pos);
+        char kind;
+        size_t count;
+        if (!nl || sscanf(delta + pos, "%c %zu", &kind, &count) != 2) goto fail;
+        pos = nl - delta + 1;
+
+        if (kind == 'a') {
+            if (count > delta_len - pos || buf_append(&out, delta + pos, count) < 0) goto fail;
+            pos += count;
+            continue;
+        }
+        if (kind != 'c' && kind != 'd') goto fail;
+
+        size_t start = at;
+        for (size_t i = 0; i < count; i++) {
+            if (at >= base_len) goto fail;
+            const char *line_end = memchr(base + at, '\n', base_len - at);
+            at = line_end ? (size_t)(line_end - base) + 1 : base_len;
+        }
+        if (kind == 'c' && buf_append(&out, base + start, at - start) < 0) goto fail;
+    }
+
+    if (!out.data) out.data = malloc(1);
+    if (!out.data) return NULL;
+    out.data[out.length] = '\0';
+    *length = out.length;
+    return out.data;
+
+fail:
+    free(out.data);
+    return NULL;
+}
+
+
+/* ---- Version store ---- */
+
+typedef struct delta_version {
+    uint64_t etag;
+    char *data;
+    size_t length;
+    struct delta_doc *doc;
+    struct delta_version *older;        /* next older version of the same document */
+    struct delta_version *prev;         /* store-wide age order, oldest first */
+    struct delta_version *next;
+} delta_version_t;
+
+typedef struct delta_doc {
+    char *path;
+    delta_version_t *newest;
+    int count;
+    struct delta_doc *next;
+} delta_doc_t;
+
+static delta_doc_t *g_buckets[DELTA_STORE_BUCKETS];
+static delta_version_t *g_oldest = NULL;
+static delta_version_t *g_newest = NULL;
+static size_t g_store_bytes = 0;
+static long g_store_versions = 0;
+static long g_deltas_sent = 0;
+static long g_delta_bytes = 0;
+static long g_full_bytes = 0;
+static pthread_mutex_t g_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static delta_doc_t** find_doc(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = path; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    delta_doc_t **dp = &g_buckets[hash % DELTA_STORE_BUCKETS];
+    while (*dp && strcmp((*dp)->path, path) != 0) dp = &(*dp)->next;
+    return dp;
+}
+
+
+static void drop_version(delta_version_t *v) {
+    delta_doc_t *doc = v->doc;
+
+    delta_version_t **vp = &doc->newest;
+    while (*vp != v) vp = &(*vp)->older;
+    *vp = v->older;
+    doc->count--;
+
+    if (v->prev) v->prev->next = v->next;
+    else g_oldest = v->next;
+    if (v->next) v->next->prev = v->prev;
+    else g_newest = v->prev;
+
+    g_store_bytes -= v->length;
+    g_store_versions--;
+    free(v->data);
+    free(v);
+
+    if (doc->count == 0) {
+        delta_doc_t **dp = find_doc(doc->path);
+        *dp = doc->next;
+        free(doc->path);
+        free(doc);
+    }
+}
+
+
+/* Remember this version of path unless it is already the newest one stored. */
+void version_store_put(const char *path, uint64_t etag, const char *data, size_t length) {
+    if (length > DELTA_STORE_BYTES / 4) return;
+
+    pthread_mutex_lock(&g_store_lock);
+    delta_doc_t **dp = find_doc(path);
+    delta_doc_t *doc = *dp;
+
+    if (doc && doc->newest->etag == etag) {
+        pthread_mutex_unlock(&g_store_lock);
+        return;
+    }
+
+    delta_version_t *v = calloc(1, sizeof(delta_version_t));
+    char *copy = malloc(length + 1);
+    if (!doc) {
+        doc = calloc(1, sizeof(delta_doc_t));
+        if (doc && !(doc->path = strdup(path))) {
+            free(doc);
+            doc = NULL;
+        }
+        if (doc) *dp = doc;
+    }
+    if (!v || !copy || !doc) {
+        free(v);
+        free(copy);
+        pthread_mutex_unlock(&g_store_lock);
+        return;
+    }
+
+    memcpy(copy, data, length);
+    v->etag = etag;
+    v->data = copy;
+    v->length = length;
+    v->doc = doc;
+    v->older = doc->newest;
+    doc->newest = v;
+    doc->count++;
+
+    v->prev = g_newest;
+    if (g_newest) g_newest->next = v;
+    else g_oldest = v;
+    g_newest = v;
+    g_store_bytes += length;
+    g_store_versions++;
+
+    if (doc->count > DELTA_VERSIONS_PER_DOC) {
+        delta_version_t *oldest = doc->newest;
+        while (oldest->older) oldest = oldest->older;
+        drop_version(oldest);
+    }
+    while (g_store_bytes > DELTA_STORE_BYTES && g_oldest != v) drop_version(g_oldest);
+
+    pthread_mutex_unlock(&g_store_lock);
+}
+
+
+/*
+ * Delta from the stored version `base` of path to data. Returns NULL if
+ * that version is not stored or no worthwhile delta exists.
+ */
+char* version_store_delta(const char *path, uint64_t base, const char *data, size_t length, size_t *delta_len) {
+    pthread_mutex_lock(&g_store_lock);
+    delta_doc_t *doc = *find_doc(path);
+    delta_version_t *v = doc ? doc->newest : NULL;
+    while (v && v->etag != base) v = v->older;
+
+    char *delta = v ? delta_make(v->data, v->length, data, length, delta_len) : NULL;
+    if (delta) {
+        g_deltas_sent++;
+        g_delta_bytes += *delta_len;
+        g_full_bytes += length;
+    }
+    pthread_mutex_unlock(&g_store_lock);
+    return delta;
+}
+
+
+void version_store_get_stats(delta_stats_t *stats) {
+    pthread_mutex_lock(&g_store_lock);
+    stats->versions = g_store_versions;
+    stats->bytes = g_store_bytes;
+    stats->deltas_sent = g_deltas_sent;
+    stats->delta_bytes = g_delta_bytes;
+    stats->full_bytes = g_full_bytes;
+    pthread_mutex_unlock(&g_store_lock);
+}
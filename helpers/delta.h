@@ -0,0 +1,26 @@
+#ifndef MDTP_DELTA_H
+#define MDTP_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_STORE_BYTES (32 * 1024 * 1024)
+#define DELTA_VERSIONS_PER_DOC 4
+
+typedef struct {
+    long versions;
+    long bytes;
+    long deltas_sent;
+    long delta_bytes;       /* bytes sent as deltas */
+    long full_bytes;        /* what those responses would have cost in full */
+} delta_stats_t;
+
+uint64_t delta_hash(const char *data, size_t length);
+char* delta_make(const char *base, size_t base_len, const char *data, size_t length, size_t *delta_len);
+char* delta_apply(const char *base, size_t base_len, const char *delta, size_t delta_len, size_t *length);
+
+void version_store_put(const char *path, uint64_t etag, const char *data, size_t length);
+char* version_store_delta(const char *path, uint64_t base, const char *data, size_t length, size_t *delta_len);
+void version_store_get_stats(delta_stats_t *stats);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef MDTP_LOGGING_H
+#define MDTP_LOGGING_H
+
+#include <stddef.h>
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+    LOG_CRITICAL
+} log_level_t;
+
+const char* log_level_string(log_level_t level);
+int init_logger(const char *log_file, log_level_t min_level);
+void log_message(log_level_t level, const char *format, ...);
+void close_logger();
+
+int access_log_open(const char *log_file);
+void access_log(const char *peer, const char *method, const char *path,
+                int status, size_t bytes, long latency_us);
+size_t access_log_pending(void);
+void access_log_flush(void);
+
+#endif
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "pack.h"
+#include "delta.h"
+
+/*
+ * Content packs: a whole content tree in one read-only file that the
+ * server maps and serves from without touching the file system.
+ *
+ *   header     magic "MDTPPACK", version, entry count, offsets
+ *   blobs      document bytes (and deflated variants), each aligned to
+ *              PACK_ALIGN; identical documents share one blob
+ *   index      pack_entry_t per document, sorted by path
+ *   strings    the paths the index points into
+ *
+ * Integers are stored in host byte order; a pack is built on the machine
+ * (or architecture) that serves it. Every offset is checked against the
+ * file size when the pack is opened, so lookups need no further checks.
+ */
+
+#define PACK_MAGIC "MDTPPACK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+#define PACK_MAX_DEPTH 32
+#define PACK_MAX_PATH 1024
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+    uint64_t strings_length;
+    uint64_t file_size;
+} pack_header_t;
+
+typedef struct {
+    uint64_t data_offset;
+    uint64_t length;
+    uint64_t deflated_offset;
+    uint64_t deflated_length;   /* 0: no deflated variant */
+    uint64_t etag;
+    uint32_t path_offset;
+    uint32_t path_length;
+} pack_entry_t;
+
+/*
+ * A mapping stays until the pack being served and every body borrowed
+ * from it (pack_retain()) have let go, so a reload never unmaps a
+ * document that is still being sent.
+ */
+typedef struct {
+    const char *data;
+    size_t size;
+    int refs;
+} pack_map_t;
+
+static pack_map_t *g_current = NULL;
+static const char *g_map = NULL;
+static const pack_entry_t *g_entries = NULL;
+static const char *g_strings = NULL;
+static int g_count = 0;
+
+
+/* ---- Building ---- */
+
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} pack_list_t;
+
+typedef struct pack_blob {
+    uint64_t etag;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t deflated_offset;
+    uint64_t deflated_length;
+    struct pack_blob *next;
+} pack_blob_t;
+
+
+static int list_add(pack_list_t *list, const char *path) {
+    if (list->count == list->capacity) {
+        int cap = list->capacity ? list->capacity * 2 : 256;
+        char **grown = realloc(list->paths, cap * sizeof(char *));
+        if (!grown) return -1;
+        list->paths = grown;
+        list->capacity = cap;
+    }
+    if (!(list->paths[list->count] = strdup(path))) return -1;
+    list->count++;
+    return 0;
+}
+
+
+/* Collect every regular file below root_dir/rel (skipping dot files). */
+static int collect(pack_list_t *list, const char *root_dir, const char *rel, int depth) {
+    char dir[PACK_MAX_PATH * 2];
+    snprintf(dir, sizeof(dir), "%s%s", root_dir, rel);
+
+    if (depth > PACK_MAX_DEPTH) return 0;
+    DIR *d = opendir(dir);
+    if (!d) return depth == 0 ? -1 : 0;
+
+    struct dirent *de;
+    int rc = 0;
+    while (rc == 0 && (de = readdir(d))) {
+        char child_rel[PACK_MAX_PATH];
+        char child[PACK_MAX_PATH * 3];
+        struct stat st;
+
+        if (de->d_name[0] == '.') continue;
+        if (snprintf(child_rel, sizeof(child_rel), "%s/%s", rel, de->d_name) >= (int)sizeof(child_rel)) continue;
+        snprintf(child, sizeof(child), "%s%s", root_dir, child_rel);
+        if (stat(child, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) rc = collect(list, root_dir, child_rel, depth + 1);
+        else if (S_ISREG(st.st_mode)) rc = list_add(list, child_rel);
+    }
+    closedir(d);
+    return rc;
+}
+
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+static int write_all(int fd, const void *data, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, (const char *)data + done, length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+
+/* Append data at *pos, padded so the next blob starts aligned. */
+static int write_blob(int fd, uint64_t *pos, const char *data, size_t length) {
+    static const char zeros[PACK_ALIGN];
+    size_t pad = (PACK_ALIGN - (*pos + length) % PACK_ALIGN) % PACK_ALIGN;
+
+    if (write_all(fd, data, length) < 0 || write_all(fd, zeros, pad) < 0) return -1;
+    *pos += length + pad;
+    return 0;
+}
+
+
+static char* read_whole(const char *filepath, size_t *length) {
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    char *data = malloc(st.st_size + 1);
+    size_t have = 0;
+    while (data && have < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + have, st.st_size - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += n;
+    }
+    close(fd);
+    if (data) *length = have;
+    return data;
+}
+
+
+/* Does the blob already written at b hold exactly these bytes? */
+static int blob_equals(int fd, const pack_blob_t *b, const char *data, size_t length) {
+    if (b->length != length) return 0;
+
+    char *stored = malloc(length ? length : 1);
+    int equal = stored && pread(fd, stored, length, b->offset) == (ssize_t)length &&
+                memcmp(stored, data, length) == 0;
+    free(stored);
+    return equal;
+}
+
+
+/*
+ * Compile every file under root_dir into pack_file (written to a
+ * temporary name and renamed into place). With compress, a deflated
+ * variant is stored for each document it makes smaller. Returns 0 on
+ * success, -1 on error.
+ */
+int pack_build(const char *root_dir, const char *pack_file, int compress, pack_build_stats_t *stats) {
+    pack_list_t list = { 0 };
+    pack_entry_t *entries = NULL;
+    pack_blob_t **buckets = NULL;
+    char *strings = NULL;
+    size_t strings_length = 0, bucket_count = 1;
+    int fd = -1, rc = -1;
+    char tmp_file[PACK_MAX_PATH + 8];
+
+    memset(stats, 0, sizeof(*stats));
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", pack_file);
+
+    if (collect(&list, root_dir, "", 0) < 0) {
+        perror("pack: cannot read content directory");
+        goto done;
+    }
+    qsort(list.paths, list.count, sizeof(char *), compare_paths);
+
+    while (bucket_count < (size_t)list.count * 2) bucket_count *= 2;
+    entries = calloc(list.count ? list.count : 1, sizeof(pack_entry_t));
+    buckets = calloc(bucket_count, sizeof(pack_blob_t *));
+    for (int i = 0; i < list.count; i++) strings_length += strlen(list.paths[i]);
+    strings = malloc(strings_length + 1);
+    if (!entries || !buckets || !strings) goto done;
+
+    fd = open(tmp_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("pack: cannot create pack file");
+        goto done;
+    }
+
+    /* Header placeholder; the real one is written last. */
+    pack_header_t header = { 0 };
+    uint64_t pos = 0;
+    if (write_blob(fd, &pos, (const char *)&header, sizeof(header)) < 0) goto write_error;
+
+    size_t string_pos = 0;
+    for (int i = 0; i < list.count; i++) {
+        char filepath[PACK_MAX_PATH * 3];
+        size_t length;
+        snprintf(filepath, sizeof(filepath), "%s%s", root_dir, list.paths[i]);
+
+        char *data = read_whole(filepath, &length);
+        if (!data) {
+            fprintf(stderr, "pack: cannot read %s\n", filepath);
+            goto done;
+        }
+
+        uint64_t etag = delta_hash(data, length);
+        pack_blob_t **bp = &buckets[etag & (bucket_count - 1)];
+        pack_blob_t *blob = *bp;
+        while (blob && !(blob->etag == etag && blob_equals(fd, blob, data, length))) blob = blob->next;
+
+        if (!blob) {
+            if (!(blob = calloc(1, sizeof(pack_blob_t)))) {
+                free(data);
+                goto done;
+            }
+            blob->etag = etag;
+            blob->next = *bp;
+            *bp = blob;
+
+            blob->offset = pos;
+            blob->length = length;
+            if (write_blob(fd, &pos, data, length) < 0) {
+                free(data);
+                goto write_error;
+            }
+
+            uLongf packed_len = compressBound(length);
+            char *packed = compress ? malloc(packed_len) : NULL;
+            if (packed && compress2((Bytef *)packed, &packed_len, (const Bytef *)data, length,
+                                    Z_BEST_COMPRESSION) == Z_OK && packed_len < length) {
+                blob->deflated_offset = pos;
+                blob->deflated_length = packed_len;
+                stats->deflated_bytes += packed_len;
+                if (write_blob(fd, &pos, packed, packed_len) < 0) {
+                    free(packed);
+                    free(data);
+                    goto write_error;
+                }
+            }
+            free(packed);
+            stats->blobs++;
+        }
+        free(data);
+
+        size_t path_length = strlen(list.paths[i]);
+        memcpy(strings + string_pos, list.paths[i], path_length);
+        entries[i] = (pack_entry_t){
+            .data_offset = blob->offset,
+            .length = blob->length,
+            .deflated_offset = blob->deflated_offset,
+            .deflated_length = blob->deflated_length,
+            .etag = etag,
+            .path_offset = string_pos,
+            .path_length = path_length
+        };
+        string_pos += path_length;
+        stats->documents++;
+        stats->bytes += length;
+    }
+
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.count = list.count;
+    header.index_offset = pos;
+    if (write_blob(fd, &pos, (const char *)entries, list.count * sizeof(pack_entry_t)) < 0) goto write_error;
+    header.strings_offset = pos;
+    header.strings_length = strings_length;
+    if (write_all(fd, strings, strings_length) < 0) goto write_error;
+    pos += strings_length;
+    header.file_size = pos;
+
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) < 0) goto write_error;
+    if (close(fd) < 0) {
+        fd = -1;
+        goto write_error;
+    }
+    fd = -1;
+    if (rename(tmp_file, pack_file) < 0) goto write_error;
+
+    stats->pack_bytes = pos;
+    rc = 0;
+    goto done;
+
+write_error:
+    perror("pack: write failed");
+
+done:
+    if (fd >= 0) close(fd);
+    if (rc < 0) unlink(tmp_file);
+    for (size_t i = 0; buckets && i < bucket_count; i++) {
+        while (buckets[i]) {
+            pack_blob_t *next = buckets[i]->next;
+            free(buckets[i]);
+            buckets[i] = next;
+        }
+    }
+    for (int i = 0; i < list.count; i++) free(list.paths[i]);
+    free(list.paths);
+    free(buckets);
+    free(entries);
+    free(strings);
+    return rc;
+}
+
+
+/* ---- Serving ---- */
+
+static int range_ok(uint64_t offset, uint64_t length, size_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+
+/*
+ * Map a pack, replacing the one currently served. Returns -1 (and keeps
+ * the current pack) if the file cannot be mapped or fails validation.
+ */
+int pack_open(const char *pack_file) {
+    int fd = open(pack_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(pack_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    size_t size = st.st_size;
+    const pack_header_t *h = (const pack_header_t *)map;
+    int valid = memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) == 0 &&
+                h->version == PACK_VERSION && h->file_size == size &&
+                h->index_offset % sizeof(uint64_t) == 0 &&
+                range_ok(h->index_offset, (uint64_t)h->count * sizeof(pack_entry_t), size) &&
+                range_ok(h->strings_offset, h->strings_length, size);
+
+    const pack_entry_t *entries = (const pack_entry_t *)(map + (valid ? h->index_offset : 0));
+    for (uint32_t i = 0; valid && i < h->count; i++) {
+        const pack_entry_t *e = &entries[i];
+        valid = range_ok(e->data_offset, e->length, size) &&
+                range_ok(e->deflated_offset, e->deflated_length, size) &&
+                range_ok(e->path_offset, e->path_length, h->strings_length);
+    }
+    pack_map_t *current = valid ? malloc(sizeof(pack_map_t)) : NULL;
+    if (!current) {
+        munmap((void *)map, size);
+        return -1;
+    }
+
+    /* Documents are read on demand, in no particular order. */
+    madvise((void *)map, size, MADV_RANDOM);
+
+    pack_close();
+    current->data = map;
+    current->size = size;
+    current->refs = 1;
+    g_current = current;
+    g_map = map;
+    g_entries = entries;
+    g_strings = map + h->strings_offset;
+    g_count = h->count;
+    return 0;
+}
+
+
+void pack_close(void) {
+    if (g_current) pack_release(g_current);
+    g_current = NULL;
+    g_map = NULL;
+    g_entries = NULL;
+    g_strings = NULL;
+    g_count = 0;
+}
+
+
+/* Keep the current mapping for a borrowed body; hand it back with pack_release(). */
+void* pack_retain(void) {
+    g_current->refs++;
+    return g_current;
+}
+
+
+void pack_release(void *ref) {
+    pack_map_t *map = ref;
+
+    if (--map->refs == 0) {
+        munmap((void *)map->data, map->size);
+        free(map);
+    }
+}
+
+
+int pack_loaded(void) {
+    return g_map != NULL;
+}
+
+
+int pack_count(void) {
+    return g_count;
+}
+
+
+void pack_entry(int index, pack_doc_t *doc) {
+    const pack_entry_t *e = &g_entries[index];
+
+    doc->path = g_strings + e->path_offset;
+    doc->path_length = e->path_length;
+    doc->data = g_map + e->data_offset;
+    doc->length = e->length;
+    doc->deflated = e->deflated_length ? g_map + e->deflated_offset : NULL;
+    doc->deflated_length = e->deflated_length;
+    doc->etag = e->etag;
+}
+
+
+/* Index of the first entry whose path is not less than key[0..length). */
+static int lower_bound(const char *key, size_t length) {
+    int lo = 0, hi = g_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const pack_entry_t *e = &g_entries[mid];
+        size_t n = e->path_length < length ? e->path_length : length;
+        int cmp = memcmp(g_strings + e->path_offset, key, n);
+        if (cmp < 0 || (cmp == 0 && e->path_length < length)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+
+/* Look up a document by its path ("/docs/a.md"). Returns 0 if found. */
+int pack_find(const char *path, pack_doc_t *doc) {
+    size_t length = strlen(path);
+    int i = lower_bound(path, length);
+
+    if (i >= g_count || g_entries[i].path_length != length ||
+        memcmp(g_strings + g_entries[i].path_offset, path, length) != 0) {
+        return -1;
+    }
+    pack_entry(i, doc);
+    return 0;
+}
+
+
+/* Entries whose path starts with prefix: returns how many, from *first on. */
+int pack_prefix(const char *prefix, int *first) {
+    size_t length = strlen(prefix);
+    int i = lower_bound(prefix, length);
+
+    *first = i;
+    while (i < g_count && g_entries[i].path_length >= length &&
+           memcmp(g_strings + g_entries[i].path_offset, prefix, length) == 0) {
+        i++;
+    }
+    return i - *first;
+}
@@ -0,0 +1,37 @@
+#ifndef MDTP_PACK_H
+#define MDTP_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char *path;
+    size_t path_length;
+    const char *data;
+    size_t length;
+    const char *deflated;       /* NULL if none stored */
+    size_t deflated_length;
+    uint64_t etag;
+} pack_doc_t;
+
+typedef struct {
+    long documents;
+    long blobs;                 /* distinct contents */
+    long bytes;                 /* document bytes before dedup */
+    long deflated_bytes;
+    long pack_bytes;
+} pack_build_stats_t;
+
+int pack_build(const char *root_dir, const char *pack_file, int compress, pack_build_stats_t *stats);
+
+int pack_open(const char *pack_file);
+void pack_close(void);
+void* pack_retain(void);
+void pack_release(void *ref);
+int pack_loaded(void);
+int pack_count(void);
+int pack_find(const char *path, pack_doc_t *doc);
+int pack_prefix(const char *prefix, int *first);
+void pack_entry(int index, pack_doc_t *doc);
+
+#endif
@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "proxy.h"
+#include "delta.h"
+
+/*
+ * Backend selection and response caching for "mdtp proxy".
+ *
+ * Each backend owns PROXY_RING_POINTS points on a 64-bit hash ring, placed
+ * by hashing "<name>#<n>". A request path is hashed onto the ring and goes
+ * to the owner of the next point clockwise, so every backend receives a
+ * near-equal share of paths, a path always lands on the same backend, and
+ * when one leaves only its own paths move (each to the backend that owns
+ * the following point).
+ *
+ * The response cache is keyed by request (method, path and encoding). Each
+ * entry is served for `ttl` seconds after it was stored, and the least
+ * recently used entries are dropped to keep the total under the budget.
+ */
+
+#define PROXY_CACHE_BUCKETS 4096
+
+typedef struct {
+    uint64_t point;
+    int owner;
+} ring_point_t;
+
+typedef struct proxy_cache_entry {
+    char *key;
+    proxy_response_t resp;
+    time_t expires;
+    struct proxy_cache_entry *newer, *older;
+    struct proxy_cache_entry *next;
+} proxy_cache_entry_t;
+
+static proxy_cache_entry_t *g_buckets[PROXY_CACHE_BUCKETS];
+static proxy_cache_entry_t *g_newest = NULL;
+static proxy_cache_entry_t *g_oldest = NULL;
+static pthread_mutex_t g_proxy_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long g_max_bytes = 0;
+static int g_ttl = 0;
+static long g_entries = 0;
+static long g_bytes = 0;
+static long g_hits = 0;
+static long g_misses = 0;
+static long g_expired = 0;
+
+
+static int compare_points(const void *a, const void *b) {
+    uint64_t x = ((const ring_point_t *)a)->point, y = ((const ring_point_t *)b)->point;
+    return x < y ? -1 : x > y;
+}
+
+
+/* Place count backends on the ring. Returns 0, or -1 if out of memory. */
+int proxy_ring_build(proxy_ring_t *ring, const char *const *names, int count) {
+    int total = count * PROXY_RING_POINTS;
+    ring_point_t *points = malloc(total * sizeof(ring_point_t));
+
+    memset(ring, 0, sizeof(*ring));
+    if (!points) return -1;
+
+    for (int b = 0; b < count; b++) {
+        for (int i = 0; i < PROXY_RING_POINTS; i++) {
+            char label[128];
+            int n = snprintf(label, sizeof(label), "%s#%d", names[b], i);
+            points[b * PROXY_RING_POINTS + i].point = delta_hash(label, n);
+            points[b * PROXY_RING_POINTS + i].owner = b;
+        }
+    }
+    qsort(points, total, sizeof(ring_point_t), compare_points);
+
+    ring->points = malloc(total * sizeof(uint64_t));
+    ring->owners = malloc(total * sizeof(int));
+    if (!ring->points || !ring->owners) {
+        free(points);
+        proxy_ring_free(ring);
+        return -1;
+    }
+    for (int i = 0; i < total; i++) {
+        ring->points[i] = points[i].point;
+        ring->owners[i] = points[i].owner;
+    }
+    ring->count = total;
+    free(points);
+    return 0;
+}
+
+
+/*
+ * Backend for hash: the owner of the first point at or after it, skipping
+ * backends whose bit is set in exclude. Returns -1 if every one is excluded.
+ */
+int proxy_ring_lookup(const proxy_ring_t *ring, uint64_t hash, uint64_t exclude) {
+    int lo = 0, hi = ring->count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring->points[mid] < hash) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (int i = 0; i < ring->count; i++) {
+        int owner = ring->owners[(lo + i) % ring->count];
+        if (!(exclude & (1ull << owner))) return owner;
+    }
+    return -1;
+}
+
+
+void proxy_ring_free(proxy_ring_t *ring) {
+    free(ring->points);
+    free(ring->owners);
+    memset(ring, 0, sizeof(*ring));
+}
+
+
+static proxy_cache_entry_t** find_entry(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = key; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    proxy_cache_entry_t **ep = &g_buckets[hash % PROXY_CACHE_BUCKETS];
+    while (*ep && strcmp((*ep)->key, key) != 0) ep = &(*ep)->next;
+    return ep;
+}
+
+
+static long entry_bytes(const proxy_cache_entry_t *e) {
+    return (long)(sizeof(*e) + strlen(e->key) + e->resp.length);
+}
+
+
+static void unlink_lru(proxy_cache_entry_t *e) {
+    if (e->newer) e->newer->older = e->older;
+    else g_newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else g_oldest = e->newer;
+}
+
+
+static void push_lru(proxy_cache_entry_t *e) {
+    e->newer = NULL;
+    e->older = g_newest;
+    if (g_newest) g_newest->newer = e;
+    else g_oldest = e;
+    g_newest = e;
+}
+
+
+static void remove_entry(proxy_cache_entry_t **ep) {
+    proxy_cache_entry_t *e = *ep;
+    *ep = e->next;
+
+    unlink_lru(e);
+    g_entries--;
+    g_bytes -= entry_bytes(e);
+    free(e->key);
+    free(e->resp.body);
+    free(e);
+}
+
+
+static void trim(void) {
+    while (g_oldest && g_bytes > g_max_bytes) remove_entry(find_entry(g_oldest->key));
+}
+
+
+/* Keep up to max_bytes of responses, each for ttl seconds; 0 for either disables. */
+void proxy_cache_configure(long max_bytes, int ttl) {
+    pthread_mutex_lock(&g_proxy_cache_lock);
+    g_max_bytes = ttl > 0 && max_bytes > 0 ? max_bytes : 0;
+    g_ttl = ttl;
+    trim();
+    pthread_mutex_unlock(&g_proxy_cache_lock);
+}
+
+
+/* Copy a fresh cached response for key into resp (body malloc'd). Returns 0 on a hit. */
+int proxy_cache_get(const char *key, proxy_response_t *resp) {
+    int rc = -1;
+
+    pthread_mutex_lock(&g_proxy_cache_lock);
+    if (g_max_bytes == 0) {
+        pthread_mutex_unlock(&g_proxy_cache_lock);
+        return -1;
+    }
+
+    proxy_cache_entry_t **ep = find_entry(key);
+    proxy_cache_entry_t *e = *ep;
+    if (e && e->expires <= time(NULL)) {
+        remove_entry(ep);
+        g_expired++;
+        e = NULL;
+    }
+    if (e && (resp->body = malloc(e->resp.length + 1))) {
+        char *body = resp->body;
+
+        *resp = e->resp;
+        resp->body = body;
+        memcpy(body, e->resp.body, e->resp.length);
+        body[e->resp.length] = '\0';
+        unlink_lru(e);
+        push_lru(e);
+        rc = 0;
+    }
+    if (rc == 0) g_hits++;
+    else g_misses++;
+    pthread_mutex_unlock(&g_proxy_cache_lock);
+    return rc;
+}
+
+
+/* Store a copy of resp under key, replacing any older one. */
+void proxy_cache_put(const char *key, const proxy_response_t *resp) {
+    pthread_mutex_lock(&g_proxy_cache_lock);
+    if (g_max_bytes == 0 || (long)resp->length > g_max_bytes / 4) {
+        pthread_mutex_unlock(&g_proxy_cache_lock);
+        return;
+    }
+
+    proxy_cache_entry_t **ep = find_entry(key);
+    if (*ep) remove_entry(ep);
+
+    proxy_cache_entry_t *e = calloc(1, sizeof(proxy_cache_entry_t));
+    if (e && (e->key = strdup(key)) && (e->resp.body = malloc(resp->length + 1))) {
+        char *body = e->resp.body;
+        e->resp = *resp;
+        e->resp.body = body;
+        memcpy(body, resp->body, resp->length);
+        e->expires = time(NULL) + g_ttl;
+        e->next = *ep;
+        *ep = e;
+        push_lru(e);
+        g_entries++;
+        g_bytes += entry_bytes(e);
+        trim();
+    } else if (e) {
+        free(e->key);
+        free(e);
+    }
+    pthread_mutex_unlock(&g_proxy_cache_lock);
+}
+
+
+void proxy_cache_get_stats(proxy_cache_stats_t *stats) {
+    pthread_mutex_lock(&g_proxy_cache_lock);
+    stats->entries = g_entries;
+    stats->bytes = g_bytes;
+    stats->hits = g_hits;
+    stats->misses = g_misses;
+    stats->expired = g_expired;
+    pthread_mutex_unlock(&g_proxy_cache_lock);
+}
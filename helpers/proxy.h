@@ -0,0 +1,41 @@
+#ifndef MDTP_PROXY_H
+#define MDTP_PROXY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROXY_MAX_BACKENDS 64
+#define PROXY_RING_POINTS 160       /* per backend */
+
+typedef struct {
+    uint64_t *points;               /* sorted */
+    int *owners;                    /* backend index of each point */
+    int count;
+} proxy_ring_t;
+
+int proxy_ring_build(proxy_ring_t *ring, const char *const *names, int count);
+int proxy_ring_lookup(const proxy_ring_t *ring, uint64_t hash, uint64_t exclude);
+void proxy_ring_free(proxy_ring_t *ring);
+
+typedef struct {
+    int status;
+    char content_type[64];
+    char headers[256];              /* extra header lines, each ending in CRLF */
+    char *body;
+    size_t length;
+} proxy_response_t;
+
+typedef struct {
+    long entries;
+    long bytes;
+    long hits;
+    long misses;
+    long expired;
+} proxy_cache_stats_t;
+
+void proxy_cache_configure(long max_bytes, int ttl);
+int proxy_cache_get(const char *key, proxy_response_t *resp);
+void proxy_cache_put(const char *key, const proxy_response_t *resp);
+void proxy_cache_get_stats(proxy_cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "ratelimit.h"
+
+/*
+ * Per-client token buckets in a fixed-size, open-addressing hash table.
+ * Each slot holds the client address and its bucket packed into one 64-bit
+ * word (milli-tokens in the high half, time of last refill in the low
+ * half), so a request is admitted with a single compare-and-swap and no
+ * lock. Slots idle for longer than RATE_IDLE_MS would have refilled anyway
+ * and may be taken over by a new address.
+ */
+
+#define RATE_TABLE_SIZE 8192
+#define RATE_PROBE_LIMIT 16
+#define RATE_IDLE_MS 60000
+
+typedef struct {
+    _Atomic uint32_t ip;
+    _Atomic uint64_t state;
+} rate_slot_t;
+
+static rate_slot_t g_rate_table[RATE_TABLE_SIZE];
+
+static _Atomic long g_allowed;
+static _Atomic long g_limited;
+static _Atomic long g_untracked;
+
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    /* Never 0, so that a zero state always means "fresh bucket". */
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000) | 1;
+}
+
+static uint32_t hash_ip(uint32_t ip) {
+    ip ^= ip >> 16;
+    ip *= 0x7feb352d;
+    ip ^= ip >> 15;
+    ip *= 0x846ca68b;
+    ip ^= ip >> 16;
+    return ip;
+}
+
+static rate_slot_t* find_slot(uint32_t ip, uint32_t now) {
+    uint32_t h = hash_ip(ip);
+
+    for (int probe = 0; probe < RATE_PROBE_LIMIT; probe++) {
+        rate_slot_t *slot = &g_rate_table[(h + probe) & (RATE_TABLE_SIZE - 1)];
+        uint32_t current = atomic_load_explicit(&slot->ip, memory_order_acquire);
+
+        if (current == ip) return slot;
+
+        if (current == 0) {
+            if (atomic_compare_exchange_strong(&slot->ip, &current, ip)) return slot;
+            if (current == ip) return slot;
+            continue;
+        }
+
+        uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+        if (state && now - (uint32_t)state > RATE_IDLE_MS &&
+            atomic_compare_exchange_strong(&slot->ip, &current, ip)) {
+            atomic_store_explicit(&slot->state, 0, memory_order_release);
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Take one token from ip's bucket. rate is tokens added per second and
+ * burst the bucket size. Returns 1 if the request may proceed.
+ */
+int rate_limit_allow(uint32_t ip, int rate, int burst) {
+    uint32_t now = now_ms();
+    rate_slot_t *slot = find_slot(ip, now);
+
+    if (!slot) {
+        atomic_fetch_add_explicit(&g_untracked, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    uint64_t capacity = (uint64_t)burst * 1000;
+    uint64_t old = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+    while (1) {
+        uint64_t tokens = old ? old >> 32 : capacity;
+        uint32_t last = old ? (uint32_t)old : now;
+
+        /* rate tokens/s is exactly rate milli-tokens per ms. */
+        tokens += (uint64_t)(uint32_t)(now - last) * rate;
+        if (tokens > capacity) tokens = capacity;
+
+        if (tokens < 1000) {
+            atomic_fetch_add_explicit(&g_limited, 1, memory_order_relaxed);
+            return 0;
+        }
+
+        uint64_t updated = ((tokens - 1000) << 32) | now;
+        if (atomic_compare_exchange_weak_explicit(&slot->state, &old, updated,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            atomic_fetch_add_explicit(&g_allowed, 1, memory_order_relaxed);
+            return 1;
+        }
+    }
+}
+
+void rate_limit_get_stats(rate_limit_stats_t *stats) {
+    stats->allowed = atomic_load_explicit(&g_allowed, memory_order_relaxed);
+    stats->limited = atomic_load_explicit(&g_limited, memory_order_relaxed);
+    stats->untracked = atomic_load_explicit(&g_untracked, memory_order_relaxed);
+}
@@ -0,0 +1,15 @@
+#ifndef MDTP_RATELIMIT_H
+#define MDTP_RATELIMIT_H
+
+#include <stdint.h>
+
+typedef struct {
+    long allowed;
+    long limited;
+    long untracked;     /* no free slot; request let through */
+} rate_limit_stats_t;
+
+int rate_limit_allow(uint32_t ip, int rate, int burst);
+void rate_limit_get_stats(rate_limit_stats_t *stats);
+
+#endif
@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "search.h"
+#include "logging.h"
+
+/*
+ * Full-text index over the Markdown files below root_dir. Every term maps
+ * to a posting list of (doc id delta, term frequency) pairs, both varint
+ * encoded, so a list for a common word costs about two bytes per
+ * document. Doc ids only ever grow: a changed file is indexed again under
+ * a new id and its old id is marked dead, which keeps every list sorted
+ * and append-only. Once dead documents outnumber live ones the whole
+ * index is rebuilt in the background and swapped in.
+ *
+ * A background thread rescans the tree every refresh interval (or when
+ * search_refresh_now() is called) and only reads files whose inode, size
+ * or mtime changed. Queries take the read lock; the indexer takes the
+ * write lock for one document at a time. Results are ranked with BM25.
+ */
+
+#define SEARCH_MIN_TOKEN 2
+#define SEARCH_MAX_TOKEN 32
+#define SEARCH_MAX_QUERY_TERMS 16
+#define SEARCH_MAX_DEPTH 32
+#define SEARCH_TITLE 128
+#define SEARCH_REBUILD_MIN_DEAD 256
+#define SEARCH_MAX_FILE (16 * 1024 * 1024)
+
+#define BM25_K1 1.2f
+#define BM25_B 0.75f
+
+typedef struct {
+    char *path;                 /* URL path, e.g. /docs/a.md */
+    char title[SEARCH_TITLE];
+    uint32_t length;            /* in tokens */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int alive;
+    unsigned seen;              /* last scan that found the file */
+} search_doc_t;
+
+typedef struct {
+    char *term;
+    uint8_t *postings;
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t last_doc;
+    uint32_t df;
+} search_term_t;
+
+typedef struct {
+    search_doc_t *docs;
+    uint32_t doc_count;
+    uint32_t doc_capacity;
+    uint32_t *doc_slots;        /* path hash -> doc id + 1, 0 = empty */
+    uint32_t doc_slot_count;
+    search_term_t *terms;       /* open addressing, term == NULL is empty */
+    uint32_t term_count;
+    uint32_t term_slot_count;
+    uint32_t live_docs;
+    uint64_t live_length;
+    uint64_t posting_bytes;
+    unsigned scan;
+} search_index_t;
+
+static search_index_t *g_index = NULL;
+static pthread_rwlock_t g_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t g_control_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_control_cond = PTHREAD_COND_INITIALIZER;
+static char g_root[512];
+static int g_refresh_seconds = 0;
+static int g_root_changed = 0;
+static int g_refresh_requested = 0;
+
+static long g_reindexed = 0;
+
+
+static uint32_t hash_bytes(const char *s) {
+    uint32_t hash = 2166136261u;
+    while (*s) hash = (hash ^ (unsigned char)*s++) * 16777619u;
+    return hash;
+}
+
+
+static int is_token_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+
+/*
+ * Lowercase text in place, cut it into tokens at every other character
+ * and store a pointer to each token of acceptable length. Returns the
+ * number of tokens.
+ */
+static size_t tokenize(char *text, size_t length, char **tokens) {
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        while (i < length && !is_token_char(text[i])) text[i++] = '\0';
+        size_t start = i;
+        while (i < length && is_token_char(text[i])) {
+            if (text[i] >= 'A' && text[i] <= 'Z') text[i] += 'a' - 'A';
+            i++;
+        }
+        size_t len = i - start;
+        if (i < length) text[i++] = '\0';
+        if (len >= SEARCH_MIN_TOKEN && len <= SEARCH_MAX_TOKEN) tokens[count++] = text + start;
+    }
+    return count;
+}
+
+
+static int compare_tokens(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+static void put_varint(uint8_t *out, uint32_t *pos, uint32_t value) {
+    while (value >= 0x80) {
+        out[(*pos)++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[(*pos)++] = value;
+}
+
+
+static uint32_t get_varint(const uint8_t *in, uint32_t *pos) {
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = in[(*pos)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+
+static search_term_t* find_term(search_index_t *idx, const char *term) {
+    if (idx->term_slot_count == 0) return NULL;
+    uint32_t mask = idx->term_slot_count - 1;
+    for (uint32_t i = hash_bytes(term) & mask; idx->terms[i].term; i = (i + 1) & mask) {
+        if (strcmp(idx->terms[i].term, term) == 0) return &idx->terms[i];
+    }
+    return NULL;
+}
+
+
+static int grow_terms(search_index_t *idx) {
+    uint32_t count = idx->term_slot_count ? idx->term_slot_count * 2 : 1024;
+    search_term_t *slots = calloc(count, sizeof(search_term_t));
+    if (!slots) return -1;
+
+    for (uint32_t i = 0; i < idx->term_slot_count; i++) {
+        if (!idx->terms[i].term) continue;
+        uint32_t j = hash_bytes(idx->terms[i].term) & (count - 1);
+        while (slots[j].term) j = (j + 1) & (count - 1);
+        slots[j] = idx->terms[i];
+    }
+    free(idx->terms);
+    idx->terms = slots;
+    idx->term_slot_count = count;
+    return 0;
+}
+
+
+static search_term_t* add_term(search_index_t *idx, const char *term) {
+    search_term_t *t = find_term(idx, term);
+    if (t) return t;
+
+    if ((idx->term_count + 1) * 2 > idx->term_slot_count && grow_terms(idx) < 0) return NULL;
+
+    uint32_t mask = idx->term_slot_count - 1;
+    uint32_t i = hash_bytes(term) & mask;
+    while (idx->terms[i].term) i = (i + 1) & mask;
+
+    t = &idx->terms[i];
+    t->term = strdup(term);
+    if (!t->term) return NULL;
+    idx->term_count++;
+    return t;
+}
+
+
+static int append_posting(search_index_t *idx, search_term_t *t, uint32_t doc, uint32_t tf) {
+    if (t->length + 10 > t->capacity) {
+        uint32_t cap = t->capacity ? t->capacity * 2 : 16;
+        uint8_t *grown = realloc(t->postings, cap);
+        if (!grown) return -1;
+        idx->posting_bytes += cap - t->capacity;
+        t->postings = grown;
+        t->capacity = cap;
+    }
+    /* Stored as doc + 1 for the first entry so a delta is never ambiguous. */
+    put_varint(t->postings, &t->length, t->df == 0 ? doc + 1 : doc - t->last_doc);
+    put_varint(t->postings, &t->length, tf);
+    t->last_doc = doc;
+    t->df++;
+    return 0;
+}
+
+
+static uint32_t* find_doc_slot(search_index_t *idx, const char *path) {
+    if (idx->doc_slot_count == 0) return NULL;
+    uint32_t mask = idx->doc_slot_count - 1;
+    for (uint32_t i = hash_bytes(path) & mask; ; i = (i + 1) & mask) {
+        uint32_t id = idx->doc_slots[i];
+        if (id == 0 || strcmp(idx->docs[id - 1].path, path) == 0) return &idx->doc_slots[i];
+    }
+}
+
+
+static int grow_docs(search_index_t *idx) {
+    if (idx->doc_count == idx->doc_capacity) {
+        uint32_t cap = idx->doc_capacity ? idx->doc_capacity * 2 : 256;
+        search_doc_t *grown = realloc(idx->docs, cap * sizeof(search_doc_t));
+        if (!grown) return -1;
+        idx->docs = grown;
+        idx->doc_capacity = cap;
+    }
+
+    if ((idx->doc_count + 1) * 2 > idx->doc_slot_count) {
+        uint32_t count = idx->doc_slot_count ? idx->doc_slot_count * 2 : 512;
+        uint32_t *slots = calloc(count, sizeof(uint32_t));
+        if (!slots) return -1;
+        for (uint32_t i = 0; i < idx->doc_slot_count; i++) {
+            uint32_t id = idx->doc_slots[i];
+            if (id == 0) continue;
+            uint32_t j = hash_bytes(idx->docs[id - 1].path) & (count - 1);
+            while (slots[j]) j = (j + 1) & (count - 1);
+            slots[j] = id;
+        }
+        free(idx->doc_slots);
+        idx->doc_slots = slots;
+        idx->doc_slot_count = count;
+    }
+    return 0;
+}
+
+
+static void retire_doc(search_index_t *idx, search_doc_t *doc) {
+    if (!doc->alive) return;
+    doc->alive = 0;
+    idx->live_docs--;
+    idx->live_length -= doc->length;
+}
+
+
+static void free_index(search_index_t *idx) {
+    if (!idx) return;
+    for (uint32_t i = 0; i < idx->doc_count; i++) free(idx->docs[i].path);
+    for (uint32_t i = 0; i < idx->term_slot_count; i++) {
+        free(idx->terms[i].term);
+        free(idx->terms[i].postings);
+    }
+    free(idx->docs);
+    free(idx->doc_slots);
+    free(idx->terms);
+    free(idx);
+}
+
+
+/*
+ * Read and tokenize one file, then add it as a new document, retiring the
+ * previous version of the same path. The file is read outside the lock;
+ * shared is set when idx is the live index.
+ */
+static int index_file(search_index_t *idx, int shared, const char *path,
+                      const char *filepath, const struct stat *st) {
+    FILE *f = fopen(filepath, "r");
+    if (!f) return -1;
+
+    size_t length = st->st_size;
+    char *text = malloc(length + 1);
+    char **tokens = malloc((length / 2 + 1) * sizeof(char *));
+    if (!text || !tokens || fread(text, 1, length, f) != length) {
+        fclose(f);
+        free(text);
+        free(tokens);
+        return -1;
+    }
+    fclose(f);
+    text[length] = '\0';
+
+    char title[SEARCH_TITLE];
+    const char *heading = strncmp(text, "# ", 2) == 0 ? text : strstr(text, "\n# ");
+    if (heading) {
+        heading += heading == text ? 2 : 3;
+        snprintf(title, sizeof(title), "%.*s", (int)strcspn(heading, "\r\n"), heading);
+    } else {
+        snprintf(title, sizeof(title), "%.*s", (int)sizeof(title) - 1, path);
+    }
+
+    size_t count = tokenize(text, length, tokens);
+    qsort(tokens, count, sizeof(char *), compare_tokens);
+
+    int rc = 0;
+    if (shared) pthread_rwlock_wrlock(&g_index_lock);
+
+    if (grow_docs(idx) < 0) {
+        rc = -1;
+    } else {
+        uint32_t id = idx->doc_count;
+        uint32_t *slot = find_doc_slot(idx, path);
+        search_doc_t *doc = &idx->docs[id];
+
+        memset(doc, 0, sizeof(*doc));
+        doc->path = strdup(path);
+        if (!doc->path) {
+            rc = -1;
+        } else {
+            if (*slot) {
+                retire_doc(idx, &idx->docs[*slot - 1]);
+                g_reindexed++;
+            }
+            *slot = id + 1;
+
+            snprintf(doc->title, sizeof(doc->title), "%s", title);
+            doc->length = count;
+            doc->dev = st->st_dev;
+            doc->ino = st->st_ino;
+            doc->size = st->st_size;
+            doc->mtime = st->st_mtim;
+            doc->alive = 1;
+            doc->seen = idx->scan;
+            idx->doc_count++;
+            idx->live_docs++;
+            idx->live_length += count;
+
+            for (size_t i = 0; i < count && rc == 0; ) {
+                size_t j = i + 1;
+                while (j < count && strcmp(tokens[j], tokens[i]) == 0) j++;
+
+                search_term_t *t = add_term(idx, tokens[i]);
+                if (!t || append_posting(idx, t, id, j - i) < 0) rc = -1;
+                i = j;
+            }
+        }
+    }
+
+    if (shared) pthread_rwlock_unlock(&g_index_lock);
+    free(tokens);
+    free(text);
+    return rc;
+}
+
+
+static void scan_dir(search_index_t *idx, int shared, const char *path, const char *dir, int depth) {
+    struct dirent **names;
+
+    if (depth > SEARCH_MAX_DEPTH) return;
+    int n = scandir(dir, &names, NULL, alphasort);
+    if (n < 0) return;
+
+    for (int i = 0; i < n; i++) {
+        const char *name = names[i]->d_name;
+        size_t name_len = strlen(name);
+        char child_path[1024];
+        char child_file[1024];
+        struct stat st;
+
+        if (name[0] != '.' &&
+            snprintf(child_path, sizeof(child_path), "%s/%s", path, name) < (int)sizeof(child_path) &&
+            snprintf(child_file, sizeof(child_file), "%s/%s", dir, name) < (int)sizeof(child_file) &&
+            stat(child_file, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                scan_dir(idx, shared, child_path, child_file, depth + 1);
+            } else if (S_ISREG(st.st_mode) && st.st_size <= SEARCH_MAX_FILE &&
+                       name_len > 3 && strcmp(name + name_len - 3, ".md") == 0) {
+                uint32_t *slot = find_doc_slot(idx, child_path);
+                search_doc_t *doc = slot && *slot ? &idx->docs[*slot - 1] : NULL;
+
+                if (doc && doc->alive && doc->dev == st.st_dev && doc->ino == st.st_ino &&
+                    doc->size == st.st_size && doc->mtime.tv_sec == st.st_mtim.tv_sec &&
+                    doc->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                    doc->seen = idx->scan;
+                } else if (index_file(idx, shared, child_path, child_file, &st) < 0) {
+                    log_message(LOG_WARNING, "Search: failed to index %s", child_file);
+                }
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+
+/* Bring idx up to date with the tree; files that disappeared are retired. */
+static void scan_tree(search_index_t *idx, int shared, const char *root) {
+    idx->scan++;
+    scan_dir(idx, shared, "", root, 0);
+
+    if (shared) pthread_rwlock_wrlock(&g_index_lock);
+    for (uint32_t i = 0; i < idx->doc_count; i++) {
+        if (idx->docs[i].alive && idx->docs[i].seen != idx->scan) retire_doc(idx, &idx->docs[i]);
+    }
+    if (shared) pthread_rwlock_unlock(&g_index_lock);
+}
+
+
+static search_index_t* build_index(const char *root) {
+    search_index_t *idx = calloc(1, sizeof(search_index_t));
+    if (!idx) return NULL;
+    scan_tree(idx, 0, root);
+    return idx;
+}
+
+
+static void rebuild_index(const char *root) {
+    search_index_t *fresh = build_index(root);
+    if (!fresh) {
+        log_message(LOG_ERROR, "Search: out of memory rebuilding the index");
+        return;
+    }
+
+    pthread_rwlock_wrlock(&g_index_lock);
+    search_index_t *old = g_index;
+    g_index = fresh;
+    pthread_rwlock_unlock(&g_index_lock);
+
+    free_index(old);
+    log_message(LOG_INFO, "Search index rebuilt: %u documents, %u terms",
+                fresh->live_docs, fresh->term_count);
+}
+
+
+static void* search_thread(void *arg) {
+    (void)arg;
+    char root[sizeof(g_root)];
+
+    for (;;) {
+        pthread_mutex_lock(&g_control_lock);
+        while (!g_refresh_requested && !g_root_changed) {
+            if (g_refresh_seconds <= 0) {
+                pthread_cond_wait(&g_control_cond, &g_control_lock);
+                continue;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += g_refresh_seconds;
+            if (pthread_cond_timedwait(&g_control_cond, &g_control_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        int root_changed = g_root_changed;
+        g_root_changed = 0;
+        g_refresh_requested = 0;
+        memcpy(root, g_root, sizeof(root));
+        pthread_mutex_unlock(&g_control_lock);
+
+        /* Only this thread modifies the index, so reading it unlocked is safe. */
+        uint32_t dead = g_index->doc_count - g_index->live_docs;
+        if (root_changed || (dead > g_index->live_docs && dead > SEARCH_REBUILD_MIN_DEAD)) {
+            rebuild_index(root);
+        } else {
+            scan_tree(g_index, 1, root);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Build the index for root_dir (synchronously, so it is complete before
+ * the server starts answering) and start the background indexer. With
+ * refresh_seconds 0 the tree is only rescanned on search_refresh_now().
+ */
+int search_start(const char *root_dir, int refresh_seconds) {
+    pthread_t thread;
+
+    snprintf(g_root, sizeof(g_root), "%s", root_dir);
+    g_refresh_seconds = refresh_seconds;
+
+    g_index = build_index(g_root);
+    if (!g_index) return -1;
+
+    if (pthread_create(&thread, NULL, search_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+
+    log_message(LOG_INFO, "Search index built: %u documents, %u terms",
+                g_index->live_docs, g_index->term_count);
+    return 0;
+}
+
+
+/* Called after a configuration reload; a new root rebuilds the index. */
+void search_set_root(const char *root_dir, int refresh_seconds) {
+    pthread_mutex_lock(&g_control_lock);
+    if (strcmp(g_root, root_dir) != 0) {
+        snprintf(g_root, sizeof(g_root), "%s", root_dir);
+        g_root_changed = 1;
+    }
+    g_refresh_seconds = refresh_seconds;
+    pthread_cond_signal(&g_control_cond);
+    pthread_mutex_unlock(&g_control_lock);
+}
+
+
+void search_refresh_now(void) {
+    pthread_mutex_lock(&g_control_lock);
+    g_refresh_requested = 1;
+    pthread_cond_signal(&g_control_cond);
+    pthread_mutex_unlock(&g_control_lock);
+}
+
+
+/* Growable output buffer for the result page. */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} search_out_t;
+
+static void out_printf(search_out_t *out, const char *fmt, ...) {
+    va_list ap;
+    if (!out->data) return;
+
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(out->data + out->length, out->capacity - out->length, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < out->capacity - out->length) {
+            out->length += n;
+            return;
+        }
+        size_t cap = out->capacity * 2 + n;
+        char *grown = realloc(out->data, cap);
+        if (!grown) {
+            free(out->data);
+            out->data = NULL;
+            return;
+        }
+        out->data = grown;
+        out->capacity = cap;
+    }
+}
+
+
+/*
+ * Run a query and return the ranked results as a Markdown page (malloc'd).
+ * Documents matching any query term are scored with BM25; the best `limit`
+ * are listed. Returns NULL if the index is not running or out of memory.
+ */
+char* search_query(const char *query, int limit, size_t *length) {
+    char terms_buf[512];
+    char *terms[256];
+    search_out_t out = { malloc(1024), 0, 1024 };
+
+    if (!out.data) return NULL;
+    if (limit <= 0) limit = SEARCH_DEFAULT_RESULTS;
+    if (limit > SEARCH_MAX_RESULTS) limit = SEARCH_MAX_RESULTS;
+
+    snprintf(terms_buf, sizeof(terms_buf), "%s", query);
+    size_t term_count = tokenize(terms_buf, strlen(terms_buf), terms);
+    qsort(terms, term_count, sizeof(char *), compare_tokens);
+
+    out_printf(&out, "# Search: %s\n\n", query);
+
+    pthread_rwlock_rdlock(&g_index_lock);
+    search_index_t *idx = g_index;
+    if (!idx) {
+        pthread_rwlock_unlock(&g_index_lock);
+        free(out.data);
+        return NULL;
+    }
+
+    float *scores = calloc(idx->doc_count ? idx->doc_count : 1, sizeof(float));
+    uint32_t *matched = malloc((idx->doc_count ? idx->doc_count : 1) * sizeof(uint32_t));
+    uint32_t match_count = 0;
+    float avg_length = idx->live_docs ? (float)idx->live_length / idx->live_docs : 1.0f;
+    if (avg_length <= 0) avg_length = 1.0f;
+
+    for (size_t q = 0; scores && matched && q < term_count && q < SEARCH_MAX_QUERY_TERMS; q++) {
+        if (q > 0 && strcmp(terms[q], terms[q - 1]) == 0) continue;
+        search_term_t *t = find_term(idx, terms[q]);
+        if (!t) continue;
+
+        float idf = logf(1.0f + (idx->live_docs - t->df + 0.5f) / (t->df + 0.5f));
+        if (idf < 0.01f) idf = 0.01f;
+
+        uint32_t pos = 0, doc = 0;
+        for (uint32_t n = 0; n < t->df; n++) {
+            uint32_t delta = get_varint(t->postings, &pos);
+            doc = n == 0 ? delta - 1 : doc + delta;
+            uint32_t tf = get_varint(t->postings, &pos);
+            if (!idx->docs[doc].alive) continue;
+
+            float norm = BM25_K1 * (1.0f - BM25_B + BM25_B * idx->docs[doc].length / avg_length);
+            if (scores[doc] == 0.0f) matched[match_count++] = doc;
+            scores[doc] += idf * tf * (BM25_K1 + 1.0f) / (tf + norm);
+        }
+    }
+
+    /* Partial selection of the top results, best first. */
+    uint32_t top[SEARCH_MAX_RESULTS];
+    int top_count = 0;
+    for (uint32_t i = 0; i < match_count; i++) {
+        uint32_t doc = matched[i];
+        if (top_count == limit && scores[doc] <= scores[top[top_count - 1]]) continue;
+
+        int j = top_count < limit ? top_count++ : limit - 1;
+        while (j > 0 && scores[top[j - 1]] < scores[doc]) {
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = doc;
+    }
+
+    if (!scores || !matched) {
+        free(out.data);
+        out.data = NULL;
+    } else if (match_count == 0) {
+        out_printf(&out, "No documents match.\n");
+    } else {
+        out_printf(&out, "%u of %u documents match.\n\n", match_count, idx->live_docs);
+        for (int i = 0; i < top_count; i++) {
+            search_doc_t *d = &idx->docs[top[i]];
+            out_printf(&out, "%d. [%s](%s) `%s` (%.2f)\n", i + 1, d->title, d->path, d->path,
+                       scores[top[i]]);
+        }
+    }
+    pthread_rwlock_unlock(&g_index_lock);
+
+    free(scores);
+    free(matched);
+    if (out.data) *length = out.length;
+    return out.data;
+}
+
+
+void search_get_stats(search_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_rwlock_rdlock(&g_index_lock);
+    if (g_index) {
+        stats->documents = g_index->live_docs;
+        stats->terms = g_index->term_count;
+        stats->posting_bytes = g_index->posting_bytes;
+    }
+    stats->reindexed = g_reindexed;
+    pthread_rwlock_unlock(&g_index_lock);
+}
@@ -0,0 +1,22 @@
+#ifndef MDTP_SEARCH_H
+#define MDTP_SEARCH_H
+
+#include <stddef.h>
+
+#define SEARCH_DEFAULT_RESULTS 20
+#define SEARCH_MAX_RESULTS 100
+
+typedef struct {
+    long documents;
+    long terms;
+    long posting_bytes;
+    long reindexed;     /* documents indexed again after a change */
+} search_stats_t;
+
+int search_start(const char *root_dir, int refresh_seconds);
+void search_set_root(const char *root_dir, int refresh_seconds);
+void search_refresh_now(void);
+char* search_query(const char *query, int limit, size_t *length);
+void search_get_stats(search_stats_t *stats);
+
+#endif
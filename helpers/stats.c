@@ -1,17 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>
 #include <pthread.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "logging.h"
 
 #define STATS_FILE "./logs/mdtp_stats.json"
 #define MAX_URLS 1000
 #define MAX_IPS 1000
+#define STATS_SLOTS 2048        /* hash slots per table, > 2 * MAX_URLS and MAX_IPS */
 
 typedef struct {
     char url[256];
     long count;
-    long total_time_ms;
+    long total_time_us;
 } url_stat_t;
 
 typedef struct {
@@ -29,18 +36,20 @@ typedef struct {
     long requests_404;
     long requests_500;
 
-    long total_response_time_ms;
-    long min_response_time_ms;
-    long max_response_time_ms;
+    long total_response_time_us;
+    long min_response_time_us;
+    long max_response_time_us;
     
     long bytes_sent;
     long bytes_received;
     
     url_stat_t *top_urls;
     int url_count;
+    short url_slots[STATS_SLOTS];   /* index + 1 into top_urls, 0 = empty */
     
     ip_stat_t *ips;
     int ip_count;
+    short ip_slots[STATS_SLOTS];
 
     time_t start_time;
     time_t last_request_time;
@@ -53,30 +62,45 @@ static server_stats_t g_stats = {0};
 void init_stats() {
     memset(&g_stats, 0, sizeof(g_stats));
     g_stats.start_time = time(NULL);
-    g_stats.min_response_time_ms = LONG_MAX;
+    g_stats.min_response_time_us = LONG_MAX;
     g_stats.top_urls = calloc(MAX_URLS, sizeof(url_stat_t));
     g_stats.ips = calloc(MAX_IPS, sizeof(ip_stat_t));
     pthread_mutex_init(&g_stats.lock, NULL);
+    mkdir("./logs", 0755);
     
     log_message(LOG_INFO, "Statistics system initialized");
 }
 
+/*
+ * Hash slot holding key in a table of names stored `stride` bytes apart,
+ * or the empty slot where it belongs. Called with the stats lock held.
+ */
+static short* find_slot(short *slots, const char *names, size_t stride, const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = key; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    for (uint32_t i = hash % STATS_SLOTS; ; i = (i + 1) % STATS_SLOTS) {
+        if (slots[i] == 0 || strcmp(names + (slots[i] - 1) * stride, key) == 0) return &slots[i];
+    }
+}
+
 void record_request(const char *url, const char *ip, int status_code, 
-                   long response_time_ms, long bytes_sent) {
+                   long response_time_us, long bytes_sent) {
     pthread_mutex_lock(&g_stats.lock);
     
+    time_t now = time(NULL);
     g_stats.total_requests++;
-    g_stats.last_request_time = time(NULL);
+    g_stats.last_request_time = now;
     g_stats.bytes_sent += bytes_sent;
-    g_stats.total_response_time_ms += response_time_ms;
+    g_stats.total_response_time_us += response_time_us;
     
-    if (response_time_ms < g_stats.min_response_time_ms)
-        g_stats.min_response_time_ms = response_time_ms;
-    if (response_time_ms > g_stats.max_response_time_ms)
-        g_stats.max_response_time_ms = response_time_ms;
+    if (response_time_us < g_stats.min_response_time_us)
+        g_stats.min_response_time_us = response_time_us;
+    if (response_time_us > g_stats.max_response_time_us)
+        g_stats.max_response_time_us = response_time_us;
    
-    if (status_code == 200) {
-        g_stats.requests_200++;
+    if (status_code < 400) {
+        if (status_code == 200) g_stats.requests_200++;
         g_stats.successful_requests++;
     } else if (status_code == 404) {
         g_stats.requests_404++;
@@ -84,39 +108,38 @@ void record_request(const char *url, const char *ip, int status_code,
     } else if (status_code >= 500) {
         g_stats.requests_500++;
         g_stats.failed_requests++;
+    } else {
+        g_stats.failed_requests++;
     }
     
-    int found = 0;
-    for (int i = 0; i < g_stats.url_count; i++) {
-        if (strcmp(g_stats.top_urls[i].url, url) == 0) {
-            g_stats.top_urls[i].count++;
-            g_stats.top_urls[i].total_time_ms += response_time_ms;
-            found = 1;
-            break;
-        }
-    }
-    if (!found && g_stats.url_count < MAX_URLS) {
-        strncpy(g_stats.top_urls[g_stats.url_count].url, url, 255);
-        g_stats.top_urls[g_stats.url_count].count = 1;
-        g_stats.top_urls[g_stats.url_count].total_time_ms = response_time_ms;
-        g_stats.url_count++;
+    /* Keys are looked up as stored, so a long URL matches its truncated entry. */
+    char key[sizeof(g_stats.top_urls[0].url)];
+    snprintf(key, sizeof(key), "%s", url);
+    short *slot = find_slot(g_stats.url_slots, g_stats.top_urls[0].url, sizeof(url_stat_t), key);
+    if (*slot) {
+        g_stats.top_urls[*slot - 1].count++;
+        g_stats.top_urls[*slot - 1].total_time_us += response_time_us;
+    } else if (g_stats.url_count < MAX_URLS) {
+        url_stat_t *u = &g_stats.top_urls[g_stats.url_count];
+        memcpy(u->url, key, sizeof(key));
+        u->count = 1;
+        u->total_time_us = response_time_us;
+        *slot = ++g_stats.url_count;
     }
     
-    found = 0;
-    for (int i = 0; i < g_stats.ip_count; i++) {
-        if (strcmp(g_stats.ips[i].ip, ip) == 0) {
-            g_stats.ips[i].requests++;
-            g_stats.ips[i].last_seen = time(NULL);
-            found = 1;
-            break;
-        }
-    }
-    if (!found && g_stats.ip_count < MAX_IPS) {
-        strncpy(g_stats.ips[g_stats.ip_count].ip, ip, 63);
-        g_stats.ips[g_stats.ip_count].requests = 1;
-        g_stats.ips[g_stats.ip_count].first_seen = time(NULL);
-        g_stats.ips[g_stats.ip_count].last_seen = time(NULL);
-        g_stats.ip_count++;
+    char ip_key[sizeof(g_stats.ips[0].ip)];
+    snprintf(ip_key, sizeof(ip_key), "%s", ip);
+    slot = find_slot(g_stats.ip_slots, g_stats.ips[0].ip, sizeof(ip_stat_t), ip_key);
+    if (*slot) {
+        g_stats.ips[*slot - 1].requests++;
+        g_stats.ips[*slot - 1].last_seen = now;
+    } else if (g_stats.ip_count < MAX_IPS) {
+        ip_stat_t *p = &g_stats.ips[g_stats.ip_count];
+        memcpy(p->ip, ip_key, sizeof(ip_key));
+        p->requests = 1;
+        p->first_seen = now;
+        p->last_seen = now;
+        *slot = ++g_stats.ip_count;
     }
     
     pthread_mutex_unlock(&g_stats.lock);
@@ -127,8 +150,8 @@ void print_stats() {
     
     time_t now = time(NULL);
     long uptime = now - g_stats.start_time;
-    long avg_response_time = g_stats.total_requests > 0 ? 
-        g_stats.total_response_time_ms / g_stats.total_requests : 0;
+    double avg_response_time = g_stats.total_requests > 0 ? 
+        g_stats.total_response_time_us / 1000.0 / g_stats.total_requests : 0;
     
     printf("\n");
     printf("╔════════════════════════════════════════════════════════════╗\n");
@@ -151,11 +174,11 @@ void print_stats() {
            g_stats.requests_500);
     printf("║                                                            ║\n");
     printf("║ PERFORMANCE:                                               ║\n");
-    printf("║   Avg Response: %ld ms                                     ║\n", avg_response_time);
-    printf("║   Min Response: %ld ms                                     ║\n", 
-           g_stats.min_response_time_ms == LONG_MAX ? 0 : g_stats.min_response_time_ms);
-    printf("║   Max Response: %ld ms                                     ║\n", 
-           g_stats.max_response_time_ms);
+    printf("║   Avg Response: %.3f ms                                  ║\n", avg_response_time);
+    printf("║   Min Response: %.3f ms                                  ║\n", 
+           g_stats.min_response_time_us == LONG_MAX ? 0 : g_stats.min_response_time_us / 1000.0);
+    printf("║   Max Response: %.3f ms                                  ║\n", 
+           g_stats.max_response_time_us / 1000.0);
     printf("║                                                            ║\n");
     printf("║ TRAFFIC:                                                   ║\n");
     printf("║   Bytes Sent:     %.2f MB                                  ║\n",
@@ -165,17 +188,19 @@ void print_stats() {
     printf("║                                                            ║\n");
     printf("║ TOP 5 URLS:                                                ║\n");
     
-    // Sort URLs by count
-    for (int i = 0; i < g_stats.url_count && i < 5; i++) {
-        for (int j = i + 1; j < g_stats.url_count; j++) {
-            if (g_stats.top_urls[j].count > g_stats.top_urls[i].count) {
-                url_stat_t temp = g_stats.top_urls[i];
-                g_stats.top_urls[i] = g_stats.top_urls[j];
-                g_stats.top_urls[j] = temp;
-            }
+    // Pick the busiest URLs without reordering the table the hash slots index
+    int top[5];
+    int shown = 0;
+    for (; shown < g_stats.url_count && shown < 5; shown++) {
+        int best = -1;
+        for (int j = 0; j < g_stats.url_count; j++) {
+            int taken = 0;
+            for (int k = 0; k < shown; k++) taken |= top[k] == j;
+            if (!taken && (best < 0 || g_stats.top_urls[j].count > g_stats.top_urls[best].count)) best = j;
         }
+        top[shown] = best;
         printf("║   %d. %-40s (%ld hits)   ║\n", 
-               i+1, g_stats.top_urls[i].url, g_stats.top_urls[i].count);
+               shown + 1, g_stats.top_urls[best].url, g_stats.top_urls[best].count);
     }
     
     printf("║                                                            ║\n");
@@ -203,8 +228,8 @@ void save_stats() {
     fprintf(f, "  \"requests_200\": %ld,\n", g_stats.requests_200);
     fprintf(f, "  \"requests_404\": %ld,\n", g_stats.requests_404);
     fprintf(f, "  \"requests_500\": %ld,\n", g_stats.requests_500);
-    fprintf(f, "  \"avg_response_time_ms\": %ld,\n", 
-            g_stats.total_requests > 0 ? g_stats.total_response_time_ms / g_stats.total_requests : 0);
+    fprintf(f, "  \"avg_response_time_ms\": %.3f,\n", 
+            g_stats.total_requests > 0 ? g_stats.total_response_time_us / 1000.0 / g_stats.total_requests : 0);
     fprintf(f, "  \"bytes_sent\": %ld,\n", g_stats.bytes_sent);
     fprintf(f, "  \"uptime\": %ld,\n", time(NULL) - g_stats.start_time);
     fprintf(f, "  \"unique_visitors\": %d\n", g_stats.ip_count);
@@ -0,0 +1,10 @@
+#ifndef MDTP_STATS_H
+#define MDTP_STATS_H
+
+void init_stats();
+void record_request(const char *url, const char *ip, int status_code,
+                    long response_time_us, long bytes_sent);
+void print_stats();
+void save_stats();
+
+#endif
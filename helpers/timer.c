@@ -0,0 +1,99 @@
+#include <stddef.h>
+#include <time.h>
+
+#include "timer.h"
+
+/*
+ * Hashed timer wheel with one-second ticks.
+ *
+ * An entry lives on the circular list of slot (deadline % TIMER_WHEEL_SLOTS),
+ * so arming, re-arming and cancelling are a constant-time unlink and link
+ * no matter how many timers exist. Each second that passes walks one slot;
+ * entries found there whose deadline is a later revolution of the wheel
+ * stay put. With deadlines under TIMER_WHEEL_SLOTS seconds away, which
+ * covers every timeout the servers use, each entry is visited only when it
+ * is actually due.
+ */
+
+
+static int slot_of(time_t t) {
+    return (int)((unsigned long)t % TIMER_WHEEL_SLOTS);
+}
+
+
+static void link_entry(timer_entry_t *head, timer_entry_t *entry) {
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+
+static void unlink_entry(timer_entry_t *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+
+void timer_wheel_init(timer_wheel_t *wheel, time_t now) {
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+    }
+    wheel->now = now;
+    wheel->armed = 0;
+}
+
+
+/* Arm (or move) entry to fire at deadline; a deadline already past fires on the next tick. */
+void timer_arm(timer_wheel_t *wheel, timer_entry_t *entry, time_t deadline) {
+    if (entry->next) unlink_entry(entry);
+    else wheel->armed++;
+
+    entry->deadline = deadline;
+    if (deadline <= wheel->now) deadline = wheel->now + 1;
+    link_entry(&wheel->slots[slot_of(deadline)], entry);
+}
+
+
+void timer_cancel(timer_wheel_t *wheel, timer_entry_t *entry) {
+    if (!entry->next) return;
+    unlink_entry(entry);
+    wheel->armed--;
+}
+
+
+/*
+ * Advance the wheel to now and call expired() for every entry that is due,
+ * after disarming it. The callback may free the entry's owner and arm or
+ * cancel any other entry. Returns the number of entries expired.
+ */
+int timer_expire(timer_wheel_t *wheel, time_t now, timer_expired_fn expired, void *arg) {
+    timer_entry_t due = { &due, &due, 0 };
+    int count = 0;
+
+    if (now <= wheel->now) return 0;
+
+    /* After a long stall every slot is visited once rather than every second. */
+    time_t first = now - wheel->now > TIMER_WHEEL_SLOTS ? now - TIMER_WHEEL_SLOTS + 1 : wheel->now + 1;
+    for (time_t t = first; t <= now; t++) {
+        timer_entry_t *head = &wheel->slots[slot_of(t)];
+        for (timer_entry_t *e = head->next, *next; e != head; e = next) {
+            next = e->next;
+            if (e->deadline > now) continue;
+            unlink_entry(e);
+            link_entry(&due, e);
+        }
+    }
+    wheel->now = now;
+
+    /* Pop one at a time so a callback may cancel entries still waiting here. */
+    while (due.next != &due) {
+        timer_entry_t *e = due.next;
+        unlink_entry(e);
+        wheel->armed--;
+        count++;
+        expired(e, arg);
+    }
+    return count;
+}
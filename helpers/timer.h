@@ -0,0 +1,28 @@
+#ifndef MDTP_TIMER_H
+#define MDTP_TIMER_H
+
+#include <time.h>
+
+#define TIMER_WHEEL_SLOTS 256
+
+/* Embedded in whatever it times; recover the owner with offsetof(). */
+typedef struct timer_entry {
+    struct timer_entry *prev;
+    struct timer_entry *next;   /* NULL while not armed */
+    time_t deadline;
+} timer_entry_t;
+
+typedef struct {
+    timer_entry_t slots[TIMER_WHEEL_SLOTS];     /* list heads, one per second */
+    time_t now;                 /* last second expired */
+    long armed;
+} timer_wheel_t;
+
+typedef void (*timer_expired_fn)(timer_entry_t *entry, void *arg);
+
+void timer_wheel_init(timer_wheel_t *wheel, time_t now);
+void timer_arm(timer_wheel_t *wheel, timer_entry_t *entry, time_t deadline);
+void timer_cancel(timer_wheel_t *wheel, timer_entry_t *entry);
+int timer_expire(timer_wheel_t *wheel, time_t now, timer_expired_fn expired, void *arg);
+
+#endif
@@ -0,0 +1,164 @@
+#ifdef MDTP_TRACE
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+
+/*
+ * Each thread appends its spans to its own ring, so recording takes no
+ * lock; a full ring overwrites its oldest spans. trace_dump() walks every
+ * ring and writes Chrome trace JSON (load it in chrome://tracing or
+ * Perfetto). It reads the rings while their threads keep writing, so the
+ * oldest few spans of a busy thread may be dropped as torn.
+ *
+ * Timestamps are TSC ticks on x86 (an invariant TSC is assumed) and
+ * CLOCK_MONOTONIC nanoseconds elsewhere. CLOCK_MONOTONIC_COARSE only
+ * advances once per scheduler tick, which is longer than most spans.
+ */
+
+#define TRACE_RING_SIZE 65536
+#define TRACE_DEFAULT_FILE "mdtp-trace.json"
+
+typedef struct {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+} trace_event_t;
+
+typedef struct trace_ring {
+    _Atomic uint64_t written;
+    pid_t tid;
+    char name[32];
+    struct trace_ring *next;
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static __thread trace_ring_t *t_ring = NULL;
+static trace_ring_t *g_rings = NULL;
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reference point taken on first use; ticks are converted against it at dump time. */
+static pthread_once_t g_epoch_once = PTHREAD_ONCE_INIT;
+static uint64_t g_epoch_ticks;
+static uint64_t g_epoch_ns;
+
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+static void set_epoch(void) {
+    g_epoch_ns = monotonic_ns();
+    g_epoch_ticks = read_ticks();
+}
+
+uint64_t trace_now(void) {
+    return read_ticks();
+}
+
+
+static trace_ring_t* thread_ring(void) {
+    if (t_ring) return t_ring;
+
+    pthread_once(&g_epoch_once, set_epoch);
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    if (!ring) return NULL;
+    ring->tid = (pid_t)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&g_trace_lock);
+    ring->next = g_rings;
+    g_rings = ring;
+    pthread_mutex_unlock(&g_trace_lock);
+
+    t_ring = ring;
+    return ring;
+}
+
+void trace_span(const char *name, uint64_t start, uint64_t end) {
+    trace_ring_t *ring = thread_ring();
+    if (!ring) return;
+
+    uint64_t n = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    ring->events[n % TRACE_RING_SIZE] = (trace_event_t){ name, start, end };
+    atomic_store_explicit(&ring->written, n + 1, memory_order_release);
+}
+
+/* Label the calling thread in the trace viewer. */
+void trace_thread_name(const char *name) {
+    trace_ring_t *ring = thread_ring();
+    if (ring) snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+
+/*
+ * Write every recorded span to file (NULL: $MDTP_TRACE_FILE, or
+ * mdtp-trace.json in the working directory). Returns the number of spans
+ * written, or -1 if the file cannot be written.
+ */
+int trace_dump(const char *file) {
+    if (!file) file = getenv("MDTP_TRACE_FILE");
+    if (!file) file = TRACE_DEFAULT_FILE;
+
+    pthread_once(&g_epoch_once, set_epoch);
+    double ticks_per_us = 1000.0;
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t now_ns = monotonic_ns(), now_ticks = read_ticks();
+    if (now_ns > g_epoch_ns) ticks_per_us = (double)(now_ticks - g_epoch_ticks) * 1000.0 / (now_ns - g_epoch_ns);
+#endif
+
+    FILE *f = fopen(file, "w");
+    if (!f) {
+        perror("trace: cannot write trace file");
+        return -1;
+    }
+
+    int pid = (int)getpid();
+    int count = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&g_trace_lock);
+    for (trace_ring_t *ring = g_rings; ring; ring = ring->next) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                ring == g_rings ? "" : ",\n", pid, (int)ring->tid, ring->name[0] ? ring->name : "thread");
+
+        uint64_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+        uint64_t first = written > TRACE_RING_SIZE ? written - TRACE_RING_SIZE : 0;
+        for (uint64_t i = first; i < written; i++) {
+            trace_event_t ev = ring->events[i % TRACE_RING_SIZE];
+            if (!ev.name || ev.end < ev.start || ev.start < g_epoch_ticks) continue;
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    ev.name, pid, (int)ring->tid,
+                    (ev.start - g_epoch_ticks) / ticks_per_us, (ev.end - ev.start) / ticks_per_us);
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&g_trace_lock);
+
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) return -1;
+    return count;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef MDTP_TRACE_H
+#define MDTP_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Span tracing. Compiled in only with -DMDTP_TRACE (and helpers/trace.c
+ * linked); otherwise every macro below expands to nothing.
+ *
+ *     TRACE_BEGIN(t_read);
+ *     ...
+ *     TRACE_END(t_read, "read");
+ *
+ * Span names must be string literals: only the pointer is recorded.
+ * trace_dump() only exists in traced builds; guard its callers.
+ */
+
+#ifdef MDTP_TRACE
+
+uint64_t trace_now(void);
+void trace_span(const char *name, uint64_t start, uint64_t end);
+void trace_thread_name(const char *name);
+int trace_dump(const char *file);
+
+#define TRACE_BEGIN(var) uint64_t var = trace_now()
+#define TRACE_END(var, name) trace_span((name), (var), trace_now())
+#define TRACE_THREAD(name) trace_thread_name(name)
+
+#else
+
+#define TRACE_BEGIN(var) ((void)0)
+#define TRACE_END(var, name) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+
+#endif
+
+#endif
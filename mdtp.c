@@ -8,41 +8,90 @@
  * - MDTP Client
  * - Protocol parser
  * - Request/Response handling
+ * - Load generator (bench)
+ * - Recursive site mirror
+ * - Batch fetch (MGET)
+ * - Table of contents and section extraction
+ * - Full-text search
+ * - Change notifications (WATCH)
+ * - Delta transfer of changed documents
+ * - Content packs (single-file, memory-mapped content trees)
+ * - Span tracing (built with -DMDTP_TRACE)
  ******************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <zlib.h>
+
+#include "helpers/config.h"
+#include "helpers/logging.h"
+#include "helpers/ratelimit.h"
+#include "helpers/search.h"
+#include "helpers/delta.h"
+#include "helpers/cache.h"
+#include "helpers/pack.h"
+#include "helpers/trace.h"
+#include "helpers/stats.h"
+#include "helpers/timer.h"
+#include "helpers/proxy.h"
 
 #define MDTP_VERSION "MDTP/1.0"
 #define DEFAULT_PORT 8585
 #define BUFFER_SIZE 8192
+#define REQUEST_BUFFER_MIN 1024
 #define MAX_PATH 256
 #define MAX_HEADER 1024
+#define MAX_ERROR_PAGE 65536
+#define STATUS_PAGE_SIZE 8192
+#define MAX_EVENTS 64
 
 
 typedef enum {
     MDTP_OK = 200,
+    MDTP_DELTA = 226,
+    MDTP_NOT_MODIFIED = 304,
     MDTP_BAD_REQUEST = 400,
     MDTP_NOT_FOUND = 404,
-    MDTP_INTERNAL_ERROR = 500
+    MDTP_TOO_MANY_REQUESTS = 429,
+    MDTP_INTERNAL_ERROR = 500,
+    MDTP_SERVICE_UNAVAILABLE = 503
 } mdtp_status_t;
 
 
 typedef struct {
     char method[16];
-    char path[MAX_PATH];
+    char path[MAX_HEADER];      /* MGET takes a comma-separated list */
     char version[16];
     char host[256];
     char user_agent[256];
+    int keep_alive;
+    int accept_deflate;
+    uint64_t delta_base;        /* ETag of the client's copy, 0 if none */
 } mdtp_request_t;
 
 
@@ -50,10 +99,92 @@ typedef struct {
     mdtp_status_t status;
     char content_type[64];
     size_t content_length;
-    char *body;
+    char *body;                 /* malloc'd, or borrowed if release is set */
+    void (*release)(void *ref); /* hands a borrowed body back once it is sent */
+    void *ref;
+    int keep_alive;
+    char headers[256];          /* extra header lines, each ending in CRLF */
+    int fd;                     /* >= 0: body is content_length bytes of this file */
+    off_t offset;               /*       starting at offset; see send_response() */
 } mdtp_response_t;
 
 
+/*
+ * A complete response prepared once at startup. The Date value and the
+ * Connection header are the only parts that change, so they are kept out
+ * of the buffers and spliced in at send time.
+ */
+typedef struct {
+    mdtp_status_t status;
+    char *head;         /* status line .. "Date: " */
+    size_t head_len;
+    char *body;
+    size_t body_len;
+} mdtp_static_response_t;
+
+static mdtp_static_response_t g_error_responses[] = {
+    { MDTP_BAD_REQUEST, NULL, 0, NULL, 0 },
+    { MDTP_NOT_FOUND, NULL, 0, NULL, 0 },
+    { MDTP_TOO_MANY_REQUESTS, NULL, 0, NULL, 0 },
+    { MDTP_INTERNAL_ERROR, NULL, 0, NULL, 0 },
+    { MDTP_SERVICE_UNAVAILABLE, NULL, 0, NULL, 0 }
+};
+
+static const char SERVER_HEADER_KEEP_ALIVE[] =
+    "\r\nServer: MDTP-Server/1.0\r\nConnection: keep-alive\r\n\r\n";
+static const char SERVER_HEADER_CLOSE[] =
+    "\r\nServer: MDTP-Server/1.0\r\nConnection: close\r\n\r\n";
+
+
+/* Per-connection state for the server's event loop. */
+typedef struct mdtp_conn {
+    int fd;
+    uint32_t peer_ip;
+    char peer[INET_ADDRSTRLEN];
+    struct mdtp_conn *prev;
+    struct mdtp_conn *next;
+    int protocol;               /* 1 for text requests, 2 once framed */
+    int watching;               /* number of WATCH streams on this connection */
+    uint32_t last_stream_id;
+    timer_entry_t timer;        /* read or write deadline; see conn_touch() */
+    int closing;                /* close once the pending output is written */
+    char *out;                  /* output the socket has not taken yet */
+    size_t out_offset;
+    size_t out_length;
+    size_t out_capacity;
+    int file_fd;                /* file range to send after out, or -1 */
+    off_t file_offset;
+    size_t file_remaining;
+    int corked;                 /* TCP_CORK held until the file range is out */
+    int send_buffer;            /* SO_SNDBUF we set, 0 while the kernel sizes it */
+    size_t length;
+    size_t capacity;            /* of buffer; see conn_reserve() */
+    char *buffer;
+    struct proxy_request *proxied;  /* request waiting on a backend; see proxy_forward() */
+} mdtp_conn_t;
+
+static mdtp_conn_t *g_connections = NULL;
+static int g_open_connections = 0;
+
+/* Connections turned away at accept() because max_connections was reached. */
+static long g_connections_shed = 0;
+
+/* Connections closed because a read or write deadline passed. */
+static long g_connections_timed_out = 0;
+
+/* Deadlines of every open connection, advanced once a second by the event loop. */
+static timer_wheel_t g_timers;
+static int g_epoll_fd = -1;
+
+/* Set once a successor has taken over the listener; see start_upgrade(). */
+static int g_draining = 0;
+
+/* Set by "mdtp proxy": requests are forwarded to backends; see "Proxy mode". */
+static int g_proxy = 0;
+
+#define ERROR_RESPONSE_COUNT (sizeof(g_error_responses) / sizeof(g_error_responses[0]))
+
+
 
 void get_timestamp(char *buffer, size_t size) {
     time_t now = time(NULL);
@@ -62,12 +193,34 @@ void get_timestamp(char *buffer, size_t size) {
 }
 
 
+/* The Date header only changes once a second; format it at most that often. */
+const char* cached_timestamp(size_t *length) {
+    static char timestamp[64];
+    static size_t timestamp_len;
+    static time_t formatted_at = -1;
+
+    time_t now = time(NULL);
+    if (now != formatted_at) {
+        get_timestamp(timestamp, sizeof(timestamp));
+        timestamp_len = strlen(timestamp);
+        formatted_at = now;
+    }
+
+    if (length) *length = timestamp_len;
+    return timestamp;
+}
+
+
 const char* get_status_message(mdtp_status_t status) {
     switch(status) {
         case MDTP_OK: return "OK";
+        case MDTP_DELTA: return "Delta";
+        case MDTP_NOT_MODIFIED: return "Not Modified";
         case MDTP_BAD_REQUEST: return "Bad Request";
         case MDTP_NOT_FOUND: return "Not Found";
+        case MDTP_TOO_MANY_REQUESTS: return "Too Many Requests";
         case MDTP_INTERNAL_ERROR: return "Internal Server Error";
+        case MDTP_SERVICE_UNAVAILABLE: return "Service Unavailable";
         default: return "Unknown";
     }
 }
@@ -135,246 +288,5187 @@ int parse_request(const char *raw_request, mdtp_request_t *req) {
     if (ua_header) {
         sscanf(ua_header, "User-Agent: %255[^\r\n]", req->user_agent);
     }
+
+    char connection[32];
+    const char *conn_header = strstr(raw_request, "Connection: ");
+    if (conn_header && sscanf(conn_header, "Connection: %31[^\r\n]", connection) == 1) {
+        req->keep_alive = strcasecmp(connection, "keep-alive") == 0;
+    }
+
+    char encoding[64];
+    const char *enc_header = strstr(raw_request, "Accept-Encoding: ");
+    if (enc_header && sscanf(enc_header, "Accept-Encoding: %63[^\r\n]", encoding) == 1) {
+        req->accept_deflate = strstr(encoding, "deflate") != NULL;
+    }
+
+    const char *base_header = strstr(raw_request, "Delta-Base: ");
+    if (base_header) {
+        sscanf(base_header, "Delta-Base: %" SCNx64, &req->delta_base);
+    }
     
     return 0;
 }
 
 
-char* build_response(mdtp_response_t *resp, size_t *total_length) {
-    char timestamp[64];
-    get_timestamp(timestamp, sizeof(timestamp));
-    
+void init_response(mdtp_response_t *resp, mdtp_status_t status, int keep_alive) {
+    memset(resp, 0, sizeof(*resp));
+    resp->status = status;
+    strcpy(resp->content_type, "text/markdown");
+    resp->keep_alive = keep_alive;
+    resp->fd = -1;
+}
 
-    char header[MAX_HEADER];
-    int header_len = snprintf(header, sizeof(header),
+
+/* Let go of a response body, whether it was malloc'd or borrowed. */
+void response_drop_body(mdtp_response_t *resp) {
+    if (resp->release) resp->release(resp->ref);
+    else free(resp->body);
+    resp->body = NULL;
+    resp->release = NULL;
+    resp->ref = NULL;
+}
+
+
+int format_response_header(mdtp_response_t *resp, char *header, size_t size) {
+    TRACE_BEGIN(t_header);
+    const char *timestamp = cached_timestamp(NULL);
+
+    int header_len = snprintf(header, size,
         "%s %d %s\r\n"
         "Content-Type: %s\r\n"
         "Content-Length: %zu\r\n"
+        "%s"
         "Date: %s\r\n"
         "Server: MDTP-Server/1.0\r\n"
+        "Connection: %s\r\n"
         "\r\n",
         MDTP_VERSION, resp->status, get_status_message(resp->status),
         resp->content_type,
         resp->content_length,
-        timestamp
+        resp->headers,
+        timestamp,
+        resp->keep_alive ? "keep-alive" : "close"
     );
-    
-    *total_length = header_len + resp->content_length;
-    char *full_response = malloc(*total_length);
-    if (!full_response) return NULL;
-    
-    memcpy(full_response, header, header_len);
-    if (resp->body && resp->content_length > 0) {
-        memcpy(full_response + header_len, resp->body, resp->content_length);
-    }
-    
-    return full_response;
+    TRACE_END(t_header, "header");
+    return header_len < (int)size ? header_len : (int)size - 1;
 }
 
 
-void handle_client(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-    
-    if (bytes_read <= 0) {
-        close(client_sock);
-        return;
+const char* default_error_body(mdtp_status_t status) {
+    switch(status) {
+        case MDTP_BAD_REQUEST:
+            return "# 400 - Bad Request\n\nInvalid MDTP request.";
+        case MDTP_NOT_FOUND:
+            return "# 404 - Not Found\n\nThe requested document was not found on this server.";
+        case MDTP_TOO_MANY_REQUESTS:
+            return "# 429 - Too Many Requests\n\nSlow down and try again shortly.";
+        case MDTP_SERVICE_UNAVAILABLE:
+            return "# 503 - Service Unavailable\n\nThe server is busy. Try again shortly.";
+        default:
+            return "# 500 - Internal Server Error\n\nThe server failed to process the request.";
     }
-    
-    buffer[bytes_read] = '\0';
-    
-    mdtp_request_t req;
-    if (parse_request(buffer, &req) < 0) {
-        const char *error_resp = 
-            "MDTP/1.0 400 Bad Request\r\n"
-            "Content-Type: text/markdown\r\n\r\n"
-            "# 400 - Bad Request\n\nInvalid MDTP request.";
-        send(client_sock, error_resp, strlen(error_resp), 0);
-        close(client_sock);
-        return;
+}
+
+
+/*
+ * Build the error responses. A "<code>.md" document in the content
+ * root (e.g. ./404.md) replaces the built-in body for that status. Called
+ * again after a configuration reload, since root_dir may have changed.
+ */
+int init_error_responses(void) {
+    for (size_t i = 0; i < ERROR_RESPONSE_COUNT; i++) {
+        mdtp_static_response_t *r = &g_error_responses[i];
+        char page_path[MAX_PATH * 3];
+        char *body = NULL;
+        size_t body_len = 0;
+
+        snprintf(page_path, sizeof(page_path), "%s/%d.md", get_config()->root_dir, r->status);
+        body = read_file(page_path, &body_len);
+        if (body && body_len > MAX_ERROR_PAGE) {
+            fprintf(stderr, "[MDTP] %s exceeds %d bytes, using built-in page\n",
+                    page_path, MAX_ERROR_PAGE);
+            free(body);
+            body = NULL;
+        }
+        if (body) {
+            printf("[MDTP] Custom %d page loaded from %s\n", r->status, page_path);
+        } else {
+            body = strdup(default_error_body(r->status));
+            if (!body) return -1;
+            body_len = strlen(body);
+        }
+
+        char head[MAX_HEADER];
+        int head_len = snprintf(head, sizeof(head),
+            "%s %d %s\r\n"
+            "Content-Type: text/markdown\r\n"
+            "Content-Length: %zu\r\n"
+            "Date: ",
+            MDTP_VERSION, r->status, get_status_message(r->status), body_len
+        );
+
+        free(r->head);
+        free(r->body);
+        r->head = malloc(head_len);
+        if (!r->head) {
+            free(body);
+            return -1;
+        }
+
+        memcpy(r->head, head, head_len);
+        r->head_len = head_len;
+        r->body = body;
+        r->body_len = body_len;
     }
-    
-    printf("[%s] %s %s\n", req.host, req.method, req.path);
 
-    char filepath[MAX_PATH];
-    snprintf(filepath, sizeof(filepath), ".%s", req.path);
-    
-    if (strcmp(req.path, "/") == 0) {
-        strcpy(filepath, "./index.md");
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Connection output
+ *
+ * Client sockets are non-blocking. A response is written as far as the
+ * socket takes it straight away; the rest is copied to the connection's
+ * output queue (a file range stays a file range) and the connection waits
+ * for EPOLLOUT instead of EPOLLIN until all of it has gone out. No further
+ * requests are read from it meanwhile, so a client that stops reading
+ * holds only its own buffers, never the event loop.
+ *
+ * Each connection has one deadline in g_timers, timeout_seconds ahead.
+ * While the connection is idle or part-way through a request it is the
+ * read deadline, and it only moves once a whole request has been answered,
+ * so trickling in a byte at a time does not keep a connection open. While
+ * output is pending it is the write deadline and moves whenever a write
+ * makes progress. WATCH connections have none while they are caught up.
+ * ------------------------------------------------------------------------ */
+
+#define CONN_OUT_KEEP 65536         /* larger queue buffers are freed once drained */
+
+static int conn_pending(const mdtp_conn_t *conn) {
+    return conn->out_offset < conn->out_length || conn->file_fd >= 0;
+}
+
+
+/* Largest request (or MDTP/2 frame) a connection may buffer, terminator included. */
+static size_t conn_request_limit(void) {
+    int limit = get_config()->max_request_size;
+    return limit > REQUEST_BUFFER_MIN ? (size_t)limit : REQUEST_BUFFER_MIN;
+}
+
+
+/*
+ * Request buffers start at REQUEST_BUFFER_MIN, which holds nearly every
+ * request, and double while a request needs more, up to max_request_size.
+ * Once a connection has nothing buffered a grown buffer is given back, so
+ * idle keep-alive connections cost a kilobyte each. Returns the room left.
+ */
+static size_t conn_reserve(mdtp_conn_t *conn) {
+    size_t want = conn->capacity;
+
+    if (conn->length + 1 >= want) want *= 2;
+    else if (conn->length == 0) want = REQUEST_BUFFER_MIN;
+    if (want > conn_request_limit()) want = conn_request_limit();
+    if (want < REQUEST_BUFFER_MIN) want = REQUEST_BUFFER_MIN;
+    if (want < conn->length + 1) want = conn->capacity;     /* max_request_size shrank on reload */
+
+    if (want != conn->capacity) {
+        char *buffer = realloc(conn->buffer, want);
+        if (buffer) {
+            conn->buffer = buffer;
+            conn->capacity = want;
+        }
     }
-    
-    mdtp_response_t resp;
-    size_t content_length;
-    char *content = read_file(filepath, &content_length);
-    
-    if (content) {
-        resp.status = MDTP_OK;
-        strcpy(resp.content_type, "text/markdown");
-        resp.content_length = content_length;
-        resp.body = content;
+    return conn->capacity > conn->length + 1 ? conn->capacity - 1 - conn->length : 0;
+}
+
+
+static void conn_touch(mdtp_conn_t *conn) {
+    int timeout = get_config()->timeout_seconds;
+
+    if (timeout <= 0 || (conn->watching && !conn_pending(conn))) {
+        timer_cancel(&g_timers, &conn->timer);
     } else {
-        const char *not_found_body = "# 404 - Not Found\n\nThe requested document was not found on this server.";
-        resp.status = MDTP_NOT_FOUND;
-        strcpy(resp.content_type, "text/markdown");
-        resp.content_length = strlen(not_found_body);
-        resp.body = strdup(not_found_body);
-    }
-    
-    size_t response_length;
-    char *response = build_response(&resp, &response_length);
-    
-    if (response) {
-        send(client_sock, response, response_length, 0);
-        free(response);
+        timer_arm(&g_timers, &conn->timer, time(NULL) + timeout);
     }
-    
-    free(resp.body);
-    close(client_sock);
 }
 
-void start_server(int port) {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
 
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket creation failed");
-        exit(1);
+/* Wait for the socket to become writable (pending output) or readable (none). */
+static void conn_want_write(mdtp_conn_t *conn, int on) {
+    struct epoll_event ev = { .events = on ? EPOLLOUT : EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+
+static void conn_cork(mdtp_conn_t *conn, int on) {
+    if (conn->corked == on) return;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    conn->corked = on;
+}
+
+
+/*
+ * Let a large response fit the socket send buffer in one go, so it leaves
+ * in one write instead of one EPOLLOUT round per buffer-full. Setting
+ * SO_SNDBUF turns off the kernel's own sizing for the socket, so it is only
+ * raised, only for responses beyond what the kernel grows to unaided, and
+ * never past max_send_buffer.
+ */
+#define SEND_BUFFER_MIN (256 * 1024)
+
+static void conn_size_send_buffer(mdtp_conn_t *conn, size_t length) {
+    long limit = get_config()->max_send_buffer;
+    if (length <= SEND_BUFFER_MIN || limit <= 0) return;
+    if ((long)length > limit) length = limit;
+    if ((int)length <= conn->send_buffer) return;
+
+    int current;
+    socklen_t len = sizeof(current);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &current, &len) == 0 && current >= (int)length) return;
+
+    /* The kernel doubles the value for its bookkeeping. */
+    int size = length / 2 + 1;
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == 0) conn->send_buffer = length;
+}
+
+
+static int conn_queue(mdtp_conn_t *conn, const char *data, size_t length) {
+    if (conn->out_offset > 0 && conn->out_length + length > conn->out_capacity) {
+        memmove(conn->out, conn->out + conn->out_offset, conn->out_length - conn->out_offset);
+        conn->out_length -= conn->out_offset;
+        conn->out_offset = 0;
     }
-    
-    int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    // Bind
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-    
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        exit(1);
+    if (conn->out_length + length > conn->out_capacity) {
+        size_t capacity = conn->out_capacity ? conn->out_capacity : 4096;
+        while (capacity < conn->out_length + length) capacity *= 2;
+        char *out = realloc(conn->out, capacity);
+        if (!out) return -1;
+        conn->out = out;
+        conn->out_capacity = capacity;
     }
-    
-    if (listen(server_sock, 10) < 0) {
-        perror("Listen failed");
-        exit(1);
+    memcpy(conn->out + conn->out_length, data, length);
+    conn->out_length += length;
+    return 0;
+}
+
+
+/*
+ * Write iov without blocking and queue whatever the socket does not take.
+ * Nothing is ever queued behind a file range: a response that ends in one
+ * is always the last thing written before the connection drains. Returns
+ * -1 if the connection is broken.
+ */
+static int conn_writev(mdtp_conn_t *conn, const struct iovec *iov, int count, int flags) {
+    int was_pending = conn_pending(conn);
+    size_t sent = 0;
+
+    if (conn->file_fd >= 0) return -1;
+
+    if (!was_pending) {
+        struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = count };
+        ssize_t n;
+        do {
+            n = sendmsg(conn->fd, &msg, flags | MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        if (n > 0) sent = n;
     }
-    
-    printf("[MDTP] MDTP Server running on port %d\n", port);
-    printf("[MDTP] Protocol: %s\n", MDTP_VERSION);
-    printf("[MDTP] Serving Markdown documents from current directory\n\n");
-    
-    while (1) {
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock < 0) {
-            perror("Accept failed");
+
+    for (int i = 0; i < count; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
             continue;
         }
-        
-        handle_client(client_sock);
+        if (conn_queue(conn, (char *)iov[i].iov_base + sent, iov[i].iov_len - sent) < 0) return -1;
+        sent = 0;
     }
-    
-    close(server_sock);
+
+    if (!was_pending && conn_pending(conn)) {
+        conn_want_write(conn, 1);
+        conn_touch(conn);
+    }
+    return 0;
 }
 
 
-char* mdtp_fetch(const char *host, int port, const char *path) {
-    int sock;
-    struct sockaddr_in server_addr;
-    char request[BUFFER_SIZE];
-    char response[BUFFER_SIZE * 4];
+/*
+ * Write as much pending output as the socket takes. Returns 0 once all of
+ * it is out, 1 if some remains, -1 if the connection is broken.
+ */
+static int conn_flush(mdtp_conn_t *conn) {
+    while (conn->out_offset < conn->out_length) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_offset, conn->out_length - conn->out_offset,
+                         MSG_NOSIGNAL | (conn->file_fd >= 0 ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        conn->out_offset += n;
+    }
+    conn->out_offset = conn->out_length = 0;
+    if (conn->out_capacity > CONN_OUT_KEEP) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_capacity = 0;
+    }
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
-        return NULL;
+    while (conn->file_fd >= 0 && conn->file_remaining > 0) {
+        ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, conn->file_remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        if (n == 0) return -1;      /* the file shrank under us */
+        conn->file_remaining -= n;
     }
-    
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address");
-        close(sock);
-        return NULL;
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
     }
-    
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        return NULL;
+    conn_cork(conn, 0);
+    return 0;
+}
+
+
+/* Send length bytes of fd from offset after any pending output. Takes ownership of fd. */
+static int conn_sendfile(mdtp_conn_t *conn, int fd, off_t offset, size_t length) {
+    int was_pending = conn_pending(conn);
+
+    if (conn->file_fd >= 0) {
+        close(fd);
+        return -1;
     }
-    
-    snprintf(request, sizeof(request),
-        "GET %s %s\r\n"
-        "Host: %s\r\n"
-        "User-Agent: MDTP-Client/1.0\r\n"
-        "Accept: text/markdown\r\n"
-        "\r\n",
-        path, MDTP_VERSION, host
-    );
-    
-    send(sock, request, strlen(request), 0);
+    conn->file_fd = fd;
+    conn->file_offset = offset;
+    conn->file_remaining = length;
+    if (was_pending) return 0;
 
-    ssize_t bytes_read = recv(sock, response, sizeof(response) - 1, 0);
-    close(sock);
-    
-    if (bytes_read <= 0) {
-        return NULL;
+    int rc = conn_flush(conn);
+    if (rc == 1) {
+        conn_want_write(conn, 1);
+        conn_touch(conn);
     }
-    
-    response[bytes_read] = '\0';
+    return rc < 0 ? -1 : 0;
+}
+
 
-    char *body = strstr(response, "\r\n\r\n");
-    if (body) {
-        body += 4;
-        return strdup(body);
+/* Point iov at one of the prebuilt error responses. Returns 0 if there is none for status. */
+static int error_response_iov(mdtp_status_t status, int keep_alive, struct iovec iov[4]) {
+    for (size_t i = 0; i < ERROR_RESPONSE_COUNT; i++) {
+        mdtp_static_response_t *r = &g_error_responses[i];
+        if (r->status != status || !r->head) continue;
+
+        size_t date_len;
+        const char *date = cached_timestamp(&date_len);
+        const char *tail = keep_alive ? SERVER_HEADER_KEEP_ALIVE : SERVER_HEADER_CLOSE;
+
+        iov[0] = (struct iovec){ r->head, r->head_len };
+        iov[1] = (struct iovec){ (void *)date, date_len };
+        iov[2] = (struct iovec){ (void *)tail, strlen(tail) };
+        iov[3] = (struct iovec){ r->body, r->body_len };
+        return 1;
     }
-    
-    return NULL;
+    return 0;
 }
 
 
-void print_usage(const char *prog) {
-    printf("MDTP - Markdown Transfer Protocol v1.0\n\n");
-    printf("Usage:\n");
-    printf("  %s server [port]           Start MDTP server (default port: 8585)\n", prog);
-    printf("  %s client <host> <path>    Fetch document via MDTP\n", prog);
-    printf("\nExamples:\n");
-    printf("  %s server 8585\n", prog);
-    printf("  %s client 127.0.0.1 /index.md\n", prog);
+/* Send one of the prebuilt error responses with a single writev(). Returns its body length. */
+size_t send_error_response(mdtp_conn_t *conn, mdtp_status_t status, int keep_alive) {
+    struct iovec iov[4];
+    if (!error_response_iov(status, keep_alive, iov)) return 0;
+
+    TRACE_BEGIN(t_send);
+    conn_writev(conn, iov, 4, 0);
+    TRACE_END(t_send, "send");
+    return iov[3].iov_len;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        print_usage(argv[0]);
-        return 1;
+
+/*
+ * Send the headers, then the file range straight from the page cache. The
+ * socket stays corked until the range is out, so the headers share the
+ * first segment with the body.
+ */
+static int send_file_response(mdtp_conn_t *conn, mdtp_response_t *resp) {
+    char header[MAX_HEADER];
+    int header_len = format_response_header(resp, header, sizeof(header));
+    struct iovec iov = { header, header_len };
+    int fd = resp->fd;
+
+    resp->fd = -1;
+    conn_size_send_buffer(conn, header_len + resp->content_length);
+    conn_cork(conn, 1);
+    if (conn_writev(conn, &iov, 1, 0) < 0) {
+        close(fd);
+        return -1;
     }
-    
-    if (strcmp(argv[1], "server") == 0) {
-        int port = DEFAULT_PORT;
-        if (argc > 2) {
-            port = atoi(argv[2]);
+    return conn_sendfile(conn, fd, resp->offset, resp->content_length);
+}
+
+
+/*
+ * Send a response body with freshly built headers, in one writev() from
+ * wherever the body lives; only what the socket does not take is copied
+ * (to the output queue). Takes ownership of resp->body (or resp->fd).
+ * Returns 0 on success, -1 if the connection is broken.
+ */
+int send_response(mdtp_conn_t *conn, mdtp_response_t *resp) {
+    if (resp->fd >= 0) return send_file_response(conn, resp);
+
+    char header[MAX_HEADER];
+    int header_len = format_response_header(resp, header, sizeof(header));
+    struct iovec iov[2] = { { header, header_len }, { resp->body, resp->content_length } };
+
+    conn_size_send_buffer(conn, header_len + resp->content_length);
+    int rc = conn_writev(conn, iov, resp->body && resp->content_length > 0 ? 2 : 1, 0);
+    response_drop_body(resp);
+    return rc;
+}
+
+
+/* Proxy mode, defined after the connection handlers it resumes. */
+struct proxy_request;
+static int proxy_status_rows(char *out, size_t size);
+static int proxy_forward(mdtp_conn_t *conn, const mdtp_request_t *req, const char *raw_request,
+                         const struct timespec *started);
+static void proxy_abort(struct proxy_request *pr);
+
+
+/* Markdown summary of server counters, served at /_status. */
+char* build_status_page(size_t *length) {
+    rate_limit_stats_t rl;
+    rate_limit_get_stats(&rl);
+    search_stats_t search;
+    search_get_stats(&search);
+    delta_stats_t delta;
+    version_store_get_stats(&delta);
+    cache_stats_t cache;
+    cache_get_stats(&cache);
+    long lookups = cache.hot_hits + cache.warm_hits + cache.misses;
+    mdtp_config_t *config = get_config();
+
+    char *page = malloc(STATUS_PAGE_SIZE);
+    if (!page) return NULL;
+
+    int n = snprintf(page, STATUS_PAGE_SIZE,
+        "# Server Status\n\n"
+        "| Counter | Value |\n"
+        "|---|---|\n"
+        "| Open connections | %d |\n"
+        "| Max connections | %d |\n"
+        "| Connections shed (busy) | %ld |\n"
+        "| Connections timed out | %ld |\n"
+        "| Rate limit (req/s per IP) | %d |\n"
+        "| Requests admitted | %ld |\n"
+        "| Requests rate-limited | %ld |\n"
+        "| Requests untracked (table full) | %ld |\n"
+        "| Search documents | %ld |\n"
+        "| Search terms | %ld |\n"
+        "| Search posting bytes | %ld |\n"
+        "| Search re-indexed documents | %ld |\n"
+        "| Cache hits hot / warm / misses | %ld / %ld / %ld |\n"
+        "| Cache hit rate hot / warm | %.1f%% / %.1f%% |\n"
+        "| Cache hot documents / bytes | %ld / %ld |\n"
+        "| Cache warm documents / bytes (deflated) | %ld / %ld |\n"
+        "| Cache promotions / demotions / evictions | %ld / %ld / %ld |\n"
+        "| Cached paths / distinct blobs | %ld / %ld |\n"
+        "| Cache bytes (path-keyed equivalent) | %ld (%ld) |\n"
+        "| Cache bytes saved by dedup | %ld |\n"
+        "| Cache deflated variant bytes | %ld |\n"
+        "| Stored document versions | %ld |\n"
+        "| Version store bytes | %ld |\n"
+        "| Deltas sent | %ld |\n"
+        "| Delta bytes sent (full size) | %ld (%ld) |\n",
+        g_open_connections, config->max_connections, g_connections_shed, g_connections_timed_out,
+        config->rate_limit, rl.allowed, rl.limited, rl.untracked,
+        search.documents, search.terms, search.posting_bytes, search.reindexed,
+        cache.hot_hits, cache.warm_hits, cache.misses,
+        100.0 * cache.hot_hits / (lookups ? lookups : 1), 100.0 * cache.warm_hits / (lookups ? lookups : 1),
+        cache.hot_blobs, cache.hot_bytes, cache.warm_blobs, cache.warm_bytes,
+        cache.promotions, cache.demotions, cache.evictions, cache.paths, cache.blobs, cache.blob_bytes, cache.logical_bytes,
+        cache.logical_bytes - cache.blob_bytes, cache.deflated_bytes,
+        delta.versions, delta.bytes, delta.deltas_sent, delta.delta_bytes, delta.full_bytes);
+    if (g_proxy && n < STATUS_PAGE_SIZE) n += proxy_status_rows(page + n, STATUS_PAGE_SIZE - n);
+
+    *length = n < STATUS_PAGE_SIZE ? n : STATUS_PAGE_SIZE - 1;
+    return page;
+}
+
+
+/* A document as loaded for serving; its bytes are borrowed until release_document(). */
+typedef struct {
+    const char *data;
+    size_t length;
+    const char *deflated;       /* NULL unless asked for and stored */
+    size_t deflated_length;
+    uint64_t etag;
+    void (*release)(void *ref);
+    void *ref;
+} mdtp_document_t;
+
+/*
+ * Fetch a document for serving, with its ETag, and its deflated variant if
+ * asked for and smaller. With a content pack loaded the document is served
+ * straight from the mapping, without any file system access or copy;
+ * otherwise the file is read through the content-addressed cache (see
+ * helpers/cache.c). Returns -1 if there is no such document.
+ */
+int load_document(const char *path, const char *filepath, int want_deflated, mdtp_document_t *doc) {
+    memset(doc, 0, sizeof(*doc));
+
+    if (pack_loaded()) {
+        pack_doc_t packed;
+        if (pack_find(path, &packed) < 0) return -1;
+
+        doc->data = packed.data;
+        doc->length = packed.length;
+        doc->etag = packed.etag;
+        if (want_deflated) {
+            doc->deflated = packed.deflated;
+            doc->deflated_length = packed.deflated_length;
         }
-        start_server(port);
+        doc->release = pack_release;
+        doc->ref = pack_retain();
+        return 0;
     }
-    else if (strcmp(argv[1], "client") == 0) {
-        if (argc < 4) {
-            printf("Usage: %s client <host> <path>\n", argv[0]);
-            return 1;
-        }
-        
-        char *content = mdtp_fetch(argv[2], DEFAULT_PORT, argv[3]);
-        if (content) {
-            printf("%s\n", content);
-            free(content);
-        } else {
-            printf("Failed to fetch document\n");
-            return 1;
-        }
+
+    doc->data = cache_read(filepath, &doc->length, &doc->etag,
+                           want_deflated ? &doc->deflated : NULL, &doc->deflated_length, &doc->ref);
+    if (!doc->data) return -1;
+    doc->release = cache_release;
+    return 0;
+}
+
+
+void release_document(mdtp_document_t *doc) {
+    if (doc->release) doc->release(doc->ref);
+    doc->release = NULL;
+}
+
+
+/* ------------------------------------------------------------------------
+ * MGET: many documents in one response
+ *
+ * "MGET <targets> MDTP/1.0", where <targets> is a comma-separated list of
+ * paths and a path ending in "/" stands for every file below that
+ * directory. The body is a bundle of entries, each
+ *
+ *   <status> <length> <path>\n<length bytes>\n
+ *
+ * with Bundle-Count giving the number of entries. If the request carries
+ * "Accept-Encoding: deflate" the whole bundle is zlib-compressed when that
+ * makes it smaller, and Bundle-Size gives its uncompressed length.
+ * ------------------------------------------------------------------------ */
+
+#define MGET_MAX_ENTRIES 10000
+#define MGET_MAX_BYTES (64 * 1024 * 1024)
+#define MGET_MAX_DEPTH 32
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int count;
+    int truncated;
+} mdtp_bundle_t;
+
+
+static int bundle_append(mdtp_bundle_t *b, const char *data, size_t length) {
+    if (b->length + length > b->capacity) {
+        size_t cap = b->capacity ? b->capacity : BUFFER_SIZE;
+        while (cap < b->length + length) cap *= 2;
+        char *grown = realloc(b->data, cap);
+        if (!grown) return -1;
+        b->data = grown;
+        b->capacity = cap;
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+    return 0;
+}
+
+
+static int bundle_add_entry(mdtp_bundle_t *b, int status, const char *path, const char *body, size_t length) {
+    char head[MAX_HEADER + 64];
+
+    if (b->count >= MGET_MAX_ENTRIES || b->length + length > MGET_MAX_BYTES) {
+        b->truncated = 1;
+        return 0;
+    }
+
+    int n = snprintf(head, sizeof(head), "%d %zu %s\n", status, length, path);
+    if (bundle_append(b, head, n) < 0 ||
+        bundle_append(b, body, length) < 0 ||
+        bundle_append(b, "\n", 1) < 0) {
+        return -1;
+    }
+    b->count++;
+    return 0;
+}
+
+
+static int bundle_add_file(mdtp_bundle_t *b, const char *path, const char *filepath) {
+    mdtp_document_t doc;
+    TRACE_BEGIN(t_read);
+    int found = load_document(path, filepath, 0, &doc) == 0;
+    TRACE_END(t_read, "read");
+
+    if (!found) return bundle_add_entry(b, MDTP_NOT_FOUND, path, "", 0);
+
+    int rc = bundle_add_entry(b, MDTP_OK, path, doc.data, doc.length);
+    release_document(&doc);
+    return rc;
+}
+
+
+/* Add every file below dir (skipping dot files) in name order. */
+static int bundle_add_dir(mdtp_bundle_t *b, const char *path, const char *dir, int depth) {
+    struct dirent **names;
+    int rc = 0;
+
+    if (depth > MGET_MAX_DEPTH) return 0;
+    int n = scandir(dir, &names, NULL, alphasort);
+    if (n < 0) return bundle_add_entry(b, MDTP_NOT_FOUND, path, "", 0);
+
+    for (int i = 0; i < n; i++) {
+        const char *name = names[i]->d_name;
+        if (rc == 0 && name[0] != '.' && !b->truncated) {
+            char child_path[MAX_HEADER];
+            char child_file[MAX_HEADER * 2];
+            struct stat st;
+
+            snprintf(child_path, sizeof(child_path), "%s%s", path, name);
+            snprintf(child_file, sizeof(child_file), "%s/%s", dir, name);
+            if (stat(child_file, &st) == 0) {
+                if (S_ISDIR(st.st_mode)) {
+                    strncat(child_path, "/", sizeof(child_path) - strlen(child_path) - 1);
+                    rc = bundle_add_dir(b, child_path, child_file, depth + 1);
+                } else if (S_ISREG(st.st_mode)) {
+                    rc = bundle_add_file(b, child_path, child_file);
+                }
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+    return rc;
+}
+
+
+/* A directory from the content pack: its entries are one contiguous, sorted range. */
+static int bundle_add_packed_dir(mdtp_bundle_t *b, const char *path) {
+    int first;
+    int count = pack_prefix(path, &first);
+
+    if (count == 0) return bundle_add_entry(b, MDTP_NOT_FOUND, path, "", 0);
+    for (int i = first; i < first + count && !b->truncated; i++) {
+        char child_path[MAX_HEADER];
+        pack_doc_t doc;
+
+        pack_entry(i, &doc);
+        if (doc.path_length >= sizeof(child_path)) continue;
+        memcpy(child_path, doc.path, doc.path_length);
+        child_path[doc.path_length] = '\0';
+        if (bundle_add_entry(b, MDTP_OK, child_path, doc.data, doc.length) < 0) return -1;
+    }
+    return 0;
+}
+
+
+/* Build the MGET response for req. On success resp->body holds the bundle. */
+void build_bundle(const mdtp_request_t *req, mdtp_response_t *resp) {
+    mdtp_config_t *config = get_config();
+    mdtp_bundle_t b = { 0 };
+    char targets[MAX_HEADER];
+    char *saveptr;
+
+    snprintf(targets, sizeof(targets), "%s", req->path);
+    for (char *path = strtok_r(targets, ",", &saveptr); path; path = strtok_r(NULL, ",", &saveptr)) {
+        char filepath[MAX_HEADER * 2];
+        size_t len = strlen(path);
+        int rc;
+
+        if (path[0] != '/' || strstr(path, "..")) {
+            rc = bundle_add_entry(&b, MDTP_BAD_REQUEST, path, "", 0);
+        } else if (path[len - 1] == '/' && pack_loaded()) {
+            rc = bundle_add_packed_dir(&b, path);
+        } else if (path[len - 1] == '/') {
+            snprintf(filepath, sizeof(filepath), "%s%s", config->root_dir, path);
+            rc = bundle_add_dir(&b, path, filepath, 0);
+        } else {
+            snprintf(filepath, sizeof(filepath), "%s%s", config->root_dir, path);
+            rc = bundle_add_file(&b, path, filepath);
+        }
+
+        if (rc < 0) {
+            free(b.data);
+            resp->status = MDTP_INTERNAL_ERROR;
+            return;
+        }
+    }
+
+    int n = snprintf(resp->headers, sizeof(resp->headers), "Bundle-Count: %d\r\n%s",
+                     b.count, b.truncated ? "Bundle-Truncated: true\r\n" : "");
+
+    if (req->accept_deflate && b.length > 0) {
+        uLongf packed_len = compressBound(b.length);
+        char *packed = malloc(packed_len);
+        if (packed && compress2((Bytef *)packed, &packed_len, (Bytef *)b.data, b.length,
+                                Z_DEFAULT_COMPRESSION) == Z_OK && packed_len < b.length) {
+            snprintf(resp->headers + n, sizeof(resp->headers) - n,
+                     "Content-Encoding: deflate\r\nBundle-Size: %zu\r\n", b.length);
+            free(b.data);
+            b.data = packed;
+            b.length = packed_len;
+        } else {
+            free(packed);
+        }
+    }
+
+    strcpy(resp->content_type, "application/x-mdtp-bundle");
+    resp->status = MDTP_OK;
+    resp->body = b.data ? b.data : strdup("");
+    resp->content_length = b.length;
+    if (!resp->body) resp->status = MDTP_INTERNAL_ERROR;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Heading index
+ *
+ * The first TOC or section request for a document scans it once for ATX
+ * headings (# .. ######, outside fenced code blocks) and caches their byte
+ * offsets, keyed by file path and rebuilt when the file's inode, size or
+ * mtime changes. "TOC /doc.md" returns the outline as a Markdown list and
+ * "GET /doc.md#slug" returns only that heading's section (up to the next
+ * heading of the same or a higher level), sent with sendfile().
+ * ------------------------------------------------------------------------ */
+
+#define HEADING_CACHE_SLOTS 1024
+#define HEADING_TITLE 128
+
+typedef struct {
+    int level;
+    size_t offset;              /* start of the heading line */
+    size_t end;                 /* end of its section */
+    char title[HEADING_TITLE];
+    char slug[HEADING_TITLE];
+} mdtp_heading_t;
+
+typedef struct {
+    char *path;                 /* file path, or path in the pack */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint64_t etag;              /* packed documents only */
+    mdtp_heading_t *headings;
+    int count;
+} heading_index_t;
+
+/* Direct-mapped: a colliding document simply replaces the older entry. */
+static heading_index_t g_heading_cache[HEADING_CACHE_SLOTS];
+
+
+/* GitHub-style anchor: lowercase letters and digits, spaces become '-'. */
+static void heading_slug(const char *title, char *slug, size_t size) {
+    size_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)title; *p && n + 1 < size; p++) {
+        if (isalnum(*p) || *p >= 0x80 || *p == '_') slug[n++] = tolower(*p);
+        else if ((*p == ' ' || *p == '-') && n > 0 && slug[n - 1] != '-') slug[n++] = '-';
+    }
+    while (n > 0 && slug[n - 1] == '-') n--;
+    slug[n] = '\0';
+}
+
+
+static int heading_add(heading_index_t *idx, int *cap, int level, size_t offset,
+                       const char *title, size_t title_len) {
+    if (idx->count == *cap) {
+        int grown_cap = *cap ? *cap * 2 : 16;
+        mdtp_heading_t *grown = realloc(idx->headings, grown_cap * sizeof(mdtp_heading_t));
+        if (!grown) return -1;
+        idx->headings = grown;
+        *cap = grown_cap;
+    }
+
+    mdtp_heading_t *h = &idx->headings[idx->count];
+    if (title_len >= sizeof(h->title)) title_len = sizeof(h->title) - 1;
+    memcpy(h->title, title, title_len);
+    h->title[title_len] = '\0';
+    h->level = level;
+    h->offset = offset;
+    heading_slug(h->title, h->slug, sizeof(h->slug));
+
+    /* Repeated titles get -1, -2, ... like GitHub anchors. */
+    int duplicates = 0;
+    for (int i = 0; i < idx->count; i++) {
+        if (strcmp(idx->headings[i].title, h->title) == 0) duplicates++;
+    }
+    if (duplicates > 0) {
+        size_t len = strlen(h->slug);
+        snprintf(h->slug + len, sizeof(h->slug) - len, "-%d", duplicates);
+    }
+
+    idx->count++;
+    return 0;
+}
+
+
+static int heading_index_build(heading_index_t *idx, const char *text, size_t length) {
+    int cap = 0;
+    int in_fence = 0;
+    size_t pos = 0;
+
+    while (pos < length) {
+        const char *line = text + pos;
+        const char *nl = memchr(line, '\n', length - pos);
+        size_t line_len = nl ? (size_t)(nl - line) : length - pos;
+
+        if (line_len >= 3 && (strncmp(line, "```", 3) == 0 || strncmp(line, "~~~", 3) == 0)) {
+            in_fence = !in_fence;
+        } else if (!in_fence && line_len > 0 && line[0] == '#') {
+            size_t level = 0;
+            while (level < line_len && line[level] == '#') level++;
+
+            if (level <= 6 && (level == line_len || line[level] == ' ' || line[level] == '\t')) {
+                const char *title = line + level;
+                const char *title_end = line + line_len;
+                while (title < title_end && (*title == ' ' || *title == '\t')) title++;
+                while (title_end > title && strchr(" \t\r#", title_end[-1])) title_end--;
+
+                if (heading_add(idx, &cap, level, pos, title, title_end - title) < 0) return -1;
+            }
+        }
+        pos += line_len + 1;
+    }
+
+    for (int i = 0; i < idx->count; i++) {
+        idx->headings[i].end = length;
+        for (int j = i + 1; j < idx->count; j++) {
+            if (idx->headings[j].level <= idx->headings[i].level) {
+                idx->headings[i].end = idx->headings[j].offset;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+
+static heading_index_t* heading_slot(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = key; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+    return &g_heading_cache[hash % HEADING_CACHE_SLOTS];
+}
+
+
+static void heading_reset(heading_index_t *idx) {
+    free(idx->path);
+    free(idx->headings);
+    memset(idx, 0, sizeof(*idx));
+}
+
+
+/* Return the heading index for an open document, (re)building it if needed. */
+static heading_index_t* heading_index_get(const char *filepath, int fd, const struct stat *st) {
+    heading_index_t *idx = heading_slot(filepath);
+    if (idx->path && strcmp(idx->path, filepath) == 0 && idx->etag == 0 &&
+        idx->dev == st->st_dev && idx->ino == st->st_ino && idx->size == st->st_size &&
+        idx->mtime.tv_sec == st->st_mtim.tv_sec && idx->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        return idx;
+    }
+
+    heading_reset(idx);
+
+    char *text = malloc(st->st_size + 1);
+    if (!text) return NULL;
+    if (pread(fd, text, st->st_size, 0) != st->st_size ||
+        heading_index_build(idx, text, st->st_size) < 0 ||
+        !(idx->path = strdup(filepath))) {
+        free(text);
+        heading_reset(idx);
+        return NULL;
+    }
+    free(text);
+
+    idx->dev = st->st_dev;
+    idx->ino = st->st_ino;
+    idx->size = st->st_size;
+    idx->mtime = st->st_mtim;
+    return idx;
+}
+
+
+/* Open a regular file and its heading index. Returns the fd, or -1 with resp->status set. */
+static int open_indexed(const char *filepath, heading_index_t **idx, mdtp_response_t *resp) {
+    struct stat st;
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        resp->status = MDTP_NOT_FOUND;
+        return -1;
+    }
+
+    *idx = heading_index_get(filepath, fd, &st);
+    if (!*idx) {
+        close(fd);
+        resp->status = MDTP_INTERNAL_ERROR;
+        return -1;
+    }
+    return fd;
+}
+
+
+/* A document in the content pack and its heading index. Returns NULL with resp->status set. */
+static heading_index_t* open_packed(const char *path, pack_doc_t *doc, mdtp_response_t *resp) {
+    if (pack_find(path, doc) < 0) {
+        resp->status = MDTP_NOT_FOUND;
+        return NULL;
+    }
+
+    heading_index_t *idx = heading_slot(path);
+    if (idx->path && strcmp(idx->path, path) == 0 && idx->etag == doc->etag &&
+        idx->size == (off_t)doc->length) {
+        return idx;
+    }
+
+    heading_reset(idx);
+    if (heading_index_build(idx, doc->data, doc->length) < 0 || !(idx->path = strdup(path))) {
+        heading_reset(idx);
+        resp->status = MDTP_INTERNAL_ERROR;
+        return NULL;
+    }
+    idx->etag = doc->etag;
+    idx->size = doc->length;
+    return idx;
+}
+
+
+/* "TOC <path>": the document's headings as a nested Markdown list. */
+void build_toc(const char *path, const char *filepath, mdtp_response_t *resp) {
+    heading_index_t *idx;
+    pack_doc_t doc;
+
+    if (pack_loaded()) {
+        if (!(idx = open_packed(path, &doc, resp))) return;
+    } else {
+        int fd = open_indexed(filepath, &idx, resp);
+        if (fd < 0) return;
+        close(fd);
+    }
+
+    int min_level = 6;
+    for (int i = 0; i < idx->count; i++) {
+        if (idx->headings[i].level < min_level) min_level = idx->headings[i].level;
+    }
+
+    size_t path_len = strlen(path);
+    size_t cap = 64 + path_len + idx->count * (2 * HEADING_TITLE + path_len + 24);
+    char *toc = malloc(cap);
+    if (!toc) {
+        resp->status = MDTP_INTERNAL_ERROR;
+        return;
+    }
+
+    size_t len = snprintf(toc, cap, "# Contents of %s\n\n", path);
+    for (int i = 0; i < idx->count; i++) {
+        mdtp_heading_t *h = &idx->headings[i];
+        len += snprintf(toc + len, cap - len, "%*s- [%s](%s#%s)\n",
+                        (h->level - min_level) * 2, "", h->title, path, h->slug);
+    }
+
+    resp->status = MDTP_OK;
+    resp->body = toc;
+    resp->content_length = len;
+}
+
+
+/*
+ * "GET <path>#<slug>": just that section, left for send_response() to
+ * sendfile(), or borrowed from the content pack's mapping.
+ */
+void build_section(const char *path, const char *filepath, const char *slug, mdtp_response_t *resp) {
+    heading_index_t *idx;
+    pack_doc_t doc;
+    int fd = -1;
+
+    if (pack_loaded()) {
+        if (!(idx = open_packed(path, &doc, resp))) return;
+    } else if ((fd = open_indexed(filepath, &idx, resp)) < 0) {
+        return;
+    }
+
+    mdtp_heading_t *match = NULL;
+    for (int i = 0; i < idx->count && !match; i++) {
+        if (strcmp(idx->headings[i].slug, slug) == 0) match = &idx->headings[i];
+    }
+    for (int i = 0; i < idx->count && !match; i++) {
+        if (strcasecmp(idx->headings[i].title, slug) == 0) match = &idx->headings[i];
+    }
+
+    if (!match) {
+        if (fd >= 0) close(fd);
+        resp->status = MDTP_NOT_FOUND;
+        return;
+    }
+
+    resp->status = MDTP_OK;
+    resp->content_length = match->end - match->offset;
+    if (fd >= 0) {
+        resp->fd = fd;
+        resp->offset = match->offset;
+    } else {
+        resp->body = (char *)doc.data + match->offset;
+        resp->release = pack_release;
+        resp->ref = pack_retain();
+    }
+}
+
+
+/*
+ * Copy the value of parameter `name` from a query string ("a=1&b=2"),
+ * decoding '+' and %XX escapes. Returns 0 if found, -1 otherwise.
+ */
+int query_param(const char *query, const char *name, char *value, size_t value_size) {
+    size_t name_len = strlen(name);
+
+    for (const char *p = query; p && *p; ) {
+        if (strncmp(p, name, name_len) != 0 || p[name_len] != '=') {
+            p = strchr(p, '&');
+            if (p) p++;
+            continue;
+        }
+
+        size_t n = 0;
+        for (p += name_len + 1; *p && *p != '&' && *p != '#' && n + 1 < value_size; p++) {
+            if (*p == '+') {
+                value[n++] = ' ';
+            } else if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+                char hex[3] = { p[1], p[2], '\0' };
+                value[n++] = (char)strtol(hex, NULL, 16);
+                p += 2;
+            } else {
+                value[n++] = *p;
+            }
+        }
+        value[n] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+
+/* "/_search?q=<terms>[&n=<results>]": ranked Markdown result list. */
+void build_search_page(const char *path, mdtp_response_t *resp) {
+    char terms[256] = "";
+    char count[16];
+    const char *query = strchr(path, '?');
+
+    /* The index covers root_dir, which is not what a content pack serves. */
+    if (!get_config()->enable_search || pack_loaded()) {
+        resp->status = MDTP_NOT_FOUND;
+        return;
+    }
+
+    if (query) query_param(query + 1, "q", terms, sizeof(terms));
+    int limit = query && query_param(query + 1, "n", count, sizeof(count)) == 0 ? atoi(count) : 0;
+
+    resp->body = search_query(terms, limit, &resp->content_length);
+    resp->status = resp->body ? MDTP_OK : MDTP_INTERNAL_ERROR;
+}
+
+
+/*
+ * Tag a full document with its ETag and remember this version. If the
+ * client named the version it holds in Delta-Base, answer 304 when that is
+ * still current, or 226 with a delta against it when the version store
+ * still has it; otherwise the full body goes out unchanged.
+ */
+static void delta_encode(const mdtp_request_t *req, const char *filepath, uint64_t etag, mdtp_response_t *resp) {
+    int n = snprintf(resp->headers, sizeof(resp->headers), "ETag: %016" PRIx64 "\r\n", etag);
+
+    version_store_put(filepath, etag, resp->body, resp->content_length);
+    if (req->delta_base == 0) return;
+
+    if (req->delta_base == etag) {
+        response_drop_body(resp);
+        resp->body = strdup("");
+        resp->content_length = 0;
+        resp->status = resp->body ? MDTP_NOT_MODIFIED : MDTP_INTERNAL_ERROR;
+        return;
+    }
+
+    size_t delta_len;
+    char *delta = version_store_delta(filepath, req->delta_base, resp->body, resp->content_length, &delta_len);
+    if (!delta) return;
+
+    response_drop_body(resp);
+    resp->body = delta;
+    resp->content_length = delta_len;
+    resp->status = MDTP_DELTA;
+    strcpy(resp->content_type, "text/x-mdtp-delta");
+    snprintf(resp->headers + n, sizeof(resp->headers) - n, "Delta-Base: %016" PRIx64 "\r\n", req->delta_base);
+}
+
+
+/*
+ * Work out the response to a parsed request. On success resp->body is the
+ * document, which the caller lets go of with response_drop_body() (or
+ * send_response()); for errors it is left NULL so the prebuilt error page
+ * for resp->status can be sent instead.
+ */
+void dispatch_request(const mdtp_request_t *req, mdtp_response_t *resp) {
+    mdtp_config_t *config = get_config();
+
+    init_response(resp, MDTP_OK, req->keep_alive);
+
+    if (strcmp(req->method, "MGET") == 0) {
+        build_bundle(req, resp);
+        return;
+    }
+
+    if (strcmp(req->path, "/_status") == 0) {
+        resp->body = build_status_page(&resp->content_length);
+        resp->status = resp->body ? MDTP_OK : MDTP_INTERNAL_ERROR;
+        return;
+    }
+
+    if (strncmp(req->path, "/_search", 8) == 0 && (req->path[8] == '?' || req->path[8] == '\0')) {
+        build_search_page(req->path, resp);
+        return;
+    }
+
+    char path[MAX_HEADER];
+    snprintf(path, sizeof(path), "%s", req->path);
+    char *fragment = strchr(path, '#');
+    if (fragment) *fragment++ = '\0';
+
+    /* GET, TOC and sections all read below root_dir. */
+    if (path[0] != '/' || strstr(path, "..")) {
+        resp->status = MDTP_BAD_REQUEST;
+        return;
+    }
+
+    /* A path that does not fit is refused, not looked up cut short. */
+    char filepath[MAX_PATH * 3];
+    int fits;
+    if (strcmp(path, "/") == 0) {
+        fits = snprintf(filepath, sizeof(filepath), "%s/%s", config->root_dir, config->index_file) < (int)sizeof(filepath) &&
+               snprintf(path, sizeof(path), "/%s", config->index_file) < (int)sizeof(path);
+    } else {
+        fits = snprintf(filepath, sizeof(filepath), "%s%s", config->root_dir, path) < (int)sizeof(filepath);
+    }
+    if (!fits) {
+        resp->status = MDTP_BAD_REQUEST;
+        return;
+    }
+
+    if (strcmp(req->method, "TOC") == 0) {
+        build_toc(path, filepath, resp);
+        return;
+    }
+
+    if (fragment && *fragment) {
+        build_section(path, filepath, fragment, resp);
+        return;
+    }
+    
+    mdtp_document_t doc;
+    TRACE_BEGIN(t_read);
+    int found = load_document(path, filepath, req->accept_deflate, &doc) == 0;
+    TRACE_END(t_read, "read");
+    if (!found) {
+        resp->status = MDTP_NOT_FOUND;
+        return;
+    }
+
+    /* The response borrows the document; both of its variants go back together. */
+    resp->body = (char *)doc.data;
+    resp->content_length = doc.length;
+    resp->release = doc.release;
+    resp->ref = doc.ref;
+    delta_encode(req, filepath, doc.etag, resp);
+
+    /* A full body may go out as the stored deflated variant instead. */
+    if (doc.deflated && resp->status == MDTP_OK) {
+        size_t n = strlen(resp->headers);
+        resp->body = (char *)doc.deflated;
+        resp->content_length = doc.deflated_length;
+        snprintf(resp->headers + n, sizeof(resp->headers) - n, "Content-Encoding: deflate\r\n");
+    }
+}
+
+
+/* Returns 0 if the peer is over its request rate. */
+int admit_request(mdtp_conn_t *conn) {
+    mdtp_config_t *config = get_config();
+
+    return config->rate_limit <= 0 ||
+           rate_limit_allow(conn->peer_ip, config->rate_limit, config->rate_burst);
+}
+
+
+/* Admission control in front of dispatch_request(). */
+void serve_request(mdtp_conn_t *conn, const mdtp_request_t *req, mdtp_response_t *resp) {
+    if (!admit_request(conn)) {
+        init_response(resp, MDTP_TOO_MANY_REQUESTS, req->keep_alive);
+        return;
+    }
+
+    dispatch_request(req, resp);
+}
+
+
+/*
+ * Record an answered request in the access log and the statistics. The
+ * access log is buffered per thread (see helpers/logging.c) and flushed
+ * from the event loop, so nothing here blocks on the disk.
+ */
+void log_request(const mdtp_conn_t *conn, const char *method, const char *path,
+                 int status, size_t bytes, const struct timespec *started) {
+    mdtp_config_t *config = get_config();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long latency_us = (now.tv_sec - started->tv_sec) * 1000000 + (now.tv_nsec - started->tv_nsec) / 1000;
+
+    if (config->enable_logging) access_log(conn->peer, method, path, status, bytes, latency_us);
+    if (config->enable_stats) record_request(path, conn->peer, status, latency_us, bytes);
+}
+
+
+/* ------------------------------------------------------------------------
+ * MDTP/2 framing
+ *
+ * A request whose version is MDTP/2.0 switches its connection to binary
+ * framing. The server answers "MDTP/2.0 101 Switching Protocols" and from
+ * then on both sides exchange frames with a 9-byte header:
+ *
+ *   length (24 bits) | type (8) | flags (8) | stream id (32)
+ *
+ * A request is a HEADERS frame on a new odd stream id whose payload is the
+ * usual request line and headers (no blank line). The response is a
+ * HEADERS frame with the status line and headers, then DATA frames; the
+ * last frame of a stream carries END_STREAM. Any number of requests may be
+ * in flight, and responses to requests that arrive together are
+ * interleaved frame by frame so one large document does not hold up the
+ * small ones behind it. The upgrade request itself is answered on stream 1
+ * unless its path is "*". Either side ends the connection with GOAWAY.
+ * ------------------------------------------------------------------------ */
+
+#define MDTP2_VERSION "MDTP/2.0"
+#define MDTP2_FRAME_HEADER 9
+#define MDTP2_MAX_FRAME 16384
+#define MDTP2_MAX_BATCH 32
+
+#define MDTP2_DATA 0x0
+#define MDTP2_HEADERS 0x1
+#define MDTP2_GOAWAY 0x7
+
+#define MDTP2_END_STREAM 0x1
+
+static const char MDTP2_SWITCHING[] = MDTP2_VERSION " 101 Switching Protocols\r\n\r\n";
+
+/* One response being written out by mdtp2_flush(). */
+typedef struct {
+    uint32_t stream_id;
+    char head[MAX_HEADER];
+    size_t head_len;
+    char *body;
+    size_t length;
+    size_t offset;
+    int owned;          /* body is the response's rather than a prebuilt error page */
+    void (*release)(void *ref);
+    void *ref;
+    int status;         /* the rest is for log_request() once the batch is sent */
+    char method[sizeof(((mdtp_request_t *)0)->method)];
+    char path[MAX_HEADER];      /* as long as the request's, so the log never cuts it */
+    struct timespec started;
+} mdtp2_stream_t;
+
+
+static void mdtp2_put_header(unsigned char *out, size_t length, int type, int flags, uint32_t stream_id) {
+    out[0] = length >> 16;
+    out[1] = length >> 8;
+    out[2] = length;
+    out[3] = type;
+    out[4] = flags;
+    out[5] = stream_id >> 24;
+    out[6] = stream_id >> 16;
+    out[7] = stream_id >> 8;
+    out[8] = stream_id;
+}
+
+
+static void mdtp2_get_header(const unsigned char *in, size_t *length, int *type, int *flags, uint32_t *stream_id) {
+    *length = ((size_t)in[0] << 16) | ((size_t)in[1] << 8) | in[2];
+    *type = in[3];
+    *flags = in[4];
+    *stream_id = ((uint32_t)in[5] << 24) | ((uint32_t)in[6] << 16) |
+                 ((uint32_t)in[7] << 8) | in[8];
+}
+
+
+/* Turn a response into a stream ready for mdtp2_flush(). Takes ownership of resp->body. */
+static void mdtp2_prepare(mdtp2_stream_t *s, uint32_t stream_id, mdtp_response_t *resp) {
+    /* Frames are interleaved from memory, so a file range is read in here. */
+    if (resp->fd >= 0) {
+        resp->body = malloc(resp->content_length + 1);
+        if (!resp->body || pread(resp->fd, resp->body, resp->content_length, resp->offset) !=
+                           (ssize_t)resp->content_length) {
+            free(resp->body);
+            resp->body = NULL;
+            resp->status = MDTP_INTERNAL_ERROR;
+        }
+        close(resp->fd);
+        resp->fd = -1;
+    }
+
+    s->stream_id = stream_id;
+    s->status = resp->status;
+    s->body = resp->body;
+    s->length = resp->content_length;
+    s->offset = 0;
+    s->owned = resp->body != NULL;
+    s->release = resp->release;
+    s->ref = resp->ref;
+
+    if (!resp->body) {
+        s->length = 0;
+        for (size_t i = 0; i < ERROR_RESPONSE_COUNT; i++) {
+            if (g_error_responses[i].status == resp->status) {
+                s->body = g_error_responses[i].body;
+                s->length = g_error_responses[i].body_len;
+            }
+        }
+    }
+
+    int n = snprintf(s->head, sizeof(s->head),
+        "%s %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "Date: %s\r\n"
+        "Server: MDTP-Server/1.0\r\n",
+        MDTP2_VERSION, resp->status, get_status_message(resp->status),
+        resp->content_type, s->length, resp->headers, cached_timestamp(NULL));
+    s->head_len = n < (int)sizeof(s->head) ? (size_t)n : sizeof(s->head) - 1;
+}
+
+
+/* Note which request a stream answers, for mdtp2_log(); req is NULL if it did not parse. */
+static void mdtp2_note(mdtp2_stream_t *s, const mdtp_request_t *req, const struct timespec *started) {
+    if (req) {
+        memcpy(s->method, req->method, sizeof(s->method));      /* same sizes as the request's */
+        memcpy(s->path, req->path, sizeof(s->path));
+    } else {
+        strcpy(s->method, "-");
+        strcpy(s->path, "-");
+    }
+    s->started = *started;
+}
+
+static void mdtp2_log(const mdtp_conn_t *conn, const mdtp2_stream_t *streams, int count) {
+    for (int i = 0; i < count; i++) {
+        const mdtp2_stream_t *s = &streams[i];
+        log_request(conn, s->method, s->path, s->status, s->length, &s->started);
+    }
+}
+
+
+/*
+ * Write a batch of responses. Every stream's HEADERS frame goes out first,
+ * then one DATA frame per unfinished stream per round, each round in a
+ * single writev(). Frees the bodies. Returns -1 on a write error.
+ */
+static int mdtp2_flush(mdtp_conn_t *conn, mdtp2_stream_t *streams, int count) {
+    unsigned char frame_headers[MDTP2_MAX_BATCH][MDTP2_FRAME_HEADER];
+    struct iovec iov[MDTP2_MAX_BATCH * 2];
+    int rc = 0;
+    int pending = count;
+    size_t total = 0;
+    TRACE_BEGIN(t_send);
+
+    for (int i = 0; i < count; i++) total += MDTP2_FRAME_HEADER * 2 + streams[i].head_len + streams[i].length;
+    conn_size_send_buffer(conn, total);
+
+    for (int i = 0; i < count; i++) {
+        mdtp2_stream_t *s = &streams[i];
+        mdtp2_put_header(frame_headers[i], s->head_len, MDTP2_HEADERS,
+                         s->length == 0 ? MDTP2_END_STREAM : 0, s->stream_id);
+        iov[i * 2] = (struct iovec){ frame_headers[i], MDTP2_FRAME_HEADER };
+        iov[i * 2 + 1] = (struct iovec){ s->head, s->head_len };
+        if (s->length == 0) pending--;
+    }
+    if (count > 0 && conn_writev(conn, iov, count * 2, 0) < 0) rc = -1;
+
+    while (rc == 0 && pending > 0) {
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            mdtp2_stream_t *s = &streams[i];
+            if (s->offset >= s->length) continue;
+
+            size_t chunk = s->length - s->offset;
+            if (chunk > MDTP2_MAX_FRAME) chunk = MDTP2_MAX_FRAME;
+            int last = s->offset + chunk == s->length;
+
+            mdtp2_put_header(frame_headers[i], chunk, MDTP2_DATA,
+                             last ? MDTP2_END_STREAM : 0, s->stream_id);
+            iov[n++] = (struct iovec){ frame_headers[i], MDTP2_FRAME_HEADER };
+            iov[n++] = (struct iovec){ s->body + s->offset, chunk };
+            s->offset += chunk;
+            if (last) pending--;
+        }
+        if (conn_writev(conn, iov, n, 0) < 0) rc = -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (streams[i].release) streams[i].release(streams[i].ref);
+        else if (streams[i].owned) free(streams[i].body);
+    }
+    TRACE_END(t_send, "send");
+    return rc;
+}
+
+
+static void mdtp2_send_goaway(int sock, uint32_t last_stream_id) {
+    unsigned char frame[MDTP2_FRAME_HEADER];
+    mdtp2_put_header(frame, 0, MDTP2_GOAWAY, 0, last_stream_id);
+    send(sock, frame, sizeof(frame), MSG_NOSIGNAL);
+}
+
+
+/* Switch a connection to framing; the upgrade request becomes stream 1. */
+static int mdtp2_upgrade(mdtp_conn_t *conn, const mdtp_request_t *req, const struct timespec *started) {
+    struct iovec iov = { (void *)MDTP2_SWITCHING, sizeof(MDTP2_SWITCHING) - 1 };
+    if (conn_writev(conn, &iov, 1, 0) < 0) return 0;
+    conn->protocol = 2;
+
+    if (strcmp(req->path, "*") != 0) {
+        mdtp_response_t resp;
+        mdtp2_stream_t *stream = malloc(sizeof(mdtp2_stream_t));
+        if (!stream) return 0;
+
+        serve_request(conn, req, &resp);
+        mdtp2_prepare(stream, 1, &resp);
+        mdtp2_note(stream, req, started);
+        int rc = mdtp2_flush(conn, stream, 1);
+        mdtp2_log(conn, stream, 1);
+        free(stream);
+        if (rc < 0) return 0;
+    }
+    return 1;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Change notifications
+ *
+ * "WATCH <path>" keeps the connection (or, over MDTP/2, the stream) open
+ * and sends one line per change:
+ *
+ *   <modified|created|deleted> <path>\n
+ *
+ * For a directory every entry directly inside it is reported; for a
+ * document only that document. Directories are what inotify watches, so
+ * editors that save by writing a new file and renaming it over the old one
+ * are still seen, and all watchers of documents in the same directory
+ * share one inotify watch. Events are queued like any other output; a
+ * watcher that falls WATCH_MAX_BACKLOG bytes behind is disconnected.
+ * ------------------------------------------------------------------------ */
+
+#define WATCH_MAX_BACKLOG 65536
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_MOVE_SELF)
+
+typedef struct mdtp_watcher {
+    mdtp_conn_t *conn;
+    uint32_t stream_id;         /* 0 on an MDTP/1.0 connection */
+    char path[MAX_PATH];        /* URL path of the watched directory or document */
+    char name[MAX_PATH];        /* document name within the directory, "" for all */
+    struct mdtp_watcher *next;
+} mdtp_watcher_t;
+
+typedef struct mdtp_watch {
+    int wd;
+    mdtp_watcher_t *watchers;
+    struct mdtp_watch *next;
+} mdtp_watch_t;
+
+static int g_inotify_fd = -1;
+static mdtp_watch_t *g_watches = NULL;
+
+/* epoll data.ptr for the inotify descriptor; never dereferenced. */
+static mdtp_conn_t g_inotify_marker;
+
+
+static void watch_notify(mdtp_watcher_t *w, const char *kind, const char *path, int last) {
+    unsigned char frame[MDTP2_FRAME_HEADER];
+    char line[MAX_PATH * 2 + 16];
+    int n = snprintf(line, sizeof(line), "%s %s\n", kind, path);
+    if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+
+    struct iovec iov[2] = { { frame, sizeof(frame) }, { line, n } };
+    if (w->stream_id) {
+        mdtp2_put_header(frame, n, MDTP2_DATA, last ? MDTP2_END_STREAM : 0, w->stream_id);
+    }
+
+    mdtp_conn_t *conn = w->conn;
+    if (conn->out_length - conn->out_offset > WATCH_MAX_BACKLOG ||
+        conn_writev(conn, w->stream_id ? iov : &iov[1], w->stream_id ? 2 : 1, 0) < 0) {
+        /* Too slow (or gone): the event loop sees the hangup and closes it. */
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+
+/*
+ * Register a watcher for req->path and send the response head. Returns
+ * MDTP_OK once the connection is streaming events; any other status means
+ * nothing was sent and the caller should answer with that error.
+ */
+mdtp_status_t watch_start(mdtp_conn_t *conn, const mdtp_request_t *req, uint32_t stream_id) {
+    mdtp_config_t *config = get_config();
+    char filepath[MAX_PATH * 3];
+    char dir[MAX_PATH * 3];
+    struct stat st;
+
+    if (g_inotify_fd < 0) return MDTP_INTERNAL_ERROR;
+    if (pack_loaded()) return MDTP_NOT_FOUND;      /* a pack only changes on reload */
+    if (!admit_request(conn)) return MDTP_TOO_MANY_REQUESTS;
+    if (req->path[0] != '/' || strstr(req->path, "..") || strlen(req->path) >= MAX_PATH) {
+        return MDTP_BAD_REQUEST;
+    }
+
+    snprintf(filepath, sizeof(filepath), "%s%s", config->root_dir, req->path);
+    if (stat(filepath, &st) < 0) return MDTP_NOT_FOUND;
+
+    mdtp_watcher_t *w = calloc(1, sizeof(mdtp_watcher_t));
+    if (!w) return MDTP_INTERNAL_ERROR;
+    w->conn = conn;
+    w->stream_id = stream_id;
+    snprintf(w->path, sizeof(w->path), "%s", req->path);
+
+    snprintf(dir, sizeof(dir), "%s", filepath);
+    if (!S_ISDIR(st.st_mode)) {
+        char *slash = strrchr(dir, '/');
+        snprintf(w->name, sizeof(w->name), "%s", slash + 1);
+        *slash = '\0';
+    } else {
+        size_t len = strlen(w->path);
+        if (len > 1 && w->path[len - 1] == '/') w->path[len - 1] = '\0';
+    }
+
+    /* The same directory always yields the same wd, so watches are shared. */
+    int wd = inotify_add_watch(g_inotify_fd, dir, WATCH_MASK);
+    if (wd < 0) {
+        log_message(LOG_WARNING, "WATCH %s: %s", req->path, strerror(errno));
+        free(w);
+        return MDTP_INTERNAL_ERROR;
+    }
+
+    mdtp_watch_t *watch = g_watches;
+    while (watch && watch->wd != wd) watch = watch->next;
+    if (!watch) {
+        watch = calloc(1, sizeof(mdtp_watch_t));
+        if (!watch) {
+            inotify_rm_watch(g_inotify_fd, wd);
+            free(w);
+            return MDTP_INTERNAL_ERROR;
+        }
+        watch->wd = wd;
+        watch->next = g_watches;
+        g_watches = watch;
+    }
+
+    char head[MAX_HEADER];
+    int n = snprintf(head, sizeof(head),
+        "%s 200 OK\r\n"
+        "Content-Type: application/x-mdtp-events\r\n"
+        "Date: %s\r\n"
+        "Server: MDTP-Server/1.0\r\n",
+        stream_id ? MDTP2_VERSION : MDTP_VERSION, cached_timestamp(NULL));
+
+    if (stream_id) {
+        unsigned char frame[MDTP2_FRAME_HEADER];
+        mdtp2_put_header(frame, n, MDTP2_HEADERS, 0, stream_id);
+        struct iovec iov[2] = { { frame, sizeof(frame) }, { head, n } };
+        conn_writev(conn, iov, 2, 0);
+    } else {
+        n += snprintf(head + n, sizeof(head) - n, "Connection: close\r\n\r\n");
+        struct iovec iov = { head, n };
+        conn_writev(conn, &iov, 1, 0);
+    }
+
+    w->next = watch->watchers;
+    watch->watchers = w;
+    conn->watching++;
+    return MDTP_OK;
+}
+
+
+/* Drop every watcher belonging to conn, and inotify watches left unused. */
+void watch_remove_conn(mdtp_conn_t *conn) {
+    mdtp_watch_t **wp = &g_watches;
+
+    while (*wp) {
+        mdtp_watch_t *watch = *wp;
+        mdtp_watcher_t **p = &watch->watchers;
+        while (*p) {
+            if ((*p)->conn == conn) {
+                mdtp_watcher_t *dead = *p;
+                *p = dead->next;
+                free(dead);
+            } else {
+                p = &(*p)->next;
+            }
+        }
+
+        if (!watch->watchers) {
+            inotify_rm_watch(g_inotify_fd, watch->wd);
+            *wp = watch->next;
+            free(watch);
+        } else {
+            wp = &watch->next;
+        }
+    }
+    conn->watching = 0;
+}
+
+
+/* Read pending inotify events and fan each one out to its watchers. */
+void watch_dispatch(void) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(g_inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) return;
+
+        for (char *p = buffer; p < buffer + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            mdtp_watch_t **wp = &g_watches;
+            while (*wp && (*wp)->wd != ev->wd) wp = &(*wp)->next;
+            mdtp_watch_t *watch = *wp;
+            if (!watch) continue;
+
+            /* A moved directory would report stale paths; dropping the watch yields IN_IGNORED. */
+            if (ev->mask & IN_MOVE_SELF) {
+                inotify_rm_watch(g_inotify_fd, watch->wd);
+                continue;
+            }
+
+            /* The directory is gone: tell its watchers, end their streams and forget it. */
+            if (ev->mask & IN_IGNORED) {
+                while (watch->watchers) {
+                    mdtp_watcher_t *w = watch->watchers;
+                    watch->watchers = w->next;
+                    watch_notify(w, "deleted", w->path, 1);
+                    w->conn->watching--;
+                    if (!w->stream_id) {
+                        if (conn_pending(w->conn)) w->conn->closing = 1;
+                        else shutdown(w->conn->fd, SHUT_RDWR);
+                    }
+                    free(w);
+                }
+                *wp = watch->next;
+                free(watch);
+                continue;
+            }
+
+            const char *kind = "modified";
+            if (ev->mask & IN_CREATE) kind = "created";
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) kind = "deleted";
+            if (!ev->len) continue;
+
+            for (mdtp_watcher_t *w = watch->watchers; w; w = w->next) {
+                if (w->name[0]) {
+                    if (strcmp(w->name, ev->name) == 0) watch_notify(w, kind, w->path, 0);
+                } else {
+                    char path[MAX_PATH * 2];
+                    snprintf(path, sizeof(path), "%s/%s", strcmp(w->path, "/") ? w->path : "", ev->name);
+                    watch_notify(w, kind, path, 0);
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ * Answer every complete frame buffered on an MDTP/2 connection. Returns -1
+ * when the connection should be closed once its output is written.
+ */
+static int mdtp2_handle_frames(mdtp_conn_t *conn) {
+    mdtp2_stream_t *batch = malloc(sizeof(mdtp2_stream_t) * MDTP2_MAX_BATCH);
+    if (!batch) return -1;
+
+    int count = 0;
+    int closing = 0;
+    size_t pos = 0;
+    uint32_t last_stream_id = conn->last_stream_id;     /* ids only grow, across reads too */
+
+    while (!closing && conn->length - pos >= MDTP2_FRAME_HEADER) {
+        size_t length;
+        int type, flags;
+        uint32_t stream_id;
+        mdtp2_get_header((unsigned char *)conn->buffer + pos, &length, &type, &flags, &stream_id);
+
+        /* Requests are small; a frame larger than max_request_size is an error. */
+        if (length + MDTP2_FRAME_HEADER >= conn_request_limit()) {
+            closing = 1;
+            break;
+        }
+        if (conn->length - pos < MDTP2_FRAME_HEADER + length) break;
+
+        char *payload = conn->buffer + pos + MDTP2_FRAME_HEADER;
+        pos += MDTP2_FRAME_HEADER + length;
+
+        if (type == MDTP2_GOAWAY) {
+            closing = 1;
+        } else if (type == MDTP2_HEADERS) {
+            if (stream_id == 0 || !(stream_id & 1) || stream_id <= last_stream_id) {
+                closing = 1;
+                break;
+            }
+            last_stream_id = stream_id;
+
+            /* Parsed in place: the byte after the payload is borrowed for the terminator. */
+            char next = payload[length];
+            payload[length] = '\0';
+
+            struct timespec started;
+            clock_gettime(CLOCK_MONOTONIC, &started);
+
+            mdtp_request_t req;
+            mdtp_response_t resp;
+            int parsed = parse_request(payload, &req) == 0;
+            payload[length] = next;
+            if (!parsed) {
+                init_response(&resp, MDTP_BAD_REQUEST, 0);
+            } else if (strcmp(req.method, "WATCH") == 0) {
+                mdtp_status_t status = watch_start(conn, &req, stream_id);
+                if (status == MDTP_OK) {
+                    log_request(conn, req.method, req.path, status, 0, &started);
+                    continue;
+                }
+                init_response(&resp, status, 0);
+            } else {
+                serve_request(conn, &req, &resp);
+            }
+            mdtp2_prepare(&batch[count], stream_id, &resp);
+            mdtp2_note(&batch[count++], parsed ? &req : NULL, &started);
+
+            if (count == MDTP2_MAX_BATCH) {
+                if (mdtp2_flush(conn, batch, count) < 0) closing = 1;
+                mdtp2_log(conn, batch, count);
+                count = 0;
+            }
+        }
+        /* Unknown frame types are ignored. */
+    }
+
+    if (mdtp2_flush(conn, batch, count) < 0) closing = 1;
+    mdtp2_log(conn, batch, count);
+    free(batch);
+
+    memmove(conn->buffer, conn->buffer + pos, conn->length - pos + 1);
+    conn->length -= pos;
+    conn->last_stream_id = last_stream_id;
+
+    if (closing || g_draining) {
+        unsigned char frame[MDTP2_FRAME_HEADER];
+        struct iovec iov = { frame, sizeof(frame) };
+        mdtp2_put_header(frame, 0, MDTP2_GOAWAY, 0, conn->last_stream_id);
+        conn_writev(conn, &iov, 1, 0);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Answer one complete request (headers up to and including the blank
+ * line). Returns 1 if the connection should stay open for another request.
+ */
+int handle_request(mdtp_conn_t *conn, const char *raw_request) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    mdtp_request_t req;
+    TRACE_BEGIN(t_parse);
+    int parsed = parse_request(raw_request, &req);
+    TRACE_END(t_parse, "parse");
+    if (parsed < 0) {
+        size_t bytes = send_error_response(conn, MDTP_BAD_REQUEST, 0);
+        log_request(conn, "-", "-", MDTP_BAD_REQUEST, bytes, &started);
+        return 0;
+    }
+
+    /* While draining for an upgrade, every response closes its connection. */
+    if (g_draining) req.keep_alive = 0;
+    else if (strcmp(req.version, MDTP2_VERSION) == 0 && !g_proxy) return mdtp2_upgrade(conn, &req, &started);
+
+    if (g_proxy && strcmp(req.path, "/_status") != 0) return proxy_forward(conn, &req, raw_request, &started);
+
+    if (strcmp(req.method, "WATCH") == 0) {
+        mdtp_status_t status = watch_start(conn, &req, 0);
+        size_t bytes = status == MDTP_OK ? 0 : send_error_response(conn, status, req.keep_alive);
+        log_request(conn, req.method, req.path, status, bytes, &started);
+        return status == MDTP_OK ? 1 : req.keep_alive;
+    }
+
+    mdtp_response_t resp;
+    TRACE_BEGIN(t_dispatch);
+    serve_request(conn, &req, &resp);
+    TRACE_END(t_dispatch, "dispatch");
+
+    if (!resp.body && resp.fd < 0) {
+        size_t bytes = send_error_response(conn, resp.status, req.keep_alive);
+        log_request(conn, req.method, req.path, resp.status, bytes, &started);
+        return req.keep_alive;
+    }
+
+    TRACE_BEGIN(t_send);
+    int sent = send_response(conn, &resp);
+    TRACE_END(t_send, "send");
+    log_request(conn, req.method, req.path, sent < 0 ? MDTP_INTERNAL_ERROR : resp.status,
+                resp.content_length, &started);
+    if (sent < 0) {
+        return 0;
+    }
+    return req.keep_alive;
+}
+
+
+/*
+ * Answer the complete requests buffered on a connection, stopping while a
+ * response is still being written. Returns -1 when the connection should
+ * be closed now.
+ */
+static int process_requests(mdtp_conn_t *conn) {
+    int answered = 0;
+    int keep_alive = 1;
+    char *end;
+
+    while (conn->protocol == 1 && !conn_pending(conn) && !conn->proxied &&
+           (end = strstr(conn->buffer, "\r\n\r\n")) != NULL) {
+        size_t request_len = end + 4 - conn->buffer;
+        char next = conn->buffer[request_len];
+
+        conn->buffer[request_len] = '\0';
+        TRACE_BEGIN(t_request);
+        keep_alive = handle_request(conn, conn->buffer);
+        TRACE_END(t_request, "request");
+        conn->buffer[request_len] = next;
+
+        memmove(conn->buffer, conn->buffer + request_len, conn->length - request_len + 1);
+        conn->length -= request_len;
+        answered = 1;
+
+        if (!keep_alive) break;
+    }
+
+    if (keep_alive && conn->protocol == 2 && !conn_pending(conn)) {
+        size_t buffered = conn->length;
+        keep_alive = mdtp2_handle_frames(conn) == 0;
+        answered = conn->length < buffered;
+    }
+
+    if (keep_alive && conn->protocol == 1 && !conn_pending(conn) && !conn->proxied &&
+        conn->length + 1 >= conn_request_limit()) {
+        send_error_response(conn, MDTP_BAD_REQUEST, 0);
+        keep_alive = 0;
+    }
+
+    if (!keep_alive) {
+        if (!conn_pending(conn)) return -1;
+        conn->closing = 1;
+        return 0;
+    }
+
+    /* A new read deadline starts only once a whole request has been answered. */
+    if (answered && !conn_pending(conn)) conn_touch(conn);
+    return 0;
+}
+
+
+/*
+ * Read what is available on a connection and answer every complete
+ * request buffered so far. Returns -1 when the connection should be closed.
+ */
+int handle_client(mdtp_conn_t *conn) {
+    size_t room = conn_reserve(conn);
+    if (room == 0) return -1;
+
+    TRACE_BEGIN(t_recv);
+    ssize_t bytes_read = recv(conn->fd, conn->buffer + conn->length, room, 0);
+    TRACE_END(t_recv, "recv");
+    
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (bytes_read <= 0) {
+        return -1;
+    }
+    
+    conn->length += bytes_read;
+    conn->buffer[conn->length] = '\0';
+
+    /* An MDTP/1.0 WATCH connection only carries events from here on. */
+    if (conn->protocol == 1 && conn->watching) {
+        conn->length = 0;
+        return 0;
+    }
+
+    return process_requests(conn);
+}
+
+
+/*
+ * The socket of a connection with pending output became writable: write
+ * more, and once it has all gone out, go back to the requests already
+ * buffered. Returns -1 when the connection should be closed.
+ */
+int resume_client(mdtp_conn_t *conn) {
+    int rc = conn_flush(conn);
+    if (rc < 0) return -1;
+
+    conn_touch(conn);
+    if (rc > 0) return 0;
+    if (conn->closing) return -1;
+
+    conn_want_write(conn, 0);
+    return process_requests(conn);
+}
+
+
+void close_conn(int epoll_fd, mdtp_conn_t *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->watching) watch_remove_conn(conn);
+    if (conn->proxied) proxy_abort(conn->proxied);
+    if (conn->file_fd >= 0) close(conn->file_fd);
+    timer_cancel(&g_timers, &conn->timer);
+    free(conn->out);
+    free(conn->buffer);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else g_connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    g_open_connections--;
+
+    free(conn);
+}
+
+/* Deadline expiry callback for g_timers; arg is the epoll descriptor. */
+static void conn_expired(timer_entry_t *entry, void *arg) {
+    mdtp_conn_t *conn = (mdtp_conn_t *)((char *)entry - offsetof(mdtp_conn_t, timer));
+
+    log_message(LOG_DEBUG, "%s: %s timeout, closing", conn->peer, conn_pending(conn) ? "write" : "read");
+    g_connections_timed_out++;
+    close_conn(*(int *)arg, conn);
+}
+
+
+/* ------------------------------------------------------------------------
+ * Proxy mode
+ *
+ * "mdtp proxy" runs this event loop without serving root_dir itself: every
+ * request except /_status is forwarded to one of a pool of backend
+ * servers. The backend is chosen by hashing the path (up to any '#')
+ * onto a consistent-hash ring (helpers/proxy.c), so a document is always
+ * served, and cached, by the same backend, and adding or removing one only
+ * moves the paths it owns.
+ *
+ * Upstream connections are non-blocking and stay open between requests,
+ * up to PROXY_IDLE_MAX idle ones per backend. They are watched on their
+ * own epoll set, which sits in the main one like the inotify descriptor.
+ * While its request is upstream a client connection reads no further
+ * requests; the response is then re-sent to it with its own Connection
+ * header. A request that fails before any of its response has arrived is
+ * retried on the next backend along the ring, or on a fresh connection if
+ * a pooled one had been closed by the backend. A backend that fails
+ * PROXY_FAIL_LIMIT times in a row leaves the ring until a health check
+ * (GET /_status every health_interval seconds) succeeds.
+ *
+ * WATCH is tunnelled over a dedicated upstream connection, and MDTP/2
+ * upgrades are declined so clients fall back to MDTP/1.0. Responses to
+ * requests without Delta-Base may be served from a local cache for
+ * proxy_cache_ttl seconds (proxy_cache_size bytes, 0 = off).
+ * ------------------------------------------------------------------------ */
+
+#define PROXY_HOST_MAX 64
+#define PROXY_IDLE_MAX 32
+#define PROXY_FAIL_LIMIT 3
+#define PROXY_MAX_ATTEMPTS 3
+#define PROXY_BUFFER_MIN 16384
+#define PROXY_MAX_RESPONSE (MGET_MAX_BYTES + 2 * MAX_HEADER)
+
+/* Shared with the client, further down. */
+int find_header(const char *headers, const char *name, char *value, size_t value_size);
+
+static const char PROXY_HEALTH_REQUEST[] = "GET /_status MDTP/1.0\r\nConnection: close\r\n\r\n";
+static const char PROXY_KEEP_ALIVE[] = "Connection: keep-alive\r\n\r\n";
+
+typedef enum { UP_CONNECTING, UP_SENDING, UP_READING, UP_TUNNEL, UP_IDLE } upstream_state_t;
+
+typedef struct proxy_backend {
+    char name[PROXY_HOST_MAX + 6];  /* host:port, the port up to ":65535" */
+    struct sockaddr_in addr;
+    int healthy;
+    int failures;               /* in a row */
+    int checking;               /* a health check is in flight */
+    time_t next_check;
+    long requests;
+    long errors;
+    struct proxy_upstream *idle;
+    int idle_count;
+} proxy_backend_t;
+
+typedef struct proxy_upstream {
+    int fd;
+    proxy_backend_t *backend;
+    upstream_state_t state;
+    int reused;                 /* taken from the idle pool */
+    struct proxy_request *req;  /* NULL for a health check or while idle */
+    const char *request;
+    size_t request_length;
+    size_t request_sent;
+    char *buffer;               /* response so far */
+    size_t length;
+    size_t capacity;
+    size_t header_length;       /* 0 until the blank line has arrived */
+    long long content_length;   /* -1: until EOF */
+    timer_entry_t timer;
+    struct proxy_upstream *next;    /* idle list */
+} proxy_upstream_t;
+
+typedef struct proxy_request {
+    mdtp_conn_t *client;
+    proxy_upstream_t *upstream;
+    char method[16];
+    char path[MAX_HEADER];
+    char *raw;                  /* the request as sent upstream */
+    size_t raw_length;
+    char cache_key[MAX_HEADER + 32];    /* empty: not cacheable */
+    uint64_t hash;
+    uint64_t tried;             /* backends that failed this request */
+    int attempts;
+    int keep_alive;
+    int tunnel;
+    struct timespec started;
+} proxy_request_t;
+
+static proxy_backend_t g_backends[PROXY_MAX_BACKENDS];
+static int g_backend_count = 0;
+static proxy_ring_t g_ring;
+static int g_proxy_epoll_fd = -1;
+static mdtp_conn_t g_proxy_marker;
+
+/* Deadlines of upstream exchanges and health checks. */
+static timer_wheel_t g_upstream_timers;
+
+
+/* Add a "host:port" backend. Returns 0, or -1 if it cannot be parsed. */
+int proxy_add_backend(const char *spec) {
+    char host[PROXY_HOST_MAX];
+    int port;
+
+    if (g_backend_count >= PROXY_MAX_BACKENDS) return -1;
+    if (sscanf(spec, " %63[^: ]:%d", host, &port) != 2 || port <= 0 || port > 65535) return -1;
+
+    proxy_backend_t *b = &g_backends[g_backend_count];
+    memset(b, 0, sizeof(*b));
+    b->addr.sin_family = AF_INET;
+    b->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &b->addr.sin_addr) <= 0) return -1;
+    snprintf(b->name, sizeof(b->name), "%s:%d", host, port);
+    b->healthy = 1;
+    g_backend_count++;
+    return 0;
+}
+
+
+static int proxy_add_backends(const char *list) {
+    char copy[sizeof(((mdtp_config_t *)0)->backends)];
+    char *saveptr;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char *p = strtok_r(copy, ",", &saveptr); p; p = strtok_r(NULL, ",", &saveptr)) {
+        if (proxy_add_backend(p) < 0) {
+            fprintf(stderr, "[MDTP] Invalid backend: %s\n", p);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static uint64_t proxy_down_mask(void) {
+    uint64_t mask = 0;
+    for (int i = 0; i < g_backend_count; i++) {
+        if (!g_backends[i].healthy) mask |= 1ull << i;
+    }
+    return mask;
+}
+
+
+static void upstream_watch(proxy_upstream_t *up, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = up };
+    epoll_ctl(g_proxy_epoll_fd, EPOLL_CTL_MOD, up->fd, &ev);
+}
+
+
+static void upstream_close(proxy_upstream_t *up) {
+    epoll_ctl(g_proxy_epoll_fd, EPOLL_CTL_DEL, up->fd, NULL);
+    close(up->fd);
+    timer_cancel(&g_upstream_timers, &up->timer);
+    free(up->buffer);
+    free(up);
+}
+
+
+static void backend_drop_idle(proxy_backend_t *b) {
+    while (b->idle) {
+        proxy_upstream_t *up = b->idle;
+        b->idle = up->next;
+        upstream_close(up);
+    }
+    b->idle_count = 0;
+}
+
+
+static void backend_failed(proxy_backend_t *b, const char *why) {
+    b->errors++;
+    if (++b->failures >= PROXY_FAIL_LIMIT && b->healthy) {
+        b->healthy = 0;
+        backend_drop_idle(b);
+        log_message(LOG_WARNING, "Backend %s is down: %s", b->name, why);
+    }
+}
+
+
+static void backend_ok(proxy_backend_t *b) {
+    b->failures = 0;
+    if (!b->healthy) {
+        b->healthy = 1;
+        log_message(LOG_INFO, "Backend %s is up", b->name);
+    }
+}
+
+
+/* Start a non-blocking connection to b; it reports writable once established. */
+static proxy_upstream_t* upstream_open(proxy_backend_t *b) {
+    proxy_upstream_t *up = calloc(1, sizeof(proxy_upstream_t));
+    if (!up) return NULL;
+
+    up->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (up->fd < 0) {
+        free(up);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(up->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = up };
+    if ((connect(up->fd, (struct sockaddr *)&b->addr, sizeof(b->addr)) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(g_proxy_epoll_fd, EPOLL_CTL_ADD, up->fd, &ev) < 0) {
+        close(up->fd);
+        free(up);
+        return NULL;
+    }
+    up->backend = b;
+    up->state = UP_CONNECTING;
+    return up;
+}
+
+
+/* Begin sending request on up; the rest happens as the socket reports writable. */
+static void upstream_begin(proxy_upstream_t *up, const char *request, size_t length, int seconds) {
+    up->request = request;
+    up->request_length = length;
+    up->request_sent = 0;
+    up->length = 0;
+    up->header_length = 0;
+    up->content_length = -1;
+    if (up->state == UP_IDLE) {
+        up->state = UP_SENDING;
+        upstream_watch(up, EPOLLOUT);
+    }
+    if (seconds > 0) timer_arm(&g_upstream_timers, &up->timer, time(NULL) + seconds);
+}
+
+
+/* Put a finished connection back in its backend's idle pool, or close it. */
+static void upstream_release(proxy_upstream_t *up) {
+    proxy_backend_t *b = up->backend;
+
+    if (b->idle_count >= PROXY_IDLE_MAX || !b->healthy) {
+        upstream_close(up);
+        return;
+    }
+    timer_cancel(&g_upstream_timers, &up->timer);
+    up->req = NULL;
+    up->state = UP_IDLE;
+    if (up->capacity > PROXY_BUFFER_MIN) {
+        free(up->buffer);
+        up->buffer = NULL;
+        up->capacity = 0;
+    }
+    upstream_watch(up, EPOLLIN | EPOLLRDHUP);
+    up->next = b->idle;
+    b->idle = up;
+    b->idle_count++;
+}
+
+
+static void proxy_request_free(proxy_request_t *pr) {
+    free(pr->raw);
+    free(pr);
+}
+
+
+/* The client went away (or timed out) while its request was upstream. */
+static void proxy_abort(proxy_request_t *pr) {
+    if (pr->upstream) upstream_close(pr->upstream);
+    pr->client->proxied = NULL;
+    proxy_request_free(pr);
+}
+
+
+/* End a client connection from outside its own event, as watch_dispatch() does. */
+static void proxy_hang_up(mdtp_conn_t *conn) {
+    if (conn_pending(conn)) conn->closing = 1;
+    else shutdown(conn->fd, SHUT_RDWR);
+}
+
+
+/* Carry on with a client whose proxied request has been answered. */
+static void proxy_resume(mdtp_conn_t *conn, int keep_alive) {
+    if (!keep_alive) {
+        proxy_hang_up(conn);
+        return;
+    }
+
+    conn_touch(conn);
+    if (!conn_pending(conn) && process_requests(conn) < 0) proxy_hang_up(conn);
+}
+
+
+static void proxy_reply_error(proxy_request_t *pr, mdtp_status_t status) {
+    mdtp_conn_t *conn = pr->client;
+    int keep_alive = pr->keep_alive;
+
+    conn->proxied = NULL;
+    size_t bytes = send_error_response(conn, status, keep_alive);
+    log_request(conn, pr->method, pr->path, status, bytes, &pr->started);
+    proxy_request_free(pr);
+    proxy_resume(conn, keep_alive);
+}
+
+
+static void proxy_reply(proxy_request_t *pr, mdtp_response_t *resp) {
+    mdtp_conn_t *conn = pr->client;
+
+    conn->proxied = NULL;
+    resp->keep_alive = pr->keep_alive;
+    int sent = send_response(conn, resp);
+    log_request(conn, pr->method, pr->path, sent < 0 ? MDTP_INTERNAL_ERROR : (int)resp->status,
+                resp->content_length, &pr->started);
+    int keep_alive = sent == 0 && pr->keep_alive;
+    proxy_request_free(pr);
+    proxy_resume(conn, keep_alive);
+}
+
+
+/*
+ * Send pr to the first backend along the ring that is up and has not
+ * failed it yet. Returns -1 if there is none left.
+ */
+static int proxy_send(proxy_request_t *pr) {
+    mdtp_config_t *config = get_config();
+
+    while (pr->attempts < PROXY_MAX_ATTEMPTS) {
+        int index = proxy_ring_lookup(&g_ring, pr->hash, pr->tried | proxy_down_mask());
+        if (index < 0) return -1;
+
+        proxy_backend_t *b = &g_backends[index];
+        proxy_upstream_t *up = NULL;
+        if (b->idle && !pr->tunnel) {
+            up = b->idle;
+            b->idle = up->next;
+            b->idle_count--;
+            up->reused = 1;
+        } else if (!(up = upstream_open(b))) {
+            backend_failed(b, strerror(errno));
+            pr->tried |= 1ull << index;
+            pr->attempts++;
+            continue;
+        }
+
+        b->requests++;
+        pr->attempts++;
+        pr->upstream = up;
+        up->req = pr;
+        upstream_begin(up, pr->raw, pr->raw_length, pr->tunnel ? 0 : config->timeout_seconds);
+        return 0;
+    }
+    return -1;
+}
+
+
+/*
+ * An exchange failed. A request nothing has come back for is tried again
+ * elsewhere (retry), the client is told 503 otherwise.
+ */
+static void upstream_failed(proxy_upstream_t *up, const char *why, int retry) {
+    proxy_request_t *pr = up->req;
+    proxy_backend_t *b = up->backend;
+    int index = (int)(b - g_backends);
+    int untouched = up->length == 0 && up->state != UP_TUNNEL;
+
+    /* A pooled connection the backend closed while idle: so are its siblings, likely. */
+    int stale = up->reused && untouched && up->state != UP_CONNECTING;
+
+    upstream_close(up);
+    if (stale) {
+        backend_drop_idle(b);
+    } else {
+        backend_failed(b, why);
+    }
+
+    if (!pr) {
+        b->checking = 0;
+        return;
+    }
+    pr->upstream = NULL;
+    if (!stale) pr->tried |= 1ull << index;
+    if (retry && untouched && proxy_send(pr) == 0) return;
+
+    if (pr->tunnel && !untouched) {
+        /* The stream was already flowing: end it as the backend did. */
+        mdtp_conn_t *conn = pr->client;
+        conn->proxied = NULL;
+        proxy_request_free(pr);
+        proxy_resume(conn, 0);
+        return;
+    }
+    log_message(LOG_DEBUG, "%s %s: no backend answered (%s)", pr->method, pr->path, why);
+    proxy_reply_error(pr, MDTP_SERVICE_UNAVAILABLE);
+}
+
+
+/* Turn a complete upstream response into a response for the client. */
+static void upstream_parse(const proxy_upstream_t *up, mdtp_response_t *resp) {
+    const char *head = up->buffer;
+    const char *body = up->buffer + up->header_length;
+    const char *status = strchr(head, ' ');
+
+    init_response(resp, status ? (mdtp_status_t)atoi(status + 1) : MDTP_INTERNAL_ERROR, 0);
+    find_header(head, "Content-Type", resp->content_type, sizeof(resp->content_type));
+    resp->content_length = up->length - up->header_length;
+
+    /* Keep every header the server does not write itself. */
+    size_t n = 0;
+    for (const char *line = strstr(head, "\r\n") + 2; line < body - 2; line = strstr(line, "\r\n") + 2) {
+        size_t len = strcspn(line, "\r\n");
+        if (strncasecmp(line, "Content-Type:", 13) == 0 || strncasecmp(line, "Content-Length:", 15) == 0 ||
+            strncasecmp(line, "Date:", 5) == 0 || strncasecmp(line, "Server:", 7) == 0 ||
+            strncasecmp(line, "Connection:", 11) == 0 || n + len + 3 > sizeof(resp->headers)) {
+            continue;
+        }
+        memcpy(resp->headers + n, line, len);
+        memcpy(resp->headers + n + len, "\r\n", 3);
+        n += len + 2;
+    }
+
+    resp->body = malloc(resp->content_length + 1);
+    if (resp->body) {
+        memcpy(resp->body, body, resp->content_length);
+        resp->body[resp->content_length] = '\0';
+    }
+}
+
+
+/* The whole response is in up->buffer. */
+static void upstream_done(proxy_upstream_t *up) {
+    proxy_request_t *pr = up->req;
+    proxy_backend_t *b = up->backend;
+    char connection[32] = "";
+    mdtp_response_t resp;
+
+    find_header(up->buffer, "Connection", connection, sizeof(connection));
+    int reusable = up->content_length >= 0 && strcasecmp(connection, "keep-alive") == 0 &&
+                   up->length == up->header_length + (size_t)up->content_length;
+    upstream_parse(up, &resp);
+
+    if (!pr) {
+        /* Health check: anything short of a server error will do. */
+        if (resp.status < 500) backend_ok(b);
+        else backend_failed(b, "health check failed");
+        b->checking = 0;
+        free(resp.body);
+        upstream_close(up);
+        return;
+    }
+
+    if (resp.status < 500) backend_ok(b);
+    else backend_failed(b, "server error");
+
+    pr->upstream = NULL;
+    if (reusable) upstream_release(up);
+    else upstream_close(up);
+
+    if (!resp.body) {
+        proxy_reply_error(pr, MDTP_INTERNAL_ERROR);
+        return;
+    }
+    if (pr->cache_key[0] && resp.status == MDTP_OK) {
+        proxy_response_t cached = { .status = resp.status, .body = resp.body, .length = resp.content_length };
+        snprintf(cached.content_type, sizeof(cached.content_type), "%s", resp.content_type);
+        snprintf(cached.headers, sizeof(cached.headers), "%s", resp.headers);
+        proxy_cache_put(pr->cache_key, &cached);
+    }
+    proxy_reply(pr, &resp);
+}
+
+
+/* A WATCH stream: pass whatever arrives straight on to the client. */
+static void upstream_tunnel(proxy_upstream_t *up) {
+    proxy_request_t *pr = up->req;
+    mdtp_conn_t *conn = pr->client;
+
+    if (up->state != UP_TUNNEL) {
+        const char *status = strchr(up->buffer, ' ');
+        up->state = UP_TUNNEL;
+        conn->watching = 1;
+        backend_ok(up->backend);
+        log_request(conn, pr->method, pr->path, status ? atoi(status + 1) : 0, 0, &pr->started);
+    }
+
+    struct iovec iov = { up->buffer, up->length };
+    int rc = conn_writev(conn, &iov, 1, 0);
+    up->length = 0;
+    if (rc < 0 || conn->out_length - conn->out_offset > WATCH_MAX_BACKLOG) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+
+static int upstream_reserve(proxy_upstream_t *up) {
+    if (up->capacity - up->length > 1) return 0;
+
+    size_t capacity = up->capacity ? up->capacity * 2 : PROXY_BUFFER_MIN;
+    if (up->header_length && up->content_length >= 0 &&
+        capacity < up->header_length + (size_t)up->content_length + 1) {
+        capacity = up->header_length + up->content_length + 1;
+    }
+    if (capacity > PROXY_MAX_RESPONSE) return -1;
+
+    char *buffer = realloc(up->buffer, capacity);
+    if (!buffer) return -1;
+    up->buffer = buffer;
+    up->capacity = capacity;
+    return 0;
+}
+
+
+/* Read what the backend has sent; finish the exchange once it is complete. */
+static void upstream_read(proxy_upstream_t *up) {
+    while (1) {
+        if (upstream_reserve(up) < 0) {
+            upstream_failed(up, "response too large", 0);
+            return;
+        }
+
+        ssize_t n = recv(up->fd, up->buffer + up->length, up->capacity - 1 - up->length, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+        if (n <= 0) {
+            if (n == 0 && up->header_length && up->content_length < 0) upstream_done(up);
+            else upstream_failed(up, n == 0 ? "connection closed" : strerror(errno), 1);
+            return;
+        }
+
+        size_t searched = up->length > 3 ? up->length - 3 : 0;
+        up->length += n;
+        up->buffer[up->length] = '\0';
+
+        if (up->req && up->req->tunnel) {
+            upstream_tunnel(up);
+            return;
+        }
+
+        if (!up->header_length) {
+            char *end = strstr(up->buffer + searched, "\r\n\r\n");
+            if (!end) continue;
+            up->header_length = end + 4 - up->buffer;
+
+            char value[32];
+            if (find_header(up->buffer, "Content-Length", value, sizeof(value)) == 0) {
+                up->content_length = strtoll(value, NULL, 10);
+            }
+        }
+        if (up->content_length >= 0 && up->length >= up->header_length + (size_t)up->content_length) {
+            upstream_done(up);
+            return;
+        }
+    }
+}
+
+
+static void upstream_event(proxy_upstream_t *up) {
+    if (up->state == UP_IDLE) {
+        /* Idle connections only ever hear from a backend that is closing them. */
+        proxy_backend_t *b = up->backend;
+        proxy_upstream_t **p = &b->idle;
+        while (*p != up) p = &(*p)->next;
+        *p = up->next;
+        b->idle_count--;
+        upstream_close(up);
+        return;
+    }
+
+    if (up->state == UP_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(up->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+            upstream_failed(up, strerror(error ? error : errno), 1);
+            return;
+        }
+        up->state = UP_SENDING;
+    }
+
+    if (up->state == UP_SENDING) {
+        while (up->request_sent < up->request_length) {
+            ssize_t n = send(up->fd, up->request + up->request_sent,
+                             up->request_length - up->request_sent, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+            if (n <= 0) {
+                upstream_failed(up, strerror(errno), 1);
+                return;
+            }
+            up->request_sent += n;
+        }
+        up->state = UP_READING;
+        upstream_watch(up, EPOLLIN);
+        return;
+    }
+
+    upstream_read(up);
+}
+
+
+/*
+ * Readable proxy epoll set: handle every upstream event that is ready.
+ * Events are taken one at a time because handling one may close other
+ * upstream connections (a backend's idle pool, a reused connection).
+ */
+static void proxy_dispatch(void) {
+    struct epoll_event ev;
+
+    while (epoll_wait(g_proxy_epoll_fd, &ev, 1, 0) == 1) {
+        upstream_event(ev.data.ptr);
+    }
+}
+
+
+static void upstream_expired(timer_entry_t *entry, void *arg) {
+    proxy_upstream_t *up = (proxy_upstream_t *)((char *)entry - offsetof(proxy_upstream_t, timer));
+    (void)arg;
+    upstream_failed(up, "timeout", 0);
+}
+
+
+/* Expire upstream deadlines and start any health checks that are due. */
+static void proxy_tick(void) {
+    mdtp_config_t *config = get_config();
+    time_t now = time(NULL);
+
+    timer_expire(&g_upstream_timers, now, upstream_expired, NULL);
+    if (config->health_interval <= 0) return;
+
+    for (int i = 0; i < g_backend_count; i++) {
+        proxy_backend_t *b = &g_backends[i];
+        if (b->checking || now < b->next_check) continue;
+
+        b->next_check = now + config->health_interval;
+        proxy_upstream_t *up = upstream_open(b);
+        if (!up) {
+            backend_failed(b, strerror(errno));
+            continue;
+        }
+        b->checking = 1;
+        upstream_begin(up, PROXY_HEALTH_REQUEST, sizeof(PROXY_HEALTH_REQUEST) - 1, config->health_interval);
+    }
+}
+
+
+/*
+ * Forward a parsed request (raw_request is its text) for conn. Returns
+ * like handle_request(); while the request is upstream conn->proxied is
+ * set and the connection reads no further requests.
+ */
+static int proxy_forward(mdtp_conn_t *conn, const mdtp_request_t *req, const char *raw_request,
+                         const struct timespec *started) {
+    if (strcmp(req->version, MDTP2_VERSION) == 0) {
+        size_t bytes = send_error_response(conn, MDTP_BAD_REQUEST, 0);
+        log_request(conn, req->method, req->path, MDTP_BAD_REQUEST, bytes, started);
+        return 0;
+    }
+    if (!admit_request(conn)) {
+        size_t bytes = send_error_response(conn, MDTP_TOO_MANY_REQUESTS, req->keep_alive);
+        log_request(conn, req->method, req->path, MDTP_TOO_MANY_REQUESTS, bytes, started);
+        return req->keep_alive;
+    }
+
+    proxy_request_t *pr = calloc(1, sizeof(proxy_request_t));
+    if (!pr) {
+        send_error_response(conn, MDTP_INTERNAL_ERROR, 0);
+        return 0;
+    }
+    pr->client = conn;
+    pr->keep_alive = req->keep_alive;
+    pr->tunnel = strcmp(req->method, "WATCH") == 0;
+    pr->started = *started;
+    snprintf(pr->method, sizeof(pr->method), "%s", req->method);
+    snprintf(pr->path, sizeof(pr->path), "%s", req->path);
+    pr->hash = delta_hash(req->path, strcspn(req->path, "#"));
+
+    if (!pr->tunnel && req->delta_base == 0) {
+        snprintf(pr->cache_key, sizeof(pr->cache_key), "%s %s%s",
+                 req->method, req->path, req->accept_deflate ? " deflate" : "");
+
+        proxy_response_t cached;
+        if (proxy_cache_get(pr->cache_key, &cached) == 0) {
+            mdtp_response_t resp;
+            init_response(&resp, (mdtp_status_t)cached.status, req->keep_alive);
+            snprintf(resp.content_type, sizeof(resp.content_type), "%s", cached.content_type);
+            snprintf(resp.headers, sizeof(resp.headers), "%s", cached.headers);
+            resp.body = cached.body;
+            resp.content_length = cached.length;
+            int sent = send_response(conn, &resp);
+            log_request(conn, req->method, req->path, sent < 0 ? MDTP_INTERNAL_ERROR : cached.status,
+                        cached.length, started);
+            proxy_request_free(pr);
+            return sent == 0 && req->keep_alive;
+        }
+    }
+
+    /* Upstream connections are kept open, whatever the client asked for. */
+    size_t raw_len = strlen(raw_request);
+    pr->raw = malloc(raw_len + sizeof(PROXY_KEEP_ALIVE));
+    if (!pr->raw) {
+        proxy_request_free(pr);
+        send_error_response(conn, MDTP_INTERNAL_ERROR, 0);
+        return 0;
+    }
+    if (pr->tunnel) {
+        memcpy(pr->raw, raw_request, raw_len);
+        pr->raw_length = raw_len;
+    } else {
+        for (const char *line = raw_request; *line && strncmp(line, "\r\n", 2) != 0; ) {
+            size_t len = strcspn(line, "\n") + 1;
+            if (strncasecmp(line, "Connection:", 11) != 0) {
+                memcpy(pr->raw + pr->raw_length, line, len);
+                pr->raw_length += len;
+            }
+            line += len;
+        }
+        memcpy(pr->raw + pr->raw_length, PROXY_KEEP_ALIVE, sizeof(PROXY_KEEP_ALIVE) - 1);
+        pr->raw_length += sizeof(PROXY_KEEP_ALIVE) - 1;
+    }
+
+    if (proxy_send(pr) < 0) {
+        size_t bytes = send_error_response(conn, MDTP_SERVICE_UNAVAILABLE, req->keep_alive);
+        log_request(conn, req->method, req->path, MDTP_SERVICE_UNAVAILABLE, bytes, started);
+        proxy_request_free(pr);
+        return req->keep_alive;
+    }
+    conn->proxied = pr;
+    return 1;
+}
+
+
+/* Markdown rows describing the backends, appended to /_status. */
+static int proxy_status_rows(char *out, size_t size) {
+    proxy_cache_stats_t cache;
+    proxy_cache_get_stats(&cache);
+    size_t n = 0;
+
+#define APPEND(...) do { \
+        int w = snprintf(out + n, size - n, __VA_ARGS__); \
+        n = w < 0 || (size_t)w >= size - n ? size - 1 : n + w; \
+    } while (0)
+
+    APPEND("\n## Backends\n\n"
+           "| Backend | State | Requests | Errors | Idle connections |\n"
+           "|---|---|---|---|---|\n");
+    for (int i = 0; i < g_backend_count; i++) {
+        proxy_backend_t *b = &g_backends[i];
+        APPEND("| %s | %s | %ld | %ld | %d |\n", b->name, b->healthy ? "up" : "down",
+               b->requests, b->errors, b->idle_count);
+    }
+    APPEND("\n| Proxy cache | Value |\n"
+           "|---|---|\n"
+           "| Hits / misses | %ld / %ld |\n"
+           "| Entries / bytes | %ld / %ld |\n"
+           "| Expired | %ld |\n",
+           cache.hits, cache.misses, cache.entries, cache.bytes, cache.expired);
+#undef APPEND
+    return (int)n;
+}
+
+
+/* Set up the ring and the upstream epoll set, registered in epoll_fd. */
+static int proxy_start(int epoll_fd, const mdtp_config_t *config) {
+    const char *names[PROXY_MAX_BACKENDS];
+
+    if (g_backend_count == 0 && proxy_add_backends(config->backends) < 0) return -1;
+    if (g_backend_count == 0) {
+        fprintf(stderr, "[MDTP] Proxy mode needs at least one backend (-b host:port or backends =)\n");
+        return -1;
+    }
+    for (int i = 0; i < g_backend_count; i++) names[i] = g_backends[i].name;
+    if (proxy_ring_build(&g_ring, names, g_backend_count) < 0) return -1;
+
+    g_proxy_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_proxy_epoll_fd < 0) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &g_proxy_marker };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, g_proxy_epoll_fd, &ev);
+    timer_wheel_init(&g_upstream_timers, time(NULL));
+    proxy_cache_configure(config->proxy_cache_size, config->proxy_cache_ttl);
+    return 0;
+}
+
+static volatile sig_atomic_t g_reload_requested = 0;
+static volatile sig_atomic_t g_upgrade_requested = 0;
+
+static void handle_sighup(int sig) {
+    (void)sig;
+    g_reload_requested = 1;
+}
+
+static void handle_sigusr2(int sig) {
+    (void)sig;
+    g_upgrade_requested = 1;
+}
+
+#ifdef MDTP_TRACE
+static volatile sig_atomic_t g_trace_requested = 0;
+
+static void handle_sigusr1(int sig) {
+    (void)sig;
+    g_trace_requested = 1;
+}
+#endif
+
+
+/*
+ * Apply the listener settings from the configuration: the accept queue
+ * length, TCP_DEFER_ACCEPT (connections are only handed to accept() once
+ * their first request has arrived, so the loop never wakes for an idle
+ * one) and the TCP Fast Open queue (a returning client's request rides on
+ * its SYN; the kernel must also allow it in net.ipv4.tcp_fastopen).
+ * listen() may be called again on a listening socket to change its queue.
+ */
+int tune_listener(int server_sock, const mdtp_config_t *config) {
+    int defer = config->defer_accept > 0 ? config->defer_accept : 0;
+    int fastopen = config->tcp_fastopen > 0 ? config->tcp_fastopen : 0;
+
+    setsockopt(server_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+    if (fastopen) setsockopt(server_sock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen));
+    return listen(server_sock, config->listen_backlog > 0 ? config->listen_backlog : SOMAXCONN);
+}
+
+
+int open_listener(int port) {
+    struct sockaddr_in server_addr;
+
+    /* Non-blocking: during an upgrade two processes watch it, and the one that loses accept() must not wait. */
+    int server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (server_sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    
+    int opt = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    // Bind
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(server_sock);
+        return -1;
+    }
+    
+    if (tune_listener(server_sock, get_config()) < 0) {
+        perror("Listen failed");
+        close(server_sock);
+        return -1;
+    }
+
+    return server_sock;
+}
+
+
+/* Accept one pending connection and register it. Returns -1 when none is pending. */
+int accept_conn(int epoll_fd, int server_sock) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    /* CLOEXEC keeps client sockets out of an upgraded successor process. */
+    int client_sock = accept4(server_sock, (struct sockaddr*)&client_addr, &client_len,
+                              SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client_sock < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+        return -1;
+    }
+
+    /* Over capacity: answer with the prebuilt 503 (if the socket takes it) and never read the request. */
+    if (g_open_connections >= get_config()->max_connections) {
+        struct iovec iov[4];
+        if (error_response_iov(MDTP_SERVICE_UNAVAILABLE, 0, iov)) writev(client_sock, iov, 4);
+        close(client_sock);
+        g_connections_shed++;
+        return 0;
+    }
+
+    mdtp_conn_t *conn = calloc(1, sizeof(mdtp_conn_t));
+    if (!conn) {
+        close(client_sock);
+        return 0;
+    }
+    conn->fd = client_sock;
+    conn->file_fd = -1;
+    conn->protocol = 1;
+    conn->buffer = malloc(REQUEST_BUFFER_MIN);
+    conn->capacity = REQUEST_BUFFER_MIN;
+    if (!conn->buffer) {
+        close(client_sock);
+        free(conn);
+        return 0;
+    }
+    conn->buffer[0] = '\0';
+
+    /* Responses go out whole (see conn_writev()), so Nagle would only delay their last segment. */
+    int nodelay = get_config()->tcp_nodelay != 0;
+    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    conn->peer_ip = client_addr.sin_addr.s_addr;
+    inet_ntop(AF_INET, &client_addr.sin_addr, conn->peer, sizeof(conn->peer));
+
+    struct epoll_event cev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &cev) < 0) {
+        close(client_sock);
+        free(conn->buffer);
+        free(conn);
+        return 0;
+    }
+
+    conn->next = g_connections;
+    if (g_connections) g_connections->prev = conn;
+    g_connections = conn;
+    g_open_connections++;
+    conn_touch(conn);
+    return 0;
+}
+
+
+/* Open the server and access logs the first time logging is enabled. */
+void start_logging(mdtp_config_t *config) {
+    static int started = 0;
+
+    if (!config->enable_logging || started) return;
+    started = 1;
+    init_logger("mdtp.log", config->log_level);
+    access_log_open("access.log");
+}
+
+
+/* Build the search index on first use, afterwards just follow root_dir. */
+void start_search(mdtp_config_t *config) {
+    static int started = 0;
+
+    if (!config->enable_search) return;
+    if (started) {
+        search_set_root(config->root_dir, config->search_refresh);
+    } else if (search_start(config->root_dir, config->search_refresh) == 0) {
+        started = 1;
+    } else {
+        log_message(LOG_ERROR, "Failed to build the search index");
+    }
+}
+
+
+/* Set by "server --pack": overrides pack_file from the config. */
+static const char *g_pack_file = NULL;
+
+/* Serve from the configured content pack, if any; reopened on every reload. */
+void open_pack(mdtp_config_t *config) {
+    const char *file = g_pack_file ? g_pack_file : config->pack_file;
+
+    if (!file[0]) {
+        pack_close();
+    } else if (pack_open(file) < 0) {
+        log_message(LOG_ERROR, "Failed to open content pack %s%s", file,
+                    pack_loaded() ? ", still serving the previous one" : "");
+    } else {
+        log_message(LOG_INFO, "Serving %d documents from content pack %s", pack_count(), file);
+    }
+}
+
+
+/*
+ * SIGHUP: parse the config file into a new mdtp_config_t and publish it.
+ * Open connections are left alone and simply see the new settings on
+ * their next request. If the port changed, the new listener is bound
+ * before the old one is retired, and connections already queued on the
+ * old listener are accepted rather than reset.
+ */
+void reload_server_config(int epoll_fd, int *server_sock, const char *config_file, int cli_port) {
+    mdtp_config_t *current = get_config();
+    mdtp_config_t *config = parse_config_file(config_file);
+    if (!config) {
+        log_message(LOG_WARNING, "Reload failed: cannot read %s, keeping current configuration",
+                    config_file ? config_file : CONFIG_FILE);
+        return;
+    }
+    if (cli_port > 0) config->port = cli_port;
+
+    if (config->port != current->port) {
+        int new_sock = open_listener(config->port);
+        if (new_sock < 0) {
+            log_message(LOG_ERROR, "Reload: cannot listen on port %d, staying on %d",
+                        config->port, current->port);
+            config->port = current->port;
+        } else {
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_sock, &ev);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *server_sock, NULL);
+
+            while (accept_conn(epoll_fd, *server_sock) == 0);
+            close(*server_sock);
+
+            *server_sock = new_sock;
+            log_message(LOG_INFO, "Listener moved from port %d to %d", current->port, config->port);
+        }
+    }
+
+    publish_config(config);
+    tune_listener(*server_sock, config);
+
+    if (init_error_responses() < 0) {
+        log_message(LOG_ERROR, "Reload: failed to rebuild error responses");
+    }
+    start_logging(config);
+    if (g_proxy) {
+        proxy_cache_configure(config->proxy_cache_size, config->proxy_cache_ttl);
+    } else {
+        cache_configure(config->enable_cache ? config->cache_size : 0, config->cache_hot_percent,
+                        config->max_file_size);
+        open_pack(config);
+        if (!pack_loaded()) start_search(config);
+    }
+    log_message(LOG_INFO, "Configuration reloaded (root: %s, port: %d)", config->root_dir, config->port);
+}
+
+
+/* ------------------------------------------------------------------------
+ * Binary upgrade
+ *
+ * On SIGUSR2 the server execs the binary again (picking up a replaced
+ * executable) with "--inherit <fd>", where fd is its end of a socketpair,
+ * and passes its listening socket to the new process over the pair with
+ * SCM_RIGHTS. The old process keeps serving while the successor starts
+ * up; its end of the pair sits in the event loop like any connection.
+ * Once the successor reports it is serving, the old process stops
+ * accepting, finishes the requests already in progress and exits;
+ * connections that are still open after drain_timeout seconds are closed.
+ * If the successor exits first, the pair reports end of file and the
+ * upgrade is abandoned. Because the listening socket itself is handed
+ * over, connections waiting in its backlog are never refused.
+ * ------------------------------------------------------------------------ */
+
+static char **g_argv = NULL;
+static char g_exe_path[PATH_MAX];
+static int g_upgrade_ack_fd = -1;
+
+/* Old process side of an upgrade in progress. */
+static int g_upgrade_sock = -1;
+static pid_t g_upgrade_pid = 0;
+static mdtp_conn_t g_upgrade_marker;
+
+
+/*
+ * Remember the binary to re-exec on upgrade. /proc/self/exe names the
+ * file however it was found (through $PATH, relative to a cwd that may
+ * change later), so it is read once, before anything can replace it.
+ */
+static void remember_exe(char **argv) {
+    g_argv = argv;
+    ssize_t n = readlink("/proc/self/exe", g_exe_path, sizeof(g_exe_path) - 1);
+    if (n > 0) g_exe_path[n] = '\0';
+    else snprintf(g_exe_path, sizeof(g_exe_path), "%s", argv[0]);
+}
+
+
+int send_fd(int sock, int fd) {
+    char byte = 'L';
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+
+int recv_fd(int sock) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return fd;
+}
+
+
+/* Give up on a successor that has not taken over: stop it and forget it. */
+static void abandon_upgrade(int epoll_fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, g_upgrade_sock, NULL);
+    close(g_upgrade_sock);
+    g_upgrade_sock = -1;
+    kill(g_upgrade_pid, SIGTERM);
+    waitpid(g_upgrade_pid, NULL, 0);
+    g_upgrade_pid = 0;
+}
+
+
+/*
+ * Start a successor and hand it the listener. Returns 0 once it is
+ * running; upgrade_dispatch() learns when it is serving. On failure this
+ * process carries on as before.
+ */
+int start_upgrade(int epoll_fd, int server_sock) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        log_message(LOG_ERROR, "Upgrade: socketpair failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int argc = 0;
+    while (g_argv[argc]) argc++;
+    char **child_argv = calloc(argc + 3, sizeof(char *));
+    if (!child_argv) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    int child_argc = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(g_argv[i], "--inherit") == 0 && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        child_argv[child_argc++] = g_argv[i];
+    }
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", pair[1]);
+    child_argv[child_argc] = "--inherit";
+    child_argv[child_argc + 1] = fd_arg;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* The successor's end of the pair is the one descriptor kept across exec. */
+        fcntl(pair[1], F_SETFD, 0);
+        execv(g_exe_path, child_argv);
+        perror("Upgrade: exec failed");
+        _exit(127);
+    }
+    free(child_argv);
+    close(pair[1]);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &g_upgrade_marker };
+    if (pid < 0 || send_fd(pair[0], server_sock) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pair[0], &ev) < 0) {
+        log_message(LOG_ERROR, "Upgrade: cannot start %s: %s", g_exe_path, strerror(errno));
+        close(pair[0]);
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+
+    g_upgrade_sock = pair[0];
+    g_upgrade_pid = pid;
+    log_message(LOG_INFO, "Upgrade: started pid %d, serving until it is ready", (int)pid);
+    return 0;
+}
+
+
+/*
+ * The successor's end of the pair is readable. Returns 1 if it is now
+ * serving, -1 if it exited without taking over, 0 if nothing happened.
+ */
+static int upgrade_dispatch(int epoll_fd) {
+    char ack = 0;
+    ssize_t n = recv(g_upgrade_sock, &ack, 1, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+
+    if (n == 1 && ack == 'R') {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, g_upgrade_sock, NULL);
+        close(g_upgrade_sock);
+        g_upgrade_sock = -1;
+        log_message(LOG_INFO, "Upgrade: pid %d is now serving, draining", (int)g_upgrade_pid);
+        return 1;
+    }
+
+    log_message(LOG_ERROR, "Upgrade: successor did not take over, continuing to serve");
+    abandon_upgrade(epoll_fd);
+    return -1;
+}
+
+
+/* Successor side: receive the listening socket over the inherited descriptor. */
+int inherit_listener(const char *fd_arg) {
+    char *end;
+    long unix_sock = strtol(fd_arg, &end, 10);
+
+    if (*end || unix_sock < 0 || unix_sock > INT_MAX || fcntl((int)unix_sock, F_GETFD) < 0) {
+        fprintf(stderr, "Upgrade: --inherit %s is not an open descriptor\n", fd_arg);
+        return -1;
+    }
+    fcntl((int)unix_sock, F_SETFD, FD_CLOEXEC);
+
+    int fd = recv_fd((int)unix_sock);
+    if (fd < 0) {
+        perror("Upgrade: cannot receive the listener");
+        close((int)unix_sock);
+        return -1;
+    }
+
+    /* The file status flags travel with the socket; older binaries passed it blocking. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* Acknowledged from start_server() once we are ready to accept. */
+    g_upgrade_ack_fd = (int)unix_sock;
+    return fd;
+}
+
+
+/*
+ * Periodic work for the event loop: write out buffered access log lines at
+ * least once a second, save the statistics every stats_interval seconds
+ * and, in proxy mode, run the upstream deadlines and health checks.
+ * Returns how long epoll_wait() may sleep before more is due, in
+ * milliseconds (-1: indefinitely).
+ */
+static int run_periodic(void) {
+    static time_t next_flush = 0, next_stats = 0;
+    mdtp_config_t *config = get_config();
+    time_t now = time(NULL);
+    int timeout = -1;
+
+    if (access_log_pending()) {
+        if (now >= next_flush) {
+            access_log_flush();
+            next_flush = now + 1;
+        } else {
+            timeout = 1000;
+        }
+    }
+
+    if (config->enable_stats && config->stats_interval > 0) {
+        if (next_stats == 0) next_stats = now + config->stats_interval;
+        if (now >= next_stats) {
+            save_stats();
+            next_stats = now + config->stats_interval;
+        }
+        int wait = (int)(next_stats - now) * 1000;
+        if (timeout < 0 || wait < timeout) timeout = wait;
+    }
+
+    if (g_proxy) {
+        proxy_tick();
+        if (timeout < 0 || timeout > 1000) timeout = 1000;
+    }
+    return timeout;
+}
+
+
+/*
+ * Stop accepting and close the connections sitting idle between requests.
+ * The others are not cut: each one is closed after its next response
+ * (handle_request() drops keep-alive while draining).
+ */
+void begin_drain(int epoll_fd, int server_sock) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_sock, NULL);
+    close(server_sock);
+    g_draining = 1;
+
+    for (mdtp_conn_t *conn = g_connections, *next; conn; conn = next) {
+        next = conn->next;
+        if (conn->length == 0 && !conn_pending(conn) && !conn->watching && !conn->proxied) {
+            close_conn(epoll_fd, conn);
+        }
+    }
+}
+
+
+/*
+ * Run the server. cli_port, when > 0, overrides the port from the config
+ * file both at startup and on every reload. inherit_fd is set when this
+ * process was started by a binary upgrade.
+ */
+void start_server(int cli_port, const char *config_file, const char *inherit_fd) {
+    load_config(config_file);
+    mdtp_config_t *config = get_config();
+    if (cli_port > 0 && config->port != cli_port) {
+        mdtp_config_t *adjusted = malloc(sizeof(mdtp_config_t));
+        if (!adjusted) exit(1);
+        *adjusted = *config;
+        adjusted->port = cli_port;
+        publish_config(adjusted);
+        config = adjusted;
+    }
+    int port = config->port;
+
+    int server_sock = inherit_fd ? inherit_listener(inherit_fd) : open_listener(port);
+    if (server_sock < 0) {
+        exit(1);
+    }
+    if (inherit_fd) tune_listener(server_sock, config);
+
+    if (init_error_responses() < 0) {
+        fprintf(stderr, "[MDTP] Failed to prepare error responses\n");
+        exit(1);
+    }
+    init_stats();
+    start_logging(config);
+    if (!g_proxy) {
+        cache_configure(config->enable_cache ? config->cache_size : 0, config->cache_hot_percent,
+                        config->max_file_size);
+        open_pack(config);
+        if (!pack_loaded()) start_search(config);
+    }
+    
+    printf("[MDTP] MDTP %s running on port %d\n", g_proxy ? "Proxy" : "Server", port);
+    printf("[MDTP] Protocol: %s\n", MDTP_VERSION);
+    if (!g_proxy) printf("[MDTP] Serving Markdown documents from %s\n", config->root_dir);
+    printf("[MDTP] Send SIGHUP (kill -HUP %d) to reload the configuration,\n", (int)getpid());
+    printf("[MDTP] SIGUSR2 to upgrade to a new binary without dropping connections\n\n");
+
+    /* Keep-alive peers may go away mid-response; report that as a send error. */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sighup;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = handle_sigusr2;
+    sigaction(SIGUSR2, &sa, NULL);
+#ifdef MDTP_TRACE
+    sa.sa_handler = handle_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+    TRACE_THREAD("server");
+    printf("[MDTP] Tracing enabled; SIGUSR1 writes the recorded spans\n\n");
+#endif
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        exit(1);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev);
+    g_epoll_fd = epoll_fd;
+    timer_wheel_init(&g_timers, time(NULL));
+
+    g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_inotify_fd >= 0) {
+        struct epoll_event iev = { .events = EPOLLIN, .data.ptr = &g_inotify_marker };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, g_inotify_fd, &iev);
+    } else {
+        log_message(LOG_WARNING, "inotify unavailable, WATCH disabled: %s", strerror(errno));
+    }
+
+    if (g_proxy) {
+        if (proxy_start(epoll_fd, config) < 0) exit(1);
+        printf("[MDTP] Proxying to %d backend(s)\n\n", g_backend_count);
+    }
+
+    if (g_upgrade_ack_fd >= 0) {
+        send(g_upgrade_ack_fd, "R", 1, MSG_NOSIGNAL);
+        close(g_upgrade_ack_fd);
+        g_upgrade_ack_fd = -1;
+    }
+
+    time_t drain_deadline = 0;
+    int upgraded = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+#ifdef MDTP_TRACE
+        if (g_trace_requested) {
+            g_trace_requested = 0;
+            log_message(LOG_INFO, "Trace: wrote %d spans", trace_dump(NULL));
+        }
+#endif
+
+        if (g_reload_requested && !g_draining) {
+            g_reload_requested = 0;
+            reload_server_config(epoll_fd, &server_sock, config_file, cli_port);
+        }
+
+        if (g_upgrade_requested && !g_draining) {
+            g_upgrade_requested = 0;
+            if (g_upgrade_sock >= 0) {
+                log_message(LOG_WARNING, "Upgrade: pid %d never became ready, starting again",
+                            (int)g_upgrade_pid);
+                abandon_upgrade(epoll_fd);
+            }
+            start_upgrade(epoll_fd, server_sock);
+        }
+
+        if (upgraded && !g_draining) {
+            begin_drain(epoll_fd, server_sock);
+            server_sock = -1;
+            drain_deadline = time(NULL) + get_config()->drain_timeout;
+        }
+
+        if (g_draining && (g_open_connections == 0 || time(NULL) >= drain_deadline)) {
+            if (g_open_connections > 0) {
+                log_message(LOG_WARNING, "Upgrade: drain timeout, closing %d connection(s)",
+                            g_open_connections);
+            }
+            log_message(LOG_INFO, "Upgrade: drained, exiting");
+            while (g_connections) close_conn(epoll_fd, g_connections);
+            break;
+        }
+
+        timer_expire(&g_timers, time(NULL), conn_expired, &epoll_fd);
+
+        int timeout = run_periodic();
+        if ((g_draining || g_timers.armed > 0) && (timeout < 0 || timeout > 1000)) timeout = 1000;
+
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            mdtp_conn_t *conn = events[i].data.ptr;
+
+            if (!conn) {
+                TRACE_BEGIN(t_accept);
+                accept_conn(epoll_fd, server_sock);
+                TRACE_END(t_accept, "accept");
+                continue;
+            }
+
+            if (conn == &g_inotify_marker) {
+                watch_dispatch();
+                continue;
+            }
+
+            if (conn == &g_proxy_marker) {
+                proxy_dispatch();
+                continue;
+            }
+
+            /* The listener is only retired at the top of the loop, after this batch. */
+            if (conn == &g_upgrade_marker) {
+                if (upgrade_dispatch(epoll_fd) > 0) upgraded = 1;
+                continue;
+            }
+
+            int rc = conn_pending(conn) ? resume_client(conn) : handle_client(conn);
+            if (rc < 0) {
+                close_conn(epoll_fd, conn);
+            }
+        }
+    }
+    
+    close(epoll_fd);
+    if (server_sock >= 0) close(server_sock);
+    access_log_flush();
+    if (get_config()->enable_stats) save_stats();
+#ifdef MDTP_TRACE
+    trace_dump(NULL);
+#endif
+}
+
+
+int mdtp_connect(const char *host, int port) {
+    int sock;
+    struct sockaddr_in server_addr;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        perror("Invalid address");
+        close(sock);
+        return -1;
+    }
+    
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connection failed");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+
+/*
+ * Copy the value of header `name` out of a header block terminated by
+ * "\r\n\r\n". Returns 0 if found, -1 otherwise.
+ */
+int find_header(const char *headers, const char *name, char *value, size_t value_size) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(headers, "\r\n");
+
+    while (line && strncmp(line, "\r\n\r\n", 4) != 0) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ') v++;
+            size_t len = strcspn(v, "\r\n");
+            if (len >= value_size) len = value_size - 1;
+            memcpy(value, v, len);
+            value[len] = '\0';
+            return 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+
+    return -1;
+}
+
+
+/*
+ * Read one complete response from sock. The body is read up to its
+ * Content-Length (or EOF for servers that omit it) and returned
+ * NUL-terminated; the caller frees it. keep_alive is set when the server
+ * agreed to keep the connection open. If headers is not NULL it receives a
+ * malloc'd copy of the header block. Returns NULL on error.
+ */
+char* mdtp_read_response(int sock, int *status, size_t *body_length, int *keep_alive, char **headers) {
+    size_t cap = BUFFER_SIZE;
+    size_t len = 0;
+    char *buf = malloc(cap + 1);
+    char *header_end = NULL;
+    if (!buf) return NULL;
+
+    while (!header_end) {
+        if (len == cap) {
+            if (cap >= MAX_HEADER * 16) goto fail;
+            cap *= 2;
+            char *grown = realloc(buf, cap + 1);
+            if (!grown) goto fail;
+            buf = grown;
+        }
+        ssize_t n = recv(sock, buf + len, cap - len, 0);
+        if (n <= 0) goto fail;
+        len += n;
+        buf[len] = '\0';
+        header_end = strstr(buf, "\r\n\r\n");
+    }
+
+    size_t header_len = header_end + 4 - buf;
+    int code = 0;
+    if (sscanf(buf, "%*s %d", &code) != 1) goto fail;
+
+    char value[64];
+    int has_length = find_header(buf, "Content-Length", value, sizeof(value)) == 0;
+    size_t content_length = has_length ? strtoull(value, NULL, 10) : 0;
+    int persistent = find_header(buf, "Connection", value, sizeof(value)) == 0 &&
+                     strcasecmp(value, "keep-alive") == 0;
+
+    size_t body_len = len - header_len;
+    char *body = malloc((has_length ? content_length : body_len + BUFFER_SIZE) + 1);
+    if (!body) goto fail;
+    if (has_length && body_len > content_length) body_len = content_length;
+    memcpy(body, buf + header_len, body_len);
+    buf[header_len] = '\0';
+
+    size_t body_cap = has_length ? content_length : body_len + BUFFER_SIZE;
+    while (!has_length || body_len < content_length) {
+        if (body_len == body_cap) {
+            body_cap *= 2;
+            char *grown = realloc(body, body_cap + 1);
+            if (!grown) {
+                free(body);
+                goto fail;
+            }
+            body = grown;
+        }
+        ssize_t n = recv(sock, body + body_len, body_cap - body_len, 0);
+        if (n < 0 || (n == 0 && has_length)) {
+            free(body);
+            goto fail;
+        }
+        if (n == 0) {
+            persistent = 0;
+            break;
+        }
+        body_len += n;
+    }
+    body[body_len] = '\0';
+
+    if (status) *status = code;
+    if (body_length) *body_length = body_len;
+    if (keep_alive) *keep_alive = persistent && has_length;
+    if (headers) *headers = buf;
+    else free(buf);
+    return body;
+
+fail:
+    free(buf);
+    return NULL;
+}
+
+
+/* Read exactly len bytes. Returns 0 on success, -1 on error or EOF. */
+static int recv_all(int sock, void *buf, size_t len) {
+    size_t have = 0;
+    while (have < len) {
+        ssize_t n = recv(sock, (char *)buf + have, len - have, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        have += n;
+    }
+    return 0;
+}
+
+
+/* The client end of an MDTP/2 connection (see "MDTP/2 framing" above). */
+typedef struct {
+    int sock;
+    uint32_t next_stream_id;
+} mdtp2_session_t;
+
+/* One document fetched over a session. body is malloc'd and NUL-terminated. */
+typedef struct {
+    const char *path;
+    int status;
+    char *body;
+    size_t length;
+    size_t capacity;
+    int done;
+} mdtp2_result_t;
+
+
+/*
+ * Connect and ask to switch to framing. Returns 0 once the server has
+ * switched, 1 if it only speaks MDTP/1.0 (nothing is left open), -1 on a
+ * connection error.
+ */
+int mdtp2_open(mdtp2_session_t *session, const char *host, int port) {
+    char request[MAX_HEADER];
+    char reply[MAX_HEADER];
+    size_t len = 0;
+
+    session->sock = mdtp_connect(host, port);
+    if (session->sock < 0) return -1;
+    session->next_stream_id = 1;
+
+    int n = snprintf(request, sizeof(request),
+        "OPTIONS * %s\r\n"
+        "Host: %s\r\n"
+        "User-Agent: MDTP-Client/1.0\r\n"
+        "\r\n",
+        MDTP2_VERSION, host);
+    if (send(session->sock, request, n, MSG_NOSIGNAL) != n) goto fail;
+
+    /* Byte at a time so no frame bytes are consumed along with the reply. */
+    while (len < sizeof(reply) - 1) {
+        if (recv_all(session->sock, reply + len, 1) < 0) goto fail;
+        len++;
+        if (len >= 4 && memcmp(reply + len - 4, "\r\n\r\n", 4) == 0) break;
+    }
+    reply[len] = '\0';
+
+    if (strncmp(reply, MDTP2_SWITCHING, len) == 0 && len == sizeof(MDTP2_SWITCHING) - 1) {
+        return 0;
+    }
+    close(session->sock);
+    session->sock = -1;
+    return 1;
+
+fail:
+    close(session->sock);
+    session->sock = -1;
+    return -1;
+}
+
+
+void mdtp2_close(mdtp2_session_t *session) {
+    if (session->sock < 0) return;
+    mdtp2_send_goaway(session->sock, 0);
+    close(session->sock);
+    session->sock = -1;
+}
+
+
+static int mdtp2_on_frame(mdtp2_result_t *r, int type, int flags, char *payload, size_t length) {
+    if (type == MDTP2_HEADERS) {
+        char value[64];
+        char headers[MAX_HEADER + 4];
+
+        /* find_header() expects the blank line that frames leave out. */
+        if (length > MAX_HEADER) length = MAX_HEADER;
+        memcpy(headers, payload, length);
+        memcpy(headers + length, "\r\n", 3);
+
+        if (sscanf(headers, "%*s %d", &r->status) != 1) return -1;
+        r->capacity = find_header(headers, "Content-Length", value, sizeof(value)) == 0 ?
+                      strtoull(value, NULL, 10) : BUFFER_SIZE;
+        r->body = malloc(r->capacity + 1);
+        if (!r->body) return -1;
+    } else if (type == MDTP2_DATA) {
+        if (!r->body) return -1;
+        if (r->length + length > r->capacity) {
+            size_t cap = (r->length + length) * 2;
+            char *grown = realloc(r->body, cap + 1);
+            if (!grown) return -1;
+            r->body = grown;
+            r->capacity = cap;
+        }
+        memcpy(r->body + r->length, payload, length);
+        r->length += length;
+    }
+
+    if (flags & MDTP2_END_STREAM) {
+        if (!r->body) r->body = malloc(1);
+        if (!r->body) return -1;
+        r->body[r->length] = '\0';
+        r->done = 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Request every path at once and collect the responses as their frames
+ * arrive. Returns 0 when all of them completed; on -1 the session is
+ * unusable and only results marked done hold a body.
+ */
+int mdtp2_fetch_many(mdtp2_session_t *session, const char *host, mdtp2_result_t *results, int count) {
+    uint32_t first_id = session->next_stream_id;
+    char *payload = malloc(MDTP2_MAX_FRAME);
+    if (!payload) return -1;
+
+    for (int i = 0; i < count; i++) {
+        unsigned char frame[MDTP2_FRAME_HEADER + MAX_HEADER];
+        int n = snprintf((char *)frame + MDTP2_FRAME_HEADER, MAX_HEADER,
+            "GET %s %s\r\n"
+            "Host: %s\r\n"
+            "User-Agent: MDTP-Client/1.0\r\n",
+            results[i].path, MDTP2_VERSION, host);
+        if (n >= MAX_HEADER) n = MAX_HEADER - 1;
+
+        mdtp2_put_header(frame, n, MDTP2_HEADERS, MDTP2_END_STREAM, session->next_stream_id);
+        session->next_stream_id += 2;
+        results[i].status = 0;
+        results[i].body = NULL;
+        results[i].length = 0;
+        results[i].done = 0;
+        if (send(session->sock, frame, MDTP2_FRAME_HEADER + n, MSG_NOSIGNAL) < 0) goto fail;
+    }
+
+    int remaining = count;
+    while (remaining > 0) {
+        unsigned char header[MDTP2_FRAME_HEADER];
+        size_t length;
+        int type, flags;
+        uint32_t stream_id;
+
+        if (recv_all(session->sock, header, sizeof(header)) < 0) goto fail;
+        mdtp2_get_header(header, &length, &type, &flags, &stream_id);
+        if (length > MDTP2_MAX_FRAME) goto fail;
+        if (recv_all(session->sock, payload, length) < 0) goto fail;
+        if (type == MDTP2_GOAWAY) goto fail;
+
+        uint32_t index = (stream_id - first_id) / 2;
+        if (stream_id < first_id || !(stream_id & 1) || index >= (uint32_t)count) continue;
+
+        mdtp2_result_t *r = &results[index];
+        if (r->done) continue;
+        if (mdtp2_on_frame(r, type, flags, payload, length) < 0) goto fail;
+        if (r->done) remaining--;
+    }
+
+    free(payload);
+    return 0;
+
+fail:
+    for (int i = 0; i < count; i++) {
+        if (!results[i].done) {
+            free(results[i].body);
+            results[i].body = NULL;
+        }
+    }
+    free(payload);
+    return -1;
+}
+
+
+/* Set by "client -2": fetch over MDTP/2, falling back to MDTP/1.0. */
+static int g_fetch_mdtp2 = 0;
+
+
+/*
+ * Client side of delta transfer, enabled by "client -D". Documents fetched
+ * over MDTP/1.0 are kept in a small direct-mapped cache keyed by
+ * host:port/path; the next fetch of the same document sends the ETag of
+ * the cached copy as Delta-Base and patches it with the server's delta.
+ */
+#define DELTA_CACHE_SLOTS 256
+
+typedef struct {
+    char *key;
+    char *body;
+    size_t length;
+    uint64_t etag;
+} delta_cache_entry_t;
+
+static int g_fetch_delta = 0;
+static delta_cache_entry_t g_delta_cache[DELTA_CACHE_SLOTS];
+static pthread_mutex_t g_delta_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_delta_wire_bytes = 0;      /* body bytes received */
+static size_t g_delta_doc_bytes = 0;       /* size of the documents they produced */
+
+static delta_cache_entry_t* delta_cache_slot(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = key; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+    return &g_delta_cache[hash % DELTA_CACHE_SLOTS];
+}
+
+/* Remember a copy of path's body; the cache slot's previous entry is dropped. */
+void delta_cache_put(const char *host, int port, const char *path, const char *body, size_t length, uint64_t etag) {
+    char key[MAX_HEADER];
+    snprintf(key, sizeof(key), "%s:%d%s", host, port, path);
+
+    char *key_copy = strdup(key);
+    char *body_copy = malloc(length + 1);
+    if (!key_copy || !body_copy) {
+        free(key_copy);
+        free(body_copy);
+        return;
+    }
+    memcpy(body_copy, body, length);
+    body_copy[length] = '\0';
+
+    pthread_mutex_lock(&g_delta_cache_lock);
+    delta_cache_entry_t *e = delta_cache_slot(key);
+    free(e->key);
+    free(e->body);
+    e->key = key_copy;
+    e->body = body_copy;
+    e->length = length;
+    e->etag = etag;
+    pthread_mutex_unlock(&g_delta_cache_lock);
+}
+
+/* Copy of the cached body of path, or NULL. */
+static char* delta_cache_get(const char *host, int port, const char *path, size_t *length, uint64_t *etag) {
+    char key[MAX_HEADER];
+    snprintf(key, sizeof(key), "%s:%d%s", host, port, path);
+
+    char *body = NULL;
+    pthread_mutex_lock(&g_delta_cache_lock);
+    delta_cache_entry_t *e = delta_cache_slot(key);
+    if (e->key && strcmp(e->key, key) == 0 && (body = malloc(e->length + 1))) {
+        memcpy(body, e->body, e->length + 1);
+        *length = e->length;
+        *etag = e->etag;
+    }
+    pthread_mutex_unlock(&g_delta_cache_lock);
+    return body;
+}
+
+/* One MDTP/1.0 GET, optionally naming the version we hold in Delta-Base. */
+static char* fetch_once(const char *host, int port, const char *path, uint64_t base,
+                        int *status, size_t *length, char **headers) {
+    char request[BUFFER_SIZE];
+    char delta_base[48] = "";
+
+    int sock = mdtp_connect(host, port);
+    if (sock < 0) {
+        return NULL;
+    }
+
+    if (base) snprintf(delta_base, sizeof(delta_base), "Delta-Base: %016" PRIx64 "\r\n", base);
+    snprintf(request, sizeof(request),
+        "GET %s %s\r\n"
+        "Host: %s\r\n"
+        "User-Agent: MDTP-Client/1.0\r\n"
+        "Accept: text/markdown\r\n"
+        "%s"
+        "\r\n",
+        path, MDTP_VERSION, host, delta_base
+    );
+    
+    send(sock, request, strlen(request), 0);
+
+    char *body = mdtp_read_response(sock, status, length, NULL, headers);
+    close(sock);
+    
+    return body;
+}
+
+/*
+ * Fetch with Delta-Base. A 304 returns the cached copy, a 226 delta is
+ * applied to it and checked against the new ETag; when the base is
+ * unknown the server sends the full body. Any delta that does not check
+ * out is answered by fetching the full document again.
+ */
+static char* fetch_delta(const char *host, int port, const char *path, size_t *doc_length) {
+    size_t cached_len = 0;
+    uint64_t base = 0;
+    char *cached = delta_cache_get(host, port, path, &cached_len, &base);
+
+    int status = 0;
+    size_t length = 0;
+    char *headers = NULL;
+    char *body = fetch_once(host, port, path, cached ? base : 0, &status, &length, &headers);
+
+    char value[64];
+    uint64_t etag = 0;
+    if (headers && find_header(headers, "ETag", value, sizeof(value)) == 0) {
+        etag = strtoull(value, NULL, 16);
+    }
+    free(headers);
+    if (body) g_delta_wire_bytes += length;
+
+    if (body && status == MDTP_NOT_MODIFIED && cached) {
+        free(body);
+        g_delta_doc_bytes += cached_len;
+        if (doc_length) *doc_length = cached_len;
+        return cached;
+    }
+
+    if (body && status == MDTP_DELTA && cached) {
+        size_t patched_len;
+        char *patched = delta_apply(cached, cached_len, body, length, &patched_len);
+        free(body);
+        body = NULL;
+        if (patched && delta_hash(patched, patched_len) == etag) {
+            body = patched;
+            length = patched_len;
+            status = MDTP_OK;
+        } else {
+            free(patched);
+            body = fetch_once(host, port, path, 0, &status, &length, NULL);
+            if (body) g_delta_wire_bytes += length;
+            etag = body ? delta_hash(body, length) : 0;
+        }
+    }
+    free(cached);
+
+    if (body && status == MDTP_OK) {
+        g_delta_doc_bytes += length;
+        delta_cache_put(host, port, path, body, length, etag ? etag : delta_hash(body, length));
+    }
+    if (body && doc_length) *doc_length = length;
+    return body;
+}
+
+char* mdtp_fetch(const char *host, int port, const char *path) {
+    if (g_fetch_mdtp2) {
+        mdtp2_session_t session;
+        int rc = mdtp2_open(&session, host, port);
+        if (rc < 0) return NULL;
+        if (rc == 0) {
+            mdtp2_result_t result = { .path = path };
+            rc = mdtp2_fetch_many(&session, host, &result, 1);
+            mdtp2_close(&session);
+            return rc == 0 ? result.body : NULL;
+        }
+    }
+
+    if (g_fetch_delta) return fetch_delta(host, port, path, NULL);
+
+    return fetch_once(host, port, path, 0, NULL, NULL, NULL);
+}
+
+
+/*
+ * "client" with several paths: fetch them all concurrently over one
+ * MDTP/2 connection, or one by one if the server only speaks MDTP/1.0.
+ */
+int run_client(const char *host, int port, char **paths, int count) {
+    mdtp2_session_t session;
+    int failed = 0;
+
+    int rc = g_fetch_mdtp2 && count > 1 ? mdtp2_open(&session, host, port) : 1;
+    if (rc < 0) {
+        printf("Failed to connect\n");
+        return 1;
+    }
+
+    if (rc == 0) {
+        mdtp2_result_t *results = calloc(count, sizeof(mdtp2_result_t));
+        if (!results) {
+            mdtp2_close(&session);
+            return 1;
+        }
+        for (int i = 0; i < count; i++) results[i].path = paths[i];
+
+        if (mdtp2_fetch_many(&session, host, results, count) < 0) failed = 1;
+        mdtp2_close(&session);
+
+        for (int i = 0; i < count; i++) {
+            if (results[i].done) {
+                printf("%s\n", results[i].body);
+            } else {
+                printf("Failed to fetch %s\n", results[i].path);
+            }
+            free(results[i].body);
+        }
+        free(results);
+        return failed;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char *content = mdtp_fetch(host, port, paths[i]);
+        if (content) {
+            printf("%s\n", content);
+            free(content);
+        } else {
+            printf("Failed to fetch document\n");
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+
+/* "watch": print change events for a document or directory until interrupted. */
+int run_watch(const char *host, int port, const char *path) {
+    char buffer[BUFFER_SIZE];
+    size_t len = 0;
+    char *header_end = NULL;
+
+    int sock = mdtp_connect(host, port);
+    if (sock < 0) return 1;
+
+    int n = snprintf(buffer, sizeof(buffer),
+        "WATCH %s %s\r\n"
+        "Host: %s\r\n"
+        "User-Agent: MDTP-Client/1.0\r\n"
+        "\r\n",
+        path, MDTP_VERSION, host);
+    send(sock, buffer, n, 0);
+
+    while (!header_end && len < sizeof(buffer) - 1) {
+        ssize_t got = recv(sock, buffer + len, sizeof(buffer) - 1 - len, 0);
+        if (got <= 0) break;
+        len += got;
+        buffer[len] = '\0';
+        header_end = strstr(buffer, "\r\n\r\n");
+    }
+
+    int status = 0;
+    if (!header_end || sscanf(buffer, "%*s %d", &status) != 1 || status != MDTP_OK) {
+        printf("WATCH failed%s%s\n", header_end ? ":\n" : "", header_end ? header_end + 4 : "");
+        close(sock);
+        return 1;
+    }
+
+    fwrite(header_end + 4, 1, len - (header_end + 4 - buffer), stdout);
+    fflush(stdout);
+    for (;;) {
+        ssize_t got = recv(sock, buffer, sizeof(buffer), 0);
+        if (got <= 0) break;
+        fwrite(buffer, 1, got, stdout);
+        fflush(stdout);
+    }
+
+    close(sock);
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Load generator
+ *
+ * Each connection runs on its own thread and issues requests on a fixed
+ * schedule derived from the target rate. Latency is measured from the time
+ * a request was *meant* to be sent, not when it actually went out, so a
+ * stalled server is charged for the requests it delayed (coordinated
+ * omission correction). With rate 0 the connections run closed-loop as
+ * fast as the server answers.
+ * ------------------------------------------------------------------------ */
+
+#define BENCH_DEFAULT_CONNECTIONS 10
+#define BENCH_DEFAULT_DURATION 10
+#define BENCH_MAX_PATHS 64
+
+typedef struct {
+    const char *host;
+    int port;
+    int connections;
+    double rate;
+    int duration;
+    int keep_alive;
+    char *paths[BENCH_MAX_PATHS];
+    int path_count;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} bench_config_t;
+
+typedef struct {
+    const bench_config_t *config;
+    int id;
+    pthread_t thread;
+    uint64_t *latencies;        /* corrected, from intended send time */
+    uint64_t *service_times;    /* uncorrected, from actual send time */
+    size_t count;
+    size_t cap;
+    long errors;
+    long connects;
+    long status_errors;
+    uint64_t bytes;
+} bench_worker_t;
+
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void bench_sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000ULL,
+        .tv_nsec = deadline_ns % 1000000000ULL
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+
+static int bench_record(bench_worker_t *w, uint64_t latency, uint64_t service_time) {
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        uint64_t *lat = realloc(w->latencies, cap * sizeof(uint64_t));
+        if (!lat) return -1;
+        w->latencies = lat;
+        uint64_t *svc = realloc(w->service_times, cap * sizeof(uint64_t));
+        if (!svc) return -1;
+        w->service_times = svc;
+        w->cap = cap;
+    }
+    w->latencies[w->count] = latency;
+    w->service_times[w->count] = service_time;
+    w->count++;
+    return 0;
+}
+
+
+static void* bench_worker(void *arg) {
+    bench_worker_t *w = arg;
+    const bench_config_t *cfg = w->config;
+    char request[BUFFER_SIZE];
+    int sock = -1;
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 * cfg->connections / cfg->rate) : 0;
+    uint64_t intended = cfg->start_ns +
+        (cfg->rate > 0 ? (uint64_t)(1e9 * w->id / cfg->rate) : 0);
+    unsigned int seq = w->id;
+
+    while (intended < cfg->end_ns) {
+        if (interval) {
+            bench_sleep_until(intended);
+        }
+
+        uint64_t sent_at = monotonic_ns();
+        if (!interval) intended = sent_at;
+        if (sent_at >= cfg->end_ns) break;
+
+        if (sock < 0) {
+            sock = mdtp_connect(cfg->host, cfg->port);
+            if (sock < 0) {
+                w->errors++;
+                intended += interval ? interval : 1000000;
+                continue;
+            }
+            w->connects++;
+        }
+
+        const char *path = cfg->paths[seq++ % cfg->path_count];
+        int len = snprintf(request, sizeof(request),
+            "GET %s %s\r\n"
+            "Host: %s\r\n"
+            "User-Agent: MDTP-Bench/1.0\r\n"
+            "Connection: %s\r\n"
+            "\r\n",
+            path, MDTP_VERSION, cfg->host, cfg->keep_alive ? "keep-alive" : "close"
+        );
+
+        int status = 0, keep_alive = 0;
+        size_t body_len = 0;
+        char *body = NULL;
+        if (send(sock, request, len, MSG_NOSIGNAL) == len) {
+            body = mdtp_read_response(sock, &status, &body_len, &keep_alive, NULL);
+        }
+        uint64_t done_at = monotonic_ns();
+
+        if (!body) {
+            w->errors++;
+            close(sock);
+            sock = -1;
+        } else {
+            free(body);
+            w->bytes += body_len;
+            if (status != MDTP_OK) w->status_errors++;
+            if (bench_record(w, done_at - intended, done_at - sent_at) < 0) break;
+            if (!cfg->keep_alive || !keep_alive) {
+                close(sock);
+                sock = -1;
+            }
+        }
+
+        intended += interval;
+    }
+
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static void bench_print_percentiles(const char *label, uint64_t *values, size_t count) {
+    static const double pct[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+
+    qsort(values, count, sizeof(uint64_t), compare_u64);
+    printf("  %s\n", label);
+    for (size_t i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+        size_t idx = (size_t)(pct[i] / 100.0 * count);
+        if (idx >= count) idx = count - 1;
+        printf("    p%-6g %10.3f ms\n", pct[i], values[idx] / 1e6);
+    }
+    printf("    max     %10.3f ms\n", values[count - 1] / 1e6);
+}
+
+
+int run_bench(bench_config_t *cfg) {
+    bench_worker_t *workers = calloc(cfg->connections, sizeof(bench_worker_t));
+    if (!workers) return 1;
+
+    printf("[MDTP] Bench: %s:%d, %d connections, %s, %d s, keep-alive %s, %d path(s)\n",
+           cfg->host, cfg->port, cfg->connections,
+           cfg->rate > 0 ? "fixed rate" : "closed loop",
+           cfg->duration, cfg->keep_alive ? "on" : "off", cfg->path_count);
+    if (cfg->rate > 0) {
+        printf("[MDTP] Target rate: %.0f req/s\n", cfg->rate);
+    }
+
+    cfg->start_ns = monotonic_ns() + 10000000ULL;
+    cfg->end_ns = cfg->start_ns + (uint64_t)cfg->duration * 1000000000ULL;
+
+    int started = 0;
+    for (int i = 0; i < cfg->connections; i++) {
+        workers[i].config = cfg;
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+
+    size_t total = 0;
+    long errors = 0, status_errors = 0, connects = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+        status_errors += workers[i].status_errors;
+        connects += workers[i].connects;
+        bytes += workers[i].bytes;
+    }
+
+    double elapsed = (monotonic_ns() - cfg->start_ns) / 1e9;
+    uint64_t *latencies = malloc((total ? total : 1) * sizeof(uint64_t));
+    uint64_t *service_times = malloc((total ? total : 1) * sizeof(uint64_t));
+    size_t n = 0;
+    for (int i = 0; i < started; i++) {
+        if (latencies && service_times) {
+            memcpy(latencies + n, workers[i].latencies, workers[i].count * sizeof(uint64_t));
+            memcpy(service_times + n, workers[i].service_times, workers[i].count * sizeof(uint64_t));
+            n += workers[i].count;
+        }
+        free(workers[i].latencies);
+        free(workers[i].service_times);
+    }
+    free(workers);
+
+    printf("\n  Requests:    %zu completed, %ld non-200, %ld errors, %ld connects\n",
+           total, status_errors, errors, connects);
+    printf("  Throughput:  %.1f req/s, %.2f MB/s\n",
+           total / elapsed, bytes / elapsed / 1024 / 1024);
+
+    if (n > 0) {
+        if (cfg->rate > 0) {
+            bench_print_percentiles("Latency (corrected for coordinated omission):", latencies, n);
+        }
+        bench_print_percentiles("Service time (uncorrected):", service_times, n);
+    }
+    printf("\n");
+
+    free(latencies);
+    free(service_times);
+    return errors > 0 && total == 0;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Site mirror
+ *
+ * Breadth-first crawl of an MDTP site. Each worker owns one persistent
+ * connection and pulls paths from a shared queue; every fetched document is
+ * written to disk and scanned for mdtp:// and relative .md links. A journal
+ * in the output directory records queued ("Q") and finished ("D") paths, so
+ * an interrupted mirror picks up where it stopped.
+ * ------------------------------------------------------------------------ */
+
+#define MIRROR_DEFAULT_JOBS 4
+#define MIRROR_JOURNAL ".mdtp-mirror.journal"
+
+typedef struct {
+    char **slots;
+    size_t cap;
+    size_t count;
+} path_set_t;
+
+typedef struct mirror_job {
+    char path[MAX_PATH];
+    struct mirror_job *next;
+} mirror_job_t;
+
+typedef struct {
+    const char *host;
+    int port;
+    const char *outdir;
+    int jobs;
+    path_set_t visited;
+    mirror_job_t *head;
+    mirror_job_t *tail;
+    int active;
+    long fetched;
+    long failed;
+    uint64_t bytes;
+    FILE *journal;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} mirror_t;
+
+
+uint64_t hash_string(const char *str) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+/* Returns 1 if path was added, 0 if already present, -1 on allocation failure. */
+int path_set_add(path_set_t *set, const char *path) {
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 256;
+        char **slots = calloc(cap, sizeof(char *));
+        if (!slots) return -1;
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->slots[i]) continue;
+            size_t j = hash_string(set->slots[i]) & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+
+    size_t i = hash_string(path) & (set->cap - 1);
+    while (set->slots[i]) {
+        if (strcmp(set->slots[i], path) == 0) return 0;
+        i = (i + 1) & (set->cap - 1);
+    }
+
+    set->slots[i] = strdup(path);
+    if (!set->slots[i]) return -1;
+    set->count++;
+    return 1;
+}
+
+
+int path_set_contains(const path_set_t *set, const char *path) {
+    if (!set->cap) return 0;
+    size_t i = hash_string(path) & (set->cap - 1);
+    while (set->slots[i]) {
+        if (strcmp(set->slots[i], path) == 0) return 1;
+        i = (i + 1) & (set->cap - 1);
+    }
+    return 0;
+}
+
+
+void path_set_free(path_set_t *set) {
+    for (size_t i = 0; i < set->cap; i++) free(set->slots[i]);
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+
+int mkdir_p(const char *dir) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s", dir);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) < 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    if (mkdir(tmp, 0755) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+
+/*
+ * Resolve `link` against the directory of `base` and collapse "." and ".."
+ * segments. Fails for links that climb above the site root.
+ */
+int resolve_path(const char *base, const char *link, size_t link_len, char *out, size_t out_size) {
+    char joined[MAX_PATH * 2];
+    const char *segments[MAX_PATH];
+    size_t lengths[MAX_PATH];
+    int depth = 0;
+
+    if (link_len > 0 && link[0] == '/') {
+        snprintf(joined, sizeof(joined), "%.*s", (int)link_len, link);
+    } else {
+        const char *slash = strrchr(base, '/');
+        int dir_len = slash ? (int)(slash - base + 1) : 0;
+        snprintf(joined, sizeof(joined), "%.*s/%.*s", dir_len, base, (int)link_len, link);
+    }
+
+    for (char *p = joined; *p; ) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        char *seg = p;
+        while (*p && *p != '/') p++;
+        size_t len = p - seg;
+
+        if (len == 1 && seg[0] == '.') continue;
+        if (len == 2 && seg[0] == '.' && seg[1] == '.') {
+            if (depth == 0) return -1;
+            depth--;
+            continue;
+        }
+        if (depth == MAX_PATH) return -1;
+        segments[depth] = seg;
+        lengths[depth] = len;
+        depth++;
+    }
+
+    size_t pos = 0;
+    for (int i = 0; i < depth; i++) {
+        if (pos + lengths[i] + 2 > out_size) return -1;
+        out[pos++] = '/';
+        memcpy(out + pos, segments[i], lengths[i]);
+        pos += lengths[i];
+    }
+    if (pos == 0) out[pos++] = '/';
+    out[pos] = '\0';
+    return 0;
+}
+
+
+void mirror_enqueue(mirror_t *m, const char *path) {
+    pthread_mutex_lock(&m->lock);
+
+    if (path_set_add(&m->visited, path) == 1) {
+        mirror_job_t *job = calloc(1, sizeof(mirror_job_t));
+        if (job) {
+            snprintf(job->path, sizeof(job->path), "%s", path);
+            if (m->tail) m->tail->next = job;
+            else m->head = job;
+            m->tail = job;
+            if (m->journal) fprintf(m->journal, "Q %s\n", path);
+            pthread_cond_signal(&m->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&m->lock);
+}
+
+
+static size_t link_target_length(const char *p) {
+    size_t len = 0;
+    while (p[len] && !strchr(" \t\r\n)>\"'<]", p[len])) len++;
+    return len;
+}
+
+
+void mirror_extract_links(mirror_t *m, const char *base, const char *doc) {
+    char resolved[MAX_PATH];
+
+    for (const char *p = doc; (p = strstr(p, "mdtp://")) != NULL; ) {
+        p += 7;
+        size_t len = link_target_length(p);
+        const char *path = memchr(p, '/', len);
+        if (!path) continue;
+
+        char authority[256];
+        snprintf(authority, sizeof(authority), "%.*s", (int)(path - p), p);
+        char *colon = strchr(authority, ':');
+        int port = colon ? atoi(colon + 1) : DEFAULT_PORT;
+        if (colon) *colon = '\0';
+
+        if (strcmp(authority, m->host) != 0 || port != m->port) continue;
+
+        size_t path_len = strcspn(path, "#?");
+        if (path_len > (size_t)(p + len - path)) path_len = p + len - path;
+        if (resolve_path(base, path, path_len, resolved, sizeof(resolved)) == 0) {
+            mirror_enqueue(m, resolved);
+        }
+    }
+
+    for (const char *p = doc; (p = strstr(p, "](")) != NULL; ) {
+        p += 2;
+        size_t len = link_target_length(p);
+        size_t path_len = strcspn(p, "#?");
+        if (path_len > len) path_len = len;
+
+        if (memchr(p, ':', len)) continue;
+        if (path_len < 3 || strncmp(p + path_len - 3, ".md", 3) != 0) continue;
+
+        if (resolve_path(base, p, path_len, resolved, sizeof(resolved)) == 0) {
+            mirror_enqueue(m, resolved);
+        }
+    }
+}
+
+
+/* Write a document under the output directory; directories are created as needed. */
+int write_document(const char *outdir, const char *path, const char *body, size_t length) {
+    char file[1024];
+    size_t plen = strlen(path);
+    snprintf(file, sizeof(file), "%s%s%s", outdir, path,
+             plen > 0 && path[plen - 1] == '/' ? "index.md" : "");
+
+    char *slash = strrchr(file, '/');
+    if (slash && slash != file) {
+        *slash = '\0';
+        int rc = mkdir_p(file);
+        *slash = '/';
+        if (rc < 0) return -1;
+    }
+
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, body + written, length - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+
+    return close(fd);
+}
+
+
+/*
+ * GET path over *sock, reconnecting as needed. A reused connection may have
+ * been closed by the server while idle, so one failure on it is retried on
+ * a fresh connection.
+ */
+char* mirror_fetch(mirror_t *m, int *sock, const char *path, int *status, size_t *length) {
+    char request[BUFFER_SIZE];
+    int len = snprintf(request, sizeof(request),
+        "GET %s %s\r\n"
+        "Host: %s\r\n"
+        "User-Agent: MDTP-Mirror/1.0\r\n"
+        "Accept: text/markdown\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n",
+        path, MDTP_VERSION, m->host
+    );
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = *sock >= 0;
+        if (!reused) {
+            *sock = mdtp_connect(m->host, m->port);
+            if (*sock < 0) return NULL;
+        }
+
+        int keep_alive = 0;
+        char *body = NULL;
+        if (send(*sock, request, len, MSG_NOSIGNAL) == len) {
+            body = mdtp_read_response(*sock, status, length, &keep_alive, NULL);
+        }
+
+        if (!body || !keep_alive) {
+            close(*sock);
+            *sock = -1;
+        }
+        if (body || !reused) return body;
+    }
+
+    return NULL;
+}
+
+
+static void* mirror_worker(void *arg) {
+    mirror_t *m = arg;
+    int sock = -1;
+
+    while (1) {
+        pthread_mutex_lock(&m->lock);
+        while (!m->head && m->active > 0) {
+            pthread_cond_wait(&m->cond, &m->lock);
+        }
+        if (!m->head) {
+            pthread_cond_broadcast(&m->cond);
+            pthread_mutex_unlock(&m->lock);
+            break;
+        }
+        mirror_job_t *job = m->head;
+        m->head = job->next;
+        if (!m->head) m->tail = NULL;
+        m->active++;
+        pthread_mutex_unlock(&m->lock);
+
+        int status = 0;
+        size_t length = 0;
+        char *body = mirror_fetch(m, &sock, job->path, &status, &length);
+        int ok = body && status == MDTP_OK && write_document(m->outdir, job->path, body, length) == 0;
+
+        if (ok) {
+            printf("[MIRROR] %s (%zu bytes)\n", job->path, length);
+            mirror_extract_links(m, job->path, body);
+        } else {
+            printf("[MIRROR] %s failed (%s)\n", job->path,
+                   !body ? "no response" : status != MDTP_OK ? "bad status" : "write error");
+        }
+        free(body);
+
+        pthread_mutex_lock(&m->lock);
+        if (ok) {
+            m->fetched++;
+            m->bytes += length;
+        } else {
+            m->failed++;
+        }
+        /* Failed paths stay undone in the journal and are retried on resume. */
+        if (ok && m->journal) fprintf(m->journal, "D %s\n", job->path);
+        m->active--;
+        if (!m->head && m->active == 0) pthread_cond_broadcast(&m->cond);
+        pthread_mutex_unlock(&m->lock);
+
+        free(job);
+    }
+
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+
+/* Replay the journal: queued-but-unfinished paths go back on the queue. */
+int mirror_load_journal(mirror_t *m, const char *journal_path) {
+    FILE *f = fopen(journal_path, "r");
+    if (!f) return 0;
+
+    path_set_t done = {0};
+    char line[MAX_PATH + 8];
+    int entries = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == 'D' && line[1] == ' ') path_set_add(&done, line + 2);
+    }
+
+    rewind(f);
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != 'Q' || line[1] != ' ') continue;
+        if (strlen(line + 2) >= sizeof(((mirror_job_t *)0)->path)) {
+            printf("[MIRROR] journal path too long, skipped: %.40s...\n", line + 2);
+            continue;
+        }
+        entries++;
+        if (path_set_add(&m->visited, line + 2) != 1) continue;
+        if (path_set_contains(&done, line + 2)) continue;
+
+        mirror_job_t *job = calloc(1, sizeof(mirror_job_t));
+        if (!job) break;
+        strcpy(job->path, line + 2);
+        if (m->tail) m->tail->next = job;
+        else m->head = job;
+        m->tail = job;
+    }
+
+    fclose(f);
+    path_set_free(&done);
+    return entries;
+}
+
+
+int run_mirror(const char *host, int port, const char *path, const char *outdir, int jobs) {
+    mirror_t m;
+    memset(&m, 0, sizeof(m));
+    m.host = host;
+    m.port = port;
+    m.outdir = outdir;
+    m.jobs = jobs;
+    pthread_mutex_init(&m.lock, NULL);
+    pthread_cond_init(&m.cond, NULL);
+
+    if (mkdir_p(outdir) < 0) {
+        perror("Cannot create output directory");
+        return 1;
+    }
+
+    char journal_path[1024];
+    snprintf(journal_path, sizeof(journal_path), "%s/%s", outdir, MIRROR_JOURNAL);
+
+    int resumed = mirror_load_journal(&m, journal_path);
+    m.journal = fopen(journal_path, "a");
+    if (!m.journal) {
+        perror("Cannot open mirror journal");
+        return 1;
+    }
+    setvbuf(m.journal, NULL, _IOLBF, 0);
+
+    char start[MAX_PATH];
+    if (resolve_path("/", path, strlen(path), start, sizeof(start)) < 0) {
+        printf("Invalid start path: %s\n", path);
+        fclose(m.journal);
+        return 1;
+    }
+    mirror_enqueue(&m, start);
+
+    printf("[MIRROR] mdtp://%s:%d%s -> %s (%d workers%s)\n", host, port, start, outdir,
+           jobs, resumed ? ", resuming from journal" : "");
+
+    uint64_t started_at = monotonic_ns();
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    int running = 0;
+    for (int i = 0; threads && i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, mirror_worker, &m) != 0) break;
+        running++;
+    }
+    if (running == 0) {
+        mirror_worker(&m);
+    }
+    for (int i = 0; i < running; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    double elapsed = (monotonic_ns() - started_at) / 1e9;
+    printf("[MIRROR] %ld documents, %ld failed, %.2f MB in %.2f s\n",
+           m.fetched, m.failed, m.bytes / 1024.0 / 1024.0, elapsed);
+
+    fclose(m.journal);
+    path_set_free(&m.visited);
+    pthread_mutex_destroy(&m.lock);
+    pthread_cond_destroy(&m.cond);
+    return m.failed > 0;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Batch fetch client
+ *
+ * "mdtp mget" syncs a set of documents or whole directories with a single
+ * MGET request (see "MGET" above) and writes them below an output
+ * directory.
+ * ------------------------------------------------------------------------ */
+
+typedef struct {
+    int status;
+    char path[MAX_HEADER];
+    const char *body;           /* points into the bundle */
+    size_t length;
+} mdtp_bundle_entry_t;
+
+
+/*
+ * Split a decoded bundle into entries. Returns the number of entries, or
+ * -1 if the bundle is malformed. The caller frees *entries.
+ */
+int mdtp_parse_bundle(const char *bundle, size_t length, mdtp_bundle_entry_t **entries) {
+    size_t cap = 16;
+    int count = 0;
+    size_t pos = 0;
+    mdtp_bundle_entry_t *list = malloc(cap * sizeof(*list));
+    if (!list) return -1;
+
+    while (pos < length) {
+        const char *line = bundle + pos;
+        const char *nl = memchr(line, '\n', length - pos);
+        if (!nl) goto fail;
+
+        if (count == (int)cap) {
+            cap *= 2;
+            mdtp_bundle_entry_t *grown = realloc(list, cap * sizeof(*list));
+            if (!grown) goto fail;
+            list = grown;
+        }
+
+        mdtp_bundle_entry_t *e = &list[count];
+        int path_at = 0;
+        if (sscanf(line, "%d %zu %n", &e->status, &e->length, &path_at) != 2 || path_at == 0) goto fail;
+        if (line + path_at > nl) goto fail;
+        snprintf(e->path, sizeof(e->path), "%.*s", (int)(nl - line - path_at), line + path_at);
+
+        pos = nl + 1 - bundle;
+        if (e->length + 1 > length - pos) goto fail;
+        e->body = bundle + pos;
+        pos += e->length + 1;
+        count++;
+    }
+
+    *entries = list;
+    return count;
+
+fail:
+    free(list);
+    return -1;
+}
+
+
+/*
+ * Fetch targets with one MGET. Returns the decoded bundle (free it) and its
+ * length in *length, or NULL on error. *wire_length is the number of body
+ * bytes actually received.
+ */
+char* mdtp_mget(const char *host, int port, const char *targets, int compress,
+                size_t *length, size_t *wire_length) {
+    char request[BUFFER_SIZE];
+    char *headers = NULL;
+    char value[64];
+    int status;
+    size_t body_len;
+
+    int sock = mdtp_connect(host, port);
+    if (sock < 0) return NULL;
+
+    snprintf(request, sizeof(request),
+        "MGET %s %s\r\n"
+        "Host: %s\r\n"
+        "User-Agent: MDTP-Client/1.0\r\n"
+        "%s"
+        "\r\n",
+        targets, MDTP_VERSION, host, compress ? "Accept-Encoding: deflate\r\n" : "");
+    send(sock, request, strlen(request), 0);
+
+    char *body = mdtp_read_response(sock, &status, &body_len, NULL, &headers);
+    close(sock);
+    if (!body) return NULL;
+    if (status != MDTP_OK) {
+        printf("MGET failed: %d\n%s\n", status, body);
+        goto fail;
+    }
+    *wire_length = body_len;
+
+    if (find_header(headers, "Content-Encoding", value, sizeof(value)) == 0) {
+        if (strcasecmp(value, "deflate") != 0 ||
+            find_header(headers, "Bundle-Size", value, sizeof(value)) < 0) {
+            goto fail;
+        }
+        uLongf size = strtoull(value, NULL, 10);
+        char *plain = malloc(size + 1);
+        if (!plain || uncompress((Bytef *)plain, &size, (Bytef *)body, body_len) != Z_OK) {
+            free(plain);
+            goto fail;
+        }
+        free(body);
+        body = plain;
+        body_len = size;
+        body[body_len] = '\0';
+    }
+
+    if (find_header(headers, "Bundle-Truncated", value, sizeof(value)) == 0) {
+        printf("Warning: bundle truncated by the server; request fewer documents\n");
+    }
+
+    free(headers);
+    *length = body_len;
+    return body;
+
+fail:
+    free(headers);
+    free(body);
+    return NULL;
+}
+
+
+int run_mget(const char *host, int port, const char *targets, const char *outdir, int compress) {
+    size_t length, wire_length;
+    mdtp_bundle_entry_t *entries;
+    int written = 0, failed = 0;
+
+    char *bundle = mdtp_mget(host, port, targets, compress, &length, &wire_length);
+    if (!bundle) {
+        printf("Failed to fetch bundle\n");
+        return 1;
+    }
+
+    int count = mdtp_parse_bundle(bundle, length, &entries);
+    if (count < 0) {
+        printf("Malformed bundle\n");
+        free(bundle);
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        mdtp_bundle_entry_t *e = &entries[i];
+        if (e->status != MDTP_OK || e->path[0] != '/' || strstr(e->path, "..") ||
+            write_document(outdir, e->path, e->body, e->length) < 0) {
+            printf("  %d %s\n", e->status, e->path);
+            failed++;
+            continue;
+        }
+        written++;
+    }
+
+    printf("%d documents written to %s, %d failed (%zu bytes, %zu on the wire)\n",
+           written, outdir, failed, length, wire_length);
+    free(entries);
+    free(bundle);
+    return failed ? 1 : 0;
+}
+
+
+/*
+ * "client -D <dir>": bring local copies under <dir> up to date. Each
+ * existing copy seeds the delta cache, so only the changes since it was
+ * written cross the wire.
+ */
+int run_delta_sync(const char *host, int port, char **paths, int count, const char *dir) {
+    int failed = 0;
+
+    g_fetch_delta = 1;
+    for (int i = 0; i < count; i++) {
+        char file[1024];
+        size_t length;
+        snprintf(file, sizeof(file), "%s%s", dir, paths[i]);
+
+        char *local = read_file(file, &length);
+        if (local) {
+            delta_cache_put(host, port, paths[i], local, length, delta_hash(local, length));
+            free(local);
+        }
+
+        size_t wire_before = g_delta_wire_bytes;
+        char *body = fetch_delta(host, port, paths[i], &length);
+        if (!body || write_document(dir, paths[i], body, length) < 0) {
+            printf("Failed to fetch %s\n", paths[i]);
+            free(body);
+            failed = 1;
+            continue;
+        }
+        printf("  %s: %zu bytes, %zu on the wire\n", paths[i], length, g_delta_wire_bytes - wire_before);
+        free(body);
+    }
+
+    printf("%d documents synced to %s (%zu bytes, %zu on the wire)\n",
+           count - failed, dir, g_delta_doc_bytes, g_delta_wire_bytes);
+    return failed;
+}
+
+
+/* "pack": compile a content directory into a pack for "server --pack". */
+int run_pack(const char *dir, const char *pack_file, int compress) {
+    pack_build_stats_t stats;
+
+    if (pack_build(dir, pack_file, compress, &stats) < 0) {
+        printf("Failed to build %s\n", pack_file);
+        return 1;
+    }
+
+    printf("%ld documents (%ld distinct) packed into %s\n", stats.documents, stats.blobs, pack_file);
+    printf("  %ld document bytes, %ld deflated bytes, %ld byte pack\n",
+           stats.bytes, stats.deflated_bytes, stats.pack_bytes);
+    return 0;
+}
+
+
+void print_usage(const char *prog) {
+    printf("MDTP - Markdown Transfer Protocol v1.0\n\n");
+    printf("Usage:\n");
+    printf("  %s server [port] [-c conf] [--pack file]\n", prog);
+    printf("                             Start MDTP server (default port: 8585)\n");
+    printf("                             Reads ./mdtp.conf if present; SIGHUP reloads it\n");
+    printf("  %s proxy [port] [-c conf] [-b host:port ...]\n", prog);
+    printf("                             Balance requests across MDTP servers by path\n");
+    printf("  %s client <host> <path> [path...] [-2] [-D dir]\n", prog);
+    printf("                             Fetch documents; -2 multiplexes them over MDTP/2,\n");
+    printf("                             -D updates copies in dir using deltas\n");
+    printf("  %s watch <host> <path> [-p port]\n", prog);
+    printf("                             Stream change events for a document or directory\n");
+    printf("  %s bench <host> <paths> [-p port] [-c conns] [-r rate] [-d secs] [-k]\n", prog);
+    printf("                             Load test; <paths> is a comma-separated mix\n");
+    printf("  %s mirror <host> <path> <outdir> [-p port] [-j jobs]\n", prog);
+    printf("                             Recursively mirror linked documents to disk\n");
+    printf("  %s mget <host> <paths> <outdir> [-p port] [-z]\n", prog);
+    printf("                             Fetch documents/directories (dir/) in one request\n");
+    printf("  %s pack <dir> <pack file> [-z]\n", prog);
+    printf("                             Compile a content tree into one mappable file\n");
+    printf("\nExamples:\n");
+    printf("  %s server 8585\n", prog);
+    printf("  %s client 127.0.0.1 /index.md\n", prog);
+    printf("  %s client 127.0.0.1 /index.md /about.md -D ./site\n", prog);
+    printf("  %s bench 127.0.0.1 /index.md,/about.md -c 50 -r 5000 -d 30 -k\n", prog);
+    printf("  %s mirror 127.0.0.1 /index.md ./site -j 8\n", prog);
+    printf("  %s mget 127.0.0.1 /docs/,/index.md ./site -z\n", prog);
+    printf("  %s pack ./site site.pack -z && %s server 8585 --pack site.pack\n", prog, prog);
+    printf("  %s proxy 8585 -b 127.0.0.1:8601 -b 127.0.0.1:8602\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    if (strcmp(argv[1], "server") == 0) {
+        int port = 0;
+        const char *config_file = NULL;
+        const char *inherit_fd = NULL;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) config_file = argv[++i];
+            else if (strcmp(argv[i], "--inherit") == 0 && i + 1 < argc) inherit_fd = argv[++i];
+            else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) g_pack_file = argv[++i];
+            else port = atoi(argv[i]);
+        }
+
+        remember_exe(argv);
+
+        start_server(port, config_file, inherit_fd);
+    }
+    else if (strcmp(argv[1], "proxy") == 0) {
+        int port = 0;
+        const char *config_file = NULL;
+        const char *inherit_fd = NULL;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) config_file = argv[++i];
+            else if (strcmp(argv[i], "--inherit") == 0 && i + 1 < argc) inherit_fd = argv[++i];
+            else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+                if (proxy_add_backend(argv[++i]) < 0) {
+                    fprintf(stderr, "Invalid backend: %s (expected host:port)\n", argv[i]);
+                    return 1;
+                }
+            }
+            else port = atoi(argv[i]);
+        }
+
+        g_proxy = 1;
+        remember_exe(argv);
+
+        start_server(port, config_file, inherit_fd);
+    }
+    else if (strcmp(argv[1], "client") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s client <host> <path> [path...] [-2] [-D dir]\n", argv[0]);
+            return 1;
+        }
+
+        char **paths = &argv[3];
+        const char *delta_dir = NULL;
+        int count = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-2") == 0) g_fetch_mdtp2 = 1;
+            else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) delta_dir = argv[++i];
+            else paths[count++] = argv[i];
+        }
+        if (count == 0) {
+            printf("Usage: %s client <host> <path> [path...] [-2] [-D dir]\n", argv[0]);
+            return 1;
+        }
+
+        if (delta_dir) return run_delta_sync(argv[2], DEFAULT_PORT, paths, count, delta_dir);
+        return run_client(argv[2], DEFAULT_PORT, paths, count);
+    }
+    else if (strcmp(argv[1], "watch") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s watch <host> <path> [-p port]\n", argv[0]);
+            return 1;
+        }
+
+        int port = DEFAULT_PORT;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+            else {
+                printf("Unknown watch option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        return run_watch(argv[2], port, argv[3]);
+    }
+    else if (strcmp(argv[1], "bench") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s bench <host> <paths> [-p port] [-c conns] [-r rate] [-d secs] [-k]\n", argv[0]);
+            return 1;
+        }
+
+        bench_config_t cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.host = argv[2];
+        cfg.port = DEFAULT_PORT;
+        cfg.connections = BENCH_DEFAULT_CONNECTIONS;
+        cfg.duration = BENCH_DEFAULT_DURATION;
+
+        char *saveptr;
+        for (char *p = strtok_r(argv[3], ",", &saveptr);
+             p && cfg.path_count < BENCH_MAX_PATHS;
+             p = strtok_r(NULL, ",", &saveptr)) {
+            cfg.paths[cfg.path_count++] = p;
+        }
+
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "-k") == 0) cfg.keep_alive = 1;
+            else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) cfg.port = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) cfg.connections = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) cfg.rate = atof(argv[++i]);
+            else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) cfg.duration = atoi(argv[++i]);
+            else {
+                printf("Unknown bench option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        if (cfg.path_count == 0 || cfg.connections <= 0 || cfg.duration <= 0 || cfg.rate < 0) {
+            printf("Invalid bench parameters\n");
+            return 1;
+        }
+
+        return run_bench(&cfg);
+    }
+    else if (strcmp(argv[1], "mirror") == 0) {
+        if (argc < 5) {
+            printf("Usage: %s mirror <host> <path> <outdir> [-p port] [-j jobs]\n", argv[0]);
+            return 1;
+        }
+
+        int port = DEFAULT_PORT;
+        int jobs = MIRROR_DEFAULT_JOBS;
+        for (int i = 5; i < argc; i++) {
+            if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jobs = atoi(argv[++i]);
+            else {
+                printf("Unknown mirror option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (jobs <= 0) jobs = 1;
+
+        return run_mirror(argv[2], port, argv[3], argv[4], jobs);
+    }
+    else if (strcmp(argv[1], "mget") == 0) {
+        if (argc < 5) {
+            printf("Usage: %s mget <host> <paths> <outdir> [-p port] [-z]\n", argv[0]);
+            return 1;
+        }
+
+        int port = DEFAULT_PORT;
+        int compress = 0;
+        for (int i = 5; i < argc; i++) {
+            if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-z") == 0) compress = 1;
+            else {
+                printf("Unknown mget option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        return run_mget(argv[2], port, argv[3], argv[4], compress);
+    }
+    else if (strcmp(argv[1], "pack") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s pack <dir> <pack file> [-z]\n", argv[0]);
+            return 1;
+        }
+
+        int compress = 0;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "-z") == 0) compress = 1;
+            else {
+                printf("Unknown pack option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        return run_pack(argv[2], argv[3], compress);
     }
     else {
         print_usage(argv[0]);